@@ -0,0 +1,301 @@
+/*
+ * Copyright 2010, 2011, 2012
+ *   IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#include "addrtable.h"
+
+#define ADDRTABLE_ALIGN 64 /* The cache line size. */
+#define ADDRTABLE_MIN_SIZE 16
+/*
+ * The table grows when the load factor exceeds 7/8.  Robin Hood
+ * hashing keeps the probe sequences short even at a high load.
+ */
+#define ADDRTABLE_NEEDS_GROW(tablep)				\
+  ((uint64_t)((tablep)->count + 1) * 8 > ((uint64_t)(tablep)->mask + 1) * 7)
+
+static uint64_t addrtable_random_seed(void);
+static int addrtable_alloc_slots(struct addrtable *, uint32_t);
+static void addrtable_place(struct addrtable *, struct addrtable_slot *);
+static int addrtable_grow(struct addrtable *);
+
+/*
+ * Initialize a table for the keys of key_len bytes.  The size is a
+ * hint of the expected number of entries.
+ */
+int
+addrtable_init(struct addrtable *tablep, int key_len, uint32_t size)
+{
+  assert(tablep != NULL);
+  assert(key_len > 0 && key_len <= ADDRTABLE_KEY_MAX_LEN);
+
+  memset(tablep, 0, sizeof(struct addrtable));
+  tablep->key_len = key_len;
+  tablep->seed = addrtable_random_seed();
+
+  uint32_t capacity = ADDRTABLE_MIN_SIZE;
+  while (capacity < size + (size >> 2) && capacity < (1U << 31)) {
+    capacity <<= 1;
+  }
+
+  return (addrtable_alloc_slots(tablep, capacity));
+}
+
+/* Release the slots of the table. */
+void
+addrtable_destroy(struct addrtable *tablep)
+{
+  assert(tablep != NULL);
+
+  free(tablep->slots);
+  tablep->slots = NULL;
+  tablep->mask = 0;
+  tablep->count = 0;
+}
+
+/* Remove all the entries.  The capacity of the table is kept. */
+void
+addrtable_clear(struct addrtable *tablep)
+{
+  assert(tablep != NULL);
+
+  memset(tablep->slots, 0,
+	 sizeof(struct addrtable_slot) * ((size_t)tablep->mask + 1));
+  tablep->count = 0;
+}
+
+/*
+ * Hash a key with the seed of the table.  The 64 bit finalizer of
+ * MurmurHash3 is applied per 8 bytes of the key, so that every bit
+ * of the address affects the bucket index.
+ */
+#define ADDRTABLE_FMIX64(h) do {		\
+    (h) ^= (h) >> 33;				\
+    (h) *= 0xff51afd7ed558ccdULL;		\
+    (h) ^= (h) >> 33;				\
+    (h) *= 0xc4ceb9fe1a85ec53ULL;		\
+    (h) ^= (h) >> 33;				\
+  } while (0)
+
+uint32_t
+addrtable_hash(const struct addrtable *tablep, const void *keyp)
+{
+  assert(tablep != NULL);
+  assert(keyp != NULL);
+
+  const uint8_t *datap = (const uint8_t *)keyp;
+  int data_len = tablep->key_len;
+  uint64_t h = tablep->seed ^ ((uint64_t)data_len << 56);
+  uint64_t word;
+
+  while (data_len >= 8) {
+    memcpy(&word, datap, 8);
+    h ^= word;
+    ADDRTABLE_FMIX64(h);
+    datap += 8;
+    data_len -= 8;
+  }
+  if (data_len > 0) {
+    word = 0;
+    memcpy(&word, datap, data_len);
+    h ^= word;
+    ADDRTABLE_FMIX64(h);
+  }
+
+  return ((uint32_t)(h ^ (h >> 32)));
+}
+
+/*
+ * Insert a new entry.  Returns 0 on success, 1 if the key already
+ * exists (the existing entry is kept), and -1 if memory allocation
+ * failed.
+ */
+int
+addrtable_insert(struct addrtable *tablep, const void *keyp, void *valuep)
+{
+  assert(tablep != NULL);
+  assert(keyp != NULL);
+
+  if (addrtable_lookup(tablep, keyp) != NULL) {
+    return (1);
+  }
+
+  if (ADDRTABLE_NEEDS_GROW(tablep)) {
+    if (addrtable_grow(tablep) == -1) {
+      return (-1);
+    }
+  }
+
+  struct addrtable_slot slot;
+  memset(&slot, 0, sizeof(struct addrtable_slot));
+  memcpy(slot.key, keyp, tablep->key_len);
+  slot.value = valuep;
+  slot.hash = addrtable_hash(tablep, keyp);
+  addrtable_place(tablep, &slot);
+  tablep->count++;
+
+  return (0);
+}
+
+/*
+ * Find the value stored with the key.  The probe stops as soon as it
+ * meets a slot closer to its home position than the key would be,
+ * since the Robin Hood invariant guarantees the key cannot be
+ * stored after that slot.
+ */
+void *
+addrtable_lookup(const struct addrtable *tablep, const void *keyp)
+{
+  assert(tablep != NULL);
+  assert(keyp != NULL);
+
+  uint32_t hash = addrtable_hash(tablep, keyp);
+  uint32_t index = hash & tablep->mask;
+  uint32_t dist = 1;
+  const struct addrtable_slot *slotp;
+
+  for (;;) {
+    slotp = &tablep->slots[index];
+    if (slotp->dist < dist) {
+      /* An empty slot, or a richer entry.  Not found. */
+      return (NULL);
+    }
+    if (slotp->hash == hash
+	&& memcmp(slotp->key, keyp, tablep->key_len) == 0) {
+      return (slotp->value);
+    }
+    index = (index + 1) & tablep->mask;
+    dist++;
+  }
+}
+
+/*
+ * Get a seed value for the hash function, so that the bucket
+ * positions of the addresses cannot be predicted from outside.
+ */
+static uint64_t
+addrtable_random_seed(void)
+{
+  uint64_t seed = 0;
+
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd != -1) {
+    if (read(fd, &seed, sizeof(seed)) != sizeof(seed)) {
+      seed = 0;
+    }
+    close(fd);
+  }
+  if (seed == 0) {
+    warnx("cannot read /dev/urandom, using a time based hash seed.");
+    seed = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid()
+      ^ (uint64_t)(uintptr_t)&seed;
+    ADDRTABLE_FMIX64(seed);
+  }
+
+  return (seed);
+}
+
+/* Allocate the cache line aligned slot array. */
+static int
+addrtable_alloc_slots(struct addrtable *tablep, uint32_t capacity)
+{
+  void *slotsp;
+  size_t len = sizeof(struct addrtable_slot) * (size_t)capacity;
+
+  if (posix_memalign(&slotsp, ADDRTABLE_ALIGN, len) != 0) {
+    warnx("memory allocation failed for the address table slots.");
+    return (-1);
+  }
+  memset(slotsp, 0, len);
+  tablep->slots = (struct addrtable_slot *)slotsp;
+  tablep->mask = capacity - 1;
+  tablep->count = 0;
+
+  return (0);
+}
+
+/*
+ * Store the slot to the table with Robin Hood hashing.  An entry
+ * which has probed longer takes the place of the one closer to its
+ * home position, and the displaced entry continues probing.
+ */
+static void
+addrtable_place(struct addrtable *tablep, struct addrtable_slot *newp)
+{
+  struct addrtable_slot tmp;
+  uint32_t index = newp->hash & tablep->mask;
+
+  newp->dist = 1;
+  for (;;) {
+    struct addrtable_slot *slotp = &tablep->slots[index];
+    if (slotp->dist == 0) {
+      *slotp = *newp;
+      return;
+    }
+    if (slotp->dist < newp->dist) {
+      tmp = *slotp;
+      *slotp = *newp;
+      *newp = tmp;
+    }
+    index = (index + 1) & tablep->mask;
+    newp->dist++;
+  }
+}
+
+/* Double the capacity and rehash all the entries. */
+static int
+addrtable_grow(struct addrtable *tablep)
+{
+  struct addrtable_slot *old_slotsp = tablep->slots;
+  uint32_t old_capacity = tablep->mask + 1;
+  uint32_t count = tablep->count;
+
+  if (old_capacity >= (1U << 31)) {
+    warnx("the address table is too large.");
+    return (-1);
+  }
+  if (addrtable_alloc_slots(tablep, old_capacity << 1) == -1) {
+    tablep->slots = old_slotsp;
+    return (-1);
+  }
+
+  uint32_t index;
+  for (index = 0; index < old_capacity; index++) {
+    if (old_slotsp[index].dist != 0) {
+      struct addrtable_slot slot = old_slotsp[index];
+      addrtable_place(tablep, &slot);
+    }
+  }
+  tablep->count = count;
+  free(old_slotsp);
+
+  return (0);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2010, 2011, 2012
+ *   IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ADDRTABLE_H__
+#define __ADDRTABLE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define ADDRTABLE_KEY_MAX_LEN 16 /* struct in6_addr{} */
+
+/*
+ * A slot of the table.  The key is stored inline, so that a lookup
+ * touches only the slot array until the value is returned.  Two
+ * slots fit in a cache line.
+ */
+struct addrtable_slot {
+  uint8_t key[ADDRTABLE_KEY_MAX_LEN];
+  void *value;
+  uint32_t hash;
+  uint32_t dist; /* The probe distance + 1.  0 means an empty slot. */
+};
+
+/*
+ * An open addressing hash table keyed by IPv4 or IPv6 addresses,
+ * using Robin Hood hashing with a seeded hash function.
+ */
+struct addrtable {
+  struct addrtable_slot *slots;
+  uint32_t mask;
+  uint32_t count;
+  int key_len;
+  uint64_t seed;
+};
+
+int addrtable_init(struct addrtable *, int, uint32_t);
+void addrtable_destroy(struct addrtable *);
+void addrtable_clear(struct addrtable *);
+uint32_t addrtable_hash(const struct addrtable *, const void *);
+int addrtable_insert(struct addrtable *, const void *, void *);
+void *addrtable_lookup(const struct addrtable *, const void *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
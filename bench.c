@@ -0,0 +1,671 @@
+/*
+ * Copyright 2010, 2011, 2012
+ *   IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * map646-bench: translate the packets in a pcap or pcapng file with
+ * the translation code of map646, without a tun interface, and
+ * report the throughput.  The translated packets can be written to a
+ * pcap file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <err.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+
+#include "mapping.h"
+#include "tunif.h"
+#include "tunio.h"
+#include "checksum.h"
+#include "pmtudisc.h"
+#include "xlate.h"
+#include "drop.h"
+#include "coarsetime.h"
+
+/* The link types of the packet capture files. */
+#define BENCH_LINKTYPE_NULL	0
+#define BENCH_LINKTYPE_ETHERNET	1
+#define BENCH_LINKTYPE_RAW	101
+#define BENCH_LINKTYPE_LOOP	108
+#define BENCH_LINKTYPE_LINUX_SLL	113
+#define BENCH_LINKTYPE_IPV4	228
+#define BENCH_LINKTYPE_IPV6	229
+#define BENCH_LINKTYPE_LINUX_SLL2	276
+
+#define BENCH_PCAPNG_MAX_IFS 256
+
+/* The directions returned by dispatch(), and the unmapped packets. */
+#define BENCH_DIR_UNMAPPED 0
+#define BENCH_DIR_MAX 5
+static const char *bench_dir_names[BENCH_DIR_MAX] = {
+  "unmapped", "ItoG", "GtoI", "6to4", "4to6"
+};
+
+struct bench_packet {
+  const uint8_t *datap;		/* The IP packet in the input file. */
+  size_t len;
+  uint32_t af;
+  uint32_t ts_sec, ts_usec;
+  int direction;
+};
+
+/* The context of the output function. */
+struct bench_output {
+  FILE *fp;			/* The pcap file, or NULL. */
+  const struct bench_packet *packetp;	/* The packet being translated. */
+  uint64_t packets;
+};
+
+static struct bench_packet *bench_packets = NULL;
+static int bench_packet_count = 0;
+static int bench_packet_cap = 0;
+static int bench_skipped = 0;
+
+/* The receive buffer, with the headroom used by the translation. */
+static uint8_t bench_buf[TUNIO_HEADROOM + TUNIO_GSO_BUF_LEN]
+__attribute__((aligned(64)));
+
+static void usage(const char *);
+static uint8_t *bench_read_file(const char *, size_t *);
+static int bench_load(const uint8_t *, size_t);
+static int bench_load_pcap(const uint8_t *, size_t);
+static int bench_load_pcapng(const uint8_t *, size_t);
+static void bench_add_packet(int, const uint8_t *, size_t, uint32_t,
+			     uint32_t);
+static uint8_t *bench_prepare(const struct bench_packet *);
+static void bench_output(const uint8_t *, size_t, void *);
+static int bench_write_pcap_header(FILE *);
+static double bench_run(struct tunio *, struct bench_output *, int, int,
+			int);
+static double bench_now(void);
+
+static void
+usage(const char *progname)
+{
+  fprintf(stderr,
+	  "Usage: %s [-c <conf path>] [-n <rounds>] [-w <output pcap>]"
+	  " <input pcap>\n", progname);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  const char *conf_path = "/etc/map646.conf";
+  const char *output_path = NULL;
+  int rounds = 10;
+  int ch;
+
+  while ((ch = getopt(argc, argv, "c:n:w:")) != -1) {
+    switch (ch) {
+    case 'c':
+      conf_path = optarg;
+      break;
+    case 'n':
+      rounds = atoi(optarg);
+      if (rounds < 1) {
+	usage(argv[0]);
+      }
+      break;
+    case 'w':
+      output_path = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+  }
+
+  /* Initialization of supporting classes. */
+  cksum_initialize();
+  if (mapping_initialize() == -1) {
+    errx(EXIT_FAILURE, "failed to initialize the mapping class.");
+  }
+  if (pmtudisc_initialize() == -1) {
+    errx(EXIT_FAILURE, "failed to initialize the path mtu discovery class.");
+  }
+  if (mapping_create_table(conf_path) == -1) {
+    errx(EXIT_FAILURE, "mapping table creation failed.");
+  }
+
+  size_t file_len;
+  uint8_t *filep = bench_read_file(argv[optind], &file_len);
+  if (filep == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  if (bench_load(filep, file_len) == -1) {
+    exit(EXIT_FAILURE);
+  }
+
+  struct bench_output output;
+  memset(&output, 0, sizeof(struct bench_output));
+  struct tunio *tiop = tunio_create_output(bench_output, &output);
+  if (tiop == NULL) {
+    exit(EXIT_FAILURE);
+  }
+
+  /*
+   * Classify the packets in advance.  The packets without a mapping
+   * entry are not translated, since each of them would be reported.
+   */
+  int counts[BENCH_DIR_MAX];
+  memset(counts, 0, sizeof(counts));
+  for (int i = 0; i < bench_packet_count; i++) {
+    struct bench_packet *packetp = &bench_packets[i];
+    struct mapping_match match;
+    int d = dispatch(bench_prepare(packetp), &match);
+    if (d <= 0 || d >= BENCH_DIR_MAX
+	|| (match.mappingp == NULL && match.mapping66p == NULL)) {
+      d = BENCH_DIR_UNMAPPED;
+    }
+    packetp->direction = d;
+    counts[d]++;
+  }
+  printf("%d packets loaded, %d skipped.\n", bench_packet_count,
+	 bench_skipped);
+  for (int d = 0; d < BENCH_DIR_MAX; d++) {
+    printf("  %-8s %d\n", bench_dir_names[d], counts[d]);
+  }
+
+  /* Write the translated packets once. */
+  if (output_path != NULL) {
+    output.fp = fopen(output_path, "w");
+    if (output.fp == NULL) {
+      err(EXIT_FAILURE, "opening %s failed.", output_path);
+    }
+    if (bench_write_pcap_header(output.fp) == -1) {
+      err(EXIT_FAILURE, "writing to %s failed.", output_path);
+    }
+    (void)bench_run(tiop, &output, -1, 1, 0);
+    if (fclose(output.fp) != 0) {
+      err(EXIT_FAILURE, "writing to %s failed.", output_path);
+    }
+    output.fp = NULL;
+    printf("%llu packets written to %s.\n",
+	   (unsigned long long)output.packets, output_path);
+  }
+
+  /*
+   * The time to copy the packets to the receive buffer is measured
+   * separately, and subtracted from the translation time.
+   */
+  printf("%d rounds.\n", rounds);
+  printf("  %-8s %12s %12s %12s %10s\n", "", "packets/s", "ns/packet",
+	 "out/packet", "Mbit/s");
+  for (int d = -1; d < BENCH_DIR_MAX; d++) {
+    int count = (d == -1) ? bench_packet_count - counts[0] : counts[d];
+    if (d == BENCH_DIR_UNMAPPED || count == 0) {
+      continue;
+    }
+    uint64_t bytes = 0;
+    for (int i = 0; i < bench_packet_count; i++) {
+      if (bench_packets[i].direction != BENCH_DIR_UNMAPPED
+	  && (d == -1 || bench_packets[i].direction == d)) {
+	bytes += bench_packets[i].len;
+      }
+    }
+    output.packets = 0;
+    double copy_time = bench_run(tiop, &output, d, rounds, 1);
+    double time = bench_run(tiop, &output, d, rounds, 0) - copy_time;
+    double total = (double)count * rounds;
+    if (time <= 0) {
+      time = 1e-9;
+    }
+    printf("  %-8s %12.0f %12.1f %12.2f %10.1f\n",
+	   d == -1 ? "all" : bench_dir_names[d], total / time,
+	   time * 1e9 / total, output.packets / total,
+	   bytes * 8.0 * rounds / time / 1e6);
+  }
+
+  /* The packets dropped by the translator in all the runs. */
+  for (int reason = 0; reason < DROP_REASON_MAX; reason++) {
+    uint64_t dropped = drop_get_count(reason);
+    if (dropped > 0) {
+      printf("  dropped %-16s %llu\n", drop_reason_name(reason),
+	     (unsigned long long)dropped);
+    }
+  }
+
+  tunio_destroy(tiop);
+  mapping_destroy_table();
+  free(bench_packets);
+  free(filep);
+
+  return (0);
+}
+
+/* Read the entire file to memory. */
+static uint8_t *
+bench_read_file(const char *path, size_t *lenp)
+{
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    warn("opening %s failed.", path);
+    return (NULL);
+  }
+
+  size_t cap = 1024 * 1024, len = 0;
+  uint8_t *bufp = (uint8_t *)malloc(cap);
+  while (bufp != NULL) {
+    len += fread(bufp + len, 1, cap - len, fp);
+    if (len < cap) {
+      break;
+    }
+    cap *= 2;
+    uint8_t *newp = (uint8_t *)realloc(bufp, cap);
+    if (newp == NULL) {
+      free(bufp);
+    }
+    bufp = newp;
+  }
+  if (bufp == NULL) {
+    warnx("memory allocation failed for %s.", path);
+    fclose(fp);
+    return (NULL);
+  }
+  if (ferror(fp)) {
+    warn("reading %s failed.", path);
+    free(bufp);
+    fclose(fp);
+    return (NULL);
+  }
+  fclose(fp);
+
+  *lenp = len;
+  return (bufp);
+}
+
+static uint32_t
+bench_get32(const uint8_t *p, int big_endian)
+{
+  if (big_endian) {
+    return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16
+	    | (uint32_t)p[2] << 8 | p[3]);
+  }
+  return ((uint32_t)p[3] << 24 | (uint32_t)p[2] << 16
+	  | (uint32_t)p[1] << 8 | p[0]);
+}
+
+static uint16_t
+bench_get16(const uint8_t *p, int big_endian)
+{
+  if (big_endian) {
+    return ((uint16_t)(p[0] << 8 | p[1]));
+  }
+  return ((uint16_t)(p[1] << 8 | p[0]));
+}
+
+/* Load the packets from a pcap or pcapng file. */
+static int
+bench_load(const uint8_t *p, size_t len)
+{
+  if (len >= 4 && bench_get32(p, 0) == 0x0a0d0d0a) {
+    return (bench_load_pcapng(p, len));
+  }
+
+  return (bench_load_pcap(p, len));
+}
+
+static int
+bench_load_pcap(const uint8_t *p, size_t len)
+{
+  if (len < 24) {
+    warnx("not a pcap file.");
+    return (-1);
+  }
+
+  int big_endian, nsec;
+  switch (bench_get32(p, 0)) {
+  case 0xa1b2c3d4:
+    big_endian = 0;
+    nsec = 0;
+    break;
+  case 0xd4c3b2a1:
+    big_endian = 1;
+    nsec = 0;
+    break;
+  case 0xa1b23c4d:
+    big_endian = 0;
+    nsec = 1;
+    break;
+  case 0x4d3cb2a1:
+    big_endian = 1;
+    nsec = 1;
+    break;
+  default:
+    warnx("not a pcap file.");
+    return (-1);
+  }
+  int linktype = bench_get32(p + 20, big_endian) & 0xffff;
+
+  size_t off = 24;
+  while (off + 16 <= len) {
+    uint32_t ts_sec = bench_get32(p + off, big_endian);
+    uint32_t ts_frac = bench_get32(p + off + 4, big_endian);
+    uint32_t cap_len = bench_get32(p + off + 8, big_endian);
+    off += 16;
+    if (cap_len > len - off) {
+      warnx("truncated pcap file.");
+      break;
+    }
+    bench_add_packet(linktype, p + off, cap_len, ts_sec,
+		     nsec ? ts_frac / 1000 : ts_frac);
+    off += cap_len;
+  }
+
+  return (0);
+}
+
+static int
+bench_load_pcapng(const uint8_t *p, size_t len)
+{
+  int big_endian = 0;
+  int if_count = 0;
+  int linktypes[BENCH_PCAPNG_MAX_IFS];
+  uint64_t ts_units[BENCH_PCAPNG_MAX_IFS];	/* per second */
+
+  size_t off = 0;
+  while (off + 12 <= len) {
+    uint32_t type = bench_get32(p + off, big_endian);
+    if (type == 0x0a0d0d0a) {
+      /* A section header block may change the byte order. */
+      if (off + 12 > len) {
+	break;
+      }
+      uint32_t magic = bench_get32(p + off + 8, 0);
+      if (magic == 0x1a2b3c4d) {
+	big_endian = 0;
+      } else if (magic == 0x4d3c2b1a) {
+	big_endian = 1;
+      } else {
+	warnx("not a pcapng file.");
+	return (-1);
+      }
+      if_count = 0;
+    }
+    uint32_t block_len = bench_get32(p + off + 4, big_endian);
+    if (block_len < 12 || block_len > len - off) {
+      warnx("truncated pcapng file.");
+      break;
+    }
+    const uint8_t *bodyp = p + off + 8;
+    size_t body_len = block_len - 12;
+
+    if (type == 1 && body_len >= 8) {
+      /* An interface description block. */
+      if (if_count < BENCH_PCAPNG_MAX_IFS) {
+	linktypes[if_count] = bench_get16(bodyp, big_endian);
+	ts_units[if_count] = 1000000;
+	size_t opt_off = 8;
+	while (opt_off + 4 <= body_len) {
+	  uint16_t code = bench_get16(bodyp + opt_off, big_endian);
+	  uint16_t opt_len = bench_get16(bodyp + opt_off + 2, big_endian);
+	  if (code == 0 || opt_off + 4 + opt_len > body_len) {
+	    break;
+	  }
+	  if (code == 9 && opt_len == 1) {
+	    /* if_tsresol */
+	    uint8_t resol = bodyp[opt_off + 4];
+	    uint64_t units = 1;
+	    for (int i = 0; i < (resol & 0x7f) && units < (1ULL << 62); i++) {
+	      units *= (resol & 0x80) ? 2 : 10;
+	    }
+	    ts_units[if_count] = units;
+	  }
+	  opt_off += 4 + ((opt_len + 3) & ~3);
+	}
+      }
+      if_count++;
+    } else if (type == 6 && body_len >= 20) {
+      /* An enhanced packet block. */
+      uint32_t if_id = bench_get32(bodyp, big_endian);
+      uint64_t ts = (uint64_t)bench_get32(bodyp + 4, big_endian) << 32
+	| bench_get32(bodyp + 8, big_endian);
+      uint32_t cap_len = bench_get32(bodyp + 12, big_endian);
+      if (if_id < (uint32_t)if_count && if_id < BENCH_PCAPNG_MAX_IFS
+	  && cap_len <= body_len - 20) {
+	uint64_t units = ts_units[if_id];
+	bench_add_packet(linktypes[if_id], bodyp + 20, cap_len,
+			 (uint32_t)(ts / units),
+			 (uint32_t)((ts % units) * 1000000 / units));
+      } else {
+	bench_skipped++;
+      }
+    } else if (type == 3 && body_len >= 4) {
+      /* A simple packet block, captured on the first interface. */
+      uint32_t orig_len = bench_get32(bodyp, big_endian);
+      size_t cap_len = orig_len < body_len - 4 ? orig_len : body_len - 4;
+      if (if_count > 0) {
+	bench_add_packet(linktypes[0], bodyp + 4, cap_len, 0, 0);
+      } else {
+	bench_skipped++;
+      }
+    }
+
+    off += block_len;
+  }
+
+  return (0);
+}
+
+/*
+ * Add an IP packet to the packet list after removing the link layer
+ * header.  The packets which are not IPv4 or IPv6, or are truncated,
+ * are skipped.
+ */
+static void
+bench_add_packet(int linktype, const uint8_t *p, size_t len, uint32_t ts_sec,
+		 uint32_t ts_usec)
+{
+  size_t hdr_len = 0;
+  switch (linktype) {
+  case BENCH_LINKTYPE_ETHERNET:
+    hdr_len = 14;
+    /* Skip the VLAN tags. */
+    while (len >= hdr_len && (bench_get16(p + hdr_len - 2, 1) == 0x8100
+			      || bench_get16(p + hdr_len - 2, 1) == 0x88a8)) {
+      hdr_len += 4;
+    }
+    break;
+  case BENCH_LINKTYPE_NULL:
+  case BENCH_LINKTYPE_LOOP:
+    hdr_len = 4;
+    break;
+  case BENCH_LINKTYPE_LINUX_SLL:
+    hdr_len = 16;
+    break;
+  case BENCH_LINKTYPE_LINUX_SLL2:
+    hdr_len = 20;
+    break;
+  case BENCH_LINKTYPE_RAW:
+  case 12:			/* DLT_RAW of most BSDs */
+  case 14:			/* DLT_RAW of OpenBSD */
+  case BENCH_LINKTYPE_IPV4:
+  case BENCH_LINKTYPE_IPV6:
+    break;
+  default:
+    bench_skipped++;
+    return;
+  }
+  if (len <= hdr_len) {
+    bench_skipped++;
+    return;
+  }
+  p += hdr_len;
+  len -= hdr_len;
+
+  /* Decide the address family from the IP version, and trim padding. */
+  uint32_t af;
+  size_t ip_len;
+  if ((p[0] >> 4) == 4 && len >= sizeof(struct ip)) {
+    af = AF_INET;
+    ip_len = ntohs(((const struct ip *)p)->ip_len);
+  } else if ((p[0] >> 4) == 6 && len >= sizeof(struct ip6_hdr)) {
+    af = AF_INET6;
+    ip_len = sizeof(struct ip6_hdr)
+      + ntohs(((const struct ip6_hdr *)p)->ip6_plen);
+  } else {
+    bench_skipped++;
+    return;
+  }
+  if (ip_len > len || ip_len + tun_hdr_len > TUNIO_GSO_BUF_LEN) {
+    bench_skipped++;
+    return;
+  }
+
+  if (bench_packet_count == bench_packet_cap) {
+    int cap = bench_packet_cap ? bench_packet_cap * 2 : 1024;
+    struct bench_packet *packets
+      = (struct bench_packet *)realloc(bench_packets,
+				       cap * sizeof(struct bench_packet));
+    if (packets == NULL) {
+      errx(EXIT_FAILURE, "memory allocation failed for the packets.");
+    }
+    bench_packets = packets;
+    bench_packet_cap = cap;
+  }
+  struct bench_packet *packetp = &bench_packets[bench_packet_count++];
+  packetp->datap = p;
+  packetp->len = ip_len;
+  packetp->af = af;
+  packetp->ts_sec = ts_sec;
+  packetp->ts_usec = ts_usec;
+  packetp->direction = BENCH_DIR_UNMAPPED;
+}
+
+/*
+ * Copy the packet to the receive buffer after the tun header, as the
+ * packet is read from the tun interface.
+ */
+static uint8_t *
+bench_prepare(const struct bench_packet *packetp)
+{
+  uint8_t *bufp = bench_buf + TUNIO_HEADROOM;
+
+  tun_set_hdr(bufp, packetp->af);
+  memcpy(bufp + tun_hdr_len, packetp->datap, packetp->len);
+
+  return (bufp);
+}
+
+/* Count the translated packet, and write it to the pcap file. */
+static void
+bench_output(const uint8_t *p, size_t len, void *arg)
+{
+  struct bench_output *outputp = (struct bench_output *)arg;
+
+  outputp->packets++;
+  if (outputp->fp == NULL || len < tun_hdr_len) {
+    return;
+  }
+  p += tun_hdr_len;
+  len -= tun_hdr_len;
+
+  uint32_t record[4];
+  record[0] = outputp->packetp->ts_sec;
+  record[1] = outputp->packetp->ts_usec;
+  record[2] = len;
+  record[3] = len;
+  if (fwrite(record, sizeof(record), 1, outputp->fp) != 1
+      || fwrite(p, len, 1, outputp->fp) != 1) {
+    warn("writing a packet failed.");
+  }
+}
+
+/* Write the header of a pcap file in the host byte order. */
+static int
+bench_write_pcap_header(FILE *fp)
+{
+  uint32_t hdr[6];
+  hdr[0] = 0xa1b2c3d4;
+  hdr[1] = 2 | (4 << 16);	/* version 2.4 */
+  hdr[2] = 0;			/* thiszone */
+  hdr[3] = 0;			/* sigfigs */
+  hdr[4] = TUNIO_GSO_BUF_LEN;	/* snaplen */
+  hdr[5] = BENCH_LINKTYPE_RAW;
+
+  return (fwrite(hdr, sizeof(hdr), 1, fp) == 1 ? 0 : -1);
+}
+
+/*
+ * Translate the mapped packets of the specified direction (-1 means
+ * all the directions) for the rounds, and return the elapsed time in
+ * seconds.  If copy_only is set, the packets are only copied to the
+ * receive buffer to measure the overhead of the benchmark itself.
+ */
+static double
+bench_run(struct tunio *tiop, struct bench_output *outputp, int direction,
+	  int rounds, int copy_only)
+{
+  double start = bench_now();
+  for (int r = 0; r < rounds; r++) {
+    /*
+     * No clock thread runs in the bench.  Update the clock and free
+     * the removed path MTU information per round.
+     */
+    coarsetime_update();
+    pmtudisc_expire();
+    for (int i = 0; i < bench_packet_count; i++) {
+      const struct bench_packet *packetp = &bench_packets[i];
+      if (packetp->direction == BENCH_DIR_UNMAPPED
+	  || (direction != -1 && packetp->direction != direction)) {
+	continue;
+      }
+      uint8_t *bufp = bench_prepare(packetp);
+      if (copy_only) {
+	__asm__ __volatile__("" : : "r"(bufp) : "memory");
+	continue;
+      }
+      struct mapping_match match;
+      int d = dispatch(bufp, &match);
+      outputp->packetp = packetp;
+      xlate_packet(tiop, d, &match, bufp, tun_hdr_len + packetp->len);
+    }
+  }
+
+  return (bench_now() - start);
+}
+
+static double
+bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
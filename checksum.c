@@ -45,12 +45,55 @@
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CKSUM_X86
+#endif
+
+#include "checksum.h"
+#include "logring.h"
+
 static int32_t cksum_acc_ip_pheader_wo_payload_len(const void *);
 static int32_t cksum_acc_ip_pheader(const void *);
 static int32_t cksum_acc_words(const uint16_t *, int);
+static int32_t cksum_acc_words_scalar(const uint16_t *, int);
+#if defined(CKSUM_X86)
+static int32_t cksum_acc_words_sse2(const uint16_t *, int);
+static int32_t cksum_acc_words_avx2(const uint16_t *, int);
+static int32_t cksum_acc_words_avx512(const uint16_t *, int);
+#endif
+
+/*
+ * The implementation of the cksum_acc_words() function selected by
+ * cksum_initialize().  The scalar one is used until then.
+ */
+static int32_t (*cksum_acc_words_func)(const uint16_t *, int)
+  = cksum_acc_words_scalar;
+
+/* The data shorter than this is always summed by the scalar code. */
+#define CKSUM_VECTOR_MIN_LEN 64
 
 #define ADDCARRY(s) {while ((s) >> 16) {((s) = ((s) >> 16) + ((s) & 0xffff));}}
 
+/*
+ * Select the fastest implementation of the sum calculation supported
+ * by the CPU.
+ */
+void
+cksum_initialize(void)
+{
+#if defined(CKSUM_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw")) {
+    cksum_acc_words_func = cksum_acc_words_avx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    cksum_acc_words_func = cksum_acc_words_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    cksum_acc_words_func = cksum_acc_words_sse2;
+  }
+#endif
+}
+
 /* Calculate the checksum value of an IPv4 header. */
 uint16_t
 cksum_calc_ip4_header(const struct ip *ip4_hdrp)
@@ -151,7 +194,7 @@ cksum_update_ulp(int ulp, const void *orig_ip_hdrp, struct iovec *iov)
 #endif
 
   default:
-    warnx("unsupported upper layer protocol %d.", ulp);
+    logring_log(LOGRING_UNSUPPORTED_ULP, ulp);
     return (-1);
   }
 
@@ -245,7 +288,7 @@ cksum66_update_ulp(int ulp, const void *orig_ip_hdrp, struct iovec *iov)
 #endif
 
   default:
-    warnx("unsupported upper layer protocol %d.", ulp);
+    logring_log(LOGRING_UNSUPPORTED_ULP, ulp);
     return (-1);
   }
 
@@ -301,7 +344,7 @@ cksum_calc_ulp(int ulp, struct iovec *iov)
     break;
 
   default:
-    warnx("unsupported upper layer protocol %d.", ulp);
+    logring_log(LOGRING_UNSUPPORTED_ULP, ulp);
     return (-1);
   }
 
@@ -339,6 +382,132 @@ cksum_update_icmp_type_code(void *icmp46_hdrp, int orig_type, int orig_code,
   return (0);
 }
 
+/*
+ * Complete a partial checksum requested by the virtio-net header.
+ * The checksum field located at csum_offset from datap holds the sum
+ * of the pseudo header, and the sum of the data_len bytes from datap
+ * is folded into it.
+ */
+void
+cksum_complete_partial(void *datap, size_t data_len, size_t csum_offset)
+{
+  assert(datap != NULL);
+  assert(csum_offset + sizeof(uint16_t) <= data_len);
+
+  int32_t sum = cksum_acc_words((const uint16_t *)datap, data_len);
+  ADDCARRY(sum);
+  sum = ~sum & 0xffff;
+  if (sum == 0) {
+    /* 0 means no checksum in UDP. */
+    sum = 0xffff;
+  }
+  *(uint16_t *)((uint8_t *)datap + csum_offset) = sum;
+}
+
+/*
+ * Complement the checksum field of the upper layer header.  The field
+ * of a partial checksum holds the pseudo header sum without being
+ * complemented.  Complementing it before and after calling
+ * cksum_update_ulp() (or cksum66_update_ulp()) adjusts the pseudo
+ * header sum in the same way as a complete checksum.
+ */
+int
+cksum_complement_ulp(int ulp, void *ulp_hdrp)
+{
+  assert(ulp_hdrp != NULL);
+
+  uint16_t *sump;
+  switch (ulp) {
+#if defined(__linux__)
+#define th_sum check
+#define uh_sum check
+#endif
+  case IPPROTO_TCP:
+    sump = &((struct tcphdr *)ulp_hdrp)->th_sum;
+    break;
+  case IPPROTO_UDP:
+    sump = &((struct udphdr *)ulp_hdrp)->uh_sum;
+    break;
+#if defined(__linux__)
+#undef th_sum
+#undef uh_sum
+#endif
+  case IPPROTO_ICMPV6:
+    sump = &((struct icmp6_hdr *)ulp_hdrp)->icmp6_cksum;
+    break;
+  default:
+    logring_log(LOGRING_UNSUPPORTED_ULP, ulp);
+    return (-1);
+  }
+  *sump = ~*sump;
+
+  return (0);
+}
+
+/*
+ * Calculate the difference between the sum of the new data and the
+ * sum of the old data.  The result can be passed to the
+ * cksum_adjust_ulp() function when the old data in the pseudo header
+ * is replaced with the new data.  The data lengths must be even.
+ */
+uint16_t
+cksum_calc_delta(const void *new_datap, int new_len, const void *old_datap,
+		 int old_len)
+{
+  assert(new_datap != NULL);
+  assert(old_datap != NULL);
+  assert((new_len & 1) == 0 && (old_len & 1) == 0);
+
+  int32_t sum = cksum_acc_words(new_datap, new_len);
+  ADDCARRY(sum);
+  sum -= cksum_acc_words(old_datap, old_len);
+  ADDCARRY(sum);
+
+  return (sum);
+}
+
+/*
+ * Adjust the TCP or UDP checksum value by the difference of the
+ * pseudo header sums computed in advance (see cksum_calc_delta()).
+ * This is the fast path of the cksum_update_ulp() and the
+ * cksum66_update_ulp() functions, which sum up both of the pseudo
+ * headers for every packet.  The ICMP and ICMPv6 checksum values are
+ * not handled here, since the translation changes their pseudo header
+ * and their type/code values, and -1 is returned.
+ */
+int
+cksum_adjust_ulp(int ulp, void *ulp_hdrp, int32_t delta)
+{
+  assert(ulp_hdrp != NULL);
+
+  uint16_t *sump;
+  switch (ulp) {
+#if defined(__linux__)
+#define th_sum check
+#define uh_sum check
+#endif
+  case IPPROTO_TCP:
+    sump = &((struct tcphdr *)ulp_hdrp)->th_sum;
+    break;
+  case IPPROTO_UDP:
+    sump = &((struct udphdr *)ulp_hdrp)->uh_sum;
+    break;
+#if defined(__linux__)
+#undef th_sum
+#undef uh_sum
+#endif
+  default:
+    return (-1);
+  }
+
+  int32_t sum = ~*sump & 0xffff;
+  sum += delta;
+  ADDCARRY(sum);
+  *sump = ~sum & 0xffff;
+
+  return (0);
+}
+
 /*
  * Calculate the sum of the pseudo IP header by spliting it into 16
  * bits integer values.
@@ -402,7 +571,7 @@ cksum_acc_ip_pheader_wo_payload_len(const void *ip_phdrp)
     break;
 
   default:
-    warnx("unsupported IP version %d.", version);
+    logring_log(LOGRING_UNSUPPORTED_IP_VERSION, version);
     return (0);
   }
 
@@ -429,7 +598,7 @@ cksum_acc_ip_pheader(const void *ip_phdrp)
     break;
 
   default:
-    warnx("unsupported IP version %d.", version);
+    logring_log(LOGRING_UNSUPPORTED_IP_VERSION, version);
     return (0);
   }
 
@@ -442,12 +611,26 @@ cksum_acc_ip_pheader(const void *ip_phdrp)
  * Calculate the sum of the series of 16 bits integer values.  If the
  * length of the data is odd, the last byte will be shifted by 8 bits
  * and calculated as a 16 bits value.
+ *
+ * All the implementations return the same value.  The vectorized ones
+ * compute the exact sum in 64 bits, which is truncated to 32 bits in
+ * the same way as the scalar one.
  */
 static int32_t
 cksum_acc_words(const uint16_t *data, int data_len)
 {
   assert(data != NULL);
 
+  if (data_len < CKSUM_VECTOR_MIN_LEN) {
+    return (cksum_acc_words_scalar(data, data_len));
+  }
+
+  return (cksum_acc_words_func(data, data_len));
+}
+
+static int32_t
+cksum_acc_words_scalar(const uint16_t *data, int data_len)
+{
   int32_t sum = 0;
 
   while (data_len > 1) {
@@ -467,3 +650,117 @@ cksum_acc_words(const uint16_t *data, int data_len)
 
   return (sum);
 }
+
+#if defined(CKSUM_X86)
+/*
+ * The vectorized implementations.  The sum of the 16 bits words is
+ * split to the sum of their first bytes and the sum of their second
+ * bytes, which are calculated with the PSADBW instruction into the
+ * 64 bits lanes without overflow.  The sum is the first one plus the
+ * second one shifted by 8 bits, since the words are loaded in the
+ * host byte order.
+ */
+__attribute__((target("sse2")))
+static int32_t
+cksum_acc_words_sse2(const uint16_t *data, int data_len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i mask = _mm_set1_epi16(0x00ff);
+  __m128i lo = zero, hi = zero;
+
+  while (data_len >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    lo = _mm_add_epi64(lo, _mm_sad_epu8(_mm_and_si128(v, mask), zero));
+    hi = _mm_add_epi64(hi, _mm_sad_epu8(_mm_srli_epi16(v, 8), zero));
+    p += 16;
+    data_len -= 16;
+  }
+
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(lo, _mm_slli_epi64(hi, 8)));
+  uint64_t sum = lanes[0] + lanes[1];
+
+  return ((int32_t)(sum + (uint32_t)cksum_acc_words_scalar((const uint16_t *)p,
+							   data_len)));
+}
+
+__attribute__((target("avx2")))
+static int32_t
+cksum_acc_words_avx2(const uint16_t *data, int data_len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i mask = _mm256_set1_epi16(0x00ff);
+  __m256i lo = zero, hi = zero;
+
+  while (data_len >= 64) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+    __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+    lo = _mm256_add_epi64(lo, _mm256_sad_epu8(_mm256_and_si256(v0, mask),
+					       zero));
+    hi = _mm256_add_epi64(hi, _mm256_sad_epu8(_mm256_srli_epi16(v0, 8),
+					       zero));
+    lo = _mm256_add_epi64(lo, _mm256_sad_epu8(_mm256_and_si256(v1, mask),
+					       zero));
+    hi = _mm256_add_epi64(hi, _mm256_sad_epu8(_mm256_srli_epi16(v1, 8),
+					       zero));
+    p += 64;
+    data_len -= 64;
+  }
+  while (data_len >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    lo = _mm256_add_epi64(lo, _mm256_sad_epu8(_mm256_and_si256(v, mask),
+					       zero));
+    hi = _mm256_add_epi64(hi, _mm256_sad_epu8(_mm256_srli_epi16(v, 8),
+					       zero));
+    p += 32;
+    data_len -= 32;
+  }
+
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes,
+		      _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 8)));
+  uint64_t sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+  return ((int32_t)(sum + (uint32_t)cksum_acc_words_scalar((const uint16_t *)p,
+							   data_len)));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int32_t
+cksum_acc_words_avx512(const uint16_t *data, int data_len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  const __m512i zero = _mm512_setzero_si512();
+  const __m512i mask = _mm512_set1_epi16(0x00ff);
+  __m512i lo = zero, hi = zero;
+
+  while (data_len >= 64) {
+    __m512i v = _mm512_loadu_si512((const void *)p);
+    lo = _mm512_add_epi64(lo, _mm512_sad_epu8(_mm512_and_si512(v, mask),
+					       zero));
+    hi = _mm512_add_epi64(hi, _mm512_sad_epu8(_mm512_srli_epi16(v, 8),
+					       zero));
+    p += 64;
+    data_len -= 64;
+  }
+  if (data_len > 1) {
+    /* Load the rest of the words with a mask not to read beyond. */
+    __mmask32 rest = (__mmask32)((1ULL << (data_len / 2)) - 1);
+    __m512i v = _mm512_maskz_loadu_epi16(rest, (const void *)p);
+    lo = _mm512_add_epi64(lo, _mm512_sad_epu8(_mm512_and_si512(v, mask),
+					       zero));
+    hi = _mm512_add_epi64(hi, _mm512_sad_epu8(_mm512_srli_epi16(v, 8),
+					       zero));
+    p += data_len & ~1;
+    data_len &= 1;
+  }
+
+  __m512i total = _mm512_add_epi64(lo, _mm512_slli_epi64(hi, 8));
+  uint64_t sum = _mm512_reduce_add_epi64(total);
+
+  return ((int32_t)(sum + (uint32_t)cksum_acc_words_scalar((const uint16_t *)p,
+							   data_len)));
+}
+#endif
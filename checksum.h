@@ -30,11 +30,16 @@
 extern "C" {
 #endif
 
+void cksum_initialize(void);
 uint16_t cksum_calc_ip4_header(const struct ip *);
 int cksum_update_ulp(int, const void *, struct iovec *);
 int cksum66_update_ulp(int, const void *, struct iovec *);
 int cksum_calc_ulp(int, struct iovec *);
 int cksum_update_icmp_type_code(void *, int, int, int, int);
+void cksum_complete_partial(void *, size_t, size_t);
+int cksum_complement_ulp(int, void *);
+uint16_t cksum_calc_delta(const void *, int, const void *, int);
+int cksum_adjust_ulp(int, void *, int32_t);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,219 @@
+/*
+ * Copyright 2010, 2011, 2012
+ *   IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * cksum-test: check that every vectorized implementation of the sum
+ * calculation supported by the CPU returns exactly the same sum as
+ * the scalar one, for random data of random lengths at unaligned
+ * addresses.  Run by `make check`.
+ *
+ * The data is placed near the end of a buffer followed by an
+ * inaccessible page, so that the implementation reading beyond the
+ * end of the data is caught as a segmentation fault.
+ */
+
+/* Include the source itself to test its static functions. */
+#include "checksum.c"
+
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define CKSUM_TEST_MAX_LEN 70000
+#define CKSUM_TEST_MAX_SLACK 64
+#define CKSUM_TEST_ROUNDS 2000
+
+struct cksum_test_kernel {
+  const char *name;
+  int32_t (*func)(const uint16_t *, int);
+};
+
+/* The ends of the buffers of random data and of all 0xff. */
+static uint8_t *cksum_test_random_end;
+static uint8_t *cksum_test_saturated_end;
+
+static void usage(const char *);
+static uint8_t *cksum_test_buffer(int);
+static int cksum_test_kernels(struct cksum_test_kernel *);
+static int cksum_test_one(struct cksum_test_kernel *, int, int, int);
+
+static void
+usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [-n <rounds>] [-s <seed>]\n", progname);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int rounds = CKSUM_TEST_ROUNDS;
+  unsigned int seed = (unsigned int)time(NULL);
+  int ch;
+
+  while ((ch = getopt(argc, argv, "n:s:")) != -1) {
+    switch (ch) {
+    case 'n':
+      rounds = atoi(optarg);
+      if (rounds < 1) {
+	usage(argv[0]);
+      }
+      break;
+    case 's':
+      seed = (unsigned int)strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc) {
+    usage(argv[0]);
+  }
+
+  struct cksum_test_kernel kernels[4];
+  int num_kernels = cksum_test_kernels(kernels);
+  printf("seed %u, kernels:", seed);
+  for (int i = 0; i < num_kernels; i++) {
+    printf(" %s", kernels[i].name);
+  }
+  printf("\n");
+  if (num_kernels == 0) {
+    printf("no vectorized implementation to test.\n");
+    return (0);
+  }
+
+  srandom(seed);
+  cksum_test_random_end = cksum_test_buffer(0);
+  cksum_test_saturated_end = cksum_test_buffer(1);
+
+  int failed = 0;
+  for (int i = 0; i < num_kernels; i++) {
+    /* All the short lengths, and the longest ones. */
+    for (int len = 0; len <= 4 * CKSUM_VECTOR_MIN_LEN; len++) {
+      for (int slack = 0; slack < 4; slack++) {
+	failed += cksum_test_one(&kernels[i], len, slack, 0);
+	failed += cksum_test_one(&kernels[i], len, slack, 1);
+      }
+    }
+    for (int slack = 0; slack < 4; slack++) {
+      failed += cksum_test_one(&kernels[i], CKSUM_TEST_MAX_LEN, slack, 0);
+      failed += cksum_test_one(&kernels[i], CKSUM_TEST_MAX_LEN, slack, 1);
+    }
+
+    for (int round = 0; round < rounds; round++) {
+      int len = random() % (CKSUM_TEST_MAX_LEN + 1);
+      int slack = random() % CKSUM_TEST_MAX_SLACK;
+      failed += cksum_test_one(&kernels[i], len, slack, (round % 8) == 0);
+    }
+  }
+
+  if (failed) {
+    printf("%d tests failed.\n", failed);
+    return (1);
+  }
+  printf("all tests passed.\n");
+  return (0);
+}
+
+/*
+ * Allocate a buffer followed by an inaccessible guard page, fill it
+ * with all 0xff if saturated is set, otherwise with random data, and
+ * return the end of it.
+ */
+static uint8_t *
+cksum_test_buffer(int saturated)
+{
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t len = (CKSUM_TEST_MAX_LEN + CKSUM_TEST_MAX_SLACK + page_size - 1)
+    / page_size * page_size;
+  uint8_t *bufp = mmap(NULL, len + page_size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufp == MAP_FAILED) {
+    err(EXIT_FAILURE, "failed to allocate the test buffer.");
+  }
+  if (mprotect(bufp + len, page_size, PROT_NONE) == -1) {
+    err(EXIT_FAILURE, "failed to protect the guard page.");
+  }
+
+  for (size_t i = 0; i < len; i++) {
+    bufp[i] = saturated ? 0xff : random();
+  }
+
+  return (bufp + len);
+}
+
+/*
+ * Fill the kernels array with the vectorized implementations
+ * supported by the CPU, and return the number of them.
+ */
+static int
+cksum_test_kernels(struct cksum_test_kernel *kernels)
+{
+  int num_kernels = 0;
+
+#if defined(CKSUM_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    kernels[num_kernels].name = "sse2";
+    kernels[num_kernels++].func = cksum_acc_words_sse2;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    kernels[num_kernels].name = "avx2";
+    kernels[num_kernels++].func = cksum_acc_words_avx2;
+  }
+  if (__builtin_cpu_supports("avx512bw")) {
+    kernels[num_kernels].name = "avx512bw";
+    kernels[num_kernels++].func = cksum_acc_words_avx512;
+  }
+#endif
+
+  return (num_kernels);
+}
+
+/*
+ * Sum len bytes of data ending slack bytes before the guard page with
+ * the kernel and with the scalar implementation.  The data is all
+ * 0xff if saturated is set, otherwise random.  Returns 1 if the sums
+ * differ.  The bytes following the data are random too, so summing
+ * beyond an odd length is also caught.
+ */
+static int
+cksum_test_one(struct cksum_test_kernel *kernelp, int len, int slack,
+	       int saturated)
+{
+  uint8_t *datap = (saturated ? cksum_test_saturated_end
+		    : cksum_test_random_end) - slack - len;
+
+  uint32_t expected = cksum_acc_words_scalar((const uint16_t *)datap, len);
+  uint32_t sum = kernelp->func((const uint16_t *)datap, len);
+  if (sum != expected) {
+    printf("%s: len %d, address %p, %s: sum 0x%08x, expected 0x%08x\n",
+	   kernelp->name, len, (void *)datap,
+	   saturated ? "all 0xff" : "random", sum, expected);
+    return (1);
+  }
+
+  return (0);
+}
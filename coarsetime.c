@@ -0,0 +1,114 @@
+/*
+ * Copyright 2010, 2011, 2012
+ *   IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+#include <pthread.h>
+
+#if defined(__linux__)
+#include <sys/timerfd.h>
+#endif
+
+#include "coarsetime.h"
+
+time_t coarsetime_sec = 0;
+
+static pthread_t coarsetime_thread;
+static void (*coarsetime_tick)(time_t);
+
+static void *coarsetime_main(void *);
+
+void
+coarsetime_update(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  __atomic_store_n(&coarsetime_sec, now.tv_sec, __ATOMIC_RELAXED);
+}
+
+int
+coarsetime_start(void (*tick)(time_t))
+{
+  coarsetime_update();
+  coarsetime_tick = tick;
+  if (pthread_create(&coarsetime_thread, NULL, coarsetime_main, NULL) != 0) {
+    warnx("failed to create the clock thread.");
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * The clock thread is woken up every COARSETIME_TICK milliseconds by a
+ * timerfd, or by nanosleep() where timerfd is not available.
+ */
+static void *
+coarsetime_main(void *arg)
+{
+  struct timespec interval;
+  interval.tv_sec = COARSETIME_TICK / 1000;
+  interval.tv_nsec = (long)(COARSETIME_TICK % 1000) * 1000000;
+
+  int timer_fd = -1;
+#if defined(__linux__)
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (timer_fd != -1) {
+    struct itimerspec spec;
+    spec.it_interval = interval;
+    spec.it_value = interval;
+    if (timerfd_settime(timer_fd, 0, &spec, NULL) == -1) {
+      warn("failed to set the clock timer.");
+      close(timer_fd);
+      timer_fd = -1;
+    }
+  }
+#endif
+
+  time_t last_tick = coarsetime_now();
+  while (1) {
+    if (timer_fd != -1) {
+      uint64_t expirations;
+      if (read(timer_fd, &expirations, sizeof(expirations)) == -1) {
+	nanosleep(&interval, NULL);
+      }
+    } else {
+      nanosleep(&interval, NULL);
+    }
+
+    coarsetime_update();
+    time_t now = coarsetime_now();
+    if (now != last_tick) {
+      last_tick = now;
+      if (coarsetime_tick != NULL) {
+	coarsetime_tick(now);
+      }
+    }
+  }
+
+  return (NULL);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2010, 2011, 2012
+ *   IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __COARSETIME_H__
+#define __COARSETIME_H__
+
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COARSETIME_TICK 100	/* The clock is updated every 100 msec. */
+
+/*
+ * A process-wide coarse clock in seconds, for the checks on the
+ * forwarding path which do not need a precise time, such as the
+ * lifetime of the path MTU information.  The time is monotonic, not
+ * the wall clock time.  It is updated by the clock thread, or by
+ * coarsetime_update() in a program without the thread, and reading it
+ * is one plain load.
+ */
+extern time_t coarsetime_sec;
+
+static inline time_t
+coarsetime_now(void)
+{
+  return (__atomic_load_n(&coarsetime_sec, __ATOMIC_RELAXED));
+}
+
+void coarsetime_update(void);
+
+/*
+ * Start the clock thread.  The tick function is called on the thread
+ * every second, to run the periodic maintenance off the forwarding
+ * path.
+ */
+int coarsetime_start(void (*tick)(time_t));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
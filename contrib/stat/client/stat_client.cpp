@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <sys/time.h>
 #include <err.h>
 
 #include <sys/types.h>
@@ -22,6 +23,8 @@
 
 #include "stat.h"
 #include "stat_file_manager.h"
+#include "stat_snapshot.h"
+#include "stat_shm_reader.h"
 
 #define STAT_SOCK "/tmp/map646_stat"
 
@@ -69,6 +72,7 @@ int main(int argc, char**argv)
    }
    
    json_object *jobj;
+   stat_shm_reader *shm = NULL;
 
    
    while(true){
@@ -113,6 +117,104 @@ int main(int argc, char**argv)
          }
          jobj = json_tokener_parse(buf);
          std::cout << json_object_to_json_string(jobj) << std::endl;
+      }else if(command == "snapshot"){
+
+         if((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0){
+            perror("socket");
+            exit(1);
+         }
+         memset((char *)&addr, 0, sizeof(addr));
+         addr.sun_family = AF_UNIX;
+         strcpy(addr.sun_path, STAT_SOCK);
+         if(connect(fd, (sockaddr *)&addr, sizeof(addr.sun_family) + strlen(STAT_SOCK)) < 0){
+            perror("connect");
+            exit(1);
+         }
+         std::cout << "command: snapshot" << std::endl;
+         write(fd, "snapshot", sizeof("snapshot"));
+
+         /* The size in decimal, the ack, and then the snapshot. */
+         char size_buf[32];
+         memset(size_buf, 0, sizeof(size_buf));
+         if(read(fd, size_buf, sizeof(size_buf) - 1) <= 0){
+            std::cout << "read failed" << std::endl;
+            exit(1);
+         }
+         size_t size = strtoul(size_buf, NULL, 10);
+         write(fd, "ok", sizeof("ok"));
+         std::string snap(size, 0);
+         size_t got = 0;
+         while(got < size){
+            ssize_t n = read(fd, &snap[got], size - got);
+            if(n <= 0){
+               std::cout << "read2 failed" << std::endl;
+               exit(1);
+            }
+            got += n;
+         }
+         close(fd);
+
+         std::map<map646_in_addr, stat_chunk> stat;
+         std::map<map646_in6_addr, stat_chunk> stat66;
+         time_t last_flush;
+         timeval start, end;
+         gettimeofday(&start, NULL);
+         int ret = snapshot_decode((const uint8_t *)snap.data(), size, &last_flush, stat, stat66);
+         gettimeofday(&end, NULL);
+         if(ret < 0){
+            std::cout << "broken snapshot" << std::endl;
+            continue;
+         }
+         std::cout << "size: " << size << " bytes, decoded in "
+                   << (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec)
+                   << " usec, last flush: " << ctime_r(&last_flush, size_buf);
+         for(std::map<map646_in_addr, stat_chunk>::iterator it = stat.begin(); it != stat.end(); it++){
+            std::cout << "service addr: " << it->first.get_addr() << ", num: " << it->second.total_num()
+                      << ", peers: " << it->second.total_peers() << std::endl;
+         }
+         for(std::map<map646_in6_addr, stat_chunk>::iterator it = stat66.begin(); it != stat66.end(); it++){
+            std::cout << "service addr: " << it->first.get_addr() << ", num: " << it->second.total_num()
+                      << ", peers: " << it->second.total_peers() << std::endl;
+         }
+      }else if(command == "shm"){
+
+         if(shm == NULL){
+            shm = new stat_shm_reader();
+            if(shm->open() < 0){
+               delete shm;
+               shm = NULL;
+               continue;
+            }
+         }
+
+         std::map<map646_in_addr, stat_chunk> stat;
+         std::map<map646_in6_addr, stat_chunk> stat66;
+         time_t last_flush;
+         uint64_t drop[DROP_REASON_MAX];
+         timeval start, end;
+         gettimeofday(&start, NULL);
+         int ret = shm->read(&last_flush, stat, stat66, drop);
+         gettimeofday(&end, NULL);
+         if(ret < 0){
+            continue;
+         }
+         char time_buf[32];
+         std::cout << "read in "
+                   << (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec)
+                   << " usec, last flush: " << ctime_r(&last_flush, time_buf);
+         for(std::map<map646_in_addr, stat_chunk>::iterator it = stat.begin(); it != stat.end(); it++){
+            std::cout << "service addr: " << it->first.get_addr() << ", num: " << it->second.total_num()
+                      << ", peers: " << it->second.total_peers() << std::endl;
+         }
+         for(std::map<map646_in6_addr, stat_chunk>::iterator it = stat66.begin(); it != stat66.end(); it++){
+            std::cout << "service addr: " << it->first.get_addr() << ", num: " << it->second.total_num()
+                      << ", peers: " << it->second.total_peers() << std::endl;
+         }
+         for(int r = 0; r < DROP_REASON_MAX; r++){
+            if(drop[r] != 0){
+               std::cout << "dropped " << drop_reason_name(r) << ": " << drop[r] << std::endl;
+            }
+         }
       }else if(command == "flush"){
 
          if((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0){
@@ -173,7 +275,7 @@ int main(int argc, char**argv)
          std::cin >> filename;
          fm->write(filename, jobj);
       }else{
-         std::cout << "unknown command: commands are show | flush | quit | toggle | time | stat | write" << std::endl;
+         std::cout << "unknown command: commands are show | snapshot | shm | flush | quit | toggle | time | stat | write" << std::endl;
       }
    }
 
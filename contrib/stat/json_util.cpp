@@ -44,6 +44,10 @@ int json_merge(json_object* jobj){
             json_object_object_foreach(jchunk, key, jelement){
 
                int proto = map646_stat::get_proto_ID(key);
+               if(proto < 0){
+                  /* The estimated peers cannot be merged. */
+                  continue;
+               }
                
                if(jelement != NULL){
                   stat[addr].stat_element[proto].num += json_object_get_int(json_object_object_get(jelement, "num"));
@@ -68,6 +72,17 @@ int json_merge(json_object* jobj){
                         stat[addr].stat_element[proto].port_stat[port] += json_object_get_int(value);
                      }
                   }
+
+                  json_object *jport_error = json_object_object_get(jelement, "port_error");
+                  if(jport_error != NULL){
+                     json_object_object_foreach(jport_error, key, value){
+                        std::stringstream ss;
+                        int port;
+                        ss << key;
+                        ss >> port;
+                        stat[addr].stat_element[proto].port_error[port] += json_object_get_int(value);
+                     }
+                  }
                }
             }
          }
@@ -81,6 +96,10 @@ int json_merge(json_object* jobj){
             map646_stat::map646_in6_addr addr6(key6);
             json_object_object_foreach(jchunk6, key, jelement){
                int proto = map646_stat::get_proto_ID(key);
+               if(proto < 0){
+                  /* The estimated peers cannot be merged. */
+                  continue;
+               }
 
                if(jelement != NULL){
                   stat66[addr6].stat_element[proto].num += json_object_get_int(json_object_object_get(jelement, "num"));
@@ -105,6 +124,17 @@ int json_merge(json_object* jobj){
                         stat66[addr6].stat_element[proto].port_stat[port] += json_object_get_int(value);
                      }
                   }
+
+                  json_object *jport_error = json_object_object_get(jelement, "port_error");
+                  if(jport_error != NULL){
+                     json_object_object_foreach(jport_error, key, value){
+                        std::stringstream ss;
+                        int port;
+                        ss << key;
+                        ss >> port;
+                        stat66[addr6].stat_element[proto].port_error[port] += json_object_get_int(value);
+                     }
+                  }
                }
             }
          }
@@ -165,6 +195,19 @@ int json_merge(json_object* jobj){
                }
                json_object_object_add(element, "port", port);
             }
+
+            if(!it->second.stat_element[i].port_error.empty()){
+               std::map<int, int>::iterator error_it = it->second.stat_element[i].port_error.begin();
+               json_object *port_error = json_object_new_object();
+               while(error_it != it->second.stat_element[i].port_error.end()){
+                  std::stringstream ss;
+                  ss << error_it->first;
+                  std::string s = ss.str();
+                  json_object_object_add(port_error, s.c_str(), json_object_new_int(error_it->second));
+                  error_it++;
+               }
+               json_object_object_add(element, "port_error", port_error);
+            }
             json_object_object_add(chunk, map646_stat::get_proto(i).c_str(), element); 
             }
          }
@@ -222,6 +265,19 @@ int json_merge(json_object* jobj){
                   }
                   json_object_object_add(element, "port", port);
                }
+
+               if(!it6->second.stat_element[i].port_error.empty()){
+                  std::map<int, int>::iterator error_it = it6->second.stat_element[i].port_error.begin();
+                  json_object *port_error = json_object_new_object();
+                  while(error_it != it6->second.stat_element[i].port_error.end()){
+                     std::stringstream ss;
+                     ss << error_it->first;
+                     std::string s = ss.str();
+                     json_object_object_add(port_error, s.c_str(), json_object_new_int(error_it->second));
+                     error_it++;
+                  }
+                  json_object_object_add(element, "port_error", port_error);
+               }
                json_object_object_add(chunk, map646_stat::get_proto(i).c_str(), element); 
             }
          }
@@ -0,0 +1,199 @@
+#include <string>
+#include <vector>
+#include <map>
+
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <err.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "stat.h"
+#include "stat_shm_reader.h"
+
+#define STAT_SHM_RETRY_MAX 10000
+
+stat_shm_reader::stat_shm_reader() : fd(-1), shmp(NULL), size(0){
+}
+
+stat_shm_reader::~stat_shm_reader(){
+   if(shmp != NULL){
+      munmap((void *)shmp, size);
+   }
+   if(fd != -1){
+      close(fd);
+   }
+}
+
+int stat_shm_reader::open(const char *name){
+   if((fd = shm_open(name, O_RDONLY, 0)) < 0){
+      warn("shm_open %s", name);
+      return -1;
+   }
+   if(map(sizeof(map646_stat::stat_shm_header)) < 0){
+      return -1;
+   }
+   if(memcmp(shmp->magic, STAT_SHM_MAGIC, sizeof(shmp->magic)) != 0
+      || shmp->version != STAT_SHM_VERSION
+      || shmp->header_len != sizeof(map646_stat::stat_shm_header)
+      || shmp->hist_bits > 16
+      || shmp->len_buckets != (uint32_t)map646_stat::stat_hist_buckets(shmp->hist_bits)
+      || shmp->top_ports > STAT_TOP_PORTS_MAX
+      || shmp->hll_registers != STAT_HLL_REGISTERS
+      || shmp->drop_reasons != DROP_REASON_MAX
+      || shmp->entry_len != sizeof(map646_stat::stat_shm_entry)
+         + 6 * (sizeof(map646_stat::stat_counter) + shmp->len_buckets * sizeof(uint32_t))
+         + 4 * shmp->top_ports * sizeof(map646_stat::stat_top_port)
+         + STAT_HLL_REGISTERS){
+      warnx("unknown stat shared memory format");
+      return -1;
+   }
+   return 0;
+}
+
+int stat_shm_reader::map(size_t new_size){
+   void *p = mmap(NULL, new_size, PROT_READ, MAP_SHARED, fd, 0);
+   if(p == MAP_FAILED){
+      warn("mmap");
+      return -1;
+   }
+   if(shmp != NULL){
+      munmap((void *)shmp, size);
+   }
+   shmp = (const map646_stat::stat_shm_header *)p;
+   size = new_size;
+   return 0;
+}
+
+/*
+ * Copy the header and the entries consistently.  The entries are
+ * entry_len bytes each.  The copy is retried while map646 is updating
+ * the segment.
+ */
+int stat_shm_reader::read(map646_stat::stat_shm_header *headerp,
+                          std::vector<uint8_t> &entries){
+   if(shmp == NULL){
+      return -1;
+   }
+   for(int n = 0; n < STAT_SHM_RETRY_MAX; n++){
+      uint32_t seq = __atomic_load_n(&shmp->seq, __ATOMIC_ACQUIRE);
+      if(seq & 1){
+         sched_yield();
+         continue;
+      }
+      memcpy(headerp, shmp, sizeof(*headerp));
+      if(headerp->size > size){
+         if(map(headerp->size) < 0){
+            return -1;
+         }
+         continue;
+      }
+      size_t len = (headerp->num_entries[0] + headerp->num_entries[1])
+         * headerp->entry_len;
+      if(sizeof(*headerp) + len > size){
+         /* Torn header. */
+         continue;
+      }
+      entries.resize(len);
+      if(len > 0){
+         memcpy(&entries[0], shmp + 1, len);
+      }
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if(__atomic_load_n(&shmp->seq, __ATOMIC_RELAXED) == seq){
+         return 0;
+      }
+   }
+   warnx("the stat shared memory is busy");
+   return -1;
+}
+
+/*
+ * Read the counters into the stat maps.  Only the addresses with any
+ * counted packet are added.  If dropp is not NULL, the DROP_REASON_MAX
+ * counts of the dropped packets since the startup are copied to it,
+ * indexed by the reasons of drop.h.
+ */
+int stat_shm_reader::read(time_t *timep,
+                          std::map<map646_stat::map646_in_addr, map646_stat::stat_chunk> &stat,
+                          std::map<map646_stat::map646_in6_addr, map646_stat::stat_chunk> &stat66,
+                          uint64_t *dropp){
+   map646_stat::stat_shm_header header;
+   std::vector<uint8_t> entries;
+   if(read(&header, entries) < 0){
+      return -1;
+   }
+   if(timep != NULL){
+      *timep = (time_t)header.last_flush;
+   }
+   if(dropp != NULL){
+      memcpy(dropp, header.drop, sizeof(header.drop));
+   }
+
+   size_t counter_len = sizeof(map646_stat::stat_counter)
+      + header.len_buckets * sizeof(uint32_t);
+   size_t num = header.num_entries[0] + header.num_entries[1];
+   for(size_t i = 0; i < num; i++){
+      const map646_stat::stat_shm_entry &entry
+         = *(const map646_stat::stat_shm_entry *)&entries[i * header.entry_len];
+      const map646_stat::stat_counter *counters[6];
+      bool counted = false;
+      for(int c = 0; c < 6; c++){
+         counters[c] = (const map646_stat::stat_counter *)
+            ((const uint8_t *)entry.counter + c * counter_len);
+         if(counters[c]->num != 0){
+            counted = true;
+         }
+      }
+      if(!counted){
+         continue;
+      }
+
+      map646_stat::stat_chunk *chunkp;
+      if(i < header.num_entries[0]){
+         in_addr addr;
+         memcpy(&addr, &entry.addr, sizeof(addr));
+         chunkp = &stat[map646_stat::map646_in_addr(addr)];
+      }else{
+         chunkp = &stat66[map646_stat::map646_in6_addr(entry.addr)];
+      }
+      const uint8_t *hllp = (const uint8_t *)entry.counter + 6 * counter_len
+         + 4 * header.top_ports * sizeof(map646_stat::stat_top_port);
+      if(chunkp->peer_hll.empty()){
+         chunkp->peer_hll.assign(hllp, hllp + STAT_HLL_REGISTERS);
+      }else{
+         map646_stat::stat_hll_merge(&chunkp->peer_hll[0], hllp);
+      }
+      for(int c = 0; c < 6; c++){
+         map646_stat::stat_chunk::_stat_element &element = chunkp->stat_element[c];
+         element.num += counters[c]->num;
+         element.error += counters[c]->error;
+         for(uint32_t b = 0; b < header.len_buckets; b++){
+            if(counters[c]->len[b] != 0){
+               element.len[map646_stat::stat_hist_lower(b, header.hist_bits)]
+                  += counters[c]->len[b];
+            }
+         }
+         if(c < TCP_IN){
+            continue;
+         }
+         const map646_stat::stat_top_port *ports
+            = (const map646_stat::stat_top_port *)
+            ((const uint8_t *)entry.counter + 6 * counter_len
+             + (c - TCP_IN) * header.top_ports * sizeof(map646_stat::stat_top_port));
+         for(uint32_t p = 0; p < header.top_ports && ports[p].count != 0; p++){
+            element.port_stat[ports[p].port] += ports[p].count;
+            if(ports[p].error != 0){
+               element.port_error[ports[p].port] += ports[p].error;
+            }
+         }
+      }
+   }
+
+   return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef STAT_SHM_READER_H
+#define STAT_SHM_READER_H
+
+/*
+ * Read the counters from the stat shared memory segment of map646
+ * (see stat.h of map646).  The segment is mapped once, and each read()
+ * copies the counters without any system call, unless the segment
+ * has grown since the last read().
+ */
+class stat_shm_reader{
+public:
+   stat_shm_reader();
+   ~stat_shm_reader();
+   int open(const char *name = STAT_SHM_NAME);
+   int read(map646_stat::stat_shm_header *headerp,
+            std::vector<uint8_t> &entries);
+   int read(time_t *timep,
+            std::map<map646_stat::map646_in_addr, map646_stat::stat_chunk> &stat,
+            std::map<map646_stat::map646_in6_addr, map646_stat::stat_chunk> &stat66,
+            uint64_t *dropp = NULL);
+private:
+   int map(size_t size);
+   int fd;
+   const map646_stat::stat_shm_header *shmp;
+   size_t size;
+};
+#endif
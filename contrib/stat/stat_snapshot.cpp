@@ -0,0 +1,185 @@
+#include <string>
+#include <map>
+
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "stat.h"
+#include "stat_snapshot.h"
+
+class snapshot_reader{
+public:
+   snapshot_reader(const uint8_t *bufp, size_t len) : p(bufp), end(bufp + len){
+   }
+
+   bool get(uint64_t *vp, int n){
+      if(end - p < n){
+         return false;
+      }
+      *vp = 0;
+      while(n-- > 0){
+         *vp = *vp << 8 | *p++;
+      }
+      return true;
+   }
+
+   bool get_varint(uint64_t *vp){
+      *vp = 0;
+      for(int shift = 0; shift < 64; shift += 7){
+         if(p == end){
+            return false;
+         }
+         uint8_t c = *p++;
+         *vp |= (uint64_t)(c & 0x7f) << shift;
+         if(!(c & 0x80)){
+            return true;
+         }
+      }
+      return false;
+   }
+
+   bool get_bytes(void *dstp, size_t n){
+      if((size_t)(end - p) < n){
+         return false;
+      }
+      memcpy(dstp, p, n);
+      p += n;
+      return true;
+   }
+
+private:
+   const uint8_t *p;
+   const uint8_t *end;
+};
+
+static bool decode_chunk(snapshot_reader &r, int bits, map646_stat::stat_chunk &chunk){
+   uint64_t bitmap;
+   if(!r.get(&bitmap, 1)){
+      return false;
+   }
+
+   /* The registers of the peers are merged to those of the chunk. */
+   uint64_t num_registers;
+   if(!r.get_varint(&num_registers)){
+      return false;
+   }
+   std::vector<uint8_t> hll(STAT_HLL_REGISTERS);
+   uint64_t index = 0;
+   while(num_registers-- > 0){
+      uint64_t delta, value;
+      if(!r.get_varint(&delta) || !r.get(&value, 1)){
+         return false;
+      }
+      index += delta;
+      if(index >= STAT_HLL_REGISTERS){
+         return false;
+      }
+      hll[index] = value;
+   }
+   if(chunk.peer_hll.empty()){
+      chunk.peer_hll.swap(hll);
+   }else{
+      map646_stat::stat_hll_merge(&chunk.peer_hll[0], &hll[0]);
+   }
+
+   for(int i = 0; i < 6; i++){
+      if(!(bitmap & (1 << i))){
+         continue;
+      }
+      map646_stat::stat_chunk::_stat_element &element = chunk.stat_element[i];
+      uint64_t num, n, delta, count;
+      if(!r.get(&num, 4)){
+         return false;
+      }
+      element.num += num;
+
+      if(!r.get_varint(&n)){
+         return false;
+      }
+      /* The lengths are keyed by the smallest length of the bucket. */
+      uint64_t bucket = 0;
+      while(n-- > 0){
+         if(!r.get_varint(&delta) || !r.get_varint(&count)){
+            return false;
+         }
+         bucket += delta;
+         if(bucket >= (uint64_t)map646_stat::stat_hist_buckets(bits)){
+            return false;
+         }
+         element.len[map646_stat::stat_hist_lower(bucket, bits)] += count;
+      }
+
+      if(!r.get_varint(&n)){
+         return false;
+      }
+      uint64_t port = 0, error;
+      while(n-- > 0){
+         if(!r.get_varint(&delta) || !r.get_varint(&count)
+            || !r.get_varint(&error)){
+            return false;
+         }
+         port += delta;
+         if(port > 0xffff){
+            return false;
+         }
+         element.port_stat[port] += count;
+         if(error != 0){
+            element.port_error[port] += error;
+         }
+      }
+   }
+
+   return true;
+}
+
+int snapshot_decode(const uint8_t *bufp, size_t len, time_t *timep,
+                    std::map<map646_stat::map646_in_addr, map646_stat::stat_chunk> &stat,
+                    std::map<map646_stat::map646_in6_addr, map646_stat::stat_chunk> &stat66){
+   snapshot_reader r(bufp, len);
+   uint64_t magic, version, bits, buckets, snap_len, time, num;
+
+   if(len < STAT_SNAP_HDR_LEN || memcmp(bufp, STAT_SNAP_MAGIC, 4) != 0){
+      return -1;
+   }
+   r.get(&magic, 4);
+   r.get(&version, 1);
+   r.get(&bits, 1);
+   r.get(&buckets, 2);
+   r.get(&snap_len, 4);
+   r.get(&time, 8);
+   if(version != STAT_SNAP_VERSION || snap_len != len || bits > 16
+      || buckets != (uint64_t)map646_stat::stat_hist_buckets(bits)){
+      return -1;
+   }
+   if(timep != NULL){
+      *timep = (time_t)time;
+   }
+
+   if(!r.get(&num, 4)){
+      return -1;
+   }
+   while(num-- > 0){
+      in_addr addr;
+      if(!r.get_bytes(&addr, sizeof(addr))
+         || !decode_chunk(r, bits, stat[map646_stat::map646_in_addr(addr)])){
+         return -1;
+      }
+   }
+
+   if(!r.get(&num, 4)){
+      return -1;
+   }
+   while(num-- > 0){
+      in6_addr addr6;
+      if(!r.get_bytes(&addr6, sizeof(addr6))
+         || !decode_chunk(r, bits, stat66[map646_stat::map646_in6_addr(addr6)])){
+         return -1;
+      }
+   }
+
+   return 0;
+}
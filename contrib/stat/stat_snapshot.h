@@ -0,0 +1,13 @@
+#ifndef STAT_SNAPSHOT_H
+#define STAT_SNAPSHOT_H
+
+/*
+ * Decode the binary snapshot of the "snapshot" command (see stat.h of
+ * map646) into the stat maps.  The counters are added to the maps.
+ * Returns 0 on success, or -1 if the snapshot is broken or of an
+ * unknown version.
+ */
+int snapshot_decode(const uint8_t *bufp, size_t len, time_t *timep,
+                    std::map<map646_stat::map646_in_addr, map646_stat::stat_chunk> &stat,
+                    std::map<map646_stat::map646_in6_addr, map646_stat::stat_chunk> &stat66);
+#endif
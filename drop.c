@@ -0,0 +1,301 @@
+/*
+ * Copyright 2010, 2011, 2012
+ *   IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "drop.h"
+#include "logring.h"
+
+/*
+ * The log message of each reason.  The message is formatted with the
+ * address of the sample if it is counted by drop_count_addr(), with
+ * strerror(arg0) if DROP_F_ERRNO is set, or with (arg0, arg1)
+ * otherwise.
+ */
+#define DROP_F_ERRNO 0x01
+
+static const struct drop_reason_info {
+  const char *name;
+  const char *message;
+  int flags;
+} drop_reasons[DROP_REASON_MAX] = {
+  { "short_packet", "too short packet (%ld) received.", 0 },
+  { "unsupported", "unsupported packet.", 0 },
+  { "ip4_options", "IPv4 options are not supported.", 0 },
+  { "ip6_exthdr", "Extention header %ld is not supported.", 0 },
+  { "truncated",
+    "Insufficient data supplied (%ld), while IP header says (%ld)", 0 },
+  { "no_mapping", "no mapping entry found for %s.", 0 },
+  { "icmp_fragment",
+    "fragmented ICMP packets (protocol %ld) are not supported.", 0 },
+  { "icmp_short", "too short ICMP message (%ld) of protocol %ld.", 0 },
+  { "icmp_type", "unsupported ICMP type %ld of protocol %ld.", 0 },
+  { "icmp_rate_limit", "ICMP rate limit over.", 0 },
+  { "gso_too_long", "too long GSO packet (%ld) for IPv4.", 0 },
+  { "send_failed", "sending a packet failed: %s.", DROP_F_ERRNO },
+};
+
+/*
+ * The counters of a thread.  Each thread takes its own entry at the
+ * first drop, and only that thread writes to it.  The threads beyond
+ * DROP_MAX_THREADS share drop_overflow with atomic adds.
+ */
+struct drop_counters {
+  uint64_t count[DROP_REASON_MAX];
+} __attribute__((aligned(64)));
+
+static struct drop_counters drop_threads[DROP_MAX_THREADS];
+static struct drop_counters drop_overflow;
+static int drop_num_threads = 0;
+static __thread struct drop_counters *drop_self = NULL;
+
+/*
+ * The samples of a reason taken in the current interval.  A thread
+ * claims a slot by incrementing taken, and fills it only if the slot
+ * is free, since the previous owner may not have finished it when the
+ * sampler reset taken.  The sampler prints the ready slots and frees
+ * them.
+ */
+#define DROP_SAMPLE_FREE 0
+#define DROP_SAMPLE_BUSY 1
+#define DROP_SAMPLE_READY 2
+
+struct drop_sample {
+  int state;
+  int af;
+  long arg[2];
+  uint8_t addr[sizeof(struct in6_addr)];
+};
+
+struct drop_log {
+  unsigned int taken;
+  struct drop_sample samples[DROP_LOG_SAMPLES_MAX];
+} __attribute__((aligned(64)));
+
+static struct drop_log drop_logs[DROP_REASON_MAX];
+static int drop_log_samples = 0;
+static pthread_t drop_log_thread;
+
+static struct drop_sample *drop_sample_claim(int);
+static void drop_sample_print(int, const struct drop_sample *);
+static void *drop_log_main(void *);
+
+static void
+drop_increment(int reason)
+{
+  struct drop_counters *countersp = drop_self;
+  if (countersp == NULL) {
+    int index = __atomic_fetch_add(&drop_num_threads, 1, __ATOMIC_RELAXED);
+    countersp = (index < DROP_MAX_THREADS) ? &drop_threads[index]
+      : &drop_overflow;
+    drop_self = countersp;
+  }
+
+  if (countersp == &drop_overflow) {
+    __atomic_fetch_add(&countersp->count[reason], 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_store_n(&countersp->count[reason],
+		     countersp->count[reason] + 1, __ATOMIC_RELAXED);
+  }
+}
+
+void
+drop_count(int reason, long arg0, long arg1)
+{
+  assert(reason >= 0 && reason < DROP_REASON_MAX);
+
+  drop_increment(reason);
+
+  struct drop_sample *samplep = drop_sample_claim(reason);
+  if (samplep != NULL) {
+    samplep->af = 0;
+    samplep->arg[0] = arg0;
+    samplep->arg[1] = arg1;
+    __atomic_store_n(&samplep->state, DROP_SAMPLE_READY, __ATOMIC_RELEASE);
+  }
+}
+
+void
+drop_count_addr(int reason, int af, const void *addrp)
+{
+  assert(reason >= 0 && reason < DROP_REASON_MAX);
+  assert(af == AF_INET || af == AF_INET6);
+  assert(addrp != NULL);
+
+  drop_increment(reason);
+
+  struct drop_sample *samplep = drop_sample_claim(reason);
+  if (samplep != NULL) {
+    samplep->af = af;
+    memcpy(samplep->addr, addrp, (af == AF_INET) ? sizeof(struct in_addr)
+	   : sizeof(struct in6_addr));
+    __atomic_store_n(&samplep->state, DROP_SAMPLE_READY, __ATOMIC_RELEASE);
+  }
+}
+
+/*
+ * Take a free sample slot of the reason, or return NULL if the slots
+ * of this interval are used up.  Once they are, this is one relaxed
+ * load.
+ */
+static struct drop_sample *
+drop_sample_claim(int reason)
+{
+  struct drop_log *logp = &drop_logs[reason];
+  unsigned int samples = __atomic_load_n(&drop_log_samples, __ATOMIC_RELAXED);
+  if (__atomic_load_n(&logp->taken, __ATOMIC_RELAXED) >= samples) {
+    return (NULL);
+  }
+  unsigned int index = __atomic_fetch_add(&logp->taken, 1, __ATOMIC_RELAXED);
+  if (index >= samples) {
+    return (NULL);
+  }
+
+  struct drop_sample *samplep = &logp->samples[index];
+  int expected = DROP_SAMPLE_FREE;
+  if (!__atomic_compare_exchange_n(&samplep->state, &expected,
+				   DROP_SAMPLE_BUSY, 0, __ATOMIC_ACQUIRE,
+				   __ATOMIC_RELAXED)) {
+    return (NULL);
+  }
+  return (samplep);
+}
+
+uint64_t
+drop_get_count(int reason)
+{
+  assert(reason >= 0 && reason < DROP_REASON_MAX);
+
+  int num_threads = __atomic_load_n(&drop_num_threads, __ATOMIC_RELAXED);
+  if (num_threads > DROP_MAX_THREADS) {
+    num_threads = DROP_MAX_THREADS;
+  }
+  uint64_t count = __atomic_load_n(&drop_overflow.count[reason],
+				   __ATOMIC_RELAXED);
+  int index;
+  for (index = 0; index < num_threads; index++) {
+    count += __atomic_load_n(&drop_threads[index].count[reason],
+			     __ATOMIC_RELAXED);
+  }
+  return (count);
+}
+
+const char *
+drop_reason_name(int reason)
+{
+  assert(reason >= 0 && reason < DROP_REASON_MAX);
+
+  return (drop_reasons[reason].name);
+}
+
+int
+drop_log_start(int samples)
+{
+  if (samples < 0 || samples > DROP_LOG_SAMPLES_MAX) {
+    warnx("the drop log samples must be 0 to %d.", DROP_LOG_SAMPLES_MAX);
+    return (-1);
+  }
+
+  __atomic_store_n(&drop_log_samples, samples, __ATOMIC_RELAXED);
+  if (pthread_create(&drop_log_thread, NULL, drop_log_main, NULL) != 0) {
+    warnx("failed to create the drop log thread.");
+    return (-1);
+  }
+
+  return (0);
+}
+
+static void
+drop_sample_print(int reason, const struct drop_sample *samplep)
+{
+  const struct drop_reason_info *infop = &drop_reasons[reason];
+
+  if (samplep->af != 0) {
+    char addr_str[INET6_ADDRSTRLEN];
+    inet_ntop(samplep->af, samplep->addr, addr_str, sizeof(addr_str));
+    logring_warnx(infop->message, addr_str);
+  } else if (infop->flags & DROP_F_ERRNO) {
+    logring_warnx(infop->message, strerror((int)samplep->arg[0]));
+  } else {
+    logring_warnx(infop->message, samplep->arg[0], samplep->arg[1]);
+  }
+}
+
+/*
+ * The log sampler prints the samples taken in the last interval, and
+ * summarizes the rest of the drops by the counters.
+ */
+static void *
+drop_log_main(void *arg)
+{
+  uint64_t last_counts[DROP_REASON_MAX];
+  int reason;
+  for (reason = 0; reason < DROP_REASON_MAX; reason++) {
+    last_counts[reason] = drop_get_count(reason);
+  }
+
+  while (1) {
+    sleep(DROP_LOG_INTERVAL);
+
+    for (reason = 0; reason < DROP_REASON_MAX; reason++) {
+      uint64_t count = drop_get_count(reason);
+      uint64_t dropped = count - last_counts[reason];
+      last_counts[reason] = count;
+
+      struct drop_log *logp = &drop_logs[reason];
+      uint64_t printed = 0;
+      int index;
+      for (index = 0; index < DROP_LOG_SAMPLES_MAX; index++) {
+	struct drop_sample *samplep = &logp->samples[index];
+	if (__atomic_load_n(&samplep->state, __ATOMIC_ACQUIRE)
+	    != DROP_SAMPLE_READY) {
+	  continue;
+	}
+	drop_sample_print(reason, samplep);
+	__atomic_store_n(&samplep->state, DROP_SAMPLE_FREE, __ATOMIC_RELEASE);
+	printed++;
+      }
+      if (dropped > printed) {
+	logring_warnx("%llu more packets dropped for %s in the last %d "
+		      "seconds.", (unsigned long long)(dropped - printed),
+		      drop_reasons[reason].name, DROP_LOG_INTERVAL);
+      }
+      __atomic_store_n(&logp->taken, 0, __ATOMIC_RELAXED);
+    }
+  }
+
+  return (NULL);
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2010, 2011, 2012
+ *   IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __DROP_H__
+#define __DROP_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The reasons why a packet is dropped.  The names are used as the
+ * keys of the "drop" stat command, and the values are the indexes of
+ * the drop counts in the stat shared memory segment (see stat.h), so
+ * do not reorder or rename them without updating the clients.
+ */
+enum drop_reason {
+  DROP_SHORT_PACKET,	/* shorter than the tun header */
+  DROP_UNSUPPORTED,	/* no mapping table, or unknown address family */
+  DROP_IP4_OPTIONS,	/* IPv4 header with options */
+  DROP_IP6_EXTHDR,	/* IPv6 extension header other than fragment */
+  DROP_TRUNCATED,	/* shorter than the IP header says */
+  DROP_NO_MAPPING,	/* the address is not mapped */
+  DROP_ICMP_FRAGMENT,	/* fragmented ICMP/ICMPv6 packet */
+  DROP_ICMP_SHORT,	/* truncated ICMP/ICMPv6 message */
+  DROP_ICMP_TYPE,	/* ICMP/ICMPv6 type which cannot be translated */
+  DROP_ICMP_RATE_LIMIT,	/* ICMP error suppressed by the rate limit */
+  DROP_GSO_TOO_LONG,	/* GSO packet longer than an IPv4 packet */
+  DROP_SEND_FAILED,	/* writing to the tun queue failed */
+  DROP_REASON_MAX
+};
+
+#define DROP_MAX_THREADS 64
+#define DROP_LOG_SAMPLES_MAX 16
+#define DROP_LOG_SAMPLES_DEFAULT 3
+#define DROP_LOG_INTERVAL 10
+
+/*
+ * Count a dropped packet.  The counters are per thread, so counting
+ * is one relaxed add without any lock or shared cache line.  The
+ * arguments are the values printed by the log sampler, whose meaning
+ * depends on the reason (see drop_reasons[] in drop.c).  Nothing is
+ * printed on the calling thread.
+ */
+void drop_count(int reason, long arg0, long arg1);
+void drop_count_addr(int reason, int af, const void *addrp);
+
+uint64_t drop_get_count(int reason);
+const char *drop_reason_name(int reason);
+
+/*
+ * Start the log sampler thread, which prints at most the specified
+ * number of the samples of each reason and the number of the other
+ * drops every DROP_LOG_INTERVAL seconds.  If the thread is not
+ * started, the drops are only counted.
+ */
+int drop_log_start(int samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
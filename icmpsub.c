@@ -27,7 +27,9 @@
 #include <unistd.h>
 #include <time.h>
 #include <assert.h>
+#include <errno.h>
 #include <err.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -41,9 +43,13 @@
 
 #include "icmpsub.h"
 #include "tunif.h"
+#include "tunio.h"
 #include "checksum.h"
 #include "mapping.h"
 #include "pmtudisc.h"
+#include "drop.h"
+#include "logring.h"
+#include "coarsetime.h"
 
 #if defined(__linux__)
 #define IPV6_VERSION 0x60
@@ -76,7 +82,7 @@ static int icmpsub_check_sending_rate(void);
  * converted to ICMPv6.
  */
 int
-icmpsub_process_icmp4(int tun_fd, const struct icmp *icmp4_hdrp,
+icmpsub_process_icmp4(struct tunio *tiop, const struct icmp *icmp4_hdrp,
 		      int icmp4_size, int *discard_okp)
 {
   assert(icmp4_hdrp != NULL);
@@ -85,8 +91,7 @@ icmpsub_process_icmp4(int tun_fd, const struct icmp *icmp4_hdrp,
   *discard_okp = 0;
 
   if (icmp4_size < ICMP_MINLEN) {
-    warnx("ICMP message must be longer than %d (%d received).", ICMP_MINLEN,
-	  icmp4_size);
+    drop_count(DROP_ICMP_SHORT, icmp4_size, IPPROTO_ICMP);
     *discard_okp = 1;
     return (-1);
   }
@@ -109,8 +114,7 @@ icmpsub_process_icmp4(int tun_fd, const struct icmp *icmp4_hdrp,
 	 * The original IPv4 header is necessary to extract the
 	 * destination address of the original packet.
 	 */
-	warnx("ICMP_UNREACH_NEEDFRAG message must be longer than %lu "
-	      "(%d received).", ICMP_MINLEN + sizeof(struct ip), icmp4_size);
+	drop_count(DROP_ICMP_SHORT, icmp4_size, IPPROTO_ICMP);
 	return (-1);
       }
 
@@ -120,12 +124,13 @@ icmpsub_process_icmp4(int tun_fd, const struct icmp *icmp4_hdrp,
 						 &orig_local_addr,
 						 &orig_remote_addr,
 						 &mtu) == -1) {
-	warnx("cannot extract MTU information from the ICMP packet.");
+	logring_log(LOGRING_ICMP_MTU_EXTRACT, IPPROTO_ICMP);
 	return (-1);
       }
       if (pmtudisc_update_path_mtu_size(AF_INET, &orig_remote_addr,
 					mtu) == -1) {
-	warnx("cannot update path mtu information.");
+	logring_log_addr(LOGRING_PMTU_UPDATE, AF_INET, &orig_remote_addr,
+			 NULL, mtu);
 	return (-1);
       }
 
@@ -141,7 +146,11 @@ icmpsub_process_icmp4(int tun_fd, const struct icmp *icmp4_hdrp,
       if (mapping_convert_addrs_4to6(&orig_remote_addr, &orig_local_addr,
 				     &orig_remote_addr6, &orig_local_addr6)
 	  == -1) {
-	warnx("no mapping available.  gave up to convert ICMP destination unreach/needfrag message to ICMPv6 packet too big message.");
+	/*
+	 * Counted by the mapping class.  Gave up to convert ICMP
+	 * destination unreach/needfrag message to ICMPv6 packet too
+	 * big message.
+	 */
 	return (-1);
       }
       /*
@@ -160,16 +169,16 @@ icmpsub_process_icmp4(int tun_fd, const struct icmp *icmp4_hdrp,
       memcpy(&orig_ip6_hdr.ip6_dst, &orig_remote_addr6,
 	     sizeof(struct in6_addr));
       /*
-       * Check weather tun_fd is valid,
+       * Check weather tiop is valid,
        * because this func is also used by stat functions
        */
 
-      if(tun_fd > 0){
-	if (icmpsub_send_icmp6_packet_too_big(tun_fd, &orig_ip6_hdr,
+      if(tiop != NULL){
+	if (icmpsub_send_icmp6_packet_too_big(tiop, &orig_ip6_hdr,
 					      &orig_remote_addr6,
 					      &orig_local_addr6,
 					      mtu) == -1) {
-	  warnx("failed to send ICMPv6 Packet Too Big message.");
+	  /* Counted as a drop. */
 	  return (-1);
 	}
       }
@@ -185,7 +194,8 @@ icmpsub_process_icmp4(int tun_fd, const struct icmp *icmp4_hdrp,
  * converted to ICMPv6.
  */
 int
-icmpsub_process_icmp6(int tun_fd, const struct icmp6_hdr *icmp6_hdrp,
+icmpsub_process_icmp6(struct tunio *tiop,
+		      const struct icmp6_hdr *icmp6_hdrp,
 		      int icmp6_size, int *discard_okp)
 {
   assert(icmp6_hdrp != NULL);
@@ -194,8 +204,7 @@ icmpsub_process_icmp6(int tun_fd, const struct icmp6_hdr *icmp6_hdrp,
   *discard_okp = 0;
 
   if (icmp6_size < sizeof(struct icmp6_hdr)) {
-    warnx("ICMPv6 message must be longer than %lu (%d received).",
-	  sizeof(struct icmp6_hdr), icmp6_size);
+    drop_count(DROP_ICMP_SHORT, icmp6_size, IPPROTO_ICMPV6);
     *discard_okp = 1;
     return (-1);
   }
@@ -217,9 +226,7 @@ icmpsub_process_icmp6(int tun_fd, const struct icmp6_hdr *icmp6_hdrp,
        * The original IPv6 header is necessary to extract the
        * destination address of the original packet.
        */
-      warnx("ICMP6_PACKET_TOO_BIG message must be longer than %lu "
-	    "(%d received).",
-	    sizeof(struct icmp6_hdr) + sizeof(struct ip6_hdr), icmp6_size);
+      drop_count(DROP_ICMP_SHORT, icmp6_size, IPPROTO_ICMPV6);
       return (-1);
     }
 
@@ -228,12 +235,13 @@ icmpsub_process_icmp6(int tun_fd, const struct icmp6_hdr *icmp6_hdrp,
     if (icmpsub_extract_icmp6_packet_too_big(icmp6_hdrp, &orig_local_addr,
 					     &orig_remote_addr,
 					     &mtu) == -1) {
-      warnx("cannot extract MTU information from the ICMPv6 packet.");
+      logring_log(LOGRING_ICMP_MTU_EXTRACT, IPPROTO_ICMPV6);
       return (-1);
     }
     if (pmtudisc_update_path_mtu_size(AF_INET6, &orig_remote_addr, mtu)
 	== -1) {
-      warnx("cannot update path mtu information.");
+      logring_log_addr(LOGRING_PMTU_UPDATE, AF_INET6, &orig_remote_addr,
+		       NULL, mtu);
       return (-1);
     }
 
@@ -249,7 +257,11 @@ icmpsub_process_icmp6(int tun_fd, const struct icmp6_hdr *icmp6_hdrp,
     if (mapping_convert_addrs_6to4(&orig_remote_addr, &orig_local_addr,
 				   &orig_remote_addr4, &orig_local_addr4)
 	== -1) {
-      warnx("no mapping available.  gave up to convert ICMPv6 packet too big message to ICMP destination unreach/needfrag message.");
+      /*
+       * Counted by the mapping class.  Gave up to convert ICMPv6
+       * packet too big message to ICMP destination unreach/needfrag
+       * message.
+       */
       return (-1);
     }
     /*
@@ -267,12 +279,12 @@ icmpsub_process_icmp6(int tun_fd, const struct icmp6_hdr *icmp6_hdrp,
     memcpy(&orig_ip4_hdr.ip_dst, &orig_remote_addr4, sizeof(struct in_addr));
     orig_ip4_hdr.ip_sum = cksum_calc_ip4_header(&orig_ip4_hdr);
 #define IP6_FRAG6_HDR_LEN (sizeof(struct ip6_hdr) + sizeof(struct ip6_frag))
-    if (icmpsub_send_icmp4_unreach_needfrag(tun_fd, &orig_ip4_hdr,
+    if (icmpsub_send_icmp4_unreach_needfrag(tiop, &orig_ip4_hdr,
 					    &orig_remote_addr4,
 					    &orig_local_addr4,
 					    mtu - IP6_FRAG6_HDR_LEN)
 	== -1) {
-      warnx("failed to send ICMP unreach needfrag.");
+      /* Counted as a drop. */
       return (-1);
     }
   }
@@ -287,7 +299,7 @@ icmpsub_process_icmp6(int tun_fd, const struct icmp6_hdr *icmp6_hdrp,
  * original packet that caused this ICMPv4 error.
  */
 int
-icmpsub_send_icmp4_unreach_needfrag(int tun_fd, void *in_pktp,
+icmpsub_send_icmp4_unreach_needfrag(struct tunio *tiop, void *in_pktp,
 				    const struct in_addr *local_addrp,
 				    const struct in_addr *remote_addrp,
 				    int mtu)
@@ -298,7 +310,7 @@ icmpsub_send_icmp4_unreach_needfrag(int tun_fd, void *in_pktp,
 
   /* Check if we can send this ICMPv4 packet or not. */
   if (icmpsub_check_sending_rate()) {
-    warnx("ICMP rate limit over.");
+    drop_count(DROP_ICMP_RATE_LIMIT, 0, 0);
     return (0);
   }
 
@@ -309,7 +321,7 @@ icmpsub_send_icmp4_unreach_needfrag(int tun_fd, void *in_pktp,
   if (icmpsub_create_icmp4_unreach_needfrag(&ip4_hdr, &icmp4_hdr,
 					    local_addrp, remote_addrp,
 					    mtu) == -1) {
-    warnx("ICMP unreach needfrag packet creation failed.");
+    logring_log(LOGRING_ICMP_CREATE, IPPROTO_ICMP);
     return (-1);
   }
 
@@ -317,10 +329,9 @@ icmpsub_send_icmp4_unreach_needfrag(int tun_fd, void *in_pktp,
   ip4_hdr.ip_sum = cksum_calc_ip4_header(&ip4_hdr);
 
   struct iovec iov[5];
-  uint32_t af;
-  tun_set_af(&af, AF_INET);
-  iov[0].iov_base = &af;
-  iov[0].iov_len = sizeof(uint32_t);
+  uint8_t tun_hdr[TUN_HDR_MAX_LEN];
+  iov[0].iov_base = tun_hdr;
+  iov[0].iov_len = tun_set_hdr(tun_hdr, AF_INET);
   iov[1].iov_base = &ip4_hdr;
   iov[1].iov_len = sizeof(struct ip);
   iov[2].iov_base = NULL;
@@ -333,8 +344,8 @@ icmpsub_send_icmp4_unreach_needfrag(int tun_fd, void *in_pktp,
   /* Calculate the ICMPv4 header checksum. */
   cksum_calc_ulp(IPPROTO_ICMP, iov);
 
-  if (writev(tun_fd, iov, 5) == -1) {
-    warn("failed to write ICMP unreach needfrag packet to the tun device.");
+  if (tunio_writev(tiop, iov, 5) == -1) {
+    drop_count(DROP_SEND_FAILED, errno, 0);
     return (-1);
   }
 
@@ -348,7 +359,7 @@ icmpsub_send_icmp4_unreach_needfrag(int tun_fd, void *in_pktp,
  * that caused this ICMPv6 error.
  */
 int
-icmpsub_send_icmp6_packet_too_big(int tun_fd, void *in_pktp,
+icmpsub_send_icmp6_packet_too_big(struct tunio *tiop, void *in_pktp,
 				  const struct in6_addr *local_addrp,
 				  const struct in6_addr *remote_addrp,
 				  int mtu)
@@ -359,7 +370,7 @@ icmpsub_send_icmp6_packet_too_big(int tun_fd, void *in_pktp,
 
   /* Check if we can send this ICMPv6 packet or not. */
   if (icmpsub_check_sending_rate()) {
-    warnx("ICMP rate limit over.");
+    drop_count(DROP_ICMP_RATE_LIMIT, 0, 0);
     return (0);
   }
 
@@ -369,15 +380,14 @@ icmpsub_send_icmp6_packet_too_big(int tun_fd, void *in_pktp,
   if (icmpsub_create_icmp6_packet_too_big(&ip6_hdr, &icmp6_hdr,
 					  local_addrp, remote_addrp,
 					  mtu) == -1) {
-    warnx("ICMPv6 packet too big header creation failed.");
+    logring_log(LOGRING_ICMP_CREATE, IPPROTO_ICMPV6);
     return (-1);
   }
 
   struct iovec iov[5];
-  uint32_t af;
-  tun_set_af(&af, AF_INET6);
-  iov[0].iov_base = &af;
-  iov[0].iov_len = sizeof(uint32_t);
+  uint8_t tun_hdr[TUN_HDR_MAX_LEN];
+  iov[0].iov_base = tun_hdr;
+  iov[0].iov_len = tun_set_hdr(tun_hdr, AF_INET6);
   iov[1].iov_base = &ip6_hdr;
   iov[1].iov_len = sizeof(struct ip6_hdr);
   iov[2].iov_base = NULL;
@@ -390,8 +400,8 @@ icmpsub_send_icmp6_packet_too_big(int tun_fd, void *in_pktp,
   /* Calculate the ICMPv6 header checksum. */
   cksum_calc_ulp(IPPROTO_ICMPV6, iov);
 
-  if (writev(tun_fd, iov, 5) == -1) {
-    warn("failed to write ICMPv6 packet too big message to the tun device.");
+  if (tunio_writev(tiop, iov, 5) == -1) {
+    drop_count(DROP_SEND_FAILED, errno, 0);
     return (-1);
   }
 
@@ -432,7 +442,7 @@ icmpsub_convert_icmp(int incoming_icmp_protocol, struct iovec *iov)
 				      icmp_hdrp->icmp_code,
 				      ICMP6_ECHO_REQUEST,
 				      icmp_hdrp->icmp_code) == -1) {
-	warnx("Checksum update when converting ICMP Echo to ICMPv6 Echo failed.");
+	logring_log(LOGRING_ICMP_CKSUM, ICMP_ECHO);
 	return(-1);
       }
       break;
@@ -444,13 +454,13 @@ icmpsub_convert_icmp(int incoming_icmp_protocol, struct iovec *iov)
 				      icmp_hdrp->icmp_code,
 				      ICMP6_ECHO_REPLY,
 				      icmp_hdrp->icmp_code) == -1) {
-	warnx("Checksum update when converting ICMP Echo Reply to ICMPv6 Echo Reply failed.");
+	logring_log(LOGRING_ICMP_CKSUM, ICMP_ECHOREPLY);
 	return (-1);
       }
       break;
 
     default:
-      warnx("unsupported ICMP type %d.", icmp_hdrp->icmp_type);
+      drop_count(DROP_ICMP_TYPE, icmp_hdrp->icmp_type, IPPROTO_ICMP);
       return (-1);
     }
     ip6_hdrp = iov[1].iov_base;
@@ -467,7 +477,7 @@ icmpsub_convert_icmp(int incoming_icmp_protocol, struct iovec *iov)
 				      icmp6_hdrp->icmp6_code,
 				      ICMP_ECHO,
 				      icmp6_hdrp->icmp6_code) == -1) {
-	warnx("Checksum update when converting ICMPv6 Echo to ICMP Echo failed.");
+	logring_log(LOGRING_ICMP_CKSUM, ICMP6_ECHO_REQUEST);
 	return(-1);
       }
       break;
@@ -479,13 +489,13 @@ icmpsub_convert_icmp(int incoming_icmp_protocol, struct iovec *iov)
 				      icmp6_hdrp->icmp6_code,
 				      ICMP_ECHOREPLY,
 				      icmp6_hdrp->icmp6_code) == -1) {
-	warnx("Checksum update when converting ICMPv6 Echo Reply to ICMP Echo Reply failed.");
+	logring_log(LOGRING_ICMP_CKSUM, ICMP6_ECHO_REPLY);
 	return(-1);
       }
       break;
 
     default:
-      warnx("unsupported ICMPv6 type %d.", icmp6_hdrp->icmp6_type);
+      drop_count(DROP_ICMP_TYPE, icmp6_hdrp->icmp6_type, IPPROTO_ICMPV6);
       return (-1);
     }
     ip4_hdrp = iov[1].iov_base;
@@ -527,7 +537,7 @@ icmpsub_extract_icmp4_unreach_needfrag(const struct icmp *icmp_hdrp,
      * Very old implementation may not support the Path MTU discovery
      * mechanism.
      */
-    warnx("The received IPv4 MTU size (%d) is too small.", *mtup);
+    logring_log(LOGRING_ICMP4_MTU_TOO_SMALL, *mtup);
     /*
      * XXX: Every router must be able to forward a datagram of 68
      * octets without fragmentation. (RFC791: Internet Protocol)
@@ -563,7 +573,7 @@ icmpsub_extract_icmp6_packet_too_big(const struct icmp6_hdr *icmp6_hdrp,
   /* Copy the nexthop MTU size notified by the intermediate gateway. */
   *mtup = ntohl(icmp6_hdrp->icmp6_mtu);
   if (*mtup < ICMPSUB_IPV6_MINMTU) {
-    warnx("The received IPv6 MTU size (%d) is too small.", *mtup);
+    logring_log(LOGRING_ICMP6_MTU_TOO_SMALL, *mtup);
     /*
      * IPv6 requires that every link in the internet have an MTU of
      * 1280 octets or greater. (RFC2460: Internet Protocol, Version 6
@@ -779,13 +789,20 @@ icmpsub_select_source_address(int af, const void *remote_addrp,
 }
 #endif
 
+/*
+ * The rate limit is shared by all the forwarding threads, since it
+ * limits the total number of ICMP errors generated by this node.
+ */
 static int
 icmpsub_check_sending_rate(void)
 {
+  static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
   static int count = 0;
   static time_t from;
-  time_t now = time(NULL);
+  time_t now = coarsetime_now();
+  int ret = 0;
 
+  pthread_mutex_lock(&rate_lock);
   if (now - from > 1) {
     /* Reset counter. */
     count = 0;
@@ -794,10 +811,11 @@ icmpsub_check_sending_rate(void)
 
   if (count > ICMPSUB_RATE_LIMIT_COUNT) {
     /* Too frequent. */
-    return (-1);
+    ret = -1;
+  } else {
+    count = count + 1;
   }
+  pthread_mutex_unlock(&rate_lock);
 
-  count = count + 1;
-
-  return (0);
+  return (ret);
 }
@@ -30,11 +30,15 @@
 extern "C" {
 #endif
 
-int icmpsub_process_icmp4(int, const struct icmp *, int, int *);
-int icmpsub_process_icmp6(int, const struct icmp6_hdr *, int, int *);
-int icmpsub_send_icmp4_unreach_needfrag(int, void *, const struct in_addr *,
+struct tunio;
+
+int icmpsub_process_icmp4(struct tunio *, const struct icmp *, int, int *);
+int icmpsub_process_icmp6(struct tunio *, const struct icmp6_hdr *, int, int *);
+int icmpsub_send_icmp4_unreach_needfrag(struct tunio *, void *,
+					const struct in_addr *,
 					const struct in_addr *, int);
-int icmpsub_send_icmp6_packet_too_big(int, void *, const struct in6_addr *,
+int icmpsub_send_icmp6_packet_too_big(struct tunio *, void *,
+				      const struct in6_addr *,
 				      const struct in6_addr *, int);
 int icmpsub_convert_icmp(int, struct iovec *);
 
@@ -0,0 +1,382 @@
+/*
+ * Copyright 2010, 2011, 2012
+ *   IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <err.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "logring.h"
+
+#define LOGRING_MAX_THREADS 64
+
+/*
+ * The message of each code.  The addresses of the record are given
+ * first as strings, followed by the integer argument.
+ */
+static const char *logring_messages[LOGRING_CODE_MAX] = {
+  "unknown ether frame type %lx received.",
+  "unsupported address family %ld.",
+  "unsupported upper layer protocol %ld.",
+  "unsupported IP version %ld.",
+  "invalid partial checksum end (%ld).",
+  "unsupported GSO type %ld.",
+  "MTU %ld is too small for a GSO packet.",
+  "The received IPv4 MTU size (%ld) is too small.",
+  "The received IPv6 MTU size (%ld) is too small.",
+  "cannot extract MTU information from the ICMP packet (protocol %ld).",
+  "ICMP error packet creation failed (protocol %ld).",
+  "Checksum update when converting ICMP type %ld failed.",
+  "cannot update path mtu information of %s to %ld.",
+  "cannot allocate memory for the path mtu information of %s.",
+  "insertion of the path mtu information of %s failed.",
+  "failed to update stat of worker %ld.",
+  "input %s -> %s, length %ld.",
+  "output %s -> %s, length %ld.",
+};
+
+struct logring_record {
+  uint64_t time;	/* nanoseconds since the epoch */
+  long arg;
+  uint16_t code;
+  uint8_t af;
+  uint8_t naddrs;
+  uint8_t addrs[2][sizeof(struct in6_addr)];
+};
+
+/*
+ * The ring of a thread.  The thread puts the records at head, and the
+ * writer thread takes them from tail.  overflow is the number of the
+ * records discarded because the ring was full.
+ */
+struct logring {
+  uint64_t head;
+  uint64_t overflow;
+  uint64_t tail __attribute__((aligned(64)));
+  uint64_t reported_overflow;
+  struct logring_record records[LOGRING_SIZE];
+};
+
+static struct logring *logring_rings[LOGRING_MAX_THREADS];
+static int logring_num_rings = 0;
+static pthread_mutex_t logring_register_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct logring *logring_self = NULL;
+
+/* The destination, shared by the writer thread and the direct writes. */
+#define LOGRING_DEST_STDERR 0
+#define LOGRING_DEST_SYSLOG 1
+#define LOGRING_DEST_FILE 2
+
+static int logring_dest = LOGRING_DEST_STDERR;
+static FILE *logring_fp = NULL;
+static uint64_t logring_written = 0;
+static pthread_mutex_t logring_output_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t logring_thread;
+
+static uint64_t logring_now(void);
+static void logring_put(int, int, const void *, const void *, long);
+static void logring_format(const struct logring_record *, char *, size_t);
+static void logring_output(uint64_t, const char *);
+static void *logring_main(void *);
+
+/*
+ * Give a ring to the calling thread.  The messages of the thread are
+ * written by the writer thread after this.
+ */
+int
+logring_register_thread(void)
+{
+  assert(logring_self == NULL);
+
+  struct logring *ringp;
+  if (posix_memalign((void **)&ringp, 64, sizeof(struct logring)) != 0) {
+    warnx("memory allocation failed for a log ring.");
+    return (-1);
+  }
+  memset(ringp, 0, sizeof(struct logring));
+
+  pthread_mutex_lock(&logring_register_mutex);
+  if (logring_num_rings == LOGRING_MAX_THREADS) {
+    pthread_mutex_unlock(&logring_register_mutex);
+    warnx("too many log ring threads.");
+    free(ringp);
+    return (-1);
+  }
+  logring_rings[logring_num_rings] = ringp;
+  __atomic_store_n(&logring_num_rings, logring_num_rings + 1,
+		   __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&logring_register_mutex);
+
+  logring_self = ringp;
+  return (0);
+}
+
+void
+logring_log(int code, long arg)
+{
+  logring_put(code, 0, NULL, NULL, arg);
+}
+
+void
+logring_log_addr(int code, int af, const void *addr1p, const void *addr2p,
+		 long arg)
+{
+  assert(af == AF_INET || af == AF_INET6);
+  assert(addr1p != NULL);
+
+  logring_put(code, af, addr1p, addr2p, arg);
+}
+
+static void
+logring_put(int code, int af, const void *addr1p, const void *addr2p,
+	    long arg)
+{
+  assert(code >= 0 && code < LOGRING_CODE_MAX);
+
+  struct logring_record record_buf;
+  struct logring_record *recordp = &record_buf;
+  struct logring *ringp = logring_self;
+  uint64_t head = 0;
+  if (ringp != NULL) {
+    head = ringp->head;
+    if (head - __atomic_load_n(&ringp->tail, __ATOMIC_ACQUIRE)
+	>= LOGRING_SIZE) {
+      __atomic_store_n(&ringp->overflow, ringp->overflow + 1,
+		       __ATOMIC_RELAXED);
+      return;
+    }
+    recordp = &ringp->records[head & (LOGRING_SIZE - 1)];
+  }
+
+  recordp->time = logring_now();
+  recordp->arg = arg;
+  recordp->code = code;
+  recordp->af = af;
+  recordp->naddrs = 0;
+  size_t addr_len = (af == AF_INET) ? sizeof(struct in_addr)
+    : sizeof(struct in6_addr);
+  if (addr1p != NULL) {
+    memcpy(recordp->addrs[recordp->naddrs++], addr1p, addr_len);
+  }
+  if (addr2p != NULL) {
+    memcpy(recordp->addrs[recordp->naddrs++], addr2p, addr_len);
+  }
+
+  if (ringp != NULL) {
+    __atomic_store_n(&ringp->head, head + 1, __ATOMIC_RELEASE);
+    return;
+  }
+
+  /* Not a forwarding thread.  Write it now. */
+  char message[256];
+  logring_format(recordp, message, sizeof(message));
+  logring_output(recordp->time, message);
+}
+
+void
+logring_warnx(const char *fmt, ...)
+{
+  char message[256];
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(message, sizeof(message), fmt, ap);
+  va_end(ap);
+  logring_output(logring_now(), message);
+}
+
+uint64_t
+logring_get_written(void)
+{
+  return (__atomic_load_n(&logring_written, __ATOMIC_RELAXED));
+}
+
+uint64_t
+logring_get_overflow(void)
+{
+  uint64_t overflow = 0;
+  int num_rings = __atomic_load_n(&logring_num_rings, __ATOMIC_ACQUIRE);
+  int index;
+  for (index = 0; index < num_rings; index++) {
+    overflow += __atomic_load_n(&logring_rings[index]->overflow,
+				__ATOMIC_RELAXED);
+  }
+  return (overflow);
+}
+
+int
+logring_open(const char *dest)
+{
+  assert(dest != NULL);
+
+  if (strcmp(dest, "stderr") == 0) {
+    logring_dest = LOGRING_DEST_STDERR;
+  } else if (strcmp(dest, "syslog") == 0) {
+    openlog("map646", LOG_PID, LOG_DAEMON);
+    logring_dest = LOGRING_DEST_SYSLOG;
+  } else {
+    logring_fp = fopen(dest, "a");
+    if (logring_fp == NULL) {
+      warn("opening the log file %s failed.", dest);
+      return (-1);
+    }
+    logring_dest = LOGRING_DEST_FILE;
+  }
+
+  return (0);
+}
+
+int
+logring_start(void)
+{
+  if (pthread_create(&logring_thread, NULL, logring_main, NULL) != 0) {
+    warnx("failed to create the log writer thread.");
+    return (-1);
+  }
+
+  return (0);
+}
+
+static uint64_t
+logring_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+}
+
+static void
+logring_format(const struct logring_record *recordp, char *message,
+	       size_t size)
+{
+  const char *fmt = logring_messages[recordp->code];
+  char addr_strs[2][INET6_ADDRSTRLEN];
+  int index;
+  for (index = 0; index < recordp->naddrs; index++) {
+    inet_ntop(recordp->af, recordp->addrs[index], addr_strs[index],
+	      INET6_ADDRSTRLEN);
+  }
+
+  switch (recordp->naddrs) {
+  case 0:
+    snprintf(message, size, fmt, recordp->arg);
+    break;
+  case 1:
+    snprintf(message, size, fmt, addr_strs[0], recordp->arg);
+    break;
+  default:
+    snprintf(message, size, fmt, addr_strs[0], addr_strs[1], recordp->arg);
+    break;
+  }
+}
+
+/*
+ * Write a message to the destination.  The time of the record is
+ * written with the message, since the message may be written later
+ * than it is logged.  syslog records the time by itself.
+ */
+static void
+logring_output(uint64_t time_ns, const char *message)
+{
+  char time_str[32];
+  time_t sec = time_ns / 1000000000;
+  struct tm tm;
+  localtime_r(&sec, &tm);
+  size_t len = strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
+  snprintf(time_str + len, sizeof(time_str) - len, ".%03u",
+	   (unsigned int)(time_ns % 1000000000 / 1000000));
+
+  pthread_mutex_lock(&logring_output_mutex);
+  switch (logring_dest) {
+  case LOGRING_DEST_SYSLOG:
+    syslog(LOG_WARNING, "%s", message);
+    break;
+  case LOGRING_DEST_FILE:
+    fprintf(logring_fp, "%s %s\n", time_str, message);
+    fflush(logring_fp);
+    break;
+  default:
+    warnx("%s %s", time_str, message);
+    break;
+  }
+  __atomic_store_n(&logring_written, logring_written + 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&logring_output_mutex);
+}
+
+/*
+ * The writer thread formats and writes the records of all the rings,
+ * and reports the records lost by overflow.
+ */
+static void *
+logring_main(void *arg)
+{
+  struct timespec interval;
+  interval.tv_sec = LOGRING_INTERVAL / 1000;
+  interval.tv_nsec = (long)(LOGRING_INTERVAL % 1000) * 1000000;
+
+  while (1) {
+    int num_rings = __atomic_load_n(&logring_num_rings, __ATOMIC_ACQUIRE);
+    int index;
+    for (index = 0; index < num_rings; index++) {
+      struct logring *ringp = logring_rings[index];
+      uint64_t tail = ringp->tail;
+      uint64_t head = __atomic_load_n(&ringp->head, __ATOMIC_ACQUIRE);
+      while (tail != head) {
+	const struct logring_record *recordp
+	  = &ringp->records[tail & (LOGRING_SIZE - 1)];
+	char message[256];
+	logring_format(recordp, message, sizeof(message));
+	logring_output(recordp->time, message);
+	tail++;
+	__atomic_store_n(&ringp->tail, tail, __ATOMIC_RELEASE);
+      }
+
+      uint64_t overflow = __atomic_load_n(&ringp->overflow,
+					  __ATOMIC_RELAXED);
+      if (overflow != ringp->reported_overflow) {
+	char message[64];
+	snprintf(message, sizeof(message), "%llu log messages lost.",
+		 (unsigned long long)(overflow - ringp->reported_overflow));
+	logring_output(logring_now(), message);
+	ringp->reported_overflow = overflow;
+      }
+    }
+    nanosleep(&interval, NULL);
+  }
+
+  return (NULL);
+}
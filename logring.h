@@ -0,0 +1,100 @@
+/*
+ * Copyright 2010, 2011, 2012
+ *   IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __LOGRING_H__
+#define __LOGRING_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The messages logged on the forwarding path.  Each record carries a
+ * code, up to two addresses and an integer argument, which are
+ * formatted by the writer thread with the message of the code (see
+ * logring_messages[] in logring.c).
+ */
+enum logring_code {
+  LOGRING_UNKNOWN_ETHER_TYPE,
+  LOGRING_UNSUPPORTED_AF,
+  LOGRING_UNSUPPORTED_ULP,
+  LOGRING_UNSUPPORTED_IP_VERSION,
+  LOGRING_VNET_CSUM_OFFSET,
+  LOGRING_VNET_GSO_TYPE,
+  LOGRING_VNET_GSO_MTU,
+  LOGRING_ICMP4_MTU_TOO_SMALL,
+  LOGRING_ICMP6_MTU_TOO_SMALL,
+  LOGRING_ICMP_MTU_EXTRACT,
+  LOGRING_ICMP_CREATE,
+  LOGRING_ICMP_CKSUM,
+  LOGRING_PMTU_UPDATE,
+  LOGRING_PMTU_NOMEM,
+  LOGRING_PMTU_INSERT,
+  LOGRING_STAT_UPDATE,
+  LOGRING_DEBUG_INPUT,
+  LOGRING_DEBUG_OUTPUT,
+  LOGRING_CODE_MAX
+};
+
+#define LOGRING_SIZE 256	/* The records of a thread, power of 2. */
+#define LOGRING_INTERVAL 100	/* The writer polls the rings in msec. */
+
+/*
+ * Log a message.  On a thread registered with
+ * logring_register_thread(), the record is put to the ring of the
+ * thread and formatted later by the writer thread.  If the ring is
+ * full, the record is counted as an overflow and discarded, and the
+ * caller never waits.  On the other threads, the message is written
+ * at once.
+ */
+void logring_log(int code, long arg);
+void logring_log_addr(int code, int af, const void *addr1p,
+		      const void *addr2p, long arg);
+
+/*
+ * Write a formatted message at once to the destination of the log.
+ * Used by the threads off the forwarding path.
+ */
+void logring_warnx(const char *fmt, ...)
+  __attribute__((format(printf, 1, 2)));
+
+int logring_register_thread(void);
+uint64_t logring_get_written(void);
+uint64_t logring_get_overflow(void);
+
+/*
+ * Select the destination, "stderr" (default), "syslog", or the path
+ * of a file to which the messages are appended.
+ */
+int logring_open(const char *dest);
+int logring_start(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -27,6 +27,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sched.h>
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
@@ -34,12 +36,12 @@
 #include <fcntl.h>
 #include <iostream>
 #include <string>
+#include <sstream>
 
 #include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/epoll.h>
 #include <net/if.h>
 
 #include <sys/time.h>
@@ -53,51 +55,155 @@
 
 #include "mapping.h"
 #include "tunif.h"
+#include "tunio.h"
+#include "qsbr.h"
 #include "checksum.h"
 #include "pmtudisc.h"
-#include "icmpsub.h"
 #include "stat.h"
-
-#if defined(__linux__)
-#define IPV6_VERSION 0x60
-#endif
-
-#define BUF_LEN 1600 /* XXX: should be bigger than the MTU size of the
-			local interfaces used to transmit actual
-			packets. */
-
-static int send_4to6(void *, size_t);
-static int send_6to4(void *, size_t);
-static int send66_GtoI(void *, size_t);
-static int send66_ItoG(void *, size_t);
+#include "xlate.h"
+#include "statctl.h"
+#include "drop.h"
+#include "logring.h"
+#include "coarsetime.h"
 
 void cleanup_sigint(int);
 void cleanup(void);
 void reload_sighup(int);
+void worker_failed_sigusr1(int);
+static void reload(void);
+static void *worker_main(void *);
+static void *reload_main(void *);
+static void *stat_shm_main(void *);
+static void clock_tick(time_t);
+static void worker_input(struct tunio *, uint8_t *, ssize_t, void *);
+static void stat_register_id(int, uint32_t, const void *);
+static void stat_command(const char *, std::string &);
 
-int tun_fd;
-int stat_listen_fd, stat_fd;
+/*
+ * Each forwarding worker serves one queue of the tun interface, and
+ * runs on its own thread pinned to a CPU core.
+ */
+struct worker {
+  pthread_t thread;
+  int index;
+  int tun_fd;
+};
+
+static struct worker workers[TUN_MAX_QUEUES];
+static int num_workers = 1;
+static int tunio_backend_type = TUNIO_BACKEND_RW;
+static int offload_enable = 0;
+int stat_listen_fd;
+
+/* Set by the SIGHUP handler, processed in the main loop. */
+static volatile sig_atomic_t reload_requested = 0;
+/*
+ * The errno of the first worker whose tun queue failed, or 0.  The
+ * worker wakes up the main thread with SIGUSR1, and the main loop
+ * uninstalls the routes and exits.  Accessed with the atomic builtins.
+ */
+static pthread_t main_thread;
+static int worker_errno = 0;
+/*
+ * The configuration file is reloaded by a dedicated thread, so that
+ * neither the main loop nor the forwarding workers wait for it.
+ */
+static pthread_t reload_thread;
+static pthread_mutex_t reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reload_cond = PTHREAD_COND_INITIALIZER;
+static int reload_pending = 0;
+/*
+ * The counters are copied to the stat shared memory segment every
+ * stat_shm_interval milliseconds by the stat_shm thread.  0 disables
+ * the segment.
+ */
+static pthread_t stat_shm_thread;
+static int stat_shm_interval = 1000;
+/*
+ * The number of the dropped packets logged for each reason in every
+ * DROP_LOG_INTERVAL seconds.  The others are only counted.
+ */
+static int drop_log_samples = DROP_LOG_SAMPLES_DEFAULT;
+/* stderr, syslog, or the path of a file. */
+static const char *log_dest = "stderr";
+/*
+ * Toggled by the stat client on the statctl thread, read by the
+ * workers.  Accessed only with the atomic builtins.
+ */
+static bool stat_enable = false;
 
 std::string map646_conf_path("/etc/map646.conf");
 map646_stat::stat map_stat;
 
+static void
+usage(const char *progname)
+{
+  std::cout << "Usage:" << progname
+	    << " [-c <Conf path>] [-w <workers>] [-u] [-o] [-s <msec>]"
+	    << " [-l <samples>] [-L <stderr|syslog|log path>]"
+	    << std::endl;
+  exit(1);
+}
+
 int main(int argc, char *argv[])
 {
 
-  /* Configuration path option */
-  if (argc == 3) {
-    if (!strcmp("-c", argv[1])) {
-      map646_conf_path = argv[2];
-    } else {
-      std::cout <<"Usage:" << argv[0] << " [-c] <Conf path>" << std::endl;
-      exit(1);
+  /* Command line options. */
+  int ch;
+  while ((ch = getopt(argc, argv, "c:w:uos:l:L:")) != -1) {
+    switch (ch) {
+    case 'c':
+      /* Configuration path option */
+      map646_conf_path = optarg;
+      break;
+    case 'w':
+      /* The number of the forwarding threads (and tun queues). */
+      num_workers = atoi(optarg);
+      if (num_workers < 1 || num_workers > TUN_MAX_QUEUES) {
+	errx(EXIT_FAILURE, "the number of workers must be 1 to %d.",
+	     TUN_MAX_QUEUES);
+      }
+      break;
+    case 'u':
+      /* Use io_uring to read/write the tun queues. */
+      tunio_backend_type = TUNIO_BACKEND_URING;
+      break;
+    case 'o':
+      /* Receive and send GSO packets with the virtio-net header. */
+      offload_enable = 1;
+      break;
+    case 's':
+      /* The interval to update the stat shared memory. */
+      stat_shm_interval = atoi(optarg);
+      if (stat_shm_interval < 0) {
+	errx(EXIT_FAILURE, "the stat shared memory interval must not be negative.");
+      }
+      break;
+    case 'l':
+      /* The number of the drop log samples per reason and interval. */
+      drop_log_samples = atoi(optarg);
+      if (drop_log_samples < 0 || drop_log_samples > DROP_LOG_SAMPLES_MAX) {
+	errx(EXIT_FAILURE, "the drop log samples must be 0 to %d.",
+	     DROP_LOG_SAMPLES_MAX);
+      }
+      break;
+    case 'L':
+      /* The destination of the log messages. */
+      log_dest = optarg;
+      break;
+    default:
+      usage(argv[0]);
     }
-  } else if (argc != 1) {
-    std::cout <<"Usage:" << argv[0] << " [-c] <Conf path>" << std::endl;
-    exit(1);
+  }
+  if (optind != argc) {
+    usage(argv[0]);
   }
 
   /* Initialization of supporting classes. */
+  if (logring_open(log_dest) == -1) {
+    errx(EXIT_FAILURE, "failed to open the log %s.", log_dest);
+  }
+  cksum_initialize();
   if (mapping_initialize() == -1) {
     errx(EXIT_FAILURE, "failed to initialize the mapping class.");
   }
@@ -106,6 +212,9 @@ int main(int argc, char *argv[])
   }
 
   /* Exit/Signal handers setup. */
+  for (int i = 0; i < TUN_MAX_QUEUES; i++) {
+    workers[i].tun_fd = -1;
+  }
   if (atexit(cleanup) == -1) {
     err(EXIT_FAILURE, "failed to register an exit hook.");
   }
@@ -115,55 +224,53 @@ int main(int argc, char *argv[])
   if (signal(SIGHUP, reload_sighup) == SIG_ERR) {
     err(EXIT_FAILURE, "failed to register a SIGHUP hook.");
   }
+  if (signal(SIGUSR1, worker_failed_sigusr1) == SIG_ERR) {
+    err(EXIT_FAILURE, "failed to register a SIGUSR1 hook.");
+  }
+  main_thread = pthread_self();
 
-  /* Create a tun interface. */
-  tun_fd = -1;
+  /* Create a tun interface with one queue per worker. */
+  int tun_fds[TUN_MAX_QUEUES];
   strncpy(tun_if_name, TUN_DEFAULT_IF_NAME, IFNAMSIZ);
-  tun_fd = tun_alloc(tun_if_name);
-  if (tun_fd == -1) {
+  num_workers = tun_alloc(tun_if_name, tun_fds, num_workers, offload_enable);
+  if (num_workers == -1) {
     errx(EXIT_FAILURE, "cannot open a tun internface %s.", tun_if_name);
   }
+  for (int i = 0; i < num_workers; i++) {
+    workers[i].index = i;
+    workers[i].tun_fd = tun_fds[i];
+  }
 
   /* Create a stat socket */
-  stat_listen_fd = -1;
-  stat_fd = -1;
-  sockaddr_un caddr;
-  socklen_t len;
-
-  memset(&caddr, 0, sizeof(sockaddr_un));
-  memset(&len, 0, sizeof(socklen_t));
-
   stat_listen_fd = map646_stat::statif_alloc();
   if (stat_listen_fd == -1) {
     err(EXIT_FAILURE, "failed to open a stat interface");
   }
 
-  /* Set up epoll */
-  int epfd, nfiles = 10;
-  epoll_event *epevp;
-  if ((epfd = epoll_create( nfiles )) == -1) {
-    errx(EXIT_FAILURE, "epoll_create() failed");
+  /* Create mapping table from the configuraion file. */
+  mapping_set_id_hook(stat_register_id);
+  if (mapping_create_table(map646_conf_path.c_str()) == -1) {
+    errx(EXIT_FAILURE, "mapping table creation failed.");
   }
 
-  epevp = new epoll_event;
-  epevp->data.fd = tun_fd;
-  epevp->events = EPOLLIN;
-  if (epoll_ctl(epfd, EPOLL_CTL_ADD, tun_fd, epevp) == -1) {
-    errx(EXIT_FAILURE, "epoll_ctl() failed");
+  /*
+   * Allocate the stat shard of each worker.  The histogram bits and
+   * the top ports are read from the configuration file only at the
+   * startup.
+   */
+  int stat_hist_bits = mapping_get_stat_hist_bits();
+  int stat_top_ports = mapping_get_stat_top_ports();
+  if (map_stat.initialize(num_workers, stat_hist_bits < 0
+			  ? STAT_HIST_BITS_DEFAULT : stat_hist_bits,
+			  stat_top_ports < 0
+			  ? STAT_TOP_PORTS_DEFAULT : stat_top_ports) == -1) {
+    errx(EXIT_FAILURE, "failed to initialize the stat.");
   }
-  delete epevp;
 
-  epevp = new epoll_event;
-  epevp->data.fd = stat_listen_fd;
-  epevp->events = EPOLLIN;
-  if (epoll_ctl(epfd, EPOLL_CTL_ADD, stat_listen_fd, epevp) == -1) {
-    errx(EXIT_FAILURE, "epoll_ctl() failed");
-  }
-  delete epevp;
-
-  /* Create mapping table from the configuraion file. */
-  if (mapping_create_table(map646_conf_path.c_str(), 0) == -1) {
-    errx(EXIT_FAILURE, "mapping table creation failed.");
+  if (stat_shm_interval > 0
+      && map_stat.open_shm(STAT_SHM_NAME) == -1) {
+    warnx("the stat is not published to the shared memory.");
+    stat_shm_interval = 0;
   }
 
   /*
@@ -175,127 +282,234 @@ int main(int argc, char *argv[])
     errx(EXIT_FAILURE, "failed to install mapped route information.");
   }
 
-  ssize_t read_len;
-  uint8_t buf[BUF_LEN];
-  uint8_t *bufp;
-
-  bool stat_enable = false;
+  std::cout << std::boolalpha << "stat_enable: "
+	    << __atomic_load_n(&stat_enable, __ATOMIC_RELAXED) << std::endl;
 
-  std::cout << std::boolalpha << "stat_enable: " << stat_enable << std::endl;
+  /*
+   * Start the forwarding workers, the reload thread and the stat
+   * threads.  Signals are blocked in them so that they are always
+   * delivered to this (main) thread.
+   */
+  sigset_t sigset, old_sigset;
+  sigfillset(&sigset);
+  pthread_sigmask(SIG_BLOCK, &sigset, &old_sigset);
+  if (coarsetime_start(clock_tick) == -1) {
+    errx(EXIT_FAILURE, "failed to start the clock thread.");
+  }
+  for (int i = 0; i < num_workers; i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])
+	!= 0) {
+      errx(EXIT_FAILURE, "failed to create worker thread %d.", i);
+    }
+  }
+  if (pthread_create(&reload_thread, NULL, reload_main, NULL) != 0) {
+    errx(EXIT_FAILURE, "failed to create the reload thread.");
+  }
+  if (stat_shm_interval > 0
+      && pthread_create(&stat_shm_thread, NULL, stat_shm_main, NULL) != 0) {
+    errx(EXIT_FAILURE, "failed to create the stat shared memory thread.");
+  }
+  if (statctl_start(stat_listen_fd, stat_command) == -1) {
+    errx(EXIT_FAILURE, "failed to start the stat control thread.");
+  }
+  if (logring_start() == -1) {
+    errx(EXIT_FAILURE, "failed to start the log writer thread.");
+  }
+  if (drop_log_samples > 0 && drop_log_start(drop_log_samples) == -1) {
+    errx(EXIT_FAILURE, "failed to start the drop log thread.");
+  }
+  pthread_sigmask(SIG_SETMASK, &old_sigset, NULL);
+  std::cout << "workers: " << num_workers << std::endl;
 
-  /* MAIN WHILE LOOP */
+  /*
+   * This thread only waits for the signals.  SIGHUP and SIGUSR1 are
+   * blocked except in sigsuspend(), so that no request is missed.
+   */
+  sigset_t wait_sigset;
+  sigemptyset(&wait_sigset);
+  sigaddset(&wait_sigset, SIGHUP);
+  sigaddset(&wait_sigset, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &wait_sigset, &old_sigset);
   while (1) {
-    int res;
-    int timeout = -1;
-    struct epoll_event events[nfiles];
-    if ((res = epoll_wait(epfd, events, nfiles, timeout)) == -1) {
-      if (errno == EINTR) {
-	continue;
+    while (!reload_requested
+	   && __atomic_load_n(&worker_errno, __ATOMIC_ACQUIRE) == 0) {
+      sigsuspend(&old_sigset);
+    }
+    int error = __atomic_load_n(&worker_errno, __ATOMIC_ACQUIRE);
+    if (error != 0) {
+      /* Uninstall the routes once, under the lock of the table. */
+      if (mapping_uninstall_route() == -1) {
+	warnx("failed to uninstall route entries created before.  should we continue?");
       }
-      errx(EXIT_FAILURE,"epoll_wait() failed ");
+      errno = error;
+      err(EXIT_FAILURE, "read from tun failed.");
     }
+    reload_requested = 0;
+    reload();
+  }
+}
+
+/*
+ * The forwarding loop of each worker.  A worker reads packets from
+ * its own tun queue, translates them, and writes the results back to
+ * the same queue.  The worker is pinned to a CPU core chosen by its
+ * index.
+ */
+static void *
+worker_main(void *arg)
+{
+  struct worker *workerp = (struct worker *)arg;
 
-    for (int i = 0; i < res; i++) {
-      int fd = events[i].data.fd;
+#if defined(__linux__)
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_cpus > 0) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(workerp->index % num_cpus, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset)
+	!= 0) {
+      warnx("failed to pin worker %d to CPU %ld.", workerp->index,
+	    workerp->index % num_cpus);
+    }
+  }
+#endif
 
-      if (fd == tun_fd) {
-	read_len = read(tun_fd, (void *)buf, BUF_LEN);
-	bufp = buf;
-	int d = dispatch(bufp);
-	bufp += sizeof(uint32_t);
+  if (qsbr_register_thread() == -1) {
+    errx(EXIT_FAILURE, "failed to register worker %d to QSBR.",
+	 workerp->index);
+  }
+  if (logring_register_thread() == -1) {
+    errx(EXIT_FAILURE, "failed to create the log ring of worker %d.",
+	 workerp->index);
+  }
 
-	if (stat_enable == true) {
-	  if (map_stat.update(bufp, read_len, d) < 0) {
-	    warnx("failed to update stat");
-	  }
-	}
+  struct tunio *tiop
+    = tunio_create(workerp->tun_fd, tunio_backend_type,
+		   tun_offload ? TUNIO_GSO_BUF_LEN : TUNIO_BUF_LEN);
+  if (tiop == NULL) {
+    errx(EXIT_FAILURE, "failed to create the I/O context of worker %d.",
+	 workerp->index);
+  }
 
-	switch (d) {
-	case FOURTOSIX:
-	  send_4to6(bufp, (size_t)read_len);
-	  break;
-	case SIXTOFOUR:
-	  send_6to4(bufp, (size_t)read_len);
-	  break;
-	case SIXTOSIX_GtoI:
-	  send66_GtoI(bufp, (size_t)read_len);
-	  break;
-	case SIXTOSIX_ItoG:
-	  send66_ItoG(bufp, (size_t)read_len);
-	  break;
-	default:
-	  warnx("unsupported mapping");
-	}
+  if (tunio_run(tiop, worker_input, workerp) == -1) {
+    /*
+     * The program reaches here only when reading from the tun queue
+     * fails.  The main thread uninstalls the routes and exits.
+     */
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&worker_errno, &expected,
+				    errno != 0 ? errno : EIO, false,
+				    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      pthread_kill(main_thread, SIGUSR1);
+    }
+  }
 
-      } else if (fd == stat_listen_fd) {
-	if ((stat_fd = accept(stat_listen_fd, (sockaddr *)&caddr, &len)) < 0) {
-	  warnx("failed to accept stat client");
-	  break;
-	}
-	epoll_event epev;
-	epev.data.fd = stat_fd;
-	epev.events = EPOLLIN;
-	if (epoll_ctl(epfd, EPOLL_CTL_ADD, stat_fd, &epev) == -1) {
-	  warnx("epoll_ctr failed()");
-	}
-      } else {
-	const int COMMAND_SIZE = 10;
-	char command[COMMAND_SIZE];
-	std::string list("show, info, time, flush, toggle, help, stat");
-	memset(command, 0, COMMAND_SIZE);
-	int size;
-	if ((size = read(fd, command, COMMAND_SIZE)) < 0) {
-	  warnx("read() faild");
-	} else if (size != 0) {
-	  if (strcmp(command, "show") == 0) {
-	    map_stat.write_stat(stat_fd);
-	  } else if (strcmp(command, "info") == 0) {
-	    map_stat.write_info(stat_fd);
-	  } else if (strcmp(command, "time") == 0) {
-	    map_stat.write_last_flush_time(stat_fd);
-	  } else if (strcmp(command, "flush") == 0) {
-	    map_stat.flush();
-	    map_stat.safe_write(fd, std::string("flushed"));
-	  } else if (strcmp(command, "toggle") == 0) {
-	    stat_enable = !stat_enable;
-	    if (stat_enable) {
-	      map_stat.safe_write(fd, std::string("true"));
-	    } else {
-	      map_stat.safe_write(fd, std::string("false"));
-	    }
-	  } else if (strcmp(command, "stat") == 0) {
-	    if (stat_enable) {
-	      map_stat.safe_write(fd, std::string("true"));
-	    } else {
-	      map_stat.safe_write(fd, std::string("false"));
-	    }
-	  } else if (strcmp(command, "help") == 0) {
-	    map_stat.safe_write(fd, list);
-	  } else {
-	    std::string msg("unknown commands: ");
-	    msg += list;
-	    map_stat.safe_write(fd, msg);
-	  }
-	}
+  qsbr_unregister_thread();
+  tunio_destroy(tiop);
+  return (NULL);
+}
 
-	epoll_event epev;
-	epev.data.fd = fd;
-	if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &epev) == -1) {
-	  perror("epoll_ctl() EPOLL_CTL_DEL failed");
-	}
-	close(fd);
-      }
+/*
+ * Translate one packet read from the tun queue, and send the result
+ * to the same queue.
+ */
+static void
+worker_input(struct tunio *tiop, uint8_t *buf, ssize_t read_len, void *arg)
+{
+  if (read_len < (ssize_t)tun_hdr_len) {
+    drop_count(DROP_SHORT_PACKET, read_len, 0);
+    return;
+  }
+
+  struct mapping_match match;
+  int d = dispatch(buf, &match);
+
+  if (__atomic_load_n(&stat_enable, __ATOMIC_RELAXED)) {
+    struct worker *workerp = (struct worker *)arg;
+    if (map_stat.update(workerp->index, buf + tun_hdr_len,
+			read_len - tun_hdr_len, d, &match) < 0) {
+      logring_log(LOGRING_STAT_UPDATE, workerp->index);
     }
   }
 
-  /*
-   * The program reaches here only when read(2) fails in the above
-   * while loop.
-   */
-  if (mapping_uninstall_route() == -1) {
-    warnx("failed to uninstall route entries created before.  should we continue?");
+  xlate_packet(tiop, d, &match, buf, read_len);
+
+  /* No reference to the mapping table is held after this point. */
+  qsbr_quiescent();
+}
+
+/*
+ * Record a mapped address when the mapping class gives a new ID to
+ * it.  Its stat slots are allocated if the stat is enabled.
+ */
+static void
+stat_register_id(int af, uint32_t id, const void *addrp)
+{
+  map_stat.register_id(af, id, addrp);
+}
+
+/*
+ * Make the reply of a stat command.  Called on the stat control
+ * thread.
+ */
+static void
+stat_command(const char *command, std::string &reply)
+{
+  std::string list("show, snapshot, info, time, flush, toggle, help, stat, "
+		   "drop, log");
+
+  if (strcmp(command, "show") == 0) {
+    map_stat.show(reply);
+  } else if (strcmp(command, "snapshot") == 0) {
+    map_stat.snapshot(reply);
+  } else if (strcmp(command, "info") == 0) {
+    map_stat.info(reply);
+  } else if (strcmp(command, "time") == 0) {
+    map_stat.last_flush_time(reply);
+  } else if (strcmp(command, "flush") == 0) {
+    map_stat.flush();
+    reply = "flushed";
+  } else if (strcmp(command, "toggle") == 0) {
+    /*
+     * Only the statctl thread writes the flag.  The counters are
+     * allocated before the workers start counting, and freed after
+     * they stop.
+     */
+    bool enable = !__atomic_load_n(&stat_enable, __ATOMIC_RELAXED);
+    if (enable) {
+      if (map_stat.enable() == 0) {
+	__atomic_store_n(&stat_enable, true, __ATOMIC_RELAXED);
+      }
+    } else {
+      __atomic_store_n(&stat_enable, false, __ATOMIC_RELAXED);
+      map_stat.disable();
+    }
+    reply = __atomic_load_n(&stat_enable, __ATOMIC_RELAXED)
+      ? "true" : "false";
+  } else if (strcmp(command, "stat") == 0) {
+    reply = __atomic_load_n(&stat_enable, __ATOMIC_RELAXED)
+      ? "true" : "false";
+  } else if (strcmp(command, "drop") == 0) {
+    /* The dropped packets since the startup, by reason. */
+    std::ostringstream os;
+    os << "{";
+    for (int i = 0; i < DROP_REASON_MAX; i++) {
+      os << (i == 0 ? "" : ",") << "\"" << drop_reason_name(i) << "\":"
+	 << drop_get_count(i);
+    }
+    os << "}";
+    reply = os.str();
+  } else if (strcmp(command, "log") == 0) {
+    /* The log messages written, and lost by the full log rings. */
+    std::ostringstream os;
+    os << "{\"written\":" << logring_get_written()
+       << ",\"overflow\":" << logring_get_overflow() << "}";
+    reply = os.str();
+  } else if (strcmp(command, "help") == 0) {
+    reply = list;
+  } else {
+    reply = "unknown commands: " + list;
   }
-  err(EXIT_FAILURE, "read from tun failed.");
 }
 
 /*
@@ -323,15 +537,15 @@ cleanup(void)
       warnx("failed to uninstall route entries created before.  should we continue?");
     }
   }
-  if (tun_fd != -1) {
-    close(tun_fd);
+  for (int i = 0; i < TUN_MAX_QUEUES; i++) {
+    if (workers[i].tun_fd != -1) {
+      close(workers[i].tun_fd);
+    }
   }
   if (stat_listen_fd != -1) {
     close(stat_listen_fd);
   }
-  if (stat_fd != -1) {
-    close(stat_fd);
-  }
+  map_stat.unlink_shm();
 
 #if !defined(__linux__)
   (void)tun_dealloc(tun_if_name);
@@ -341,977 +555,87 @@ cleanup(void)
 }
 
 /*
- * The reload function deletes all the route information installed by
- * this program, reload the configuration file, and re-install the new
- * route information given by the configuration file.
+ * The SIGHUP handler only records the request.  The actual reload is
+ * done by the main loop, outside of the signal handler context.
  */
 void
 reload_sighup(int dummy)
 {
-  std::cout << "reload_sighup" << std::endl;
-  /*
-   * Uninstall all the route installed when the configuration file was
-   * read last time.
-   */
-  if (mapping_uninstall_route() == -1) {
-    warnx("failed to uninstall route entries created before.  should we continue?");
-  }
-
-  /* Destroy the mapping table. */
-  mapping_destroy_table();
-
-  /* Create a new mapping table from the configuraion file. */
-  if (mapping_create_table(map646_conf_path.c_str(), 0) == -1) {
-    errx(EXIT_FAILURE, "mapping table creation failed.");
-  }
-
-  /*
-   * Install necessary route entries based on the mapping table
-   * information.
-   */
-  if (mapping_install_route() == -1) {
-    errx(EXIT_FAILURE, "failed to install mapped route information.");
-  }
+  reload_requested = 1;
 }
 
 /*
- * Convert an IPv4 packet given as the argument to an IPv6 packet, and
- * send it.
+ * The SIGUSR1 handler only wakes up the main loop, which checks
+ * worker_errno.
  */
-static int
-send_4to6(void *datap, size_t data_len)
+void
+worker_failed_sigusr1(int dummy)
 {
-  assert (datap != NULL);
-
-  uint8_t *packetp = (uint8_t *)datap;
-
-  /* Analyze IPv4 header contents. */
-  struct ip *ip4_hdrp;
-  struct in_addr ip4_src, ip4_dst;
-  uint16_t ip4_tlen, ip4_hlen, ip4_plen;
-  uint8_t ip4_ttl, ip4_proto;
-  ip4_hdrp = (struct ip *)packetp;
-  if (ip4_hdrp->ip_hl << 2 != sizeof(struct ip)) {
-    /* IPv4 options are not supported. Just drop it. */
-    warnx("IPv4 options are not supported.");
-    return (0);
-  }
-  memcpy((void *)&ip4_src, (const void *)&ip4_hdrp->ip_src,
-	 sizeof(struct in_addr));
-  memcpy((void *)&ip4_dst, (const void *)&ip4_hdrp->ip_dst,
-	 sizeof(struct in_addr));
-  ip4_tlen = ntohs(ip4_hdrp->ip_len);
-  ip4_hlen = ip4_hdrp->ip_hl << 2;
-  ip4_plen = ip4_tlen - ip4_hlen;
-  ip4_ttl = ip4_hdrp->ip_ttl;
-  ip4_proto = ip4_hdrp->ip_p;
-
-  /* Check the packet size. */
-  if (ip4_tlen > data_len) {
-    /* Data is too short.  Drop it. */
-    warnx("Insufficient data supplied (%lu), while IP header says (%d)",
-	  data_len, ip4_tlen);
-    return (-1);
-  }
-
-  /* Fragment information check. */
-  int ip4_id = ntohs(ip4_hdrp->ip_id);
-  int ip4_off_flags = ntohs(ip4_hdrp->ip_off);
-  int ip4_offset = ip4_off_flags & IP_OFFMASK;
-  int ip4_more_frag = ip4_off_flags & IP_MF;
-  int ip4_is_frag = 0;
-  if (ip4_more_frag || ip4_offset != 0) {
-    /* This is one of the fragmented packets. */
-    ip4_is_frag = 1;
-  }
-
-  packetp += ip4_hlen;
-
-#ifdef DEBUG
-  fprintf(stderr, "src = %s\n", inet_ntoa(ip4_src));
-  fprintf(stderr, "dst = %s\n", inet_ntoa(ip4_dst));
-  fprintf(stderr, "hlen = %d\n", ip4_hlen);
-  fprintf(stderr, "plen = %d\n", ip4_plen);
-  fprintf(stderr, "ttl = %d\n", ip4_ttl);
-  fprintf(stderr, "protocol = %d\n", ip4_proto);
-#endif
-
-  /* ICMP error handling. */
-  if (ip4_proto == IPPROTO_ICMP) {
-    int discard_ok = 0;
-    if (icmpsub_process_icmp4(tun_fd, (const struct icmp *)packetp,
-			      data_len - sizeof(ip4_hlen),
-			      &discard_ok)
-	== -1) {
-      return (0);
-    }
-    if (discard_ok) {
-      return (0);
-    }
-  }
-
-  /* Convert IP addresses. */
-  struct in6_addr ip6_src, ip6_dst;
-  if (mapping_convert_addrs_4to6(&ip4_src, &ip4_dst,
-				 &ip6_src, &ip6_dst) == -1) {
-    warnx("no mapping available. packet is dropped.");
-    return (0);
-  }
-
-  /* Prepare an IPv6 header template. */
-  struct ip6_hdr ip6_hdr;
-  memset(&ip6_hdr, 0, sizeof(struct ip6_hdr));
-  ip6_hdr.ip6_vfc = IPV6_VERSION;
-  ip6_hdr.ip6_plen = htons(ip4_plen);
-  ip6_hdr.ip6_nxt = ip4_proto;
-  ip6_hdr.ip6_hlim = ip4_ttl;
-  memcpy((void *)&ip6_hdr.ip6_src, (const void *)&ip6_src,
-	 sizeof(struct in6_addr));
-  memcpy((void *)&ip6_hdr.ip6_dst, (const void *)&ip6_dst,
-	 sizeof(struct in6_addr));
-
-#ifdef DEBUG
-  char addr_name[64];
-  fprintf(stderr, "to src = %s\n",
-	  inet_ntop(AF_INET6, &ip6_src, addr_name, 64));
-  fprintf(stderr, "to dst = %s\n",
-	  inet_ntop(AF_INET6, &ip6_dst, addr_name, 64));
-  fprintf(stderr, "plen = %d\n", ntohs(ip6_hdr.ip6_plen));
-#endif
-
-  /* Fragment processing. */
-  int mtu = pmtudisc_get_path_mtu_size(AF_INET6, &ip6_dst);
-#define IP6_FRAG6_HDR_LEN (sizeof(struct ip6_hdr) + sizeof(struct ip6_frag))
-  if (ip4_plen > mtu - IP6_FRAG6_HDR_LEN) {
-    /* Fragment is needed for this packet. */
-
-    /*
-     * Send an ICMP error message with the unreach type and the
-     * need_fragment code.  ICMP error message generation will be rate
-     * limited.
-     */
-    if (icmpsub_send_icmp4_unreach_needfrag(tun_fd, datap, &ip4_dst, &ip4_src,
-					    mtu - IP6_FRAG6_HDR_LEN)
-	== -1) {
-      warnx("sending ICMP unreach w/ needfrag failed.");
-      /* Continue processing anyway. */
-    }
-
-    int frag_payload_unit = ((mtu - IP6_FRAG6_HDR_LEN) >> 3) << 3;
-    struct ip6_frag ip6_frag_hdr;
-    memset(&ip6_frag_hdr, 0, sizeof(struct ip6_frag));
-    if (ip4_id == 0) {
-      /*
-       * ip4_id may be 0 if the incoming packet is not a fragmented
-       * packet.
-       */
-      ip4_id = random();
-    }
-    ip6_frag_hdr.ip6f_ident = htonl(ip4_id);
-
-    int frag_count = (ip4_plen / frag_payload_unit) + 1;
-    int plen_left = ip4_plen;
-    int relative_offset = 0;
-    while (frag_count--) {
-      /*
-       * Set the original payload length value here to calculate the
-       * relative offset value and upper layer checksum value for
-       * ICMPv6 case.  The next header field is also reset here for
-       * checksum calculation.
-       *
-       * The ICMPv6 fragmentation works in this case only (that means,
-       * the incoming ICMP is not fragmented, but outgoing ICMPv6 is
-       * fragmented), because the ICMPv6 checksum calculation needs
-       * the payload length information in the IPv6 pseudo header
-       * which is not included in the ICMP checksum value.  Note that
-       * TCP and UDP doesn't require the original payload length
-       * information because that information is already counted in
-       * their checksum values.
-       */
-      ip6_hdr.ip6_plen = htons(ip4_plen);
-      ip6_hdr.ip6_nxt = ip4_proto;
-
-      /*
-       * Decide the length of each fragment, and configure the more
-       * fragment flag.
-       */
-      ip6_frag_hdr.ip6f_offlg |= IP6F_MORE_FRAG;
-      int frag_plen = 0;
-      if (plen_left > frag_payload_unit) {
-	frag_plen = frag_payload_unit;
-      } else {
-	frag_plen = plen_left;
-	if (!ip4_more_frag) {
-	  /*
-	   * Clear the IP6F_MORE_FRAG flag since this is the final
-	   * packet generated from a non-fragmented packet or from the
-	   * final fragmented packet.
-	   */
-	  ip6_frag_hdr.ip6f_offlg &= ~IP6F_MORE_FRAG;
-	}
-      }
-
-      /* The fragment offset re-calculation. */
-      relative_offset = ntohs(ip6_hdr.ip6_plen) - plen_left;
-      ip6_frag_hdr.ip6f_offlg |= htons((ip4_offset << 3) + relative_offset);
-
-      plen_left -= frag_plen;
-
-      /* Arrange the pieces of the information. */
-      struct iovec iov[4];
-      uint32_t af;
-      tun_set_af(&af, AF_INET6);
-      iov[0].iov_base = &af;
-      iov[0].iov_len = sizeof(uint32_t);
-      iov[1].iov_base = &ip6_hdr;
-      iov[1].iov_len = sizeof(struct ip6_hdr);
-      iov[2].iov_base = &ip6_frag_hdr;
-      iov[2].iov_len = sizeof(struct ip6_frag);
-      iov[3].iov_base = packetp + relative_offset;
-      iov[3].iov_len = frag_plen;
-
-      /*
-       * Re-calculate the checksum in the ICMP (which is converted to
-       * ICMPv6 eventually), TCP, or UDP header, if a packet contains
-       * the upper layer protocol header.
-       */
-      if (ntohs(ip6_frag_hdr.ip6f_offlg & IP6F_OFF_MASK) == 0) {
-	/* The first fragmented packet case. */
-	if (ip4_proto == IPPROTO_ICMP) {
-	  /* Convert the ICMP type/code to those of ICMPv6. */
-	  if (icmpsub_convert_icmp(IPPROTO_ICMP, iov) == -1) {
-	    /* ICMP to ICMPv6 conversion failed. */
-	    return (0);
-	  }
-	}
-	cksum_update_ulp(ip6_hdr.ip6_nxt, ip4_hdrp, iov);
-      } else if (ip4_proto == IPPROTO_ICMP) {
-	/*
-	 * ICMP to ICMPv6 special case handling.  The next header
-	 * value of the first fragment of ICMPv6 is set to
-	 * IPPROTO_ICMPV6 in the convert_icmp() function, but the rest
-	 * of the fragment packets need to be set it properly here to
-	 * make the IPv6 header chain appropriate.
-	 */
-	ip6_hdr.ip6_nxt = IPPROTO_ICMPV6;
-      }
-
-      /*
-       * Insert the IPv6 fragment header to the IPv6 header chain, and
-       * adjust the payload length.
-       */
-      ip6_frag_hdr.ip6f_nxt = ip6_hdr.ip6_nxt;
-      ip6_hdr.ip6_nxt = IPPROTO_FRAGMENT;
-      ip6_hdr.ip6_plen = htons(frag_plen + sizeof(struct ip6_frag));
-
-      /* Send this fragment. */
-      ssize_t write_len;
-      write_len = writev(tun_fd, iov, 4);
-      if (write_len == -1) {
-	warn("sending an IPv6 packet failed.");
-      }
-    }
-  } else {
-    /* The packet size is smaller than the MTU size. */
-    struct ip6_frag ip6_frag_hdr;
-    struct iovec iov[4];
-    uint32_t af;
-    if (ip4_is_frag) {
-      /*
-       * Size is OK, but the incoming IPv4 packet has fragment
-       * information.  Replace the IPv4 fragment information with the
-       * IPv6 Fragment header.
-       */
-
-      /*
-       * Fragmented ICMP is not supported, because the checksum
-       * calculation procedure for the ICMPv6 packet needs the payload
-       * length of the original IP packet which is only available
-       * after receiving all the fragmented ICMP packets.
-       */
-      if (ip4_proto == IPPROTO_ICMP) {
-	warnx("ICMP fragment packets are not supported.");
-	/* Just drop it. */
-	return (0);
-      }
-
-      /*
-       * Copy the fragment related information from the IPv4 header to
-       * the IPv6 fragment header.
-       */
-      memset(&ip6_frag_hdr, 0, sizeof(struct ip6_frag));
-      if (ip4_more_frag) {
-	ip6_frag_hdr.ip6f_offlg |= IP6F_MORE_FRAG;
-      }
-      ip6_frag_hdr.ip6f_offlg |= htons(ip4_offset << 3);
-      ip6_frag_hdr.ip6f_ident = htonl(ip4_id);
-
-      /* Arrange the pieces of the information. */
-      tun_set_af(&af, AF_INET6);
-      iov[0].iov_base = &af;
-      iov[0].iov_len = sizeof(uint32_t);
-      iov[1].iov_base = &ip6_hdr;
-      iov[1].iov_len = sizeof(struct ip6_hdr);
-      iov[2].iov_base = &ip6_frag_hdr;
-      iov[2].iov_len = sizeof(struct ip6_frag);
-      iov[3].iov_base = packetp;
-      iov[3].iov_len = ip4_plen;
-    } else {
-      /*
-       * No fragment processing is needed.  Just create a simple IPv6
-       * packet.
-       */
-      tun_set_af(&af, AF_INET6);
-      iov[0].iov_base = &af;
-      iov[0].iov_len = sizeof(uint32_t);
-      iov[1].iov_base = &ip6_hdr;
-      iov[1].iov_len = sizeof(struct ip6_hdr);
-      iov[2].iov_base = NULL;
-      iov[2].iov_len = 0;
-      iov[3].iov_base = packetp;
-      iov[3].iov_len = ip4_plen;
-    }
-
-    /*
-     * Re-calculate the checksum in ICMP (which is converted to ICMPv6
-     * eventually), TCP, or UDP header, if a packet contains the upper
-     * layer protocol header.
-     */
-    if (ip4_offset == 0) {
-      /*
-       * This is a single packet or the first fragment packet, which
-       * includes an upper layer protocol header.
-       */
-      if (ip4_proto == IPPROTO_ICMP) {
-	/* Convert the ICMP type/code to those of ICMPv6. */
-	if (icmpsub_convert_icmp(IPPROTO_ICMP, iov) == -1) {
-	  /* ICMP to ICMPv6 conversion failed. */
-	  return (0);
-	}
-      }
-      cksum_update_ulp(ip6_hdr.ip6_nxt, ip4_hdrp, iov);
-    }
-
-    /*
-     * Insert the IPv6 fragment header to the IPv6 header chain if it
-     * is necessary, and adjust the payload length.
-     */
-    if (ip4_is_frag) {
-      ip6_frag_hdr.ip6f_nxt = ip6_hdr.ip6_nxt;
-      ip6_hdr.ip6_nxt = IPPROTO_FRAGMENT;
-      ip6_hdr.ip6_plen = htons(ip4_plen + sizeof(struct ip6_frag));
-    }
-
-    /* Send this (fragmented) packet. */
-    ssize_t write_len;
-    write_len = writev(tun_fd, iov, 4);
-    if (write_len == -1) {
-      warn("sending an IPv6 packet failed.");
-    }
-  }
-
-  return (0);
 }
 
 /*
- * Convert an IPv6 packet given as the argument to an IPv4 packet, and
- * send it.
+ * Pass the reload request to the reload thread.  Requests made while
+ * a reload is running are merged into one more reload.
  */
-static int
-send_6to4(void *datap, size_t data_len)
+static void
+reload(void)
 {
-  assert(datap != NULL);
-
-  char *packetp = (char *)datap;
-
-  /* Analyze IPv6 header contents. */
-  struct ip6_hdr *ip6_hdrp;
-  uint8_t ip6_next_header;
-  ip6_hdrp = (struct ip6_hdr *)packetp;
-  ip6_next_header = ip6_hdrp->ip6_nxt;
-  packetp += sizeof(struct ip6_hdr);
-
-  /* ICMPv6 error handling. */
-  /* XXX: we don't handle fragmented ICMPv6 messages. */
-  if (ip6_next_header == IPPROTO_ICMPV6) {
-    int discard_ok = 0;
-    if (icmpsub_process_icmp6(tun_fd, (const struct icmp6_hdr *)packetp,
-			      data_len - sizeof(ip6_hdr),
-			      &discard_ok)
-	== -1) {
-      return (0);
-    }
-    if (discard_ok) {
-      return (0);
-    }
-  }
-
-  /* Fragment header check. */
-  struct ip6_frag *ip6_frag_hdrp = NULL;
-  int ip6_more_frag = 0;
-  int ip6_offset = 0;
-  int ip6_id = 0;
-  if (ip6_next_header == IPPROTO_FRAGMENT) {
-    ip6_frag_hdrp = (struct ip6_frag *)packetp;
-    ip6_next_header = ip6_frag_hdrp->ip6f_nxt;
-    ip6_more_frag = ip6_frag_hdrp->ip6f_offlg & IP6F_MORE_FRAG;
-    ip6_offset = ntohs(ip6_frag_hdrp->ip6f_offlg & IP6F_OFF_MASK);
-    ip6_id = ntohl(ip6_frag_hdrp->ip6f_ident);
-    packetp += sizeof(struct ip6_frag);
-  }
-
-  /*
-   * Next header check: Currently, any kinds of extension headers other
-   * than the Fragment header are not supported and just dropped.
-   */
-  if (ip6_next_header != IPPROTO_ICMPV6
-      && ip6_next_header != IPPROTO_TCP
-      && ip6_next_header != IPPROTO_UDP) {
-    warnx("Extention header %d is not supported.", ip6_next_header);
-    return (0);
-  }
-
-  /* Get some basic IPv6 header values. */
-  struct in6_addr ip6_src, ip6_dst;
-  uint16_t ip6_payload_len;
-  uint8_t ip6_hop_limit;
-  memcpy((void *)&ip6_src, (const void *)&ip6_hdrp->ip6_src,
-	 sizeof(struct in6_addr));
-  memcpy((void *)&ip6_dst, (const void *)&ip6_hdrp->ip6_dst,
-	 sizeof(struct in6_addr));
-  ip6_payload_len = ntohs(ip6_hdrp->ip6_plen);
-  if (ip6_frag_hdrp != NULL) {
-    ip6_payload_len -= sizeof(struct ip6_frag);
-  }
-  ip6_hop_limit = ip6_hdrp->ip6_hlim;
-
-  /* Check the packet size. */
-  if (ip6_payload_len + sizeof(struct ip6_hdr) > data_len) {
-    /* Data is too short.  Drop it. */
-    warnx("Insufficient data supplied (%lu), while IP header says (%lu)",
-	  data_len, ip6_payload_len + sizeof(struct ip6_hdr));
-    return (-1);
-  }
-
-#ifdef DEBUG
-  char addr_name[64];
-  fprintf(stderr, "src = %s\n",
-	  inet_ntop(AF_INET6, &ip6_src, addr_name, 64));
-  fprintf(stderr, "dst = %s\n",
-	  inet_ntop(AF_INET6, &ip6_dst, addr_name, 64));
-  fprintf(stderr, "plen = %d\n", ip6_payload_len);
-  fprintf(stderr, "nxt = %d\n", ip6_next_header);
-  fprintf(stderr, "hlim = %d\n", ip6_hop_limit);
-#endif
-
-  /* Convert IP addresses. */
-  struct in_addr ip4_src, ip4_dst;
-  if (mapping_convert_addrs_6to4(&ip6_src, &ip6_dst,
-				 &ip4_src, &ip4_dst) == -1) {
-    warnx("no mapping available. packet is dropped.");
-    return (-1);
-  }
-
-  /* Prepare an IPv4 header. */
-  struct ip ip4_hdr;
-  memset(&ip4_hdr, 0, sizeof(struct ip));
-  ip4_hdr.ip_v = IPVERSION;
-  ip4_hdr.ip_hl = sizeof(struct ip) >> 2;
-  ip4_hdr.ip_len = htons(sizeof(struct ip) + ip6_payload_len);
-  ip4_hdr.ip_id = htons(ip6_id & 0xffff);
-  ip4_hdr.ip_off = htons(IP_DF);
-  ip4_hdr.ip_ttl = ip6_hop_limit;
-  ip4_hdr.ip_p = ip6_next_header;
-  /* The header checksum is calculated before being sent. */
-  ip4_hdr.ip_sum = 0;
-  memcpy((void *)&ip4_hdr.ip_src, (const void *)&ip4_src,
-	 sizeof(struct in_addr));
-  memcpy((void *)&ip4_hdr.ip_dst, (const void *)&ip4_dst,
-	 sizeof(struct in_addr));
-
-#ifdef DEBUG
-  fprintf(stderr, "to src = %s\n", inet_ntoa(ip4_src));
-  fprintf(stderr, "to dst = %s\n", inet_ntoa(ip4_dst));
-#endif
-
-  /* Fragment processing. */
-  int mtu = pmtudisc_get_path_mtu_size(AF_INET, &ip4_dst);
-  if (ip6_payload_len > mtu - sizeof(struct ip)) {
-    /* Fragment is needed for this packet. */
-
-    /*
-     * Send an ICMPv6 Packet Too Big message.  ICMP error message
-     * generation will be rate limited.
-     */
-    if (icmpsub_send_icmp6_packet_too_big(tun_fd, datap, &ip6_dst, &ip6_src,
-					  mtu) == -1) {
-      warnx("sending ICMPv6 Packet Too Big failed.");
-      /* Continue processing anyway. */
-    }
-
-    int frag_payload_unit = ((mtu - sizeof(struct ip)) >> 3) << 3;
-    if (ip6_id == 0) {
-      /*
-       * ip6_id may be 0 if the incoming packet is not a fragmented
-       * packet.
-       */
-      ip4_hdr.ip_id = random();
-    }
-
-    int frag_count = (ip6_payload_len / frag_payload_unit) + 1;
-    int plen_left = ip6_payload_len;
-    int relative_offset = 0;
-    while (frag_count--) {
-      /*
-       * Decide the length of each fragment, and configure the more
-       * fragment flag.
-       */
-      ip4_hdr.ip_off |= htons(IP_MF);
-      int frag_plen = 0;
-      if (plen_left > frag_payload_unit) {
-	frag_plen = frag_payload_unit;
-      } else {
-	frag_plen = plen_left;
-	if (!ip6_more_frag) {
-	  /*
-	   * Clear the IP_MF flag since this is the final packet
-	   * generated from a non-fragmented packet or from the final
-	   * fragmented packet.
-	   */
-	  ip4_hdr.ip_off &= htons(~IP_MF);
-	}
-      }
-
-      /* The fragment offset re-calculation. */
-      relative_offset = ip6_payload_len - plen_left;
-      ip4_hdr.ip_off |= htons((ip6_offset + relative_offset) >> 3);
-
-      plen_left -= frag_plen;
-
-      /* Arrange the pieces of the information. */
-      struct iovec iov[4];
-      uint32_t af = 0;
-      tun_set_af(&af, AF_INET);
-      iov[0].iov_base = &af;
-      iov[0].iov_len = sizeof(uint32_t);
-      iov[1].iov_base = &ip4_hdr;
-      iov[1].iov_len = sizeof(struct ip);
-      iov[2].iov_base = NULL;
-      iov[2].iov_len = 0;
-      iov[3].iov_base = packetp + relative_offset;
-      iov[3].iov_len = frag_plen;
-
-      /*
-       * Re-calculate the checksum in the ICMPv6 (which is converted
-       * to ICMP eventually), TCP, or UDP header, if a packet contains
-       * the upper layer protocol header.
-       */
-      if ((ntohs(ip4_hdr.ip_off) & IP_OFFMASK) == 0) {
-	/* This is the first fragmented packet. */
-	if (ip6_next_header == IPPROTO_ICMPV6) {
-	  /* Convert the ICMPv6 type/code to those of ICMP. */
-	  if (icmpsub_convert_icmp(IPPROTO_ICMPV6, iov) == -1) {
-	    /* ICMPv6 to ICMP conversion failed. */
-	    return (0);
-	  }
-	}
-	/*
-	 * If the input IPv6 packet is a fragmented packet which
-	 * is still too big to forward, then ip6_nxt has been set
-	 * to ipv6-frag.  Update the field with the final protocol
-	 * number before re-calculating upper layer checksum which
-	 * uses protocol number as a part of the IP pseudo header.
-	 * (This line can be placed out of this while loop.)
-	 */
-	ip6_hdrp->ip6_nxt = ip6_next_header;
-	cksum_update_ulp(ip4_hdr.ip_p, ip6_hdrp, iov);
-      }
-
-      /* Adjust IPv4 total length. */
-      ip4_hdr.ip_len = htons(frag_plen + sizeof(struct ip));
-
-      /* Calculate the IPv4 header checksum. */
-      ip4_hdr.ip_sum = 0; /* need to clear, since we reuse ip4_hdr. */
-      ip4_hdr.ip_sum = cksum_calc_ip4_header(&ip4_hdr);
-
-      /* Send this fragment. */
-      ssize_t write_len;
-      write_len = writev(tun_fd, iov, 4);
-      if (write_len == -1) {
-	warn("sending an IPv4 packet failed.");
-      }
-    }
-  } else {
-    /* The packet size is smaller than the MTU size. */
-    struct iovec iov[4];
-    uint32_t af = 0;
-    if (ip6_frag_hdrp != NULL) {
-      /*
-       * Size is OK, but the incoming IPv6 packet has fragment
-       * information.  Replace the IPv6 Fragment header with the IPv4
-       * fragment information.
-       */
-
-      /* See the comment in send_4to6(). */
-      if (ip6_next_header == IPPROTO_ICMPV6) {
-	warnx("ICMPv6 fragment packets are not supported.");
-	/* Just drop it. */
-	return (0);
-      }
-
-      /*
-       * Copy the fragment related information from the Fragment
-       * header to the IPv4 header.
-       */
-      if (ip6_more_frag) {
-	ip4_hdr.ip_off |= htons(IP_MF);
-      }
-      ip4_hdr.ip_off |= htons(ip6_offset >> 3);
-      /*
-       * XXX: we don't have a big enough field for the fragment
-       * identifier in IPv4 (16 bits in IPv4, 32 bits in IPv6).  Cut
-       * top 16 bits.
-       */
-      ip4_hdr.ip_id = htons(ip6_id & 0xffff);
-
-      /* Arrange the pieces of the information. */
-      tun_set_af(&af, AF_INET);
-      iov[0].iov_base = &af;
-      iov[0].iov_len = sizeof(uint32_t);
-      iov[1].iov_base = &ip4_hdr;
-      iov[1].iov_len = sizeof(struct ip);
-      iov[2].iov_base = NULL;
-      iov[2].iov_len = 0;
-      iov[3].iov_base = packetp;
-      iov[3].iov_len = ip6_payload_len;
-    } else {
-      /*
-       * No fragment processing is needed.  Just create a simple IPv4
-       * packet.
-       */
-      tun_set_af(&af, AF_INET);
-      iov[0].iov_base = &af;
-      iov[0].iov_len = sizeof(uint32_t);
-      iov[1].iov_base = &ip4_hdr;
-      iov[1].iov_len = sizeof(struct ip);
-      iov[2].iov_base = NULL;
-      iov[2].iov_len = 0;
-      iov[3].iov_base = packetp;
-      iov[3].iov_len = ip6_payload_len;
-    }
-
-    /*
-     * Re-calculate the checksum in the ICMPv6 (which is converted
-     * to ICMP eventually), TCP, or UDP header, if a packet contains
-     * the upper layer protocol header.
-     */
-    if ((ntohs(ip4_hdr.ip_off) & IP_OFFMASK) == 0) {
-      /*
-       * This is a single packet or the first fragment packet, which
-       * includes an upper layer protocol header.
-       */
-      if (ip6_next_header == IPPROTO_ICMPV6) {
-	/* Convert the ICMPv6 type/code to those of ICMP. */
-	if (icmpsub_convert_icmp(IPPROTO_ICMPV6, iov) == -1) {
-	  /* ICMPv6 to ICMP conversion failed. */
-	  return (0);
-	}
-      }
+  pthread_mutex_lock(&reload_mutex);
+  reload_pending = 1;
+  pthread_cond_signal(&reload_cond);
+  pthread_mutex_unlock(&reload_mutex);
+}
 
-      /*
-       * Since the input IPv6 packet is a fragmented packet,
-       * ip6_nxt is set to ipv6-frag.  Update the field with the
-       * final protocol number before re-calculating upper layer
-       * checksum which uses protocol number as a part of the IP
-       * pseudo header.
-       */
-      ip6_hdrp->ip6_nxt = ip6_next_header;
-      cksum_update_ulp(ip4_hdr.ip_p, ip6_hdrp, iov);
+/*
+ * The reload thread builds a new mapping table from the configuration
+ * file, and replaces the current table and the route information
+ * installed by this program with it.  The forwarding workers keep
+ * translating packets with the current table during the reload.
+ */
+static void *
+reload_main(void *arg)
+{
+  while (1) {
+    pthread_mutex_lock(&reload_mutex);
+    while (!reload_pending) {
+      pthread_cond_wait(&reload_cond, &reload_mutex);
     }
+    reload_pending = 0;
+    pthread_mutex_unlock(&reload_mutex);
 
-    /* Calculate the IPv4 header checksum. */
-    ip4_hdr.ip_sum = cksum_calc_ip4_header(&ip4_hdr);
-
-    /* Send this (fragmented) packet. */
-    ssize_t write_len;
-    write_len = writev(tun_fd, iov, 4);
-    if (write_len == -1) {
-      warn("sending an IPv4 packet failed.");
+    std::cout << "reload_sighup" << std::endl;
+    if (mapping_reload_table(map646_conf_path.c_str()) == -1) {
+      warnx("reloading %s failed.", map646_conf_path.c_str());
     }
   }
 
-  return (0);
+  return (NULL);
 }
 
-
 /*
- * Convert an IPv6 packet given as the argument to an IPv6 packet, and
- * send it.
+ * The periodic maintenance, called every second on the clock thread.
  */
-static int
-send66_ItoG(void *datap, size_t data_len)
+static void
+clock_tick(time_t now)
 {
-  assert(datap != NULL);
-
-  char *packetp = (char *)datap;
-
-  /* Analyze IPv6 header contents. */
-  struct ip6_hdr *ip6_hdrp;
-  uint8_t ip6_next_header;
-  ip6_hdrp = (struct ip6_hdr *)packetp;
-  ip6_next_header = ip6_hdrp->ip6_nxt;
-  packetp += sizeof(struct ip6_hdr);
-
-  /* ICMPv6 error handling. */
-  /* XXX: we don't handle fragmented ICMPv6 messages. */
-  if (ip6_next_header == IPPROTO_ICMPV6) {
-    int discard_ok = 0;
-    if (icmpsub_process_icmp6(tun_fd, (const struct icmp6_hdr *)packetp,
-			      data_len - sizeof(ip6_hdr),
-			      &discard_ok)
-	== -1) {
-      return (0);
-    }
-    if (discard_ok)
-      return (0);
-  }
-
-  /* Fragment header check. */
-  struct ip6_frag *ip6_frag_hdrp = NULL;
-  if (ip6_next_header == IPPROTO_FRAGMENT) {
-    ip6_frag_hdrp = (struct ip6_frag *)packetp;
-    ip6_next_header = ip6_frag_hdrp->ip6f_nxt;
-    packetp += sizeof(struct ip6_frag);
-  }
-
-  /*
-   * Next header check: Currently, any kinds of extension headers other
-   * than the Fragment header are not supported and just dropped.
-   */
-  if (ip6_next_header != IPPROTO_ICMPV6
-      && ip6_next_header != IPPROTO_TCP
-      && ip6_next_header != IPPROTO_UDP) {
-    warnx("Extention header %d is not supported.", ip6_next_header);
-    return (0);
-  }
-
-  /* Get some basic IPv6 header values. */
-  struct in6_addr ip6_before_src, ip6_before_dst;
-  uint16_t ip6_payload_len;
-  uint8_t ip6_hop_limit;
-  memcpy((void *)&ip6_before_src, (const void *)&ip6_hdrp->ip6_src,
-	 sizeof(struct in6_addr));
-  memcpy((void *)&ip6_before_dst, (const void *)&ip6_hdrp->ip6_dst,
-	 sizeof(struct in6_addr));
-  ip6_payload_len = ntohs(ip6_hdrp->ip6_plen);
-  if (ip6_frag_hdrp != NULL) {
-    ip6_payload_len -= sizeof(struct ip6_frag);
-  }
-  ip6_hop_limit = ip6_hdrp->ip6_hlim;
-
-  /* Check the packet size. */
-  if (ip6_payload_len + sizeof(struct ip6_hdr) > data_len) {
-    /* Data is too short.  Drop it. */
-    warnx("Insufficient data supplied (%lu), while IP header says (%lu)",
-	  data_len, ip6_payload_len + sizeof(struct ip6_hdr));
-    return (-1);
-  }
-
-#ifdef DEBUG
-  char addr_name[64];
-  fprintf(stderr, "src = %s\n",
-	  inet_ntop(AF_INET6, &ip6_before_src, addr_name, 64));
-  fprintf(stderr, "dst = %s\n",
-	  inet_ntop(AF_INET6, &ip6_before_dst, addr_name, 64));
-  fprintf(stderr, "plen = %d\n", ip6_payload_len);
-  fprintf(stderr, "nxt = %d\n", ip6_next_header);
-  fprintf(stderr, "hlim = %d\n", ip6_hop_limit);
-#endif
-
-  /* Convert IP addresses. */
-  struct in6_addr ip6_after_src, ip6_after_dst;
-  if (mapping66_convert_addrs_ItoG(&ip6_before_src, &ip6_before_dst,
-				   &ip6_after_src, &ip6_after_dst) == -1) {
-    warnx("no mapping available. packet is dropped.");
-    return (-1);
-  }
-
-  /* Prepare an IPv6 header template. */
-  struct ip6_hdr ip6_hdr;
-  memset(&ip6_hdr, 0, sizeof(struct ip6_hdr));
-  ip6_hdr.ip6_vfc = IPV6_VERSION;
-  ip6_hdr.ip6_plen = ip6_hdrp->ip6_plen;
-  ip6_hdr.ip6_nxt = ip6_next_header;
-  ip6_hdr.ip6_hlim = ip6_hop_limit;
-  memcpy((void *)&ip6_hdr.ip6_src, (const void *)&ip6_after_src,
-	 sizeof(struct in6_addr));
-  memcpy((void *)&ip6_hdr.ip6_dst, (const void *)&ip6_after_dst,
-	 sizeof(struct in6_addr));
-
-#ifdef DEBUG
-  fprintf(stderr, "to src = %s\n",
-	  inet_ntop(AF_INET6, &ip6_after_src, addr_name, 64));
-  fprintf(stderr, "to dst = %s\n",
-	  inet_ntop(AF_INET6, &ip6_after_dst, addr_name, 64));
-  fprintf(stderr, "plen = %d\n", ntohs(ip6_hdr.ip6_plen));
-#endif
-
-  struct iovec iov[4];
-  uint32_t af;
-
-  tun_set_af(&af, AF_INET6);
-  iov[0].iov_base = &af;
-  iov[0].iov_len = sizeof(uint32_t);
-  iov[1].iov_base = &ip6_hdr;
-  iov[1].iov_len = sizeof(struct ip6_hdr);
-  iov[2].iov_base = NULL;
-  iov[2].iov_len = 0;
-  iov[3].iov_base = packetp;
-  iov[3].iov_len = ip6_payload_len;
-
-  cksum66_update_ulp(ip6_hdr.ip6_nxt, ip6_hdrp, iov);
-
-  ssize_t write_len;
-  write_len = writev(tun_fd, iov, 4);
-  if (write_len == -1) {
-    warn("sending an IPv6 packet failed.");
-  }
-
-  return (0);
+  pmtudisc_expire();
 }
 
 /*
- * Convert an IPv6 packet given as the argument to an IPv6 packet, and
- * send it.
+ * The stat_shm thread publishes the counters to the stat shared
+ * memory segment periodically, off the forwarding and control paths.
  */
-static int
-send66_GtoI(void *datap, size_t data_len)
+static void *
+stat_shm_main(void *arg)
 {
-  assert(datap != NULL);
-
-  char *packetp = (char *)datap;
-
-  /* Analyze IPv6 header contents. */
-  struct ip6_hdr *ip6_hdrp;
-  uint8_t ip6_next_header;
-  ip6_hdrp = (struct ip6_hdr *)packetp;
-  ip6_next_header = ip6_hdrp->ip6_nxt;
-  packetp += sizeof(struct ip6_hdr);
-
-  /* ICMPv6 error handling. */
-  /* XXX: we don't handle fragmented ICMPv6 messages. */
-  if (ip6_next_header == IPPROTO_ICMPV6) {
-    int discard_ok = 0;
-    if (icmpsub_process_icmp6(tun_fd, (const struct icmp6_hdr *)packetp,
-			      data_len - sizeof(ip6_hdr),
-			      &discard_ok)
-	== -1) {
-      return (0);
-    }
-    if (discard_ok)
-      return (0);
-  }
-
-  /* Fragment header check. */
-  struct ip6_frag *ip6_frag_hdrp = NULL;
-  if (ip6_next_header == IPPROTO_FRAGMENT) {
-    ip6_frag_hdrp = (struct ip6_frag *)packetp;
-    ip6_next_header = ip6_frag_hdrp->ip6f_nxt;
-    packetp += sizeof(struct ip6_frag);
-  }
-
-  /*
-   * Next header check: Currently, any kinds of extension headers other
-   * than the Fragment header are not supported and just dropped.
-   */
-  if (ip6_next_header != IPPROTO_ICMPV6
-      && ip6_next_header != IPPROTO_TCP
-      && ip6_next_header != IPPROTO_UDP) {
-    warnx("Extention header %d is not supported.", ip6_next_header);
-    return (0);
-  }
-
-  /* Get some basic IPv6 header values. */
-  struct in6_addr ip6_before_src, ip6_before_dst;
-  uint16_t ip6_payload_len;
-  uint8_t ip6_hop_limit;
-  memcpy((void *)&ip6_before_src, (const void *)&ip6_hdrp->ip6_src,
-	 sizeof(struct in6_addr));
-  memcpy((void *)&ip6_before_dst, (const void *)&ip6_hdrp->ip6_dst,
-	 sizeof(struct in6_addr));
-  ip6_payload_len = ntohs(ip6_hdrp->ip6_plen);
-  if (ip6_frag_hdrp != NULL) {
-    ip6_payload_len -= sizeof(struct ip6_frag);
-  }
-  ip6_hop_limit = ip6_hdrp->ip6_hlim;
-
-  /* Check the packet size. */
-  if (ip6_payload_len + sizeof(struct ip6_hdr) > data_len) {
-    /* Data is too short.  Drop it. */
-    warnx("Insufficient data supplied (%lu), while IP header says (%lu)",
-	  data_len, ip6_payload_len + sizeof(struct ip6_hdr));
-    return (-1);
-  }
-
-#ifdef DEBUG
-  char addr_name[64];
-  fprintf(stderr, "src = %s\n",
-	  inet_ntop(AF_INET6, &ip6_before_src, addr_name, 64));
-  fprintf(stderr, "dst = %s\n",
-	  inet_ntop(AF_INET6, &ip6_before_dst, addr_name, 64));
-  fprintf(stderr, "plen = %d\n", ip6_payload_len);
-  fprintf(stderr, "nxt = %d\n", ip6_next_header);
-  fprintf(stderr, "hlim = %d\n", ip6_hop_limit);
-#endif
+  struct timespec interval;
+  interval.tv_sec = stat_shm_interval / 1000;
+  interval.tv_nsec = (long)(stat_shm_interval % 1000) * 1000000;
 
-  /* Convert IP addresses. */
-  struct in6_addr ip6_after_src, ip6_after_dst;
-  if (mapping66_convert_addrs_GtoI(&ip6_before_src, &ip6_before_dst,
-				   &ip6_after_src, &ip6_after_dst) == -1) {
-    warnx("no mapping available. packet is dropped.");
-    return (-1);
-  }
-
-  /* Prepare an IPv6 header template. */
-  struct ip6_hdr ip6_hdr;
-  memset(&ip6_hdr, 0, sizeof(struct ip6_hdr));
-  ip6_hdr.ip6_vfc = IPV6_VERSION;
-  ip6_hdr.ip6_plen = ip6_hdrp->ip6_plen;
-  ip6_hdr.ip6_nxt = ip6_next_header;
-  ip6_hdr.ip6_hlim = ip6_hop_limit;
-  memcpy((void *)&ip6_hdr.ip6_src, (const void *)&ip6_after_src,
-	 sizeof(struct in6_addr));
-  memcpy((void *)&ip6_hdr.ip6_dst, (const void *)&ip6_after_dst,
-	 sizeof(struct in6_addr));
-
-#ifdef DEBUG
-  fprintf(stderr, "to src = %s\n",
-	  inet_ntop(AF_INET6, &ip6_after_src, addr_name, 64));
-  fprintf(stderr, "to dst = %s\n",
-	  inet_ntop(AF_INET6, &ip6_after_dst, addr_name, 64));
-  fprintf(stderr, "plen = %d\n", ntohs(ip6_hdr.ip6_plen));
-#endif
-
-  struct iovec iov[4];
-  uint32_t af;
-
-  tun_set_af(&af, AF_INET6);
-  iov[0].iov_base = &af;
-  iov[0].iov_len = sizeof(uint32_t);
-  iov[1].iov_base = &ip6_hdr;
-  iov[1].iov_len = sizeof(struct ip6_hdr);
-  iov[2].iov_base = NULL;
-  iov[2].iov_len = 0;
-  iov[3].iov_base = packetp;
-  iov[3].iov_len = ip6_payload_len;
-
-  cksum66_update_ulp(ip6_hdr.ip6_nxt, ip6_hdrp, iov);
-
-  ssize_t write_len;
-  write_len = writev(tun_fd, iov, 4);
-  if (write_len == -1) {
-    warn("sending an IPv6 packet failed.");
+  while (1) {
+    nanosleep(&interval, NULL);
+    map_stat.publish_shm();
   }
 
-  return (0);
+  return (NULL);
 }
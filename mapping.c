@@ -33,6 +33,7 @@
 #include <string.h>
 #include <assert.h>
 #include <err.h>
+#include <pthread.h>
 
 #include <sys/queue.h>
 #include <sys/socket.h>
@@ -48,110 +49,419 @@
 
 
 #include "mapping.h"
+#include "addrtable.h"
 #include "tunif.h"
+#include "qsbr.h"
+#include "checksum.h"
+#include "drop.h"
 
 /*
- * The mapping structure between the global IPv4 address and the
- * internal IPv6 address.
+ * The index entry of an internal IPv6 address.  An address may be
+ * used both by a map-static entry and a map66-static entry, so the
+ * entry refers to both, and the direction of a packet from the
+ * address is decided with a single lookup.
  */
-struct mapping {
-  SLIST_ENTRY(mapping) entries;
-  struct in_addr addr4;
-  struct in6_addr addr6;
+struct mapping_src6 {
+  SLIST_ENTRY(mapping_src6) entries;
+  const struct mapping *mappingp;
+  const struct mapping66 *mapping66p;
 };
 
-struct mapping66 {
-  SLIST_ENTRY(mapping66) entries;
-  struct in6_addr global;
-  struct in6_addr intra;
+/*
+ * A route entry to the tun interface.  The mapped addresses are
+ * covered by the aggregated route entries, and each route entry
+ * covers at most the number of unmapped addresses specified by the
+ * route-aggregation-holes directive.  The packets to the unmapped
+ * addresses are dropped by the dispatch() function.
+ */
+struct mapping_route {
+  uint8_t addr[16];	/* The IPv4 address uses the first 4 bytes. */
+  int prefix_len;
 };
 
-struct mapping_hash {
-  SLIST_ENTRY(mapping_hash) entries;
-  struct mapping *mappingp;
-};
+SLIST_HEAD(mapping_listhead, mapping);
+SLIST_HEAD(mapping66_listhead, mapping66);
+SLIST_HEAD(mapping_src6_listhead, mapping_src6);
+
+/*
+ * A mapping table built from the configuration file.  A table is
+ * never modified once it is published to the forwarding threads.  A
+ * reload builds a new table and replaces the pointer to the current
+ * table, and the old table is freed after all the forwarding threads
+ * pass a quiescent state.
+ */
+struct mapping_table {
+  struct in6_addr prefix;
+  struct mapping_listhead mapping_head;
+  struct mapping66_listhead mapping66_head;
+  struct mapping_src6_listhead src6_head;
+
+  /*
+   * The index tables to find the mapping entries.  The keys are
+   * stored inline in the table slots.
+   */
+  struct addrtable addr4_table;	/* by the IPv4 address */
+  /*
+   * By the internal IPv6 address, for a packet to the IPv4 network
+   * and a packet from Intra to Global.
+   */
+  struct addrtable src6_table;
+  /* For a packet from Global to Intra, by the global address. */
+  struct addrtable global_table;
 
-struct mapping66_hash {
-  SLIST_ENTRY(mapping66_hash) entries;
-  struct mapping66 *mappingp;
+  /*
+   * The route entries to the IPv4 addresses and the IPv6 global
+   * addresses, sorted by the address.
+   */
+  uint64_t route_holes;
+  struct mapping_route *route4s;
+  int route4_count;
+  struct mapping_route *route6s;
+  int route6_count;
+
+  /* The stat-histogram-bits directive, or -1 if not specified. */
+  int stat_hist_bits;
+  /* The stat-top-ports directive, or -1 if not specified. */
+  int stat_top_ports;
 };
 
-#define MAPPING_TABLE_HASH_SIZE 1009
+#define MAPPING_TABLE_INITIAL_SIZE 1024
 
-SLIST_HEAD(mapping_listhead, mapping);
-SLIST_HEAD(mapping66_listhead, mapping66);
-struct mapping_listhead mapping_head;
-struct mapping66_listhead mapping66_head;
+/* The current table.  Accessed with the atomic builtins. */
+static struct mapping_table *mapping_current = NULL;
 
-SLIST_HEAD(mapping_hash_listhead, mapping_hash);
-SLIST_HEAD(mapping66_hash_listhead, mapping66_hash);
+/*
+ * Serializes the writers, which build, publish and retire the
+ * tables.  The forwarding threads never take this lock.
+ */
+static pthread_mutex_t mapping_update_lock = PTHREAD_MUTEX_INITIALIZER;
 
-struct mapping_hash_listhead mapping_hash_4to6_heads[MAPPING_TABLE_HASH_SIZE];
-struct mapping_hash_listhead mapping_hash_6to4_heads[MAPPING_TABLE_HASH_SIZE];
+/*
+ * The IDs given to the IPv4 addresses of the map-static entries and
+ * the global IPv6 addresses of the map66-static entries.  An address
+ * keeps its ID even after it is removed from the table, so that an
+ * address added again by a later reload gets the same ID.  The value
+ * of an entry is the ID + 1.  Protected by mapping_update_lock.
+ */
+static struct addrtable mapping_id4_table;
+static struct addrtable mapping_id66_table;
+static mapping_id_hook_t mapping_id_hook = NULL;
+
+static struct mapping_table *mapping_table_new(void);
+static void mapping_table_free(struct mapping_table *);
+static int mapping_table_load(struct mapping_table *, const char *, int);
+static int mapping_table_precompute(struct mapping_table *);
+static int mapping_table_aggregate(struct mapping_table *);
+static int mapping_table_assign_ids(struct mapping_table *);
+static int mapping_get_id(struct addrtable *, int, const void *,
+			  uint32_t *);
+static int mapping_addr_compare(const void *, const void *);
+static int mapping_route_aggregate(uint8_t (*)[16], int, int, uint64_t,
+				   struct mapping_route **, int *);
+static void mapping_route_aggregate_range(uint8_t (*)[16], int, int, int,
+					  int, uint64_t,
+					  struct mapping_route *, int *);
+static int mapping_route_compare(const struct mapping_route *,
+				 const struct mapping_route *);
+static void mapping_apply_route(int, const struct mapping_route *, int,
+				const struct mapping_route *, int,
+				int (*)(int, const void *, int), const char *);
+static struct mapping_table *mapping_table_publish(struct mapping_table *);
+static const struct mapping_table *mapping_table_get(void);
+static void mapping_commit_route(int *);
+static int mapping_update_route(const struct mapping_table *,
+				const struct mapping_table *);
+
+static const struct mapping *mapping_find_mapping_with_ip4_addr(const struct mapping_table *,
+								const struct in_addr *);
+static const struct mapping *mapping_find_mapping_with_ip6_addr(const struct mapping_table *,
+								const struct in6_addr *);
+static const struct mapping66 *mapping66_find_mapping_with_I_addr(const struct mapping_table *,
+								  const struct in6_addr *);
+static const struct mapping66 *mapping66_find_mapping_with_G_addr(const struct mapping_table *,
+								  const struct in6_addr *);
+
+static struct mapping_src6 *mapping_get_src6(struct mapping_table *,
+					     const struct in6_addr *);
+static int mapping_insert_mapping(struct mapping_table *, struct mapping *);
+static int mapping66_insert_mapping(struct mapping_table *,
+				    struct mapping66 *);
 
-//hashtable for a packet from Intra to Global
-struct mapping66_hash_listhead mapping66_hash_ItoG_heads[MAPPING_TABLE_HASH_SIZE];
-//hashtable for a packet from Global to Intra
-struct mapping66_hash_listhead mapping66_hash_GtoI_heads[MAPPING_TABLE_HASH_SIZE];
 
-static struct in6_addr mapping_prefix;
+int
+mapping_initialize(void)
+{
+  __atomic_store_n(&mapping_current, NULL, __ATOMIC_RELEASE);
 
-static int mapping_get_hash_index(const void *, int);
-static const struct mapping *mapping_find_mapping_with_ip4_addr(const struct
-								in_addr *);
-static const struct mapping *mapping_find_mapping_with_ip6_addr(const struct
-								in6_addr *);
-static const struct mapping66 *mapping66_find_mapping_with_I_addr(const struct
-								  in6_addr *);
-static const struct mapping66 *mapping66_find_mapping_with_G_addr(const struct
-								  in6_addr *);
+  if (addrtable_init(&mapping_id4_table, sizeof(struct in_addr),
+		     MAPPING_TABLE_INITIAL_SIZE) == -1
+      || addrtable_init(&mapping_id66_table, sizeof(struct in6_addr),
+			MAPPING_TABLE_INITIAL_SIZE) == -1) {
+    warnx("mapping ID table initialization failed.");
+    return (-1);
+  }
 
-static int mapping_insert_mapping(struct mapping *);
-static int mapping66_insert_mapping(struct mapping66 *);
+  return (0);
+}
 
+/*
+ * Set the function called when a new ID is given to an address.  It
+ * must be set before the first table is created.
+ */
+void
+mapping_set_id_hook(mapping_id_hook_t hook)
+{
+  pthread_mutex_lock(&mapping_update_lock);
+  mapping_id_hook = hook;
+  pthread_mutex_unlock(&mapping_update_lock);
+}
 
+/*
+ * Read the configuration file specified as the map646_conf_path
+ * variable, and publish the table built from it as the current
+ * table.
+ */
 int
-mapping_initialize(void)
+mapping_create_table(const char *map646_conf_path)
 {
-  memset(&mapping_prefix, 0, sizeof(struct in6_addr));
+  assert(map646_conf_path != NULL);
 
-  SLIST_INIT(&mapping_head);
-  SLIST_INIT(&mapping66_head);
+  struct mapping_table *tablep = mapping_table_new();
+  if (tablep == NULL) {
+    return (-1);
+  }
+  if (mapping_table_load(tablep, map646_conf_path, 0) == -1
+      || mapping_table_precompute(tablep) == -1
+      || mapping_table_aggregate(tablep) == -1) {
+    mapping_table_free(tablep);
+    return (-1);
+  }
 
-  int count = MAPPING_TABLE_HASH_SIZE;
-  while (count--) {
-    SLIST_INIT(&mapping_hash_4to6_heads[count]);
-    SLIST_INIT(&mapping_hash_6to4_heads[count]);
-    SLIST_INIT(&mapping66_hash_ItoG_heads[count]);
-    SLIST_INIT(&mapping66_hash_GtoI_heads[count]);
+  pthread_mutex_lock(&mapping_update_lock);
+  if (mapping_table_assign_ids(tablep) == -1) {
+    pthread_mutex_unlock(&mapping_update_lock);
+    mapping_table_free(tablep);
+    return (-1);
   }
+  struct mapping_table *old_tablep = mapping_table_publish(tablep);
+  qsbr_synchronize();
+  mapping_table_free(old_tablep);
+  pthread_mutex_unlock(&mapping_update_lock);
 
   return (0);
 }
 
 /*
- * Read the configuration file specified as the map646_conf_path
- * variable.  Each mapping entry is converted to the form of the
- * struct mapping{} structure, and stored as SLIST entries.
+ * Get the sub-bucket bits of the packet length histograms of the stat
+ * given by the stat-histogram-bits directive, or -1 if the directive
+ * is not in the current table.
  */
 int
-mapping_create_table(const char *map646_conf_path, int depth)
+mapping_get_stat_hist_bits(void)
+{
+  const struct mapping_table *tablep = mapping_table_get();
+  if (tablep == NULL) {
+    return (-1);
+  }
+  return (tablep->stat_hist_bits);
+}
+
+/*
+ * Get the number of the source ports tracked for each TCP/UDP counter
+ * of the stat given by the stat-top-ports directive, or -1 if the
+ * directive is not in the current table.
+ */
+int
+mapping_get_stat_top_ports(void)
+{
+  const struct mapping_table *tablep = mapping_table_get();
+  if (tablep == NULL) {
+    return (-1);
+  }
+  return (tablep->stat_top_ports);
+}
+
+/*
+ * Build a new table from the configuration file, and replace the
+ * current table and its route entries with it.  The forwarding
+ * threads keep running with the current table while the new table is
+ * built.  If the configuration file cannot be read, the current table
+ * is kept.
+ */
+int
+mapping_reload_table(const char *map646_conf_path)
 {
   assert(map646_conf_path != NULL);
 
+  struct mapping_table *tablep = mapping_table_new();
+  if (tablep == NULL) {
+    return (-1);
+  }
+  if (mapping_table_load(tablep, map646_conf_path, 0) == -1
+      || mapping_table_precompute(tablep) == -1
+      || mapping_table_aggregate(tablep) == -1) {
+    warnx("the current mapping table is kept.");
+    mapping_table_free(tablep);
+    return (-1);
+  }
+
+  pthread_mutex_lock(&mapping_update_lock);
+
+  if (mapping_table_assign_ids(tablep) == -1) {
+    pthread_mutex_unlock(&mapping_update_lock);
+    warnx("the current mapping table is kept.");
+    mapping_table_free(tablep);
+    return (-1);
+  }
+
+  struct mapping_table *old_tablep = mapping_table_publish(tablep);
+
+  /*
+   * Replace the route entries installed when the configuration file
+   * was read last time.  The entries which exist in both of the
+   * tables are kept as they are, so the packets to them are never
+   * dropped during the reload.
+   */
+  if (mapping_update_route(old_tablep, tablep) == -1) {
+    warnx("failed to update mapped route information.");
+  }
+
+  /* Free the old table after no forwarding thread refers to it. */
+  qsbr_synchronize();
+  mapping_table_free(old_tablep);
+
+  pthread_mutex_unlock(&mapping_update_lock);
+
+  return (0);
+}
+
+/* Destroy the mapping table. */
+void
+mapping_destroy_table(void)
+{
+  pthread_mutex_lock(&mapping_update_lock);
+  struct mapping_table *old_tablep = mapping_table_publish(NULL);
+  qsbr_synchronize();
+  mapping_table_free(old_tablep);
+  pthread_mutex_unlock(&mapping_update_lock);
+}
+
+/* Allocate an empty table. */
+static struct mapping_table *
+mapping_table_new(void)
+{
+  struct mapping_table *tablep;
+
+  tablep = (struct mapping_table *)malloc(sizeof(struct mapping_table));
+  if (tablep == NULL) {
+    warnx("memory allocation failed for struct mapping_table{}.");
+    return (NULL);
+  }
+  memset(tablep, 0, sizeof(struct mapping_table));
+  tablep->stat_hist_bits = -1;
+  tablep->stat_top_ports = -1;
+
+  SLIST_INIT(&tablep->mapping_head);
+  SLIST_INIT(&tablep->mapping66_head);
+  SLIST_INIT(&tablep->src6_head);
+
+  if (addrtable_init(&tablep->addr4_table, sizeof(struct in_addr),
+		     MAPPING_TABLE_INITIAL_SIZE) == -1
+      || addrtable_init(&tablep->src6_table, sizeof(struct in6_addr),
+			MAPPING_TABLE_INITIAL_SIZE) == -1
+      || addrtable_init(&tablep->global_table, sizeof(struct in6_addr),
+			MAPPING_TABLE_INITIAL_SIZE) == -1) {
+    warnx("mapping table initialization failed.");
+    mapping_table_free(tablep);
+    return (NULL);
+  }
+
+  return (tablep);
+}
+
+/* Free the table and all the mapping entries in it. */
+static void
+mapping_table_free(struct mapping_table *tablep)
+{
+  if (tablep == NULL) {
+    return;
+  }
+
+  /* Clear all the index entries for the mapping{} structure instances. */
+  addrtable_destroy(&tablep->addr4_table);
+  addrtable_destroy(&tablep->src6_table);
+  addrtable_destroy(&tablep->global_table);
+
+  while (!SLIST_EMPTY(&tablep->src6_head)) {
+    struct mapping_src6 *msp = SLIST_FIRST(&tablep->src6_head);
+    SLIST_REMOVE_HEAD(&tablep->src6_head, entries);
+    free(msp);
+  }
+
+  /* Clear the actual mapping data list entries. */
+  while (!SLIST_EMPTY(&tablep->mapping_head)) {
+    struct mapping *mp = SLIST_FIRST(&tablep->mapping_head);
+    SLIST_REMOVE_HEAD(&tablep->mapping_head, entries);
+    free(mp);
+  }
+
+  while (!SLIST_EMPTY(&tablep->mapping66_head)) {
+    struct mapping66 *mp = SLIST_FIRST(&tablep->mapping66_head);
+    SLIST_REMOVE_HEAD(&tablep->mapping66_head, entries);
+    free(mp);
+  }
+
+  free(tablep->route4s);
+  free(tablep->route6s);
+  free(tablep);
+}
+
+/*
+ * Replace the current table with the new one, and return the old
+ * table.  The old table may still be used by the forwarding threads
+ * until qsbr_synchronize() returns.
+ */
+static struct mapping_table *
+mapping_table_publish(struct mapping_table *tablep)
+{
+  return (__atomic_exchange_n(&mapping_current, tablep, __ATOMIC_ACQ_REL));
+}
+
+/*
+ * Get the current table.  The forwarding threads can use the table
+ * and the entries in it until they report a quiescent state.
+ */
+static const struct mapping_table *
+mapping_table_get(void)
+{
+  return (__atomic_load_n(&mapping_current, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Read the configuration file, and store each mapping entry to the
+ * table given as the form of the struct mapping{} structure.
+ */
+static int
+mapping_table_load(struct mapping_table *tablep,
+		   const char *map646_conf_path, int depth)
+{
+  assert(tablep != NULL);
+  assert(map646_conf_path != NULL);
+
   if (depth > 10) {
-    err(EXIT_FAILURE, "too many recursive include.");
+    warnx("too many recursive include.");
+    return (-1);
   }
   FILE *conf_fp;
-  char *line;
+  char *line = NULL;
   size_t line_cap = 0;
 #define TERMLEN 256
   char op[TERMLEN], addr1[TERMLEN], addr2[TERMLEN];
 
   conf_fp = fopen(map646_conf_path, "r");
   if (conf_fp == NULL) {
-    err(EXIT_FAILURE, "opening a configuration file %s failed.",
-	map646_conf_path);
+    warn("opening a configuration file %s failed.", map646_conf_path);
+    return (-1);
   }
 
   int line_count = 0;
@@ -169,7 +479,7 @@ mapping_create_table(const char *map646_conf_path, int depth)
 	free(mappingp);
 	continue;
       }
-      if (mapping_find_mapping_with_ip4_addr(&mappingp->addr4)) {
+      if (mapping_find_mapping_with_ip4_addr(tablep, &mappingp->addr4)) {
 	warnx("line %d: duplicate entry for addrss %s.", line_count, addr1);
 	free(mappingp);
 	continue;
@@ -179,12 +489,12 @@ mapping_create_table(const char *map646_conf_path, int depth)
 	free(mappingp);
 	continue;
       }
-      if (mapping_find_mapping_with_ip6_addr(&mappingp->addr6)) {
+      if (mapping_find_mapping_with_ip6_addr(tablep, &mappingp->addr6)) {
 	warnx("line %d: duplicate entry for addrss %s.", line_count, addr2);
 	free(mappingp);
 	continue;
       }
-      if (mapping_insert_mapping(mappingp) == -1) {
+      if (mapping_insert_mapping(tablep, mappingp) == -1) {
 	err(EXIT_FAILURE, "inserting a mapping entry failed.");
       }
     } else if (strcmp(op, "map66-static") == 0) {
@@ -195,7 +505,7 @@ mapping_create_table(const char *map646_conf_path, int depth)
 	free(mappingp);
 	continue;
       }
-      if (mapping66_find_mapping_with_G_addr(&mappingp->global)) {
+      if (mapping66_find_mapping_with_G_addr(tablep, &mappingp->global)) {
 	warnx("line %d: duplicate entry for addrss %s.", line_count, addr1);
 	free(mappingp);
 	continue;
@@ -205,120 +515,333 @@ mapping_create_table(const char *map646_conf_path, int depth)
 	free(mappingp);
 	continue;
       }
-      if (mapping66_find_mapping_with_I_addr(&mappingp->intra)) {
+      if (mapping66_find_mapping_with_I_addr(tablep, &mappingp->intra)) {
 	warnx("line %d: duplicate entry for addrss %s.", line_count, addr2);
 	free(mappingp);
 	continue;
       }
-      if (mapping66_insert_mapping(mappingp) == -1) {
+      if (mapping66_insert_mapping(tablep, mappingp) == -1) {
 	err(EXIT_FAILURE, "inserting a mapping entry failed.");
       }
+    } else if (strcmp(op, "route-aggregation-holes") == 0) {
+      char *endp;
+      unsigned long long holes = strtoull(addr1, &endp, 10);
+      if (*addr1 == '\0' || *endp != '\0' || holes > UINT32_MAX) {
+	warnx("line %d: invalid number of holes %s.", line_count, addr1);
+	continue;
+      }
+      tablep->route_holes = holes;
+    } else if (strcmp(op, "stat-histogram-bits") == 0) {
+      char *endp;
+      unsigned long bits = strtoul(addr1, &endp, 10);
+      if (*addr1 == '\0' || *endp != '\0'
+	  || bits > MAPPING_STAT_HIST_BITS_MAX) {
+	warnx("line %d: invalid number of bits %s (0 to %d).", line_count,
+	      addr1, MAPPING_STAT_HIST_BITS_MAX);
+	continue;
+      }
+      tablep->stat_hist_bits = bits;
+    } else if (strcmp(op, "stat-top-ports") == 0) {
+      char *endp;
+      unsigned long ports = strtoul(addr1, &endp, 10);
+      if (*addr1 == '\0' || *endp != '\0'
+	  || ports < 1 || ports > MAPPING_STAT_TOP_PORTS_MAX) {
+	warnx("line %d: invalid number of ports %s (1 to %d).", line_count,
+	      addr1, MAPPING_STAT_TOP_PORTS_MAX);
+	continue;
+      }
+      tablep->stat_top_ports = ports;
     } else if (strcmp(op, "mapping-prefix") == 0) {
-      if (inet_pton(AF_INET6, addr1, &mapping_prefix) != 1) {
+      if (inet_pton(AF_INET6, addr1, &tablep->prefix) != 1) {
 	warn("line %d: invalid address %s.\n", line_count, addr1);
       }
     } else if (strcmp(op, "include") == 0) {
       struct stat sub_conf_stat;
       memset(&sub_conf_stat, 0, sizeof(struct stat));
       if (stat(addr1, &sub_conf_stat) == 0) {
-	if (mapping_create_table(addr1, depth + 1) == -1) {
-	  errx(EXIT_FAILURE, "mapping table creation from %s failed.",
-	       addr1);
+	if (mapping_table_load(tablep, addr1, depth + 1) == -1) {
+	  warnx("mapping table creation from %s failed.", addr1);
+	  free(line);
+	  fclose(conf_fp);
+	  return (-1);
 	}
       }
     } else {
       warnx("line %d: unknown operand %s.\n", line_count, op);
     }
   }
+  free(line);
+  fclose(conf_fp);
+
   return (0);
 }
 
-/* Destroy the mapping table. */
-void
-mapping_destroy_table(void)
+/*
+ * Compute the checksum differences of the mapping entries.  The
+ * difference of a map-static entry includes the mapping prefix, which
+ * may be specified after the entry in the configuration file.
+ */
+static int
+mapping_table_precompute(struct mapping_table *tablep)
 {
-  /* Clear the IPv6 pseudo prefix information. */
-  memset(&mapping_prefix, 0, sizeof(struct in6_addr));
-
-  /* Clear all the hash entries for the mapping{} structure instances. */
-  int count = MAPPING_TABLE_HASH_SIZE;
-  while (count--) {
-    /* Clear the hash entries for searching by IPv4 address as a key. */
-    while (!SLIST_EMPTY(&mapping_hash_4to6_heads[count])) {
-      struct mapping_hash *mhp = SLIST_FIRST(&mapping_hash_4to6_heads[count]);
-      SLIST_REMOVE_HEAD(&mapping_hash_4to6_heads[count], entries);
-      free(mhp);
-    }
+  assert(tablep != NULL);
 
-    /* Clear the hash entries for searching by IPv6 address as a key. */
-    while (!SLIST_EMPTY(&mapping_hash_6to4_heads[count])) {
-      struct mapping_hash *mhp = SLIST_FIRST(&mapping_hash_6to4_heads[count]);
-      SLIST_REMOVE_HEAD(&mapping_hash_6to4_heads[count], entries);
-      free(mhp);
-    }
+  struct mapping *mappingp;
+  SLIST_FOREACH(mappingp, &tablep->mapping_head, entries) {
+    uint8_t addrs[sizeof(struct in6_addr) + 8];
+    memcpy(addrs, &mappingp->addr6, sizeof(struct in6_addr));
+    memcpy(addrs + sizeof(struct in6_addr), &tablep->prefix, 8);
+    mappingp->cksum_delta = cksum_calc_delta(addrs, sizeof(addrs),
+					     &mappingp->addr4,
+					     sizeof(struct in_addr));
+  }
 
-    while (!SLIST_EMPTY(&mapping66_hash_ItoG_heads[count])) {
-      struct mapping66_hash *mhp = SLIST_FIRST(&mapping66_hash_ItoG_heads[count]);
-      SLIST_REMOVE_HEAD(&mapping66_hash_ItoG_heads[count], entries);
-      free(mhp);
+  struct mapping66 *mapping66p;
+  SLIST_FOREACH(mapping66p, &tablep->mapping66_head, entries) {
+    mapping66p->cksum_delta = cksum_calc_delta(&mapping66p->global,
+					       sizeof(struct in6_addr),
+					       &mapping66p->intra,
+					       sizeof(struct in6_addr));
+  }
+
+  return (0);
+}
+
+/*
+ * Give the IDs to the mapping entries of the table.  The addresses
+ * mapped before get the same IDs as before.  Called with
+ * mapping_update_lock held.
+ */
+static int
+mapping_table_assign_ids(struct mapping_table *tablep)
+{
+  assert(tablep != NULL);
+
+  struct mapping *mappingp;
+  SLIST_FOREACH(mappingp, &tablep->mapping_head, entries) {
+    if (mapping_get_id(&mapping_id4_table, AF_INET, &mappingp->addr4,
+		       &mappingp->stat_id) == -1) {
+      return (-1);
     }
+  }
 
-    while (!SLIST_EMPTY(&mapping66_hash_GtoI_heads[count])) {
-      struct mapping66_hash *mhp = SLIST_FIRST(&mapping66_hash_GtoI_heads[count]);
-      SLIST_REMOVE_HEAD(&mapping66_hash_GtoI_heads[count], entries);
-      free(mhp);
+  struct mapping66 *mapping66p;
+  SLIST_FOREACH(mapping66p, &tablep->mapping66_head, entries) {
+    if (mapping_get_id(&mapping_id66_table, AF_INET6, &mapping66p->global,
+		       &mapping66p->stat_id) == -1) {
+      return (-1);
     }
   }
 
-  /* Clear the actual mapping data list entries. */
-  while (!SLIST_EMPTY(&mapping_head)) {
-    struct mapping *mp = SLIST_FIRST(&mapping_head);
-    SLIST_REMOVE_HEAD(&mapping_head, entries);
-    free(mp);
+  return (0);
+}
+
+/*
+ * Get the ID of the address from the ID table, or give the next ID
+ * to the address if it is not in the table yet.
+ */
+static int
+mapping_get_id(struct addrtable *id_tablep, int af, const void *addrp,
+	       uint32_t *idp)
+{
+  uintptr_t value = (uintptr_t)addrtable_lookup(id_tablep, addrp);
+  if (value != 0) {
+    *idp = value - 1;
+    return (0);
   }
 
-  while (!SLIST_EMPTY(&mapping66_head)) {
-    struct mapping66 *mp = SLIST_FIRST(&mapping66_head);
-    SLIST_REMOVE_HEAD(&mapping66_head, entries);
-    free(mp);
+  uint32_t id = id_tablep->count;
+  if (addrtable_insert(id_tablep, addrp, (void *)((uintptr_t)id + 1))
+      == -1) {
+    warnx("memory allocation failed for a mapping ID.");
+    return (-1);
+  }
+  if (mapping_id_hook != NULL) {
+    (*mapping_id_hook)(af, id, addrp);
+  }
+
+  *idp = id;
+  return (0);
+}
+
+/*
+ * Compute the route entries to the IPv4 addresses and the IPv6
+ * global addresses of the table.
+ */
+static int
+mapping_table_aggregate(struct mapping_table *tablep)
+{
+  assert(tablep != NULL);
+
+  int count4 = 0, count6 = 0;
+  const struct mapping *mappingp;
+  SLIST_FOREACH(mappingp, &tablep->mapping_head, entries) {
+    count4++;
+  }
+  const struct mapping66 *mapping66p;
+  SLIST_FOREACH(mapping66p, &tablep->mapping66_head, entries) {
+    count6++;
+  }
+
+  uint8_t (*addrs)[16];
+  addrs = (uint8_t (*)[16])calloc((count4 > count6 ? count4 : count6) + 1,
+				  sizeof(*addrs));
+  if (addrs == NULL) {
+    warnx("memory allocation failed for the route aggregation.");
+    return (-1);
+  }
+
+  int i = 0;
+  SLIST_FOREACH(mappingp, &tablep->mapping_head, entries) {
+    memcpy(addrs[i++], &mappingp->addr4, sizeof(struct in_addr));
+  }
+  if (mapping_route_aggregate(addrs, count4, 32, tablep->route_holes,
+			      &tablep->route4s, &tablep->route4_count) == -1) {
+    free(addrs);
+    return (-1);
+  }
+
+  i = 0;
+  SLIST_FOREACH(mapping66p, &tablep->mapping66_head, entries) {
+    memcpy(addrs[i++], &mapping66p->global, sizeof(struct in6_addr));
+  }
+  if (mapping_route_aggregate(addrs, count6, 128, tablep->route_holes,
+			      &tablep->route6s, &tablep->route6_count) == -1) {
+    free(addrs);
+    return (-1);
+  }
+
+  free(addrs);
+
+  return (0);
+}
+
+static int
+mapping_addr_compare(const void *a, const void *b)
+{
+  return (memcmp(a, b, 16));
+}
+
+/*
+ * Compute the smallest set of prefixes which covers the addresses
+ * (addr_bits long each) without covering more than the specified
+ * number of unmapped addresses per prefix.  The addresses are sorted
+ * in place.  The result is stored to routesp and countp sorted by the
+ * address.
+ */
+static int
+mapping_route_aggregate(uint8_t (*addrs)[16], int count, int addr_bits,
+			uint64_t holes, struct mapping_route **routesp,
+			int *countp)
+{
+  assert(addrs != NULL);
+  assert(routesp != NULL);
+  assert(countp != NULL);
+
+  /* The prefixes never overlap, so there are count routes at most. */
+  *routesp = (struct mapping_route *)calloc(count + 1,
+					    sizeof(struct mapping_route));
+  if (*routesp == NULL) {
+    warnx("memory allocation failed for struct mapping_route{}.");
+    return (-1);
+  }
+  *countp = 0;
+  if (count == 0) {
+    return (0);
+  }
+
+  qsort(addrs, count, sizeof(*addrs), mapping_addr_compare);
+  mapping_route_aggregate_range(addrs, 0, count, 0, addr_bits, holes,
+				*routesp, countp);
+
+  return (0);
+}
+
+#define MAPPING_ADDR_BIT(addr, bit) (((addr)[(bit) / 8] >> (7 - (bit) % 8)) & 1)
+
+/*
+ * Cover the sorted addresses from lo to hi - 1, which share the first
+ * prefix_len bits.  The largest prefix which satisfies the hole limit
+ * is used, otherwise the range is divided into the two halves.
+ */
+static void
+mapping_route_aggregate_range(uint8_t (*addrs)[16], int lo, int hi,
+			      int prefix_len, int addr_bits, uint64_t holes,
+			      struct mapping_route *routes, int *countp)
+{
+  int host_bits = addr_bits - prefix_len;
+  if (host_bits < 64) {
+    uint64_t size = (uint64_t)1 << host_bits;
+    if (size - (uint64_t)(hi - lo) <= holes) {
+      struct mapping_route *routep = &routes[(*countp)++];
+      memcpy(routep->addr, addrs[lo], 16);
+      int bit;
+      for (bit = prefix_len; bit < addr_bits; bit++) {
+	routep->addr[bit / 8] &= ~(1 << (7 - bit % 8));
+      }
+      routep->prefix_len = prefix_len;
+      return;
+    }
+  }
+
+  /* Find the first address which has 1 at the next bit. */
+  int left = lo, right = hi;
+  while (left < right) {
+    int mid = left + (right - left) / 2;
+    if (MAPPING_ADDR_BIT(addrs[mid], prefix_len)) {
+      right = mid;
+    } else {
+      left = mid + 1;
+    }
+  }
+  if (left > lo) {
+    mapping_route_aggregate_range(addrs, lo, left, prefix_len + 1, addr_bits,
+				  holes, routes, countp);
+  }
+  if (left < hi) {
+    mapping_route_aggregate_range(addrs, left, hi, prefix_len + 1, addr_bits,
+				  holes, routes, countp);
   }
 }
 
 /*
  * Converts IPv4 addresses to corresponding IPv6 addresses, based on
- * the IPv4 address information (specified as the first 2 arguments)
- * of the incoming packet and the information of the mapping table.
+ * the IPv4 address information (specified as the 2nd and 3rd
+ * arguments) of the incoming packet and the mapping entry of the
+ * IPv4 destination address.
  */
 int
-mapping_convert_addrs_4to6(const struct in_addr *ip4_src,
-			   const struct in_addr *ip4_dst,
-			   struct in6_addr *ip6_src,
-			   struct in6_addr *ip6_dst)
+mapping_translate_4to6(const struct mapping_match *matchp,
+		       const struct in_addr *ip4_src,
+		       const struct in_addr *ip4_dst,
+		       struct in6_addr *ip6_src,
+		       struct in6_addr *ip6_dst)
 {
+  assert(matchp != NULL);
   assert(ip4_src != NULL);
   assert(ip4_dst != NULL);
   assert(ip6_src != NULL);
   assert(ip6_dst != NULL);
 
-  /*
-   * The converted IPv6 destination address is the associated address
-   * of the IPv4 destination address in the mapping table.
-   */
-  const struct mapping *mappingp
-    = mapping_find_mapping_with_ip4_addr(ip4_dst);
+  const struct mapping *mappingp = matchp->mappingp;
   if (mappingp == NULL) {
     /* not found. */
-    warnx("no mapping entry found for %s.", inet_ntoa(*ip4_dst));
+    drop_count_addr(DROP_NO_MAPPING, AF_INET, ip4_dst);
     return (-1);
   }
+
+  /*
+   * The converted IPv6 destination address is the associated address
+   * of the IPv4 destination address in the mapping table.
+   */
   memcpy((void *)ip6_dst, (const void *)&mappingp->addr6,
 	 sizeof(struct in6_addr));
 
   /*
-   * IPv6 pseudo source address is concatination of the mapping_prefix
-   * variable and the IPv4 source address.
+   * IPv6 pseudo source address is concatination of the mapping prefix
+   * of the table and the IPv4 source address.
    */
-  memcpy((void *)ip6_src, (const void *)&mapping_prefix,
+  memcpy((void *)ip6_src, (const void *)&matchp->tablep->prefix,
 	 sizeof(struct in6_addr));
   uint8_t *ip4_of_ip6 = (uint8_t *)ip6_src;
   ip4_of_ip6 += 12;
@@ -329,19 +852,29 @@ mapping_convert_addrs_4to6(const struct in_addr *ip4_src,
 
 /*
  * Converts IPv6 addresses to corresponding IPv4 addresses, based on
- * the IPv6 address information (specified as the first 2 arguments)
- * of the incoming packet and the information of the mapping table.
+ * the IPv6 address information (specified as the 2nd and 3rd
+ * arguments) of the incoming packet and the mapping entry of the IPv6
+ * source address.
  */
 int
-mapping_convert_addrs_6to4(const struct in6_addr *ip6_src,
-			   const struct in6_addr *ip6_dst,
-			   struct in_addr *ip4_src,
-			   struct in_addr *ip4_dst)
+mapping_translate_6to4(const struct mapping_match *matchp,
+		       const struct in6_addr *ip6_src,
+		       const struct in6_addr *ip6_dst,
+		       struct in_addr *ip4_src,
+		       struct in_addr *ip4_dst)
 {
+  assert(matchp != NULL);
   assert(ip6_src != NULL);
   assert(ip4_src != NULL);
   assert((ip6_dst == NULL && ip4_dst == NULL)||(ip6_dst != NULL && ip4_dst != NULL));
 
+  const struct mapping *mappingp = matchp->mappingp;
+  if (mappingp == NULL) {
+    /* not found. */
+    drop_count_addr(DROP_NO_MAPPING, AF_INET6, ip6_src);
+    return (-1);
+  }
+
   /*
    * IPv4 destination address comes from the lower 4 bytes of the IPv6
    * pseudo destination address.
@@ -356,15 +889,6 @@ mapping_convert_addrs_6to4(const struct in6_addr *ip6_src,
    * IPv4 psuedo source address is the associated address of the IPv6
    * source address in the mapping table.
    */
-  const struct mapping *mappingp
-    = mapping_find_mapping_with_ip6_addr(ip6_src);
-  if (mappingp == NULL) {
-    /* not found. */
-    char addr_str[64];
-    warnx("no mapping entry found for %s.",
-	  inet_ntop(AF_INET6, ip6_src, addr_str, 64));
-    return (-1);
-  }
   memcpy((void *)ip4_src, (const void *)&mappingp->addr4,
 	 sizeof(struct in_addr));
 
@@ -372,91 +896,151 @@ mapping_convert_addrs_6to4(const struct in6_addr *ip6_src,
 }
 
 /*
- * Converts IPv6 addresses to corresponding IPv4 addresses, based on
- * the IPv6 address information (specified as the first 2 arguments)
- * of the incoming packet and the information of the mapping table.
+ * Converts the addresses of a packet from the Internet, based on the
+ * mapping entry of the IPv6 destination address.
  */
 int
-mapping66_convert_addrs_GtoI(const struct in6_addr *ip6_before_src,
-			     const struct in6_addr *ip6_before_dst,
-			     struct in6_addr *ip6_after_src,
-			     struct in6_addr *ip6_after_dst)
+mapping66_translate_GtoI(const struct mapping_match *matchp,
+			 const struct in6_addr *ip6_before_src,
+			 const struct in6_addr *ip6_before_dst,
+			 struct in6_addr *ip6_after_src,
+			 struct in6_addr *ip6_after_dst)
 {
+  assert(matchp != NULL);
   assert(ip6_before_src != NULL);
   assert(ip6_before_dst != NULL);
   assert(ip6_after_src != NULL);
   assert(ip6_after_dst != NULL);
 
-
-  const struct mapping66 *mappingp
-    = mapping66_find_mapping_with_G_addr(ip6_before_dst);
-
-  if(mappingp){
-    /*
-     * The packet is from the Internet
-     * change dst addr to the corresponding addr
-     */
-#ifdef DEBUG
-    warnx("from the Internet");
-#endif
-    memcpy((void *)ip6_after_dst, (const void *)&mappingp->intra, sizeof(struct in6_addr));
-    memcpy((void *)ip6_after_src, (const void *)ip6_before_src, sizeof(struct in6_addr));
-  }else{
+  const struct mapping66 *mappingp = matchp->mapping66p;
+  if(mappingp == NULL){
     /*
      * no mapping exists
      */
-    char addr_str[64];
-    warnx("no mapping entry found for %s.",
-	  inet_ntop(AF_INET6, ip6_before_dst, addr_str, 64));
+    drop_count_addr(DROP_NO_MAPPING, AF_INET6, ip6_before_dst);
     return (-1);
   }
 
+  /*
+   * The packet is from the Internet
+   * change dst addr to the corresponding addr
+   */
+  memcpy((void *)ip6_after_dst, (const void *)&mappingp->intra, sizeof(struct in6_addr));
+  memcpy((void *)ip6_after_src, (const void *)ip6_before_src, sizeof(struct in6_addr));
+
   return (0);
 }
 
 /*
- * Converts IPv6 addresses to corresponding IPv4 addresses, based on
- * the IPv6 address information (specified as the first 2 arguments)
- * of the incoming packet and the information of the mapping table.
+ * Converts the addresses of a packet from the private network, based
+ * on the mapping entry of the IPv6 source address.
  */
 int
-mapping66_convert_addrs_ItoG(const struct in6_addr *ip6_before_src,
-			     const struct in6_addr *ip6_before_dst,
-			     struct in6_addr *ip6_after_src,
-			     struct in6_addr *ip6_after_dst)
+mapping66_translate_ItoG(const struct mapping_match *matchp,
+			 const struct in6_addr *ip6_before_src,
+			 const struct in6_addr *ip6_before_dst,
+			 struct in6_addr *ip6_after_src,
+			 struct in6_addr *ip6_after_dst)
 {
+  assert(matchp != NULL);
   assert(ip6_before_src != NULL);
   assert(ip6_after_src != NULL);
   assert((ip6_before_dst == NULL && ip6_after_dst == NULL)||(ip6_before_dst != NULL && ip6_after_dst != NULL));
 
-
-  const struct mapping66 *mappingp
-    = mapping66_find_mapping_with_I_addr(ip6_before_src);
-
-  if(mappingp){
-    /*
-     * The packet is from the private network
-     * change src addr to the corresponding addr
-     */
-#ifdef DEBUG
-    warnx("from private network");
-#endif
-    memcpy((void *)ip6_after_src, (const void *)&mappingp->global, sizeof(struct in6_addr));
-    if(ip6_before_dst)
-      memcpy((void *)ip6_after_dst, (const void *)ip6_before_dst, sizeof(struct in6_addr));
-  }else{
+  const struct mapping66 *mappingp = matchp->mapping66p;
+  if(mappingp == NULL){
     /*
      * no mapping exists
      */
-    char addr_str[64];
-    warnx("no mapping entry found for %s.",
-	  inet_ntop(AF_INET6, ip6_before_src, addr_str, 64));
+    drop_count_addr(DROP_NO_MAPPING, AF_INET6, ip6_before_src);
     return (-1);
   }
 
+  /*
+   * The packet is from the private network
+   * change src addr to the corresponding addr
+   */
+  memcpy((void *)ip6_after_src, (const void *)&mappingp->global, sizeof(struct in6_addr));
+  if(ip6_before_dst)
+    memcpy((void *)ip6_after_dst, (const void *)ip6_before_dst, sizeof(struct in6_addr));
+
   return (0);
 }
 
+/*
+ * The mapping_convert_addrs_*() functions find the mapping entry
+ * with the addresses, and convert them the same as the
+ * mapping_translate_*() functions.  They are used when the entry is
+ * not known, e.g. for the addresses embedded in ICMP error messages.
+ */
+int
+mapping_convert_addrs_4to6(const struct in_addr *ip4_src,
+			   const struct in_addr *ip4_dst,
+			   struct in6_addr *ip6_src,
+			   struct in6_addr *ip6_dst)
+{
+  assert(ip4_dst != NULL);
+
+  struct mapping_match match;
+  match.tablep = mapping_table_get();
+  match.mappingp = mapping_find_mapping_with_ip4_addr(match.tablep, ip4_dst);
+  match.mapping66p = NULL;
+
+  return (mapping_translate_4to6(&match, ip4_src, ip4_dst, ip6_src, ip6_dst));
+}
+
+int
+mapping_convert_addrs_6to4(const struct in6_addr *ip6_src,
+			   const struct in6_addr *ip6_dst,
+			   struct in_addr *ip4_src,
+			   struct in_addr *ip4_dst)
+{
+  assert(ip6_src != NULL);
+
+  struct mapping_match match;
+  match.tablep = mapping_table_get();
+  match.mappingp = mapping_find_mapping_with_ip6_addr(match.tablep, ip6_src);
+  match.mapping66p = NULL;
+
+  return (mapping_translate_6to4(&match, ip6_src, ip6_dst, ip4_src, ip4_dst));
+}
+
+int
+mapping66_convert_addrs_GtoI(const struct in6_addr *ip6_before_src,
+			     const struct in6_addr *ip6_before_dst,
+			     struct in6_addr *ip6_after_src,
+			     struct in6_addr *ip6_after_dst)
+{
+  assert(ip6_before_dst != NULL);
+
+  struct mapping_match match;
+  match.tablep = mapping_table_get();
+  match.mappingp = NULL;
+  match.mapping66p = mapping66_find_mapping_with_G_addr(match.tablep,
+							ip6_before_dst);
+
+  return (mapping66_translate_GtoI(&match, ip6_before_src, ip6_before_dst,
+				   ip6_after_src, ip6_after_dst));
+}
+
+int
+mapping66_convert_addrs_ItoG(const struct in6_addr *ip6_before_src,
+			     const struct in6_addr *ip6_before_dst,
+			     struct in6_addr *ip6_after_src,
+			     struct in6_addr *ip6_after_dst)
+{
+  assert(ip6_before_src != NULL);
+
+  struct mapping_match match;
+  match.tablep = mapping_table_get();
+  match.mappingp = NULL;
+  match.mapping66p = mapping66_find_mapping_with_I_addr(match.tablep,
+							ip6_before_src);
+
+  return (mapping66_translate_ItoG(&match, ip6_before_src, ip6_before_dst,
+				   ip6_after_src, ip6_after_dst));
+}
+
 
 /*
  * Install the host route entries for each IPv4 address defined in the
@@ -467,43 +1051,16 @@ mapping66_convert_addrs_ItoG(const struct in6_addr *ip6_before_src,
 int
 mapping_install_route(void)
 {
+  int ret = 0;
 
-  struct mapping *mappingp;
-  SLIST_FOREACH(mappingp, &mapping_head, entries) {
-    if (tun_add_route(AF_INET, &mappingp->addr4, 32) == -1) {
-      warnx("IPv4 host %s route entry addition failed.",
-	    inet_ntoa(mappingp->addr4));
-    }
-  }
-
-  if (tun_add_route(AF_INET6, &mapping_prefix, 64) == -1) {
-    char addr_name[64];
-    warnx("IPv6 pseudo mapping prefix %s route entry addition failed.",
-	  inet_ntop(AF_INET6, &mapping_prefix, addr_name, 64));
-    return (-1);
-  }
-
-  if(tun_create_policy_table() == -1){
-    warnx("failed to create policy table");
-    return(-1);
+  pthread_mutex_lock(&mapping_update_lock);
+  const struct mapping_table *tablep = mapping_table_get();
+  if (tablep != NULL) {
+    ret = mapping_update_route(NULL, tablep);
   }
+  pthread_mutex_unlock(&mapping_update_lock);
 
-  struct mapping66 *mapping66p;
-  SLIST_FOREACH(mapping66p, &mapping66_head, entries) {
-    if (tun_add_route(AF_INET6, &mapping66p->global, 128) == -1){
-      char addr_name[64];
-      warnx("IPv6 host %s route entry addition failed.",
-	    inet_ntop(AF_INET6, &mapping66p->global, addr_name, 64));
-    }
-
-    if (tun_add_policy(AF_INET6, &mapping66p->intra, 128) == -1) {
-      char addr_name[64];
-      warnx("IPv6 host %s policy route entry addition failed.",
-	    inet_ntop(AF_INET6, &mapping66p->intra, addr_name, 64));
-    }
-  }
-
-  return (0);
+  return (ret);
 }
 
 /*
@@ -513,49 +1070,183 @@ mapping_install_route(void)
 int
 mapping_uninstall_route(void)
 {
-  struct mapping *mappingp;
-  SLIST_FOREACH(mappingp, &mapping_head, entries) {
-    if (tun_delete_route(AF_INET, &mappingp->addr4, 32) == -1) {
-      warnx("IPv4 host %s route entry deletion failed.",
-	    inet_ntoa(mappingp->addr4));
-    }
-  }
+  int ret = 0;
 
-  if (tun_delete_route(AF_INET6, &mapping_prefix, 64) == -1) {
-    char addr_str[64];
-    warnx("IPv6 pseudo mapping prefix %s route entry deletion failed.",
-	  inet_ntop(AF_INET6, &mapping_prefix, addr_str, 64));
-    return (-1);
+  pthread_mutex_lock(&mapping_update_lock);
+  const struct mapping_table *tablep = mapping_table_get();
+  if (tablep != NULL) {
+    ret = mapping_update_route(tablep, NULL);
   }
+  pthread_mutex_unlock(&mapping_update_lock);
 
-  tun_delete_policy();
-
-  return (0);
+  return (ret);
 }
 
-
 /*
- * Calculate the hash index from the data given.  Currently, the data
- * will be either IPv4 address or IPv6 address.
+ * Change the route entries installed for the old table to the ones
+ * for the new table.  Only the entries which appear in one of the
+ * tables are added or deleted, so the number of the route operations
+ * is proportional to the difference of the tables.  The new entries
+ * are added before the old entries are deleted, so an address mapped
+ * in both of the tables is kept routed even if its aggregated route
+ * entry changes.  The old table is NULL when the routes are installed
+ * first, and the new table is NULL when they are uninstalled.
  *
- * The current index calculation algorithm is not very smart.  It just
- * sums all the data considering they are a seriese of 2 bytes of
- * integers.  More improvement may be necessary.
+ * Called with mapping_update_lock held.  The lock also serializes the
+ * netlink session of the tunif module, which is not thread safe.
  */
 static int
-mapping_get_hash_index(const void *data, int data_len)
+mapping_update_route(const struct mapping_table *old_tablep,
+		     const struct mapping_table *new_tablep)
+{
+  int ret = 0;
+  char addr_name[64];
+
+  /*
+   * Add the routes which are not used by the old table.  The routes
+   * and the policies of the mapped addresses are sent in a batch,
+   * and each failure is reported by the tun module.
+   */
+  if (new_tablep != NULL) {
+    if (old_tablep == NULL
+	|| memcmp(&old_tablep->prefix, &new_tablep->prefix,
+		  sizeof(struct in6_addr)) != 0) {
+      if (tun_add_route(AF_INET6, &new_tablep->prefix, 64) == -1) {
+	warnx("IPv6 pseudo mapping prefix %s route entry addition failed.",
+	      inet_ntop(AF_INET6, &new_tablep->prefix, addr_name, 64));
+	return (-1);
+      }
+    }
+
+    if (old_tablep == NULL) {
+      if(tun_create_policy_table() == -1){
+	warnx("failed to create policy table");
+	return(-1);
+      }
+    }
+
+    (void)tun_route_begin();
+    mapping_apply_route(AF_INET, new_tablep->route4s, new_tablep->route4_count,
+			old_tablep ? old_tablep->route4s : NULL,
+			old_tablep ? old_tablep->route4_count : 0,
+			tun_add_route, "addition");
+    mapping_apply_route(AF_INET6, new_tablep->route6s,
+			new_tablep->route6_count,
+			old_tablep ? old_tablep->route6s : NULL,
+			old_tablep ? old_tablep->route6_count : 0,
+			tun_add_route, "addition");
+
+    const struct mapping66 *mapping66p;
+    SLIST_FOREACH(mapping66p, &new_tablep->mapping66_head, entries) {
+      if (mapping66_find_mapping_with_I_addr(old_tablep, &mapping66p->intra)
+	  == NULL) {
+	if (tun_add_policy(AF_INET6, &mapping66p->intra, 128) == -1) {
+	  warnx("IPv6 host %s policy route entry addition failed.",
+		inet_ntop(AF_INET6, &mapping66p->intra, addr_name, 64));
+	}
+      }
+    }
+    mapping_commit_route(&ret);
+  }
+
+  /* Delete the routes which are not used by the new table. */
+  if (old_tablep != NULL) {
+    (void)tun_route_begin();
+    mapping_apply_route(AF_INET, old_tablep->route4s, old_tablep->route4_count,
+			new_tablep ? new_tablep->route4s : NULL,
+			new_tablep ? new_tablep->route4_count : 0,
+			tun_delete_route, "deletion");
+    mapping_apply_route(AF_INET6, old_tablep->route6s,
+			old_tablep->route6_count,
+			new_tablep ? new_tablep->route6s : NULL,
+			new_tablep ? new_tablep->route6_count : 0,
+			tun_delete_route, "deletion");
+
+    const struct mapping66 *mapping66p;
+    SLIST_FOREACH(mapping66p, &old_tablep->mapping66_head, entries) {
+      if (mapping66_find_mapping_with_I_addr(new_tablep, &mapping66p->intra)
+	  == NULL) {
+	if (tun_delete_policy(AF_INET6, &mapping66p->intra, 128) == -1) {
+	  warnx("IPv6 host %s policy route entry deletion failed.",
+		inet_ntop(AF_INET6, &mapping66p->intra, addr_name, 64));
+	}
+      }
+    }
+    mapping_commit_route(&ret);
+
+    if (new_tablep == NULL
+	|| memcmp(&old_tablep->prefix, &new_tablep->prefix,
+		  sizeof(struct in6_addr)) != 0) {
+      if (tun_delete_route(AF_INET6, &old_tablep->prefix, 64) == -1) {
+	warnx("IPv6 pseudo mapping prefix %s route entry deletion failed.",
+	      inet_ntop(AF_INET6, &old_tablep->prefix, addr_name, 64));
+	ret = -1;
+      }
+    }
+  }
+
+  return (ret);
+}
+
+/* Compare two route entries by the address and the prefix length. */
+static int
+mapping_route_compare(const struct mapping_route *a,
+		      const struct mapping_route *b)
 {
-  assert(data != NULL);
-  assert(data_len > 0);
+  int diff = memcmp(a->addr, b->addr, 16);
+  if (diff != 0) {
+    return (diff);
+  }
 
-  uint16_t *datap = (uint16_t *)data;
-  data_len = data_len >> 1;
-  uint32_t sum = 0;
-  while (data_len--) {
-    sum += *datap++;
+  return (a->prefix_len - b->prefix_len);
+}
+
+/*
+ * Apply the route operation to the route entries which do not appear
+ * in the excluded entries.  Both of the arrays are sorted.
+ */
+static void
+mapping_apply_route(int af, const struct mapping_route *routes, int count,
+		    const struct mapping_route *excludes, int exclude_count,
+		    int (*op)(int, const void *, int), const char *op_name)
+{
+  char addr_name[64];
+  int i, j = 0;
+
+  for (i = 0; i < count; i++) {
+    int diff = 1;
+    while (j < exclude_count
+	   && (diff = mapping_route_compare(&excludes[j], &routes[i])) < 0) {
+      j++;
+    }
+    if (j < exclude_count && diff == 0) {
+      continue;
+    }
+    if (op(af, routes[i].addr, routes[i].prefix_len) == -1) {
+      warnx("%s %s/%d route entry %s failed.",
+	    af == AF_INET ? "IPv4" : "IPv6",
+	    inet_ntop(af, routes[i].addr, addr_name, 64),
+	    routes[i].prefix_len, op_name);
+    }
   }
+}
 
-  return (sum % MAPPING_TABLE_HASH_SIZE);
+/*
+ * Send the route requests queued by the mapping_update_route()
+ * function.  The failed requests are already reported, and only the
+ * number of them is reported here.  The netlink communication
+ * failure sets -1 to retp.
+ */
+static void
+mapping_commit_route(int *retp)
+{
+  int failures = tun_route_commit();
+  if (failures == -1) {
+    warnx("failed to update the route entries.");
+    *retp = -1;
+  } else if (failures > 0) {
+    warnx("%d route entry updates failed.", failures);
+  }
 }
 
 /*
@@ -563,23 +1254,16 @@ mapping_get_hash_index(const void *data, int data_len)
  * specified IPv4 address in its mapping information.
  */
 static const struct mapping *
-mapping_find_mapping_with_ip4_addr(const struct in_addr *addrp)
+mapping_find_mapping_with_ip4_addr(const struct mapping_table *tablep,
+				   const struct in_addr *addrp)
 {
   assert(addrp != NULL);
 
-  int hash_index = mapping_get_hash_index(addrp, sizeof(struct in_addr));
-
-  struct mapping_hash *mapping_hashp = NULL;
-  struct mapping *mappingp = NULL;
-  SLIST_FOREACH(mapping_hashp, &mapping_hash_4to6_heads[hash_index], entries) {
-    mappingp = mapping_hashp->mappingp;
-    if (memcmp((const void *)addrp, (const void *)&mappingp->addr4,
-	       sizeof(struct in_addr)) == 0)
-      /* Found. */
-      return (mappingp);
+  if (tablep == NULL) {
+    return (NULL);
   }
 
-  return (NULL);
+  return (addrtable_lookup(&tablep->addr4_table, addrp));
 }
 
 /*
@@ -587,23 +1271,22 @@ mapping_find_mapping_with_ip4_addr(const struct in_addr *addrp)
  * specified IPv6 address in its mapping information.
  */
 static const struct mapping *
-mapping_find_mapping_with_ip6_addr(const struct in6_addr *addrp)
+mapping_find_mapping_with_ip6_addr(const struct mapping_table *tablep,
+				   const struct in6_addr *addrp)
 {
   assert(addrp != NULL);
 
-  int hash_index = mapping_get_hash_index(addrp, sizeof(struct in6_addr));
+  if (tablep == NULL) {
+    return (NULL);
+  }
 
-  struct mapping_hash *mapping_hashp = NULL;
-  struct mapping *mappingp = NULL;
-  SLIST_FOREACH(mapping_hashp, &mapping_hash_6to4_heads[hash_index], entries) {
-    mappingp = mapping_hashp->mappingp;
-    if (memcmp((const void *)addrp, (const void *)&mappingp->addr6,
-	       sizeof(struct in6_addr)) == 0)
-      /* Found. */
-      return (mappingp);
+  const struct mapping_src6 *srcp = addrtable_lookup(&tablep->src6_table,
+						     addrp);
+  if (srcp == NULL) {
+    return (NULL);
   }
 
-  return (NULL);
+  return (srcp->mappingp);
 }
 
 /*
@@ -611,23 +1294,16 @@ mapping_find_mapping_with_ip6_addr(const struct in6_addr *addrp)
  * specified IPv6 address in its mapping information.
  */
 static const struct mapping66 *
-mapping66_find_mapping_with_G_addr(const struct in6_addr *addrp)
+mapping66_find_mapping_with_G_addr(const struct mapping_table *tablep,
+				   const struct in6_addr *addrp)
 {
   assert(addrp != NULL);
 
-  int hash_index = mapping_get_hash_index(addrp, sizeof(struct in6_addr));
-
-  struct mapping66_hash *mapping_hashp = NULL;
-  struct mapping66 *mappingp = NULL;
-  SLIST_FOREACH(mapping_hashp, &mapping66_hash_GtoI_heads[hash_index], entries) {
-    mappingp = mapping_hashp->mappingp;
-    if (memcmp((const void *)addrp, (const void *)&mappingp->global,
-	       sizeof(struct in6_addr)) == 0)
-      /* Found. */
-      return (mappingp);
+  if (tablep == NULL) {
+    return (NULL);
   }
 
-  return (NULL);
+  return (addrtable_lookup(&tablep->global_table, addrp));
 }
 
 /*
@@ -635,80 +1311,86 @@ mapping66_find_mapping_with_G_addr(const struct in6_addr *addrp)
  * specified IPv6 address in its mapping information.
  */
 static const struct mapping66 *
-mapping66_find_mapping_with_I_addr(const struct in6_addr *addrp)
+mapping66_find_mapping_with_I_addr(const struct mapping_table *tablep,
+				   const struct in6_addr *addrp)
 {
   assert(addrp != NULL);
 
-  int hash_index = mapping_get_hash_index(addrp, sizeof(struct in6_addr));
+  if (tablep == NULL) {
+    return (NULL);
+  }
 
-  struct mapping66_hash *mapping_hashp = NULL;
-  struct mapping66 *mappingp = NULL;
-  SLIST_FOREACH(mapping_hashp, &mapping66_hash_ItoG_heads[hash_index], entries) {
-    mappingp = mapping_hashp->mappingp;
-    if (memcmp((const void *)addrp, (const void *)&mappingp->intra,
-	       sizeof(struct in6_addr)) == 0)
-      /* Found. */
-      return (mappingp);
+  const struct mapping_src6 *srcp = addrtable_lookup(&tablep->src6_table,
+						     addrp);
+  if (srcp == NULL) {
+    return (NULL);
   }
 
-  return (NULL);
+  return (srcp->mapping66p);
+}
+
+/*
+ * Get the index entry of the internal IPv6 address.  A new entry is
+ * created if the address is not indexed yet.
+ */
+static struct mapping_src6 *
+mapping_get_src6(struct mapping_table *tablep, const struct in6_addr *addrp)
+{
+  assert(addrp != NULL);
+
+  struct mapping_src6 *srcp = addrtable_lookup(&tablep->src6_table, addrp);
+  if (srcp != NULL) {
+    return (srcp);
+  }
+
+  srcp = malloc(sizeof(struct mapping_src6));
+  if (srcp == NULL) {
+    warnx("memory allocation failed for struct mapping_src6{}.");
+    return (NULL);
+  }
+  memset(srcp, 0, sizeof(struct mapping_src6));
+  if (addrtable_insert(&tablep->src6_table, addrp, srcp) == -1) {
+    free(srcp);
+    return (NULL);
+  }
+  SLIST_INSERT_HEAD(&tablep->src6_head, srcp, entries);
+
+  return (srcp);
 }
 
 /*
  * Insert a new instance of the mapping{} structure to the list, and
- * at the same time insert the index information to the two hash
+ * at the same time insert the index information to the two index
  * tables, one is for searching with IPv4 address, the other is for
- * searching with IPv6 address.
+ * searching with the internal IPv6 address.
  */
 static int
-mapping_insert_mapping(struct mapping *new_mappingp)
+mapping_insert_mapping(struct mapping_table *tablep,
+		       struct mapping *new_mappingp)
 {
   assert(new_mappingp != NULL);
 
   /*
-   * Insert the new hash entry to the hash table for IPv4 address
-   * based search.
+   * Insert the new index entries to the table for IPv4 address based
+   * search, and to the table for IPv6 address based search.
    */
-  if (mapping_find_mapping_with_ip4_addr(&new_mappingp->addr4) == NULL) {
-    int hash_index;
-    hash_index = mapping_get_hash_index(&new_mappingp->addr4,
-					sizeof(struct in_addr));
-    struct mapping_hash *mapping_hashp;
-    mapping_hashp = malloc(sizeof(struct mapping_hash));
-    if (mapping_hashp == NULL) {
-      warnx("memory allocation failed for struct mapping_hash{}.");
-      return (-1);
-    }
-    memset(mapping_hashp, 0, sizeof(struct mapping_hash));
-    mapping_hashp->mappingp = new_mappingp;
-    SLIST_INSERT_HEAD(&mapping_hash_4to6_heads[hash_index], mapping_hashp,
-		      entries);
+  if (addrtable_insert(&tablep->addr4_table, &new_mappingp->addr4,
+		       new_mappingp) == -1) {
+    return (-1);
+  }
+  struct mapping_src6 *srcp = mapping_get_src6(tablep, &new_mappingp->addr6);
+  if (srcp == NULL) {
+    /* XXX: we should remove the index entry inserted in the above
+       block before returning from this function with an error. */
+    return (-1);
   }
 
-  /*
-   * Insert the new hash entry to the hash table for IPv6 address
-   * based search.
-   */
-  if (mapping_find_mapping_with_ip6_addr(&new_mappingp->addr6) == NULL) {
-    int hash_index;
-    hash_index = mapping_get_hash_index(&new_mappingp->addr6,
-					sizeof(struct in6_addr));
-    struct mapping_hash *mapping_hashp;
-    mapping_hashp = malloc(sizeof(struct mapping_hash));
-    if (mapping_hashp == NULL) {
-      warnx("memory allocation failed for struct mapping_hash{}.");
-      /* XXX: we should remove the hash entry inserted in the above
-	 block before returning from this function with an error. */
-      return (-1);
-    }
-    memset(mapping_hashp, 0, sizeof(struct mapping_hash));
-    mapping_hashp->mappingp = new_mappingp;
-    SLIST_INSERT_HEAD(&mapping_hash_6to4_heads[hash_index], mapping_hashp,
-		      entries);
+  if (srcp->mappingp == NULL) {
+    srcp->mappingp = new_mappingp;
   }
 
   /* Insert the new mapping{} instance to the global list. */
-  SLIST_INSERT_HEAD(&mapping_head, new_mappingp, entries);
+  SLIST_INSERT_HEAD(&tablep->mapping_head, new_mappingp, entries);
 
   return (0);
 }
@@ -716,91 +1398,125 @@ mapping_insert_mapping(struct mapping *new_mappingp)
 
 /*
  * Insert a new instance of the mapping{} structure to the list, and
- * at the same time insert the index information to the 66 hash
- * tables, which is for searching with IPv6 address
+ * at the same time insert the index information to the 66 index
+ * tables, which are for searching with IPv6 address
  */
 static int
-mapping66_insert_mapping(struct mapping66 *new_mappingp)
+mapping66_insert_mapping(struct mapping_table *tablep,
+			 struct mapping66 *new_mappingp)
 {
   assert(new_mappingp != NULL);
 
   /*
-   * Insert the new hash entry to the hash table for first IPv6 address
-   * based search.
+   * Insert the new index entries to the tables for the global and
+   * the intra address based search.
    */
-  if (mapping66_find_mapping_with_G_addr(&new_mappingp->global) == NULL) {
-    int hash_index;
-    hash_index = mapping_get_hash_index(&new_mappingp->global,
-					sizeof(struct in6_addr));
-    struct mapping66_hash *mapping_hashp;
-    mapping_hashp = malloc(sizeof(struct mapping66_hash));
-    if (mapping_hashp == NULL) {
-      warnx("memory allocation failed for struct mapping_hash{}.");
-      return (-1);
-    }
-    memset(mapping_hashp, 0, sizeof(struct mapping66_hash));
-    mapping_hashp->mappingp = new_mappingp;
-    SLIST_INSERT_HEAD(&mapping66_hash_GtoI_heads[hash_index], mapping_hashp,
-		      entries);
+  if (addrtable_insert(&tablep->global_table, &new_mappingp->global,
+		       new_mappingp) == -1) {
+    return (-1);
+  }
+  struct mapping_src6 *srcp = mapping_get_src6(tablep, &new_mappingp->intra);
+  if (srcp == NULL) {
+    /* XXX: we should remove the index entry inserted in the above
+       block before returning from this function with an error. */
+    return (-1);
   }
 
-  /*
-   * Insert the new hash entry to the hash table for IPv6 address
-   * based search.
-   */
-  if (mapping66_find_mapping_with_I_addr(&new_mappingp->intra) == NULL) {
-    int hash_index;
-    hash_index = mapping_get_hash_index(&new_mappingp->intra,
-					sizeof(struct in6_addr));
-    struct mapping66_hash *mapping_hashp;
-    mapping_hashp = malloc(sizeof(struct mapping66_hash));
-    if (mapping_hashp == NULL) {
-      warnx("memory allocation failed for struct mapping_hash{}.");
-      /* XXX: we should remove the hash entry inserted in the above
-	 block before returning from this function with an error. */
-      return (-1);
-    }
-    memset(mapping_hashp, 0, sizeof(struct mapping66_hash));
-    mapping_hashp->mappingp = new_mappingp;
-    SLIST_INSERT_HEAD(&mapping66_hash_ItoG_heads[hash_index], mapping_hashp,
-		      entries);
+  if (srcp->mapping66p == NULL) {
+    srcp->mapping66p = new_mappingp;
   }
 
   /* Insert the new mapping{} instance to the global list. */
-  SLIST_INSERT_HEAD(&mapping66_head, new_mappingp, entries);
+  SLIST_INSERT_HEAD(&tablep->mapping66_head, new_mappingp, entries);
 
   return (0);
 }
 
+/*
+ * Get the difference of the pseudo header sums before and after the
+ * translation in the specified direction, to adjust the TCP and UDP
+ * checksum values with the cksum_adjust_ulp() function.  Most of the
+ * difference is computed when the table is built.  Since dispatch()
+ * matches only the upper 64 bits of the mapping prefix, the 32 bits
+ * between the prefix and the embedded IPv4 address are taken from
+ * pseudo_addrp, which is the translated IPv6 source address for
+ * FOURTOSIX, and the original IPv6 destination address for
+ * SIXTOFOUR.  pseudo_addrp is not used for the SIXTOSIX directions.
+ */
+int32_t
+mapping_cksum_delta(const struct mapping_match *matchp, uint8_t direction,
+		    const struct in6_addr *pseudo_addrp)
+{
+  assert(matchp != NULL);
+
+  const uint16_t *wordp = (const uint16_t *)pseudo_addrp;
+  switch (direction) {
+  case FOURTOSIX:
+    assert(matchp->mappingp != NULL);
+    assert(pseudo_addrp != NULL);
+    return (matchp->mappingp->cksum_delta + wordp[4] + wordp[5]);
+  case SIXTOFOUR:
+    assert(matchp->mappingp != NULL);
+    assert(pseudo_addrp != NULL);
+    return (-(int32_t)matchp->mappingp->cksum_delta - wordp[4] - wordp[5]);
+  case SIXTOSIX_ItoG:
+    assert(matchp->mapping66p != NULL);
+    return (matchp->mapping66p->cksum_delta);
+  case SIXTOSIX_GtoI:
+    assert(matchp->mapping66p != NULL);
+    return (-(int32_t)matchp->mapping66p->cksum_delta);
+  default:
+    assert(0);
+  }
+
+  return (0);
+}
+
+/*
+ * Classify the packet read from the tun device, and find the mapping
+ * entry used to translate it.  A packet from an internal IPv6 address
+ * is classified by a single lookup with its source address.  The
+ * entries stored in matchp are valid until the calling thread
+ * reports a quiescent state with qsbr_quiescent().
+ */
 uint8_t
-dispatch(uint8_t *bufp)
+dispatch(uint8_t *bufp, struct mapping_match *matchp)
 {
   assert(bufp != NULL);
+  assert(matchp != NULL);
   uint32_t af = 0;
   af = tun_get_af(bufp);
-  bufp += sizeof(uint32_t);
-#ifdef DEBUG
-  fprintf(stderr, "af = %d\n", af);
-#endif
+  bufp += tun_hdr_len;
+
+  const struct mapping_table *tablep = mapping_table_get();
+  matchp->tablep = tablep;
+  matchp->mappingp = NULL;
+  matchp->mapping66p = NULL;
+  if (tablep == NULL) {
+    return 0;
+  }
 
   if(af == AF_INET){
+    struct ip *ip4_hdrp = (struct ip *)bufp;
+    matchp->mappingp = mapping_find_mapping_with_ip4_addr(tablep,
+							  &ip4_hdrp->ip_dst);
     return FOURTOSIX;
   }else if(af == AF_INET6){
     struct ip6_hdr *ip6_hdrp = (struct ip6_hdr *)bufp;
+    const struct mapping_src6 *srcp
+      = addrtable_lookup(&tablep->src6_table, &ip6_hdrp->ip6_src);
 
-    const struct mapping66 *mapping66p
-      = mapping66_find_mapping_with_I_addr(&ip6_hdrp->ip6_src);
-    const struct mapping *mappingp
-      = mapping_find_mapping_with_ip6_addr(&ip6_hdrp->ip6_src);
-
-    if(!mapping66p && !mappingp){
+    if(srcp == NULL){
+      matchp->mapping66p
+	= mapping66_find_mapping_with_G_addr(tablep, &ip6_hdrp->ip6_dst);
       return SIXTOSIX_GtoI;
-    }else{
-      if(memcmp(&ip6_hdrp->ip6_dst, &mapping_prefix, 8) == 0)
-	return SIXTOFOUR;
-      else
-	return SIXTOSIX_ItoG;
     }
+    if(memcmp(&ip6_hdrp->ip6_dst, &tablep->prefix, 8) == 0){
+      matchp->mappingp = srcp->mappingp;
+      return SIXTOFOUR;
+    }
+    matchp->mapping66p = srcp->mapping66p;
+    return SIXTOSIX_ItoG;
   }
 
   return 0;
@@ -30,14 +30,103 @@
 extern "C" {
 #endif
 
+#include <sys/queue.h>
+
 #define SIXTOSIX_ItoG 1
 #define SIXTOSIX_GtoI 2
 #define SIXTOFOUR 3
 #define FOURTOSIX 4
 
+/*
+ * The mapping structure between the global IPv4 address and the
+ * internal IPv6 address.
+ */
+struct mapping {
+  SLIST_ENTRY(mapping) entries;
+  struct in_addr addr4;
+  struct in6_addr addr6;
+  /*
+   * The sum of addr6 and the upper 64 bits of the mapping prefix
+   * minus the sum of addr4, to adjust the upper layer checksum
+   * values.  See mapping_cksum_delta().
+   */
+  uint16_t cksum_delta;
+  /*
+   * A dense ID of addr4, which is kept while the program runs even if
+   * the table is reloaded.  See mapping_set_id_hook().
+   */
+  uint32_t stat_id;
+};
+
+/*
+ * The mapping structure between the global IPv6 address and the
+ * internal IPv6 address.
+ */
+struct mapping66 {
+  SLIST_ENTRY(mapping66) entries;
+  struct in6_addr global;
+  struct in6_addr intra;
+  uint16_t cksum_delta;	/* The sum of global minus the sum of intra. */
+  uint32_t stat_id;	/* A dense ID of global, like mapping.stat_id. */
+};
+
+struct mapping_table;
+
+/* The largest values of the stat-histogram-bits and stat-top-ports. */
+#define MAPPING_STAT_HIST_BITS_MAX 5
+#define MAPPING_STAT_TOP_PORTS_MAX 256
+
+/*
+ * The mapping entries found by dispatch().  mappingp is set for the
+ * FOURTOSIX and SIXTOFOUR directions, and mapping66p is set for the
+ * SIXTOSIX directions, if the corresponding entry exists.  The
+ * entries are valid until the forwarding thread reports a quiescent
+ * state (see qsbr.h).
+ */
+struct mapping_match {
+  const struct mapping_table *tablep;
+  const struct mapping *mappingp;
+  const struct mapping66 *mapping66p;
+};
+
+/*
+ * Called with the address family, the ID and the address when an ID
+ * is given to an address for the first time, before the table using
+ * the ID is published.  The IDs of the IPv4 addresses of the
+ * map-static entries (AF_INET) and the global IPv6 addresses of the
+ * map66-static entries (AF_INET6) are counted from 0 separately.
+ */
+typedef void (*mapping_id_hook_t)(int, uint32_t, const void *);
+
 int mapping_initialize(void);
-int mapping_create_table(const char *, int);
+void mapping_set_id_hook(mapping_id_hook_t);
+int mapping_create_table(const char *);
+int mapping_reload_table(const char *);
 void mapping_destroy_table(void);
+int mapping_get_stat_hist_bits(void);
+int mapping_get_stat_top_ports(void);
+int mapping_translate_4to6(const struct mapping_match *,
+			   const struct in_addr *,
+			   const struct in_addr *,
+			   struct in6_addr *,
+			   struct in6_addr *);
+int mapping_translate_6to4(const struct mapping_match *,
+			   const struct in6_addr *,
+			   const struct in6_addr *,
+			   struct in_addr *,
+			   struct in_addr *);
+int mapping66_translate_ItoG(const struct mapping_match *,
+			     const struct in6_addr *,
+			     const struct in6_addr *,
+			     struct in6_addr *,
+			     struct in6_addr *);
+int mapping66_translate_GtoI(const struct mapping_match *,
+			     const struct in6_addr *,
+			     const struct in6_addr *,
+			     struct in6_addr *,
+			     struct in6_addr *);
+int32_t mapping_cksum_delta(const struct mapping_match *, uint8_t,
+			    const struct in6_addr *);
 int mapping_convert_addrs_4to6(const struct in_addr *,
 			       const struct in_addr *,
 			       struct in6_addr *,
@@ -55,7 +144,7 @@ int mapping66_convert_addrs_GtoI(const struct in6_addr *,
 				 struct in6_addr *,
 				 struct in6_addr *);
 int dispatch_6(const struct in6_addr *, const struct in6_addr *);
-uint8_t dispatch(uint8_t *);
+uint8_t dispatch(uint8_t *, struct mapping_match *);
 int mapping_install_route(void);
 int mapping_uninstall_route(void);
 
@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <err.h>
+#include <pthread.h>
 
 #include <sys/queue.h>
 #include <sys/types.h>
@@ -36,37 +37,58 @@
 
 #include <netinet/in.h>
 
+#include "pmtudisc.h"
+#include "logring.h"
+#include "coarsetime.h"
+#include "qsbr.h"
+
 struct path_mtu {
+  /*
+   * The next entry in the hash chain.  The chains are read by the
+   * forwarding threads without any lock.
+   */
+  struct path_mtu *hash_next;
+  /* The list of the entries, the recent one first.  Writers only. */
   LIST_ENTRY(path_mtu) entries;
   struct sockaddr_storage ss_addr;
-  int path_mtu;
-  time_t last_updated;
-  struct path_mtu_hash *path_mtu_hashp;
+  int path_mtu;		/* Accessed with the atomic builtins. */
+  time_t last_updated;	/* Accessed with the atomic builtins. */
+  struct path_mtu *retired_next;
 };
 LIST_HEAD(path_mtu_listhead, path_mtu);
 
-struct path_mtu_hash {
-  LIST_ENTRY(path_mtu_hash) entries;
-  struct path_mtu *path_mtup;
-};
-LIST_HEAD(path_mtu_hash_listhead, path_mtu_hash);
-
 #define PMTUDISC_DEFAULT_MTU 1500
 #define PMTUDISC_DEFAULT_LIFETIME 3600
 #define PMTUDISC_HASH_SIZE 1009
 #define PMTUDISC_PATH_MTU_MAX_INSTANCE_SIZE 10000
+#define PMTUDISC_EXPIRE_INTERVAL 60
 
 static struct path_mtu_listhead path_mtu_head;
-static struct path_mtu_hash_listhead path_mtu_hash_heads[PMTUDISC_HASH_SIZE];
+static struct path_mtu *path_mtu_hash_heads[PMTUDISC_HASH_SIZE];
+/* The removed entries waiting for the forwarding threads to leave. */
+static struct path_mtu *path_mtu_retired;
 
 static int pmtudisc_get_hash_index(const void *, int);
+static int pmtudisc_get_addr_len(int);
+static void *pmtudisc_get_addr(struct path_mtu *);
 static struct path_mtu *pmtudisc_find_path_mtu(int, const void *addrp);
 static int pmtudisc_insert_path_mtu(struct path_mtu *);
-static void pmtudisc_expire_path_mtus(void);
+static void pmtudisc_expire_path_mtus(int);
 static void pmtudisc_remove_path_mtu(struct path_mtu *);
 
 static int path_mtu_instance_size;
 
+/*
+ * The path MTU cache is shared among the forwarding threads.  Lookups
+ * walk the hash chains without any lock, in the same way as the
+ * mapping table is read (see qsbr.h).  The cache is modified under
+ * path_mtu_lock only when an ICMP/ICMPv6 error updates the path MTU
+ * information, or when the entries expire.  A removed entry is
+ * unlinked from its chain at once, and freed by pmtudisc_expire()
+ * after every forwarding thread passes a quiescent state.
+ */
+static pthread_mutex_t path_mtu_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int
 pmtudisc_initialize(void)
 {
@@ -74,8 +96,9 @@ pmtudisc_initialize(void)
 
   int count = PMTUDISC_HASH_SIZE;
   while (count--) {
-    LIST_INIT(&path_mtu_hash_heads[count]);
+    path_mtu_hash_heads[count] = NULL;
   }
+  path_mtu_retired = NULL;
 
   path_mtu_instance_size = 0;
 
@@ -87,16 +110,24 @@ pmtudisc_get_path_mtu_size(int af, const void *addr)
 {
   assert(addr != NULL);
 
-  time_t now = time(NULL);
   int pmtu = PMTUDISC_DEFAULT_MTU;
 
+  if (__atomic_load_n(&path_mtu_instance_size, __ATOMIC_RELAXED) == 0) {
+    /* Nothing learned yet. */
+    return (pmtu);
+  }
+
+  time_t now = coarsetime_now();
+
   struct path_mtu *pmtup = pmtudisc_find_path_mtu(af, addr);
   if (pmtup != NULL) {
-    if (now - pmtup->last_updated > PMTUDISC_DEFAULT_LIFETIME) {
-      /* Entry is expired. */
-      pmtudisc_remove_path_mtu(pmtup);
-    } else {
-      pmtu = pmtup->path_mtu;
+    /*
+     * An expired entry is just ignored here.  It will be refreshed by
+     * the next update, or removed by pmtudisc_expire().
+     */
+    if (now - __atomic_load_n(&pmtup->last_updated, __ATOMIC_RELAXED)
+	<= PMTUDISC_DEFAULT_LIFETIME) {
+      pmtu = __atomic_load_n(&pmtup->path_mtu, __ATOMIC_RELAXED);
     }
   }
 
@@ -109,17 +140,26 @@ pmtudisc_update_path_mtu_size(int af, const void *addrp, int pmtu)
   assert(addrp != NULL);
   assert(pmtu >= 68);
 
-  time_t now = time(NULL);
+  time_t now = coarsetime_now();
+  int ret = 0;
 
+  int addr_len = pmtudisc_get_addr_len(af);
+  if (addr_len == 0) {
+    logring_log(LOGRING_UNSUPPORTED_AF, af);
+    return (-1);
+  }
+
+  pthread_mutex_lock(&path_mtu_lock);
   struct path_mtu *pmtup = pmtudisc_find_path_mtu(af, addrp);
   if (pmtup != NULL) {
     /*
      * The path_mtu{} instance exists.  Update the MTU information if
-     * it is different from the existing one.
+     * it is different from the existing one, or the entry is expired.
      */
-    if (pmtup->path_mtu != pmtu) {
-      pmtup->path_mtu = pmtu;
-      pmtup->last_updated = now;
+    if (pmtup->path_mtu != pmtu
+	|| now - pmtup->last_updated > PMTUDISC_DEFAULT_LIFETIME) {
+      __atomic_store_n(&pmtup->path_mtu, pmtu, __ATOMIC_RELAXED);
+      __atomic_store_n(&pmtup->last_updated, now, __ATOMIC_RELAXED);
       /* Reorder the global list so that the recent entry comes to head. */
       LIST_REMOVE(pmtup, entries);
       LIST_INSERT_HEAD(&path_mtu_head, pmtup, entries);
@@ -128,36 +168,58 @@ pmtudisc_update_path_mtu_size(int af, const void *addrp, int pmtu)
     /* No entry exists. Create a new path_mtu{} instance. */
     pmtup = malloc(sizeof(struct path_mtu));
     if (pmtup == NULL) {
-      warnx("cannot allocate memory for struct path_mtu{}.");
-      return (-1);
+      logring_log_addr(LOGRING_PMTU_NOMEM, af, addrp, NULL, 0);
+      ret = -1;
+      goto out;
     }
     memset(pmtup, 0, sizeof(struct path_mtu));
     pmtup->ss_addr.ss_family = af;
-    switch (af) {
-    case AF_INET:
-      memcpy(&((struct sockaddr_in *)&pmtup->ss_addr)->sin_addr, addrp,
-	     sizeof(struct sockaddr_in));
-      break;
-    case  AF_INET6:
-      memcpy(&((struct sockaddr_in6 *)&pmtup->ss_addr)->sin6_addr, addrp,
-	     sizeof(struct sockaddr_in6));
-      break;
-    default:
-      warnx("unsupported address family %d.", af);
-      free(pmtup);
-      return (-1);
-    }
+    memcpy(pmtudisc_get_addr(pmtup), addrp, addr_len);
     pmtup->path_mtu = pmtu;
     pmtup->last_updated = now;
-    pmtup->path_mtu_hashp = NULL;
     if (pmtudisc_insert_path_mtu(pmtup) == -1) {
-      warnx("insersion of path_mtu{} structure to the management list fialed.");
+      logring_log_addr(LOGRING_PMTU_INSERT, af, addrp, NULL, 0);
       free(pmtup);
-      return (-1);
+      ret = -1;
+      goto out;
     }
   }
 
-  return (0);
+ out:
+  pthread_mutex_unlock(&path_mtu_lock);
+  return (ret);
+}
+
+/*
+ * Remove the expired path MTU information every
+ * PMTUDISC_EXPIRE_INTERVAL seconds, and free the removed entries no
+ * forwarding thread refers to any more.  Called periodically off the
+ * forwarding path, by a thread which is not registered to QSBR.
+ */
+void
+pmtudisc_expire(void)
+{
+  static time_t last_expired = 0;
+  time_t now = coarsetime_now();
+
+  pthread_mutex_lock(&path_mtu_lock);
+  if (now - last_expired >= PMTUDISC_EXPIRE_INTERVAL) {
+    last_expired = now;
+    pmtudisc_expire_path_mtus(PMTUDISC_PATH_MTU_MAX_INSTANCE_SIZE);
+  }
+  struct path_mtu *retiredp = path_mtu_retired;
+  path_mtu_retired = NULL;
+  pthread_mutex_unlock(&path_mtu_lock);
+
+  if (retiredp == NULL) {
+    return;
+  }
+  qsbr_synchronize();
+  while (retiredp != NULL) {
+    struct path_mtu *nextp = retiredp->retired_next;
+    free(retiredp);
+    retiredp = nextp;
+  }
 }
 
 static int
@@ -176,51 +238,63 @@ pmtudisc_get_hash_index(const void *data, int data_len)
   return (sum % PMTUDISC_HASH_SIZE);
 }
 
-static struct path_mtu *
-pmtudisc_find_path_mtu(int af, const void *addrp)
+/* The length of an address of the family, or 0 if not supported. */
+static int
+pmtudisc_get_addr_len(int af)
 {
-  assert(addrp != NULL);
-
-  int addr_len = 0;
   switch (af) {
   case AF_INET:
-    addr_len = sizeof(struct in_addr);
-    break;
-
+    return (sizeof(struct in_addr));
   case AF_INET6:
-    addr_len = sizeof(struct in6_addr);
-    break;
+    return (sizeof(struct in6_addr));
+  default:
+    return (0);
+  }
+}
 
+/* The destination address of the path_mtu{} instance. */
+static void *
+pmtudisc_get_addr(struct path_mtu *path_mtup)
+{
+  switch (path_mtup->ss_addr.ss_family) {
+  case AF_INET:
+    return (&((struct sockaddr_in *)&path_mtup->ss_addr)->sin_addr);
+  case AF_INET6:
+    return (&((struct sockaddr_in6 *)&path_mtup->ss_addr)->sin6_addr);
   default:
-    warnx("unsupported address family %d.", af);
+    assert(0);
+    return (NULL);
+  }
+}
+
+/*
+ * Find the path_mtu{} instance of the address.  Called by the
+ * forwarding threads without the lock, so the chain is walked with
+ * the atomic loads.
+ */
+static struct path_mtu *
+pmtudisc_find_path_mtu(int af, const void *addrp)
+{
+  assert(addrp != NULL);
+
+  int addr_len = pmtudisc_get_addr_len(af);
+  if (addr_len == 0) {
+    logring_log(LOGRING_UNSUPPORTED_AF, af);
     return (NULL);
   }
 
   int hash_index = pmtudisc_get_hash_index(addrp, addr_len);
 
-  struct path_mtu_hash *path_mtu_hashp = NULL;
-  struct path_mtu *path_mtup = NULL;
-  LIST_FOREACH(path_mtu_hashp, &path_mtu_hash_heads[hash_index], entries) {
-    path_mtup = path_mtu_hashp->path_mtup;
+  struct path_mtu *path_mtup
+    = __atomic_load_n(&path_mtu_hash_heads[hash_index], __ATOMIC_ACQUIRE);
+  for (; path_mtup != NULL;
+       path_mtup = __atomic_load_n(&path_mtup->hash_next,
+				   __ATOMIC_ACQUIRE)) {
     if (af != path_mtup->ss_addr.ss_family) {
       /* Address family mismatch. */
       continue;
     }
-    void *path_mtu_dstp = NULL;
-    switch (path_mtup->ss_addr.ss_family) {
-    case AF_INET:
-      path_mtu_dstp
-	= &(((struct sockaddr_in *)&path_mtup->ss_addr)->sin_addr);
-      break;
-    case AF_INET6:
-      path_mtu_dstp
-	= &(((struct sockaddr_in6 *)&path_mtup->ss_addr)->sin6_addr);
-      break;
-    default:
-      assert(0);
-    }
-    if (memcmp((const void *)addrp, (const void *)path_mtu_dstp,
-	       addr_len) == 0) {
+    if (memcmp(addrp, pmtudisc_get_addr(path_mtup), addr_len) == 0) {
       /* Found. */
       return (path_mtup);
     }
@@ -229,62 +303,50 @@ pmtudisc_find_path_mtu(int af, const void *addrp)
   return (NULL);
 }
 
+/*
+ * Publish the new path_mtu{} instance to the hash chain.  Called with
+ * the lock held.
+ */
 static int
 pmtudisc_insert_path_mtu(struct path_mtu *new_path_mtup)
 {
   assert(new_path_mtup != NULL);
 
-  /*
-   * Insert the new hash entry to the hash table for the path MTU
-   * destination IP address.
-   */
-  int new_af = new_path_mtup->ss_addr.ss_family;
-  void *new_dstp;
-  int new_dst_len;
-  switch (new_af) {
-  case AF_INET:
-    new_dstp = &(((struct sockaddr_in *)&new_path_mtup->ss_addr)->sin_addr);
-    new_dst_len = sizeof(struct in_addr);
-    break;
-  case AF_INET6:
-    new_dstp = &(((struct sockaddr_in6 *)&new_path_mtup->ss_addr)->sin6_addr);
-    new_dst_len = sizeof(struct in6_addr);
-    break;
-  default:
-    warnx("unsupported address family %d.", new_af);
+  int new_dst_len = pmtudisc_get_addr_len(new_path_mtup->ss_addr.ss_family);
+  if (new_dst_len == 0) {
+    logring_log(LOGRING_UNSUPPORTED_AF, new_path_mtup->ss_addr.ss_family);
     return (-1);
   }
 
-  int hash_index = pmtudisc_get_hash_index(new_dstp, new_dst_len);
-  struct path_mtu_hash *path_mtu_hashp;
-  path_mtu_hashp = malloc(sizeof(struct path_mtu_hash));
-  if (path_mtu_hashp == NULL) {
-    warnx("memory allocation failed for struct path_mtu_hash{}.");
-    return (-1);
-  }
-  memset(path_mtu_hashp, 0, sizeof(struct path_mtu_hash));
-  path_mtu_hashp->path_mtup = new_path_mtup;
-  new_path_mtup->path_mtu_hashp = path_mtu_hashp; /* Reverse pointer. */
-  LIST_INSERT_HEAD(&path_mtu_hash_heads[hash_index], path_mtu_hashp,
-		    entries);
+  int hash_index = pmtudisc_get_hash_index(pmtudisc_get_addr(new_path_mtup),
+					   new_dst_len);
+  new_path_mtup->hash_next = path_mtu_hash_heads[hash_index];
+  /* The entry is complete before the forwarding threads can see it. */
+  __atomic_store_n(&path_mtu_hash_heads[hash_index], new_path_mtup,
+		   __ATOMIC_RELEASE);
 
   /* Insert the new path_mtu{} instance to the global list. */
   LIST_INSERT_HEAD(&path_mtu_head, new_path_mtup, entries);
 
-  path_mtu_instance_size++;
+  __atomic_add_fetch(&path_mtu_instance_size, 1, __ATOMIC_RELAXED);
 
   if (path_mtu_instance_size > PMTUDISC_PATH_MTU_MAX_INSTANCE_SIZE) {
-    pmtudisc_expire_path_mtus();
+    pmtudisc_expire_path_mtus(PMTUDISC_PATH_MTU_MAX_INSTANCE_SIZE >> 1);
   }
 
   return (0);
 }
 
+/*
+ * Remove the path MTU information which is expired.  The other
+ * information beyond the max_size most recent ones is also removed.
+ * Called with the lock held.
+ */
 static void
-pmtudisc_expire_path_mtus(void)
+pmtudisc_expire_path_mtus(int max_size)
 {
-  time_t now = time(NULL);
-  int reduced_size = PMTUDISC_PATH_MTU_MAX_INSTANCE_SIZE >> 1;
+  time_t now = coarsetime_now();
+  int reduced_size = max_size;
   struct path_mtu *pmtup;
   LIST_FOREACH(pmtup, &path_mtu_head, entries) {
     if ((now - pmtup->last_updated > PMTUDISC_DEFAULT_LIFETIME)
@@ -305,18 +367,31 @@ pmtudisc_expire_path_mtus(void)
   }
 }
 
+/*
+ * Unlink the path_mtu{} instance from the hash chain and the global
+ * list.  The forwarding threads may still be reading it, so it is
+ * only retired here, and freed by pmtudisc_expire().  Called with the
+ * lock held.
+ */
 static void
 pmtudisc_remove_path_mtu(struct path_mtu *path_mtup)
 {
   assert(path_mtup != NULL);
-  assert(path_mtup->path_mtu_hashp != NULL);
 
-  struct path_mtu_hash *path_mtu_hashp = path_mtup->path_mtu_hashp;
-  LIST_REMOVE(path_mtu_hashp, entries);
-  free(path_mtu_hashp);
+  int hash_index
+    = pmtudisc_get_hash_index(pmtudisc_get_addr(path_mtup),
+			      pmtudisc_get_addr_len(path_mtup->ss_addr.ss_family));
+  struct path_mtu **nextpp = &path_mtu_hash_heads[hash_index];
+  while (*nextpp != path_mtup) {
+    assert(*nextpp != NULL);
+    nextpp = &(*nextpp)->hash_next;
+  }
+  /* A reader on this entry still finds the rest of the chain. */
+  __atomic_store_n(nextpp, path_mtup->hash_next, __ATOMIC_RELEASE);
 
   LIST_REMOVE(path_mtup, entries);
-  free(path_mtup);
+  path_mtup->retired_next = path_mtu_retired;
+  path_mtu_retired = path_mtup;
 
-  path_mtu_instance_size--;
+  __atomic_sub_fetch(&path_mtu_instance_size, 1, __ATOMIC_RELAXED);
 }
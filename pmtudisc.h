@@ -33,6 +33,7 @@ extern "C" {
 int pmtudisc_initialize(void);
 int pmtudisc_get_path_mtu_size(int, const void *);
 int pmtudisc_update_path_mtu_size(int, const void *, int);
+void pmtudisc_expire(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2010, 2011, 2012
+ *   IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <sched.h>
+#include <err.h>
+
+#include "qsbr.h"
+
+/*
+ * The state of a reader thread.  epoch is the global epoch observed
+ * at the last quiescent state, or 0 while the thread is offline (not
+ * registered, or blocked outside of the read side).  Each state has
+ * its own cache line, since it is written once per packet.
+ */
+struct qsbr_thread {
+  uint64_t epoch;
+  int in_use;
+} __attribute__((aligned(64)));
+
+static struct qsbr_thread qsbr_threads[QSBR_MAX_THREADS];
+static uint64_t qsbr_epoch = 1;
+static __thread struct qsbr_thread *qsbr_self = NULL;
+
+/*
+ * Register the calling thread as a reader.  The thread is online
+ * when this function returns.
+ */
+int
+qsbr_register_thread(void)
+{
+  assert(qsbr_self == NULL);
+
+  int index;
+  for (index = 0; index < QSBR_MAX_THREADS; index++) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&qsbr_threads[index].in_use, &expected,
+				    1, 0, __ATOMIC_ACQ_REL,
+				    __ATOMIC_RELAXED)) {
+      qsbr_self = &qsbr_threads[index];
+      qsbr_online();
+      return (0);
+    }
+  }
+
+  warnx("too many QSBR reader threads.");
+  return (-1);
+}
+
+void
+qsbr_unregister_thread(void)
+{
+  if (qsbr_self == NULL) {
+    return;
+  }
+  qsbr_offline();
+  __atomic_store_n(&qsbr_self->in_use, 0, __ATOMIC_RELEASE);
+  qsbr_self = NULL;
+}
+
+/*
+ * Report that the calling thread holds no reference to the data
+ * protected by QSBR.
+ */
+void
+qsbr_quiescent(void)
+{
+  if (qsbr_self == NULL) {
+    return;
+  }
+  __atomic_store_n(&qsbr_self->epoch,
+		   __atomic_load_n(&qsbr_epoch, __ATOMIC_ACQUIRE),
+		   __ATOMIC_RELEASE);
+}
+
+/*
+ * Mark the calling thread offline before it blocks, e.g. waiting for
+ * packets, so that it does not delay qsbr_synchronize().  The thread
+ * must not hold any reference until qsbr_online() is called.
+ */
+void
+qsbr_offline(void)
+{
+  if (qsbr_self == NULL) {
+    return;
+  }
+  __atomic_store_n(&qsbr_self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+void
+qsbr_online(void)
+{
+  if (qsbr_self == NULL) {
+    return;
+  }
+  __atomic_store_n(&qsbr_self->epoch,
+		   __atomic_load_n(&qsbr_epoch, __ATOMIC_ACQUIRE),
+		   __ATOMIC_SEQ_CST);
+  /* The following reads must not be reordered before the store. */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * Wait until every reader thread passes a quiescent state, or goes
+ * offline.  After that, the data unpublished before the call is no
+ * longer referenced and can be freed.  Must not be called by a
+ * registered reader thread.
+ */
+void
+qsbr_synchronize(void)
+{
+  assert(qsbr_self == NULL || qsbr_self->epoch == 0);
+
+  uint64_t target = __atomic_add_fetch(&qsbr_epoch, 1, __ATOMIC_SEQ_CST);
+
+  int index;
+  for (index = 0; index < QSBR_MAX_THREADS; index++) {
+    struct qsbr_thread *threadp = &qsbr_threads[index];
+    for (;;) {
+      uint64_t epoch = __atomic_load_n(&threadp->epoch, __ATOMIC_SEQ_CST);
+      if (epoch == 0 || epoch >= target) {
+	break;
+      }
+      sched_yield();
+    }
+  }
+}
@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <string.h>
 #include <fcntl.h>
 #include <stdint.h>
@@ -39,6 +40,7 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/un.h>
+#include <sys/mman.h>
 
 #include <net/if.h>
 #if defined(__linux__)
@@ -69,12 +71,14 @@
 #include <string>
 #include <sstream>
 #include <map>
-#include <json/json.h>
+#include <vector>
+#include <algorithm>
 #include <sys/time.h>
 
 #include "mapping.h"
 #include "stat.h"
 #include "icmpsub.h"
+#include "qsbr.h"
 
 namespace map646_stat{
   int statif_alloc(){
@@ -95,458 +99,1230 @@ namespace map646_stat{
       errx(EXIT_FAILURE, "failed to bind stat socket");
     }
 
-    if(listen(stat_listen_fd, 5) < 0){
+    if(listen(stat_listen_fd, SOMAXCONN) < 0){
       errx(EXIT_FAILURE, "failed to listen to stat socket");
     }
 
     return stat_listen_fd;
   }
 
-  int stat::update(const uint8_t *bufp, ssize_t len, uint8_t d){
-    /*
-      timeval currenttime;
-      gettimeofday(&currenttime, NULL);
+  stat::stat(){
+    pthread_mutex_init(&lock, NULL);
+    memset(id_count, 0, sizeof(id_count));
+    shards = NULL;
+    num_shards = 0;
+    enabled = false;
+    bank = 0;
+    hist_bits = 0;
+    hist_buckets = 0;
+    counter_size = 0;
+    top_ports = 0;
+    slot_size = 0;
+    shmp = NULL;
+    shm_size = 0;
+    shm_fd = -1;
+    shm_name = NULL;
+  }
 
-      std::cout << "diff time: " << float(currenttime.tv_sec - lastsend.tv_sec) << std::endl;
-      if(float(currenttime.tv_sec - lastsend.tv_sec)/60 > max_wait_time && max_enable){
-      warnx("stat is full. going to flush");
-      lastsend = currenttime;
-      flush();
+  stat::~stat(){
+    free_blocks();
+    for(int i = 0; i < num_shards; i++){
+      free(shards[i]->dirs[STAT_V4]);
+      free(shards[i]->dirs[STAT_V6]);
+      free(shards[i]);
+    }
+    free(shards);
+    for(int f = 0; f < 2; f++){
+      for(size_t b = 0; b < addr_blocks[f].size(); b++){
+	free(addr_blocks[f][b]);
       }
-    */
-    assert(bufp != NULL);
-    switch(d){
-    case FOURTOSIX:
-      {
-	ip* ip4_hdrp = (ip*)bufp;
+    }
+    if(shmp != NULL){
+      munmap(shmp, shm_size);
+      close(shm_fd);
+    }
+    pthread_mutex_destroy(&lock);
+  }
 
-	if(ip4_hdrp->ip_hl << 2 != sizeof(ip)){
-	  /* IPv4 options are not supported. */
-	  warnx("IPv4 options are not supported.");
-	  break;
-	}
+  /*
+   * Allocate the shards for the forwarding threads.  The shard of a
+   * thread is specified by its index to update().  The packet lengths
+   * are counted in the histograms of the bits (see stat_hist_index()),
+   * and the source ports in the ports entries (see stat_top_port).
+   */
+  int stat::initialize(int n, int bits, int ports){
+    assert(shards == NULL);
+    if(bits < 0 || bits > STAT_HIST_BITS_MAX){
+      warnx("the histogram bits must be 0 to %d", STAT_HIST_BITS_MAX);
+      return -1;
+    }
+    if(ports < 1 || ports > STAT_TOP_PORTS_MAX){
+      warnx("the top ports must be 1 to %d", STAT_TOP_PORTS_MAX);
+      return -1;
+    }
+    hist_bits = bits;
+    hist_buckets = stat_hist_buckets(bits);
+    counter_size = sizeof(stat_counter) + hist_buckets * sizeof(uint32_t);
+    top_ports = ports;
+    slot_size = (6 * counter_size + 4 * top_ports * sizeof(stat_top_port)
+		 + STAT_HLL_REGISTERS + STAT_CACHE_LINE - 1)
+      / STAT_CACHE_LINE * STAT_CACHE_LINE;
+
+    shards = (stat_shard **)calloc(n, sizeof(stat_shard *));
+    if(shards == NULL){
+      warnx("memory allocation failed for the stat shards");
+      return -1;
+    }
+    for(int i = 0; i < n; i++){
+      void *p;
+      if(posix_memalign(&p, STAT_CACHE_LINE, sizeof(stat_shard)) != 0){
+	warnx("memory allocation failed for the stat shards");
+	return -1;
+      }
+      shards[i] = (stat_shard *)p;
+      memset(shards[i], 0, sizeof(stat_shard));
+      num_shards = i + 1;
+    }
+    return 0;
+  }
 
-	map646_in_addr addr(ip4_hdrp->ip_dst);
-	uint8_t ip4_proto = ip4_hdrp->ip_p;
-	uint16_t ip4_tlen, ip4_hlen, ip4_plen;
-	ip4_tlen = ntohs(ip4_hdrp->ip_len);
-	ip4_hlen = ip4_hdrp->ip_hl << 2;
-	ip4_plen = ip4_tlen - ip4_hlen;
-	uint8_t *packetp = (uint8_t *)ip4_hdrp;
-	packetp += sizeof(iphdr);
-
-	/* Check the packet size. */
-	if (ip4_tlen > len) {
-	  /* Data is too short.  Drop it. */
-	  warnx("Insufficient data supplied (%zd), while IP header says (%d)",
-		len, ip4_tlen);
-	  break;
-	}
-	if(ip4_proto == IPPROTO_ICMP){
-	  stat46[addr].stat_element[ICMP_IN].num++;
-	  stat46[addr].stat_element[ICMP_IN].len[get_hist(ip4_plen - sizeof(icmp))]++;
-	}else if(ip4_proto == IPPROTO_TCP){
+  /*
+   * Record the address of a new stat ID.  Called by the mapping class
+   * before the ID is used by the forwarding threads.
+   */
+  void stat::register_id(int af, uint32_t id, const void *addrp){
+    assert(addrp != NULL);
+    int family = (af == AF_INET) ? STAT_V4 : STAT_V6;
+    uint32_t b = id / STAT_BLOCK_SLOTS;
+
+    pthread_mutex_lock(&lock);
+    if(b >= addr_blocks[family].size()){
+      addr_blocks[family].resize(b + 1, NULL);
+    }
+    if(addr_blocks[family][b] == NULL){
+      addr_blocks[family][b]
+	= (stat_addr_block *)calloc(1, sizeof(stat_addr_block));
+      if(addr_blocks[family][b] == NULL){
+	pthread_mutex_unlock(&lock);
+	warnx("memory allocation failed for the stat");
+	return;
+      }
+    }
+    if(enabled && alloc_blocks(family, b) == -1){
+      /* The ID is registered but its packets are not counted. */
+      warnx("memory allocation failed for the stat");
+    }
+    memcpy(&addr_blocks[family][b]->addr[id % STAT_BLOCK_SLOTS], addrp,
+	   family == STAT_V4 ? sizeof(in_addr) : sizeof(in6_addr));
+    if(id >= id_count[family]){
+      id_count[family] = id + 1;
+    }
+    pthread_mutex_unlock(&lock);
+  }
 
-	  stat46[addr].stat_element[TCP_IN].num++;
-	  uint16_t source = ntohs(((tcphdr*)packetp)->source);
-	  stat46[addr].stat_element[TCP_IN].port_stat[source]++;
-	  stat46[addr].stat_element[TCP_IN].len[get_hist(ip4_plen - sizeof(tcphdr))]++;
+  /*
+   * Replace the directories of the family smaller than num_blocks
+   * with larger copies.  The old ones are freed after the forwarding
+   * threads stop reading them.  Called with the lock held.
+   */
+  int stat::grow_directories(int family, uint32_t num_blocks){
+    std::vector<stat_directory *> old_dirs;
+    int ret = 0;
+    for(int i = 0; i < num_shards; i++){
+      stat_directory *dirp = shards[i]->dirs[family];
+      uint32_t old_num = (dirp == NULL) ? 0 : dirp->num_blocks;
+      if(num_blocks <= old_num){
+	continue;
+      }
+      uint32_t new_num = (old_num == 0) ? STAT_DIR_INITIAL_BLOCKS : old_num;
+      while(new_num < num_blocks){
+	new_num *= 2;
+      }
+      stat_directory *new_dirp
+	= (stat_directory *)calloc(1, sizeof(stat_directory)
+				   + new_num * sizeof(stat_block *));
+      if(new_dirp == NULL){
+	ret = -1;
+	break;
+      }
+      new_dirp->num_blocks = new_num;
+      if(old_num > 0){
+	memcpy(new_dirp->blocks, dirp->blocks, old_num * sizeof(stat_block *));
+	old_dirs.push_back(dirp);
+      }
+      __atomic_store_n(&shards[i]->dirs[family], new_dirp, __ATOMIC_RELEASE);
+    }
+    if(!old_dirs.empty()){
+      qsbr_synchronize();
+      for(size_t i = 0; i < old_dirs.size(); i++){
+	free(old_dirs[i]);
+      }
+    }
+    return ret;
+  }
 
-	}else if(ip4_proto == IPPROTO_UDP){
+  /*
+   * Allocate the block b of every shard if it does not exist.  The
+   * forwarding threads may see the block as soon as it is stored.
+   * Called with the lock held.
+   */
+  int stat::alloc_blocks(int family, uint32_t b){
+    if(grow_directories(family, b + 1) == -1){
+      return -1;
+    }
+    size_t block_size = STAT_BANKS * STAT_BLOCK_SLOTS * slot_size;
+    for(int i = 0; i < num_shards; i++){
+      stat_directory *dirp = shards[i]->dirs[family];
+      if(dirp->blocks[b] != NULL){
+	continue;
+      }
+      void *p;
+      if(posix_memalign(&p, STAT_CACHE_LINE, block_size) != 0){
+	return -1;
+      }
+      memset(p, 0, block_size);
+      __atomic_store_n(&dirp->blocks[b], (stat_block *)p, __ATOMIC_RELEASE);
+    }
+    return 0;
+  }
 
-	  stat46[addr].stat_element[UDP_IN].num++;
-	  uint16_t source = ntohs(((udphdr*)packetp)->source);
-	  stat46[addr].stat_element[UDP_IN].port_stat[source]++;
-	  stat46[addr].stat_element[UDP_IN].len[get_hist(ip4_plen - sizeof(udphdr))]++;
+  /*
+   * Free the blocks of all the shards, keeping the directories.
+   * Called with the lock held after no forwarding thread refers to
+   * them, or by the destructor.
+   */
+  void stat::free_blocks(){
+    for(int i = 0; i < num_shards; i++){
+      for(int f = 0; f < 2; f++){
+	stat_directory *dirp = shards[i]->dirs[f];
+	if(dirp == NULL){
+	  continue;
+	}
+	for(uint32_t b = 0; b < dirp->num_blocks; b++){
+	  free(dirp->blocks[b]);
+	  dirp->blocks[b] = NULL;
+	}
+      }
+    }
+  }
 
+  /*
+   * Allocate the blocks of the IDs registered so far, before the
+   * forwarding threads start counting.  Returns -1 if the memory is
+   * not available, leaving the stat disabled.
+   */
+  int stat::enable(){
+    pthread_mutex_lock(&lock);
+    if(enabled){
+      pthread_mutex_unlock(&lock);
+      return 0;
+    }
+    for(int f = 0; f < 2; f++){
+      for(uint32_t b = 0; b < addr_blocks[f].size(); b++){
+	if(addr_blocks[f][b] != NULL && alloc_blocks(f, b) == -1){
+	  /* No thread counts while the stat is disabled. */
+	  warnx("memory allocation failed for the stat");
+	  free_blocks();
+	  pthread_mutex_unlock(&lock);
+	  return -1;
 	}
-	break;
       }
-    case SIXTOFOUR:
-      {
-	ip6_hdr* ip6_hdrp = (ip6_hdr*)bufp;
-	in_addr service_addr;
-	uint8_t *packetp = (uint8_t *)ip6_hdrp;
-	uint8_t ip6_proto =  ip6_hdrp->ip6_nxt;
-	packetp += sizeof(ip6_hdr);
-
-	ip6_frag *ip6_frag_hdrp = NULL;
-	int ip6_more_frag = 0;
-	int ip6_offset = 0;
-	int ip6_id = 0;
-
-	if (ip6_proto == IPPROTO_FRAGMENT) {
-	  ip6_frag_hdrp = (ip6_frag *)packetp;
-	  ip6_proto = ip6_frag_hdrp->ip6f_nxt;
-	  ip6_more_frag = ip6_frag_hdrp->ip6f_offlg & IP6F_MORE_FRAG;
-	  ip6_offset = ntohs(ip6_frag_hdrp->ip6f_offlg & IP6F_OFF_MASK);
-	  ip6_id = ntohl(ip6_frag_hdrp->ip6f_ident);
-	  packetp += sizeof(ip6_frag);
-	}
-
-	if (ip6_proto != IPPROTO_ICMPV6
-	    && ip6_proto != IPPROTO_TCP
-	    && ip6_proto != IPPROTO_UDP) {
-	  warnx("Extention header %d is not supported.", ip6_proto);
-	  break;
+    }
+    enabled = true;
+    last_flush.update();
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+
+  /*
+   * Free the blocks after the forwarding threads stop counting.  The
+   * counters are lost, and the stat starts from zero when enabled
+   * again.
+   */
+  void stat::disable(){
+    pthread_mutex_lock(&lock);
+    if(!enabled){
+      pthread_mutex_unlock(&lock);
+      return;
+    }
+    enabled = false;
+    std::vector<stat_block *> blocks;
+    for(int i = 0; i < num_shards; i++){
+      for(int f = 0; f < 2; f++){
+	stat_directory *dirp = shards[i]->dirs[f];
+	if(dirp == NULL){
+	  continue;
+	}
+	for(uint32_t b = 0; b < dirp->num_blocks; b++){
+	  if(dirp->blocks[b] != NULL){
+	    blocks.push_back(dirp->blocks[b]);
+	    __atomic_store_n(&dirp->blocks[b], (stat_block *)NULL,
+			     __ATOMIC_RELAXED);
+	  }
 	}
+      }
+    }
+    /* Wait for the threads which may have loaded the blocks. */
+    qsbr_synchronize();
+    pthread_mutex_unlock(&lock);
+    for(size_t i = 0; i < blocks.size(); i++){
+      free(blocks[i]);
+    }
+  }
 
-	if(mapping_convert_addrs_6to4(&ip6_hdrp->ip6_src, NULL, &service_addr, NULL) < 0)
-	  break;
+  /*
+   * Get the slot of the ID in the bank of the shard.  Returns NULL if
+   * the block of the slot is not allocated.
+   */
+  stat_slot *stat::get_slot(stat_shard *shardp, int cur_bank, int family,
+			    uint32_t id){
+    uint32_t b = id / STAT_BLOCK_SLOTS;
+    stat_directory *dirp = __atomic_load_n(&shardp->dirs[family],
+					   __ATOMIC_ACQUIRE);
+    if(dirp == NULL || b >= dirp->num_blocks){
+      return NULL;
+    }
+    stat_block *blockp = __atomic_load_n(&dirp->blocks[b], __ATOMIC_ACQUIRE);
+    if(blockp == NULL){
+      return NULL;
+    }
+    return (stat_slot *)((uint8_t *)blockp
+			 + (cur_bank * STAT_BLOCK_SLOTS + id % STAT_BLOCK_SLOTS)
+			 * slot_size);
+  }
 
-	map646_in_addr addr(service_addr);
-	uint16_t ip6_payload_len = ntohs(ip6_hdrp->ip6_plen);
-	if (ip6_frag_hdrp != NULL) {
-	  ip6_payload_len -= sizeof(ip6_frag);
-	}
+  /* Get the counter of ICMP_IN to UDP_OUT in the slot. */
+  stat_counter *stat::get_counter(stat_slot *slotp, int index){
+    return (stat_counter *)((uint8_t *)slotp + index * counter_size);
+  }
 
-	/* Check the packet size. */
-	if (ip6_payload_len + (ssize_t)sizeof(ip6_hdr) > len) {
-	  /* Data is too short.  Drop it. */
-	  warnx("Insufficient data supplied (%zd), while IP header says (%lu)",
-		len, ip6_payload_len + sizeof(ip6_hdr));
-	  break;
-	}
+  /* Get the top ports of TCP_IN to UDP_OUT in the slot. */
+  stat_top_port *stat::get_top_ports(stat_slot *slotp, int index){
+    assert(index >= TCP_IN);
+    return (stat_top_port *)((uint8_t *)slotp + 6 * counter_size
+			     + (index - TCP_IN) * top_ports
+			     * sizeof(stat_top_port));
+  }
+
+  /* Get the HyperLogLog registers of the peers in the slot. */
+  uint8_t *stat::get_peer_hll(stat_slot *slotp){
+    return ((uint8_t *)slotp + 6 * counter_size
+	    + 4 * top_ports * sizeof(stat_top_port));
+  }
 
-	if(ip6_proto == IPPROTO_ICMPV6){
-	  stat46[addr].stat_element[ICMP_OUT].num++;
-	  stat46[addr].stat_element[ICMP_OUT].len[get_hist(ip6_payload_len - sizeof(icmp6_hdr))]++;
-	}else if(ip6_proto == IPPROTO_TCP){
-	  stat46[addr].stat_element[TCP_OUT].num++;
-	  u_int16_t source = ntohs(((tcphdr *)packetp)->source);
-	  stat46[addr].stat_element[TCP_OUT].port_stat[source]++;
-	  stat46[addr].stat_element[TCP_OUT].len[get_hist(ip6_payload_len - sizeof(tcphdr))]++;
-	}else if(ip6_proto == IPPROTO_UDP){
-	  stat46[addr].stat_element[UDP_OUT].num++;
-	  u_int16_t source = ntohs(((udphdr *)packetp)->source);
-	  stat46[addr].stat_element[UDP_OUT].port_stat[source]++;
-	  stat46[addr].stat_element[UDP_OUT].len[get_hist(ip6_payload_len - sizeof(udphdr))]++;
+  /*
+   * Sum the counters of the ID in the current bank of all the
+   * shards to the slot_size bytes of sump, and merge the registers of
+   * the peers.  The top ports are not summed (see merge_top_ports()).
+   * Returns false if no packet is counted.  Called with the lock held.
+   */
+  bool stat::sum_slot(int family, uint32_t id, stat_slot *sump){
+    memset(sump, 0, slot_size);
+    bool counted = false;
+    for(int i = 0; i < num_shards; i++){
+      stat_slot *slotp = get_slot(shards[i], bank, family, id);
+      if(slotp == NULL){
+	continue;
+      }
+      for(int c = 0; c < 6; c++){
+	stat_counter *counterp = get_counter(slotp, c);
+	stat_counter *sum_counterp = get_counter(sump, c);
+	uint32_t num = __atomic_load_n(&counterp->num, __ATOMIC_ACQUIRE);
+	if(num == 0){
+	  continue;
+	}
+	counted = true;
+	sum_counterp->num += num;
+	sum_counterp->error += __atomic_load_n(&counterp->error,
+					       __ATOMIC_RELAXED);
+	for(int b = 0; b < hist_buckets; b++){
+	  sum_counterp->len[b] += __atomic_load_n(&counterp->len[b],
+						  __ATOMIC_RELAXED);
 	}
-	break;
       }
-    case SIXTOSIX_GtoI:
-      {
-	ip6_hdr* ip6_hdrp = (ip6_hdr*)bufp;
-	map646_in6_addr addr(ip6_hdrp->ip6_dst);
-	uint8_t *packetp = (uint8_t *)ip6_hdrp;
-	uint8_t ip6_proto =  ip6_hdrp->ip6_nxt;
-	packetp += sizeof(ip6_hdr);
-
-	ip6_frag *ip6_frag_hdrp = NULL;
-	int ip6_more_frag = 0;
-	int ip6_offset = 0;
-	int ip6_id = 0;
-
-	if (ip6_proto == IPPROTO_FRAGMENT) {
-	  ip6_frag_hdrp = (ip6_frag *)packetp;
-	  ip6_proto = ip6_frag_hdrp->ip6f_nxt;
-	  ip6_more_frag = ip6_frag_hdrp->ip6f_offlg & IP6F_MORE_FRAG;
-	  ip6_offset = ntohs(ip6_frag_hdrp->ip6f_offlg & IP6F_OFF_MASK);
-	  ip6_id = ntohl(ip6_frag_hdrp->ip6f_ident);
-	  packetp += sizeof(ip6_frag);
-	}
-
-	if (ip6_proto != IPPROTO_ICMPV6
-	    && ip6_proto != IPPROTO_TCP
-	    && ip6_proto != IPPROTO_UDP) {
-	  warnx("Extention header %d is not supported.", ip6_proto);
-	  break;
+      uint8_t *hllp = get_peer_hll(slotp);
+      uint8_t *sum_hllp = get_peer_hll(sump);
+      for(int r = 0; r < STAT_HLL_REGISTERS; r++){
+	uint8_t v = __atomic_load_n(&hllp[r], __ATOMIC_RELAXED);
+	if(v > sum_hllp[r]){
+	  sum_hllp[r] = v;
 	}
+      }
+    }
+    return counted;
+  }
 
-	uint16_t ip6_payload_len = ntohs(ip6_hdrp->ip6_plen);
-	if (ip6_frag_hdrp != NULL) {
-	  ip6_payload_len -= sizeof(ip6_frag);
-	}
+  /* The sums of a port in the top ports of the shards. */
+  struct top_port_sum{
+    uint32_t upper;
+    uint32_t lower;
+    uint32_t min;		/* The smallest counts of the shards. */
+  };
 
-	/* Check the packet size. */
-	if (ip6_payload_len + (ssize_t)sizeof(ip6_hdr) > len) {
-	  /* Data is too short.  Drop it. */
-	  warnx("Insufficient data supplied (%zd), while IP header says (%lu)",
-		len, ip6_payload_len + sizeof(ip6_hdr));
-	  break;
-	}
+  static bool top_port_more(const stat_top_port &a, const stat_top_port &b){
+    if(a.count != b.count){
+      return a.count > b.count;
+    }
+    return a.port < b.port;
+  }
 
-	if(ip6_proto == IPPROTO_ICMPV6){
-	  stat66[addr].stat_element[ICMP_IN].num++;
-	  stat66[addr].stat_element[ICMP_IN].len[get_hist(ip6_payload_len - sizeof(icmp6_hdr))]++;
-	}else if(ip6_proto == IPPROTO_TCP){
-	  stat66[addr].stat_element[TCP_IN].num++;
-	  u_int16_t source = ntohs(((tcphdr *)packetp)->source);
-	  stat66[addr].stat_element[TCP_IN].port_stat[source]++;
-	  stat66[addr].stat_element[TCP_IN].len[get_hist(ip6_payload_len - sizeof(tcphdr))]++;
-	}else if(ip6_proto == IPPROTO_UDP){
-	  stat66[addr].stat_element[UDP_IN].num++;
-	  u_int16_t source = ntohs(((udphdr *)packetp)->source);
-	  stat66[addr].stat_element[UDP_IN].port_stat[source]++;
-	  stat66[addr].stat_element[UDP_IN].len[get_hist(ip6_payload_len - sizeof(udphdr))]++;
-	}
-	break;
+  static bool top_port_less(const stat_top_port &a, const stat_top_port &b){
+    return a.port < b.port;
+  }
+
+  /*
+   * Merge the top ports of the counter of the ID in the current bank
+   * of all the shards to the top_ports ports of the largest counts,
+   * in the ascending order of the ports.  A shard whose entries are
+   * all used may have counted a port not in them as many times as its
+   * smallest count, so the count of a merged port is the upper bound
+   * of the sum, and the error is the difference from the lower bound.
+   * Called with the lock held.
+   */
+  void stat::merge_top_ports(int family, uint32_t id, int index,
+			     std::vector<stat_top_port> &ports){
+    std::map<int, top_port_sum> sums;
+    std::vector<stat_top_port> entries(top_ports);
+    uint32_t min_total = 0;
+    for(int i = 0; i < num_shards; i++){
+      stat_slot *slotp = get_slot(shards[i], bank, family, id);
+      if(slotp == NULL){
+	continue;
       }
-    case SIXTOSIX_ItoG:
-      {
-	ip6_hdr* ip6_hdrp = (ip6_hdr*)bufp;
-	in6_addr service_addr;
-	uint8_t *packetp = (uint8_t *)ip6_hdrp;
-	uint8_t ip6_proto =  ip6_hdrp->ip6_nxt;
-	packetp += sizeof(ip6_hdr);
-
-	ip6_frag *ip6_frag_hdrp = NULL;
-	int ip6_more_frag = 0;
-	int ip6_offset = 0;
-	int ip6_id = 0;
-
-	if (ip6_proto == IPPROTO_FRAGMENT) {
-	  ip6_frag_hdrp = (ip6_frag *)packetp;
-	  ip6_proto = ip6_frag_hdrp->ip6f_nxt;
-	  ip6_more_frag = ip6_frag_hdrp->ip6f_offlg & IP6F_MORE_FRAG;
-	  ip6_offset = ntohs(ip6_frag_hdrp->ip6f_offlg & IP6F_OFF_MASK);
-	  ip6_id = ntohl(ip6_frag_hdrp->ip6f_ident);
-	  packetp += sizeof(ip6_frag);
-	}
-
-	if (ip6_proto != IPPROTO_ICMPV6
-	    && ip6_proto != IPPROTO_TCP
-	    && ip6_proto != IPPROTO_UDP) {
-	  warnx("Extention header %d is not supported.", ip6_proto);
+      stat_top_port *portp = get_top_ports(slotp, index);
+      int used = 0;
+      uint32_t min = 0;
+      for(; used < top_ports; used++){
+	stat_top_port &entry = entries[used];
+	entry.count = __atomic_load_n(&portp[used].count, __ATOMIC_ACQUIRE);
+	if(entry.count == 0){
 	  break;
 	}
+	entry.port = __atomic_load_n(&portp[used].port, __ATOMIC_RELAXED);
+	entry.error = std::min(__atomic_load_n(&portp[used].error,
+					       __ATOMIC_RELAXED), entry.count);
+	if(used == 0 || entry.count < min){
+	  min = entry.count;
+	}
+      }
+      if(used < top_ports){
+	/* The counts are exact until the entries are used up. */
+	min = 0;
+      }
+      min_total += min;
+      for(int j = 0; j < used; j++){
+	top_port_sum &sum = sums[entries[j].port];
+	sum.upper += entries[j].count;
+	sum.lower += entries[j].count - entries[j].error;
+	sum.min += min;
+      }
+    }
 
+    ports.clear();
+    for(std::map<int, top_port_sum>::iterator it = sums.begin();
+	it != sums.end(); it++){
+      stat_top_port port;
+      port.port = it->first;
+      port.count = it->second.upper + min_total - it->second.min;
+      port.error = port.count - it->second.lower;
+      ports.push_back(port);
+    }
+    if(ports.size() > (size_t)top_ports){
+      std::sort(ports.begin(), ports.end(), top_port_more);
+      ports.resize(top_ports);
+      std::sort(ports.begin(), ports.end(), top_port_less);
+    }
+  }
 
-	if(mapping66_convert_addrs_ItoG(&ip6_hdrp->ip6_src, NULL, &service_addr, NULL) < 0)
-	  break;
-	map646_in6_addr addr(service_addr);
-	uint16_t ip6_payload_len = ntohs(ip6_hdrp->ip6_plen);
-	if (ip6_frag_hdrp != NULL) {
-	  ip6_payload_len -= sizeof(ip6_frag);
-	}
+  std::string stat::get_addr(int family, uint32_t id){
+    char str[INET6_ADDRSTRLEN];
+    inet_ntop(family == STAT_V4 ? AF_INET : AF_INET6,
+	      &addr_blocks[family][id / STAT_BLOCK_SLOTS]->addr[id % STAT_BLOCK_SLOTS],
+	      str, sizeof(str));
+    return std::string(str);
+  }
 
-	/* Check the packet size. */
-	if (ip6_payload_len + (ssize_t)sizeof(ip6_hdr) > len) {
-	  /* Data is too short.  Drop it. */
-	  warnx("Insufficient data supplied (%zd), while IP header says (%lu)",
-		len, ip6_payload_len + sizeof(ip6_hdr));
-	  break;
-	}
+  /*
+   * Increment a counter written only by the owner thread.  The
+   * readers may load the counter at any time.
+   */
+  static inline void counter_inc(uint32_t *counterp){
+    __atomic_store_n(counterp, __atomic_load_n(counterp, __ATOMIC_RELAXED) + 1,
+		     __ATOMIC_RELAXED);
+  }
 
+  /*
+   * Hash the address of a peer for the HyperLogLog, with the finalizer
+   * of MurmurHash3.  An IPv6 address is folded to 64 bits first.
+   */
+  static inline uint64_t peer_hash(uint64_t x){
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+  }
 
-	if(ip6_proto == IPPROTO_ICMPV6){
-	  stat66[addr].stat_element[ICMP_OUT].num++;
-	  stat66[addr].stat_element[ICMP_OUT].len[get_hist(ip6_payload_len - sizeof(icmp6_hdr))]++;
-	}else if(ip6_proto == IPPROTO_TCP){
-	  stat66[addr].stat_element[TCP_OUT].num++;
-	  u_int16_t source = ntohs(((tcphdr *)packetp)->source);
-	  stat66[addr].stat_element[TCP_OUT].port_stat[source]++;
-	  stat66[addr].stat_element[TCP_OUT].len[get_hist(ip6_payload_len - sizeof(tcphdr))]++;
-	}else if(ip6_proto == IPPROTO_UDP){
-	  stat66[addr].stat_element[UDP_OUT].num++;
-	  u_int16_t source = ntohs(((udphdr *)packetp)->source);
-	  stat66[addr].stat_element[UDP_OUT].port_stat[source]++;
-	  stat66[addr].stat_element[UDP_OUT].len[get_hist(ip6_payload_len - sizeof(udphdr))]++;
-	}
-	break;
+  static inline uint64_t peer_hash4(const void *addrp){
+    uint32_t a;
+    memcpy(&a, addrp, sizeof(a));
+    return peer_hash(a);
+  }
+
+  static inline uint64_t peer_hash6(const void *addrp){
+    uint64_t a[2];
+    memcpy(a, addrp, sizeof(a));
+    return peer_hash(a[0] * 0x9e3779b97f4a7c15ULL ^ a[1]);
+  }
+
+  /*
+   * Count a packet in the shard.  port is -1 for ICMP, and peer is the
+   * hash of the address of the peer.
+   */
+  void stat::count(stat_shard *shardp, int cur_bank, int family, uint32_t id,
+		   int index, int len, int port, uint64_t peer){
+    stat_slot *slotp = get_slot(shardp, cur_bank, family, id);
+    if(slotp == NULL){
+      return;
+    }
+    /*
+     * The register of the upper bits of the hash keeps the largest
+     * position of the first 1 bit in the rest.
+     */
+    uint8_t *registerp = &get_peer_hll(slotp)[peer >> (64 - STAT_HLL_BITS)];
+    uint8_t rank = __builtin_clzll((peer << STAT_HLL_BITS)
+				   | (1ULL << (STAT_HLL_BITS - 1))) + 1;
+    if(rank > *registerp){
+      __atomic_store_n(registerp, rank, __ATOMIC_RELAXED);
+    }
+
+    stat_counter *counterp = get_counter(slotp, index);
+    if(len < 0){
+      len = 0;
+    }else if(len > STAT_HIST_LEN_MAX){
+      len = STAT_HIST_LEN_MAX;
+    }
+    counter_inc(&counterp->len[stat_hist_index(len, hist_bits)]);
+    /* A reader finds the counters by num. */
+    __atomic_store_n(&counterp->num, counterp->num + 1, __ATOMIC_RELEASE);
+    if(port < 0){
+      return;
+    }
+
+    /*
+     * The used entries are never freed until flush(), so the unused
+     * ones are at the end.  A reader may see an entry being replaced
+     * with the count of the previous port, which is off by one.
+     */
+    stat_top_port *portp = get_top_ports(slotp, index);
+    stat_top_port *minp = NULL;
+    for(int i = 0; i < top_ports; i++, portp++){
+      uint32_t c = portp->count;
+      if(c == 0){
+	/* The port must be visible before the count. */
+	__atomic_store_n(&portp->port, port, __ATOMIC_RELAXED);
+	__atomic_store_n(&portp->count, 1, __ATOMIC_RELEASE);
+	return;
+      }
+      if(portp->port == port){
+	counter_inc(&portp->count);
+	return;
+      }
+      if(minp == NULL || c < minp->count){
+	minp = portp;
+      }
+    }
+    uint32_t c = minp->count;
+    __atomic_store_n(&minp->error, c, __ATOMIC_RELAXED);
+    __atomic_store_n(&minp->count, c + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&minp->port, port, __ATOMIC_RELEASE);
+  }
+
+  /*
+   * Count a packet.  Called by the forwarding thread owning the
+   * shard, before it reports a quiescent state.
+   */
+  int stat::update(int shard, const uint8_t *bufp, ssize_t len, uint8_t d,
+		   const struct mapping_match *matchp){
+    assert(bufp != NULL);
+    assert(matchp != NULL);
+    if(shard < 0 || shard >= num_shards){
+      return -1;
+    }
+    stat_shard *shardp = shards[shard];
+    int cur_bank = __atomic_load_n(&bank, __ATOMIC_ACQUIRE);
+
+    /* The packets to the unmapped addresses are not counted. */
+    int family;
+    uint32_t id;
+    switch(d){
+    case FOURTOSIX:
+    case SIXTOFOUR:
+      if(matchp->mappingp == NULL)
+	return 0;
+      family = STAT_V4;
+      id = matchp->mappingp->stat_id;
+      break;
+    case SIXTOSIX_GtoI:
+    case SIXTOSIX_ItoG:
+      if(matchp->mapping66p == NULL)
+	return 0;
+      family = STAT_V6;
+      id = matchp->mapping66p->stat_id;
+      break;
+    default:
+      return 0;
+    }
+    int out = (d == SIXTOFOUR || d == SIXTOSIX_ItoG);
+
+    if(d == FOURTOSIX){
+      ip* ip4_hdrp = (ip*)bufp;
+
+      if(ip4_hdrp->ip_hl << 2 != sizeof(ip)){
+	/* IPv4 options are not supported.  The translator counts the drop. */
+	return 0;
+      }
+
+      uint8_t ip4_proto = ip4_hdrp->ip_p;
+      uint16_t ip4_tlen, ip4_hlen, ip4_plen;
+      ip4_tlen = ntohs(ip4_hdrp->ip_len);
+      ip4_hlen = ip4_hdrp->ip_hl << 2;
+      ip4_plen = ip4_tlen - ip4_hlen;
+      const uint8_t *packetp = bufp + sizeof(iphdr);
+      uint64_t peer = peer_hash4(&ip4_hdrp->ip_src);
+
+      /* Check the packet size. */
+      if (ip4_tlen > len) {
+	/* Data is too short.  The translator counts the drop. */
+	return 0;
+      }
+
+      if(ip4_proto == IPPROTO_ICMP){
+	count(shardp, cur_bank, family, id, ICMP_IN,
+	      ip4_plen - sizeof(icmp), -1, peer);
+      }else if(ip4_proto == IPPROTO_TCP){
+	count(shardp, cur_bank, family, id, TCP_IN,
+	      ip4_plen - sizeof(tcphdr), ntohs(((tcphdr*)packetp)->source),
+	      peer);
+      }else if(ip4_proto == IPPROTO_UDP){
+	count(shardp, cur_bank, family, id, UDP_IN,
+	      ip4_plen - sizeof(udphdr), ntohs(((udphdr*)packetp)->source),
+	      peer);
       }
+      return 0;
+    }
+
+    const ip6_hdr* ip6_hdrp = (const ip6_hdr*)bufp;
+    const uint8_t *packetp = bufp + sizeof(ip6_hdr);
+    uint8_t ip6_proto = ip6_hdrp->ip6_nxt;
+    uint16_t ip6_payload_len = ntohs(ip6_hdrp->ip6_plen);
+
+    if (ip6_proto == IPPROTO_FRAGMENT) {
+      const ip6_frag *ip6_frag_hdrp = (const ip6_frag *)packetp;
+      ip6_proto = ip6_frag_hdrp->ip6f_nxt;
+      ip6_payload_len -= sizeof(ip6_frag);
+      packetp += sizeof(ip6_frag);
+    }
+
+    if (ip6_proto != IPPROTO_ICMPV6
+	&& ip6_proto != IPPROTO_TCP
+	&& ip6_proto != IPPROTO_UDP) {
+      /* Extension headers are not supported.  The translator counts it. */
+      return 0;
+    }
+
+    /* Check the packet size. */
+    if (ip6_payload_len + (ssize_t)sizeof(ip6_hdr) > len) {
+      /* Data is too short.  The translator counts the drop. */
+      return 0;
+    }
+
+    /*
+     * The peer of a SIXTOFOUR packet is the IPv4 address embedded in
+     * the destination, so that it is hashed as the source of FOURTOSIX.
+     */
+    uint64_t peer;
+    if(d == SIXTOFOUR){
+      peer = peer_hash4(&ip6_hdrp->ip6_dst.s6_addr[12]);
+    }else if(d == SIXTOSIX_GtoI){
+      peer = peer_hash6(&ip6_hdrp->ip6_src);
+    }else{
+      peer = peer_hash6(&ip6_hdrp->ip6_dst);
+    }
+
+    if(ip6_proto == IPPROTO_ICMPV6){
+      count(shardp, cur_bank, family, id, out ? ICMP_OUT : ICMP_IN,
+	    ip6_payload_len - sizeof(icmp6_hdr), -1, peer);
+    }else if(ip6_proto == IPPROTO_TCP){
+      count(shardp, cur_bank, family, id, out ? TCP_OUT : TCP_IN,
+	    ip6_payload_len - sizeof(tcphdr),
+	    ntohs(((tcphdr *)packetp)->source), peer);
+    }else if(ip6_proto == IPPROTO_UDP){
+      count(shardp, cur_bank, family, id, out ? UDP_OUT : UDP_IN,
+	    ip6_payload_len - sizeof(udphdr),
+	    ntohs(((udphdr *)packetp)->source), peer);
     }
 
     return 0;
   }
 
+  /*
+   * Clear the counters.  The forwarding threads are switched to the
+   * other bank, which was cleared by the previous flush(), and the
+   * current bank is cleared after no thread counts to it.
+   */
   void stat::flush(){
+    pthread_mutex_lock(&lock);
+    int old_bank = bank;
+    __atomic_store_n(&bank, old_bank ^ 1, __ATOMIC_RELEASE);
     last_flush.update();
-    std::map<map646_in6_addr, stat_chunk>().swap(stat66);
-    std::map<map646_in_addr, stat_chunk>().swap(stat46);
+
+    qsbr_synchronize();
+
+    for(int i = 0; i < num_shards; i++){
+      stat_shard *shardp = shards[i];
+      for(int f = 0; f < 2; f++){
+	stat_directory *dirp = shardp->dirs[f];
+	if(dirp == NULL){
+	  continue;
+	}
+	for(uint32_t b = 0; b < dirp->num_blocks; b++){
+	  stat_block *blockp = dirp->blocks[b];
+	  if(blockp != NULL){
+	    memset((uint8_t *)blockp + old_bank * STAT_BLOCK_SLOTS * slot_size,
+		   0, STAT_BLOCK_SLOTS * slot_size);
+	  }
+	}
+      }
+    }
+    pthread_mutex_unlock(&lock);
   }
 
-  int stat::safe_write(int fd, std::string msg){
-    int size = msg.size();
-    std::stringstream ss;
-    ss << size;
-    if(write(fd, ss.str().c_str(), ss.str().length()) < 0){
+  /*
+   * Create the shared memory segment to which publish_shm() copies the
+   * counters.  The segment left by a previous process is replaced.
+   */
+  int stat::open_shm(const char *name){
+    assert(shmp == NULL);
+    assert(slot_size != 0);
+    shm_unlink(name);
+    if((shm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0){
+      warn("failed to create the stat shared memory %s", name);
       return -1;
-    }else{
-      char ack[10];
-      memset(ack, 0, 10);
-      read(fd, ack, 10);
-      if(strcmp(ack, "ok") == 0){
-	if(write(fd, msg.c_str(), size) < 0){
-	  return -1;
+    }
+    size_t size = sysconf(_SC_PAGESIZE);
+    void *p;
+    if(ftruncate(shm_fd, size) < 0
+       || (p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    shm_fd, 0)) == MAP_FAILED){
+      warn("failed to map the stat shared memory %s", name);
+      close(shm_fd);
+      shm_unlink(name);
+      return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    shmp = (stat_shm_header *)p;
+    shm_size = size;
+    shm_name = name;
+    memcpy(shmp->magic, STAT_SHM_MAGIC, sizeof(shmp->magic));
+    shmp->version = STAT_SHM_VERSION;
+    shmp->pid = getpid();
+    shmp->header_len = sizeof(stat_shm_header);
+    shmp->entry_len = sizeof(stat_shm_entry) + 6 * counter_size
+      + 4 * top_ports * sizeof(stat_top_port) + STAT_HLL_REGISTERS;
+    shmp->len_buckets = hist_buckets;
+    shmp->hist_bits = hist_bits;
+    shmp->top_ports = top_ports;
+    shmp->hll_registers = STAT_HLL_REGISTERS;
+    shmp->drop_reasons = DROP_REASON_MAX;
+    shmp->size = size;
+    pthread_mutex_unlock(&lock);
+
+    publish_shm();
+    return 0;
+  }
+
+  /*
+   * Copy the counters of the current bank to the shared memory
+   * segment.  The forwarding threads are not involved.
+   */
+  void stat::publish_shm(){
+    pthread_mutex_lock(&lock);
+    if(shmp == NULL){
+      pthread_mutex_unlock(&lock);
+      return;
+    }
+
+    size_t entry_len = shmp->entry_len;
+    size_t need = sizeof(stat_shm_header)
+      + (id_count[STAT_V4] + id_count[STAT_V6]) * entry_len;
+    if(need > shm_size){
+      /* Grow the segment.  The readers see the new size below. */
+      size_t page = sysconf(_SC_PAGESIZE);
+      size_t size = std::max(need, shm_size * 2);
+      size = (size + page - 1) / page * page;
+      void *p;
+      if(ftruncate(shm_fd, size) < 0
+	 || (p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      shm_fd, 0)) == MAP_FAILED){
+	pthread_mutex_unlock(&lock);
+	warn("failed to grow the stat shared memory");
+	return;
+      }
+      munmap(shmp, shm_size);
+      shmp = (stat_shm_header *)p;
+      shm_size = size;
+    }
+
+    uint32_t seq = shmp->seq;
+    __atomic_store_n(&shmp->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    timeval now;
+    gettimeofday(&now, NULL);
+    shmp->size = shm_size;
+    shmp->publish_time = (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+    shmp->last_flush = last_flush.get_timer();
+    for(int r = 0; r < DROP_REASON_MAX; r++){
+      shmp->drop[r] = drop_get_count(r);
+    }
+    memset(shmp->total, 0, sizeof(shmp->total));
+    std::vector<uint32_t> sum_buf(slot_size / sizeof(uint32_t));
+    stat_slot *sump = (stat_slot *)&sum_buf[0];
+    std::vector<stat_top_port> ports;
+    uint8_t *p = (uint8_t *)(shmp + 1);
+    for(int f = 0; f < 2; f++){
+      shmp->num_entries[f] = id_count[f];
+      for(uint32_t id = 0; id < id_count[f]; id++, p += entry_len){
+	stat_shm_entry *entryp = (stat_shm_entry *)p;
+	stat_addr_block *addr_blockp = addr_blocks[f][id / STAT_BLOCK_SLOTS];
+	if(addr_blockp != NULL){
+	  entryp->addr = addr_blockp->addr[id % STAT_BLOCK_SLOTS];
+	}else{
+	  memset(&entryp->addr, 0, sizeof(entryp->addr));
 	}
-      }else{
-	return -1;
+	sum_slot(f, id, sump);
+	memcpy(entryp->counter, sump, 6 * counter_size);
+	for(int i = 0; i < 6; i++){
+	  shmp->total[f][i] += get_counter(sump, i)->num;
+	}
+	stat_top_port *portp
+	  = (stat_top_port *)((uint8_t *)entryp->counter + 6 * counter_size);
+	memset(portp, 0, 4 * top_ports * sizeof(stat_top_port));
+	for(int i = TCP_IN; i < 6; i++, portp += top_ports){
+	  if(get_counter(sump, i)->num == 0){
+	    continue;
+	  }
+	  merge_top_ports(f, id, i, ports);
+	  std::sort(ports.begin(), ports.end(), top_port_more);
+	  std::copy(ports.begin(), ports.end(), portp);
+	}
+	/* The registers of the peers follow the top ports. */
+	memcpy(portp, get_peer_hll(sump), STAT_HLL_REGISTERS);
       }
     }
 
-    return 0;
+    __atomic_store_n(&shmp->seq, seq + 2, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lock);
   }
 
-  int stat::write_stat(int fd){
-    return safe_write(fd, get_json());
+  void stat::unlink_shm(){
+    if(shm_name != NULL){
+      shm_unlink(shm_name);
+    }
+  }
 
+  void stat::show(std::string &buf){
+    pthread_mutex_lock(&lock);
+    get_json(buf);
+    pthread_mutex_unlock(&lock);
   }
 
-  int stat::write_last_flush_time(int fd){
-    return safe_write(fd, last_flush.get_time());
+  void stat::last_flush_time(std::string &buf){
+    pthread_mutex_lock(&lock);
+    buf = last_flush.get_time();
+    pthread_mutex_unlock(&lock);
   }
 
-  int stat::write_info(int fd){
+  void stat::snapshot(std::string &buf){
+    pthread_mutex_lock(&lock);
+    get_snapshot(buf);
+    pthread_mutex_unlock(&lock);
+  }
+
+  void stat::info(std::string &buf){
     std::stringstream ss;
+    pthread_mutex_lock(&lock);
     ss << "lastupdate: " << last_flush.get_time() << std::endl;
-    ss << "stat46_size: " << stat46.size() << std::endl;
-
-    std::map<map646_in_addr, stat_chunk>::iterator it = stat46.begin();
-    while(it != stat46.end()){
-      ss << "service addr: " << it->first.get_addr() << ", num: " << it->second.total_num() << std::endl;
-      it++;
+    std::vector<uint32_t> sum_buf(slot_size / sizeof(uint32_t));
+    stat_slot *sump = (stat_slot *)&sum_buf[0];
+    std::vector<uint32_t> len(hist_buckets);
+    for(int f = 0; f < 2; f++){
+      std::stringstream addrs;
+      int size = 0;
+      for(uint32_t id = 0; id < id_count[f]; id++){
+	if(!sum_slot(f, id, sump)){
+	  continue;
+	}
+	int num = 0;
+	std::fill(len.begin(), len.end(), 0);
+	for(int i = 0; i < 6; i++){
+	  stat_counter *counterp = get_counter(sump, i);
+	  num += counterp->num;
+	  for(int b = 0; b < hist_buckets; b++){
+	    len[b] += counterp->len[b];
+	  }
+	}
+	/* The percentiles of the lengths of all the protocols. */
+	addrs << "service addr: " << get_addr(f, id) << ", num: " << num
+	      << ", len p50: " << stat_hist_percentile(&len[0], hist_bits, 0.5)
+	      << ", p90: " << stat_hist_percentile(&len[0], hist_bits, 0.9)
+	      << ", p99: " << stat_hist_percentile(&len[0], hist_bits, 0.99)
+	      << ", peers: " << stat_hll_estimate(get_peer_hll(sump))
+	      << std::endl;
+	size++;
+      }
+      ss << (f == STAT_V4 ? "stat46_size: " : "stat66_size: ") << size << std::endl;
+      ss << addrs.str();
     }
+    pthread_mutex_unlock(&lock);
 
-    ss << "stat66_size: " << stat66.size() << std::endl;
-    std::map<map646_in6_addr, stat_chunk>::iterator it6 = stat66.begin();
-    while(it6 != stat66.end()){
-      ss << "service addr: " << it6->first.get_addr() << ", num: " << it->second.total_num() << std::endl;
-      it6++;
-    }
+    buf = ss.str();
+  }
 
-    return safe_write(fd, ss.str());
+  /* Called with the lock held. */
+  void stat::get_json(std::string &buf){
+    json_writer jw(buf);
+    jw.begin_object();
+    add_json(jw, STAT_V4);
+    add_json(jw, STAT_V6);
+    jw.end_object();
   }
 
-  std::string stat::get_json(){
-    json_object *jobj = json_object_new_object();
+  void stat::add_json(json_writer &jw, int family){
+    jw.key(family == STAT_V4 ? "v4" : "v6");
+    bool empty = true;
+    std::vector<uint32_t> sum_buf(slot_size / sizeof(uint32_t));
+    stat_slot *sump = (stat_slot *)&sum_buf[0];
+    std::vector<stat_top_port> ports;
 
-    if(stat46.empty())
-      json_object_object_add(jobj, "v4", NULL);
-    else{
-      std::map<map646_in_addr, stat_chunk>::iterator it = stat46.begin();
-      json_object *v4 = json_object_new_object();
+    for(uint32_t id = 0; id < id_count[family]; id++){
+      if(!sum_slot(family, id, sump)){
+	continue;
+      }
+      if(empty){
+	jw.begin_object();
+	empty = false;
+      }
+      jw.key(get_addr(family, id).c_str());
+      jw.begin_object();
 
-      while(it != stat46.end()){
-	json_object *chunk = json_object_new_object();
-	for(int i = 0; i < 6; i++){
-	  json_object *element = json_object_new_object();
-
-	  int num = it->second.stat_element[i].num;
-	  if(num == 0){
-	    json_object_object_add(chunk, get_proto(i).c_str(), NULL);
-	  }else{
-	    /* add num stat */
-	    json_object *jnum = json_object_new_int(num);
-	    json_object_object_add(element, "num", jnum);
-
-	    /* add len stat */
-
-	    if(it->second.stat_element[i].len.empty()){
-	      json_object_object_add(element, "len", NULL);
-	    }else{
-	      std::map<int, int>::iterator len_it = it->second.stat_element[i].len.begin();
-	      json_object *len = json_object_new_object();
-	      while(len_it != it->second.stat_element[i].len.end()){
-		std::stringstream ss;
-		ss << len_it->first;
-		std::string s = ss.str();
-		json_object_object_add(len,s.c_str(), json_object_new_int(len_it->second));
-		len_it++;
-	      }
-	      json_object_object_add(element, "len", len);
-	    }
-
-
-	    /* add port stat */
-	    if(it->second.stat_element[i].port_stat.empty()){
-	      json_object_object_add(element, "port", NULL);
-	    }else{
-	      std::map<int, int>::iterator port_it = it->second.stat_element[i].port_stat.begin();
-	      json_object *port = json_object_new_object();
-	      while(port_it != it->second.stat_element[i].port_stat.end()){
-		std::stringstream ss;
-		ss << port_it->first;
-		std::string s = ss.str();
-		json_object_object_add(port,s.c_str(), json_object_new_int(port_it->second));
-		port_it++;
-	      }
-	      json_object_object_add(element, "port", port);
-	    }
-
-	    /* add three stats above to chunk */
-	    json_object_object_add(chunk, get_proto(i).c_str(), element);
+      for(int i = 0; i < 6; i++){
+	stat_counter *counterp = get_counter(sump, i);
+
+	jw.key(get_proto(i).c_str());
+	if(counterp->num == 0){
+	  jw.value_null();
+	  continue;
+	}
+	jw.begin_object();
+
+	/* add num stat */
+	jw.key("num");
+	jw.value_uint(counterp->num);
+
+	/* add len stat, keyed by the smallest length of each bucket */
+	jw.key("len");
+	bool len_empty = true;
+	for(int b = 0; b < hist_buckets; b++){
+	  if(counterp->len[b] == 0){
+	    continue;
+	  }
+	  if(len_empty){
+	    jw.begin_object();
+	    len_empty = false;
+	  }
+	  char bucket[16];
+	  snprintf(bucket, sizeof(bucket), "%u", stat_hist_lower(b, hist_bits));
+	  jw.key(bucket);
+	  jw.value_uint(counterp->len[b]);
+	}
+	if(len_empty){
+	  jw.value_null();
+	}else{
+	  jw.end_object();
+	}
+
+	/* add port stat, the counts and the errors of the top ports */
+	jw.key("port");
+	if(i < TCP_IN){
+	  jw.value_null();
+	  jw.key("port_error");
+	  jw.value_null();
+	  jw.end_object();
+	  continue;
+	}
+	merge_top_ports(family, id, i, ports);
+	jw.begin_object();
+	for(size_t p = 0; p < ports.size(); p++){
+	  char port[8];
+	  snprintf(port, sizeof(port), "%u", (unsigned)ports[p].port);
+	  jw.key(port);
+	  jw.value_uint(ports[p].count);
+	}
+	jw.end_object();
+	jw.key("port_error");
+	bool error_empty = true;
+	for(size_t p = 0; p < ports.size(); p++){
+	  if(ports[p].error == 0){
+	    continue;
 	  }
+	  if(error_empty){
+	    jw.begin_object();
+	    error_empty = false;
+	  }
+	  char port[8];
+	  snprintf(port, sizeof(port), "%u", (unsigned)ports[p].port);
+	  jw.key(port);
+	  jw.value_uint(ports[p].error);
+	}
+	if(error_empty){
+	  jw.value_null();
+	}else{
+	  jw.end_object();
 	}
-	json_object_object_add(v4, (it->first.get_addr()).c_str(), chunk);
-	it++;
+
+	jw.end_object();
       }
 
-      json_object_object_add(jobj, "v4", v4);
+      /* add the estimated number of the peers */
+      jw.key("peers");
+      jw.value_uint(stat_hll_estimate(get_peer_hll(sump)));
+
+      jw.end_object();
     }
 
-    if(stat66.empty())
-      json_object_object_add(jobj, "v6", NULL);
-    else{
-      std::map<map646_in6_addr, stat_chunk>::iterator it6 = stat66.begin();
-      json_object *v6 = json_object_new_object();
+    if(empty){
+      jw.value_null();
+    }else{
+      jw.end_object();
+    }
+  }
 
-      while(it6 != stat66.end()){
-	json_object *chunk = json_object_new_object();
-	for(int i = 0; i < 6; i++){
-	  json_object *element = json_object_new_object();
-
-	  int num = it6->second.stat_element[i].num;
-
-	  if(num == 0){
-	    json_object_object_add(chunk, get_proto(i).c_str(), NULL);
-	  }else{
-	    /* add num stat */
-	    json_object *jnum = json_object_new_int(num);
-	    json_object_object_add(element, "num", jnum);
-
-	    /* add len stat */
-	    if(it6->second.stat_element[i].len.empty()){
-	      json_object_object_add(element, "len", NULL);
-	    }else{
-	      std::map<int, int>::iterator len_it = it6->second.stat_element[i].len.begin();
-	      json_object *len = json_object_new_object();
-	      while(len_it != it6->second.stat_element[i].len.end()){
-		std::stringstream ss;
-		ss << len_it->first;
-		std::string s = ss.str();
-		json_object_object_add(len,s.c_str(), json_object_new_int(len_it->second));
-		len_it++;
-	      }
-	      json_object_object_add(element, "len", len);
-	    }
-
-
-	    /* add port stat */
-	    if(it6->second.stat_element[i].port_stat.empty()){
-	      json_object_object_add(element, "port", NULL);
-	    }else{
-	      std::map<int, int>::iterator port_it = it6->second.stat_element[i].port_stat.begin();
-	      json_object *port = json_object_new_object();
-	      while(port_it != it6->second.stat_element[i].port_stat.end()){
-		std::stringstream ss;
-		ss << port_it->first;
-		std::string s = ss.str();
-		json_object_object_add(port,s.c_str(), json_object_new_int(port_it->second));
-		port_it++;
-	      }
-	      json_object_object_add(element, "port", port);
-	    }
-
-	    /* add three stat above to chunk */
-	    json_object_object_add(chunk, get_proto(i).c_str(), element);
+  /* Append v in n bytes in the network byte order. */
+  static void snap_put(std::string &buf, uint64_t v, int n){
+    while(n-- > 0){
+      buf += (char)(v >> (n * 8));
+    }
+  }
+
+  static void snap_put_varint(std::string &buf, uint64_t v){
+    while(v >= 0x80){
+      buf += (char)(v | 0x80);
+      v >>= 7;
+    }
+    buf += (char)v;
+  }
+
+  /* Called with the lock held.  See stat.h for the format. */
+  void stat::get_snapshot(std::string &buf){
+    buf.append(STAT_SNAP_MAGIC, 4);
+    snap_put(buf, STAT_SNAP_VERSION, 1);
+    snap_put(buf, hist_bits, 1);
+    snap_put(buf, hist_buckets, 2);
+    snap_put(buf, 0, 4);	/* The length is filled below. */
+    snap_put(buf, last_flush.get_timer(), 8);
+    add_snapshot(buf, STAT_V4);
+    add_snapshot(buf, STAT_V6);
+
+    for(int i = 0; i < 4; i++){
+      buf[8 + i] = (char)(buf.size() >> ((3 - i) * 8));
+    }
+  }
+
+  void stat::add_snapshot(std::string &buf, int family){
+    size_t num_pos = buf.size();
+    uint32_t num_addrs = 0;
+    snap_put(buf, 0, 4);	/* The number is filled below. */
+    std::vector<uint32_t> sum_buf(slot_size / sizeof(uint32_t));
+    stat_slot *sump = (stat_slot *)&sum_buf[0];
+    std::vector<stat_top_port> ports;
+
+    for(uint32_t id = 0; id < id_count[family]; id++){
+      if(!sum_slot(family, id, sump)){
+	continue;
+      }
+      num_addrs++;
+      buf.append((const char *)&addr_blocks[family][id / STAT_BLOCK_SLOTS]
+		 ->addr[id % STAT_BLOCK_SLOTS],
+		 family == STAT_V4 ? sizeof(in_addr) : sizeof(in6_addr));
+      uint8_t bitmap = 0;
+      for(int i = 0; i < 6; i++){
+	if(get_counter(sump, i)->num != 0){
+	  bitmap |= 1 << i;
+	}
+      }
+      snap_put(buf, bitmap, 1);
+
+      const uint8_t *hllp = get_peer_hll(sump);
+      int num_registers = 0;
+      for(int r = 0; r < STAT_HLL_REGISTERS; r++){
+	if(hllp[r] != 0){
+	  num_registers++;
+	}
+      }
+      snap_put_varint(buf, num_registers);
+      int prev_register = 0;
+      for(int r = 0; r < STAT_HLL_REGISTERS; r++){
+	if(hllp[r] == 0){
+	  continue;
+	}
+	snap_put_varint(buf, r - prev_register);
+	snap_put(buf, hllp[r], 1);
+	prev_register = r;
+      }
+
+      for(int i = 0; i < 6; i++){
+	stat_counter *counterp = get_counter(sump, i);
+	if(counterp->num == 0){
+	  continue;
+	}
+	snap_put(buf, counterp->num, 4);
+
+	int num_buckets = 0;
+	for(int b = 0; b < hist_buckets; b++){
+	  if(counterp->len[b] != 0){
+	    num_buckets++;
 	  }
 	}
-	json_object_object_add(v6, (it6->first.get_addr()).c_str(), chunk);
-	it6++;
+	snap_put_varint(buf, num_buckets);
+	int prev = 0;
+	for(int b = 0; b < hist_buckets; b++){
+	  if(counterp->len[b] == 0){
+	    continue;
+	  }
+	  snap_put_varint(buf, b - prev);
+	  snap_put_varint(buf, counterp->len[b]);
+	  prev = b;
+	}
+
+	ports.clear();
+	if(i >= TCP_IN){
+	  merge_top_ports(family, id, i, ports);
+	}
+	snap_put_varint(buf, ports.size());
+	prev = 0;
+	for(size_t p = 0; p < ports.size(); p++){
+	  snap_put_varint(buf, ports[p].port - prev);
+	  snap_put_varint(buf, ports[p].count);
+	  snap_put_varint(buf, ports[p].error);
+	  prev = ports[p].port;
+	}
       }
+    }
 
-      json_object_object_add(jobj, "v6", v6);
+    for(int i = 0; i < 4; i++){
+      buf[num_pos + i] = (char)(num_addrs >> ((3 - i) * 8));
     }
+  }
 
-    return json_object_to_json_string(jobj);
+  json_writer::json_writer(std::string &b) : buf(b), need_comma(false){
   }
 
-  int stat::get_hist(int len){
-    int ret = len / 150;
-    if(ret > 10)
-      ret = 10;
-    return ret;
+  void json_writer::begin_object(){
+    if(need_comma){
+      buf += ',';
+    }
+    buf += '{';
+    need_comma = false;
+  }
+
+  void json_writer::end_object(){
+    buf += '}';
+    need_comma = true;
+  }
+
+  void json_writer::key(const char *k){
+    if(need_comma){
+      buf += ',';
+    }
+    buf += '"';
+    buf += k;
+    buf += "\":";
+    need_comma = false;
+  }
+
+  void json_writer::value_null(){
+    buf += "null";
+    need_comma = true;
+  }
+
+  void json_writer::value_uint(uint64_t v){
+    char digits[20];
+    int n = 0;
+    do{
+      digits[n++] = '0' + v % 10;
+      v /= 10;
+    }while(v != 0);
+    while(n > 0){
+      buf += digits[--n];
+    }
+    need_comma = true;
+  }
+
+  /*
+   * The smallest length such that the fraction q of the lengths
+   * counted in the histogram are not larger than it, rounded up to the
+   * largest length of its bucket.  Returns 0 if nothing is counted.
+   */
+  uint32_t stat_hist_percentile(const uint32_t *len, int bits, double q){
+    int buckets = stat_hist_buckets(bits);
+    uint64_t total = 0;
+    for(int b = 0; b < buckets; b++){
+      total += len[b];
+    }
+    if(total == 0){
+      return 0;
+    }
+    uint64_t rank = (uint64_t)(q * total);
+    if(rank < q * total){
+      rank++;
+    }
+    if(rank < 1){
+      rank = 1;
+    }
+    uint64_t n = 0;
+    for(int b = 0; b < buckets - 1; b++){
+      n += len[b];
+      if(n >= rank){
+	return stat_hist_lower(b + 1, bits) - 1;
+      }
+    }
+    return STAT_HIST_LEN_MAX;
+  }
+
+  /*
+   * Estimate the number of the distinct peers from the registers.  The
+   * small numbers are estimated by the linear counting of the empty
+   * registers.
+   */
+  uint64_t stat_hll_estimate(const uint8_t *registers){
+    double m = STAT_HLL_REGISTERS;
+    double sum = 0;
+    int zeros = 0;
+    for(int i = 0; i < STAT_HLL_REGISTERS; i++){
+      sum += ldexp(1.0, -registers[i]);
+      if(registers[i] == 0){
+	zeros++;
+      }
+    }
+    double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if(e <= 2.5 * m && zeros != 0){
+      e = m * log(m / zeros);
+    }
+    return (uint64_t)(e + 0.5);
   }
 
   std::string get_proto(int proto){
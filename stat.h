@@ -25,13 +25,43 @@
 
 
 #define STAT_SOCK "/tmp/map646_stat"
+#define STAT_SHM_NAME "/map646_stat"
 #include <map>
+#include <vector>
 #include <sstream>
 #include <sys/time.h>
+#include <pthread.h>
+
+#include "mapping.h"
+#include "drop.h"
+
+struct mapping_match;
+
 namespace map646_stat{
 
   int statif_alloc();
 
+  /*
+   * The distinct peers of a mapped address, the IPv4 nodes of a
+   * map-static address or the global IPv6 nodes of a map66-static
+   * address, are estimated with a HyperLogLog of STAT_HLL_REGISTERS
+   * registers.  The standard error is 1.04 / sqrt(STAT_HLL_REGISTERS).
+   * The registers of the shards, or of the periods separated by
+   * flush(), are merged by taking the larger value of each register.
+   */
+#define STAT_HLL_BITS 8
+#define STAT_HLL_REGISTERS (1 << STAT_HLL_BITS)
+
+  static inline void stat_hll_merge(uint8_t *registers, const uint8_t *src){
+    for(int i = 0; i < STAT_HLL_REGISTERS; i++){
+      if(src[i] > registers[i]){
+	registers[i] = src[i];
+      }
+    }
+  }
+
+  uint64_t stat_hll_estimate(const uint8_t *registers);
+
   struct stat_chunk{
 
 #define ICMP_IN  0
@@ -46,7 +76,10 @@ namespace map646_stat{
       int error;
       std::map<int, int> len;
       std::map<int, int> port_stat;
+      std::map<int, int> port_error;
     }stat_element[6];
+    /* The HyperLogLog registers of the peers, empty if not known. */
+    std::vector<uint8_t> peer_hll;
 
     int total_num(){
       int total_num = 0;
@@ -56,6 +89,13 @@ namespace map646_stat{
       return total_num;
     }
 
+    uint64_t total_peers(){
+      if(peer_hll.empty()){
+	return 0;
+      }
+      return stat_hll_estimate(&peer_hll[0]);
+    }
+
   };
 
   struct map646_in_addr{
@@ -134,6 +174,9 @@ namespace map646_stat{
       time(&timer);
       t_st = localtime(&timer);
     }
+    time_t get_timer()const{
+      return timer;
+    }
     std::string get_time()const{
       std::stringstream ss;
       int mon, day, hour, min;
@@ -161,24 +204,298 @@ namespace map646_stat{
     tm *t_st;
   };
 
+  /*
+   * The packet lengths are counted in a log-linear histogram.  Each
+   * length below 2^(bits + 1) has its own bucket, and each range of
+   * the powers of 2 above is divided into 2^bits buckets, so a bucket
+   * covers less than 1/2^bits of its lengths.  bits is given by the
+   * stat-histogram-bits directive of the configuration file.
+   */
+#define STAT_HIST_BITS_DEFAULT 3
+#define STAT_HIST_BITS_MAX MAPPING_STAT_HIST_BITS_MAX
+#define STAT_HIST_LEN_MAX 65535
+
+  /* The number of the buckets to count 0 to STAT_HIST_LEN_MAX. */
+  static inline int stat_hist_buckets(int bits){
+    return (17 - bits) << bits;
+  }
+
+  static inline int stat_hist_index(uint32_t len, int bits){
+    if(len < (2U << bits)){
+      return len;
+    }
+    int shift = 31 - __builtin_clz(len) - bits;
+    return ((shift + 1) << bits) + (len >> shift) - (1 << bits);
+  }
+
+  /* The smallest length counted in the bucket. */
+  static inline uint32_t stat_hist_lower(int index, int bits){
+    int range = index >> bits;
+    if(range <= 1){
+      return index;
+    }
+    return ((1U << bits) + (index & ((1 << bits) - 1))) << (range - 1);
+  }
+
+  uint32_t stat_hist_percentile(const uint32_t *len, int bits, double q);
+
+  /*
+   * The counters of a protocol and a direction of a mapped address.
+   * The size of len[] is fixed at initialize() by the histogram bits.
+   */
+#define STAT_CACHE_LINE 64
+  struct stat_counter{
+    uint32_t num;
+    uint32_t error;
+    uint32_t len[];
+  };
+
+  /*
+   * The counters of a mapped address, the stat_counters of ICMP_IN to
+   * UDP_OUT in a row, followed by the stat_top_ports of TCP_IN to
+   * UDP_OUT and the HyperLogLog registers of the peers, so the size of
+   * a slot does not depend on the traffic.  A
+   * slot is aligned to the cache lines, so that the slots of
+   * different addresses never share a line.
+   */
+  struct stat_slot;
+
+  /*
+   * The slots of the addresses are found by the stat_id of the
+   * mapping entries (see mapping.h), in blocks of STAT_BLOCK_SLOTS
+   * slots.  A block holds the slots of both of the banks (see
+   * stat_shard), and is never moved once allocated.
+   */
+#define STAT_V4 0		/* the map-static IPv4 addresses */
+#define STAT_V6 1		/* the map66-static global addresses */
+#define STAT_BANKS 2
+#define STAT_BLOCK_SLOTS 256
+#define STAT_DIR_INITIAL_BLOCKS 16
+  struct stat_block;
+
+  /*
+   * The blocks of a family in a shard, indexed by the ID /
+   * STAT_BLOCK_SLOTS.  The directory grows with the IDs: it is
+   * replaced by a copy twice as large when an ID beyond it gets a
+   * block, and the old one is freed after every forwarding thread
+   * passes a quiescent state.
+   */
+  struct stat_directory{
+    uint32_t num_blocks;
+    stat_block *blocks[];
+  };
+
+  /* The addresses of the IDs registered by register_id(). */
+  struct stat_addr_block{
+    in6_addr addr[STAT_BLOCK_SLOTS]; /* An IPv4 address uses 4 bytes. */
+  };
+
+  /*
+   * The source ports of a TCP or UDP counter are tracked with the
+   * Space-Saving algorithm in a fixed number of entries, given by the
+   * stat-top-ports directive of the configuration file.  A port not
+   * in the entries replaces the entry of the smallest count when no
+   * entry is unused, and takes over the count as its error.  count is
+   * never smaller than the number of the packets of the port, and
+   * count - error is never larger, so every port counted more than
+   * 1/entries of the packets is in the entries.
+   */
+#define STAT_TOP_PORTS_DEFAULT 16
+#define STAT_TOP_PORTS_MAX MAPPING_STAT_TOP_PORTS_MAX
+  struct stat_top_port{
+    uint32_t count;		/* 0 means an unused entry. */
+    uint32_t error;
+    uint16_t port;
+  };
+
+  /*
+   * The counters of a forwarding thread.  Only the owner thread
+   * writes to them, so update() needs neither a lock nor an atomic
+   * read-modify-write operation.  The readers sum the counters of all
+   * the shards.
+   *
+   * The counters are kept in two banks.  The forwarding threads count
+   * to the current bank, and flush() switches the current bank, waits
+   * until every forwarding thread passes a quiescent state (see
+   * qsbr.h), and then clears the previous bank.  The forwarding never
+   * stops, and each packet is counted in exactly one of the periods
+   * separated by flush().
+   *
+   * The blocks are allocated only while the stat is enabled, by
+   * enable() for the IDs registered so far and by register_id() for
+   * the first ID in a new block, so that update() never allocates
+   * memory.  disable() frees them.
+   */
+  struct stat_shard{
+    stat_directory *dirs[2];	/* NULL until the first block. */
+  };
+
+  /*
+   * A streaming JSON writer.  The objects are appended to the buffer
+   * as they are given, without building a tree of them.  The keys
+   * are written as they are, and must not need escaping.
+   */
+  class json_writer{
+  public:
+    json_writer(std::string &buf);
+    void begin_object();
+    void end_object();
+    void key(const char *k);
+    void value_null();
+    void value_uint(uint64_t v);
+  private:
+    std::string &buf;
+    bool need_comma;
+  };
+
+  /*
+   * The binary snapshot sent by the "snapshot" command, an alternative
+   * of the JSON of the "show" command.  The multi-byte fields are in
+   * the network byte order, and a varint is an unsigned LEB128
+   * integer.
+   *
+   *   header (STAT_SNAP_HDR_LEN bytes):
+   *     magic STAT_SNAP_MAGIC (4), version STAT_SNAP_VERSION (1),
+   *     histogram bits (1), number of the length buckets (2),
+   *     length of the whole snapshot (4),
+   *     last flush time in seconds since the epoch (8)
+   *   then the STAT_V4 and the STAT_V6 sections:
+   *     number of the addresses (4)
+   *     for each address:
+   *       address (4 or 16), bitmap of the counters below (1)
+   *       number of the non-zero peer registers (varint), and
+   *       for each: register index delta (varint), value (1)
+   *       for each counter in the bitmap, from ICMP_IN to UDP_OUT:
+   *         num (4)
+   *         number of the non-zero length buckets (varint), and
+   *         for each: bucket index delta (varint), count (varint)
+   *         number of the ports (varint), and
+   *         for each: port delta (varint), count (varint),
+   *         error (varint)
+   *
+   * The deltas are from the previous index or port of the counter,
+   * or from 0 for the first one.  The bucket indexes are those of
+   * stat_hist_index() with the histogram bits.  The ports are the top
+   * ports of the counter, whose counts are the upper bounds and the
+   * errors are the differences from the lower bounds (see
+   * stat_top_port).
+   */
+#define STAT_SNAP_MAGIC "M646"
+#define STAT_SNAP_VERSION 4
+#define STAT_SNAP_HDR_LEN 20
+
+  /*
+   * The shared memory segment STAT_SHM_NAME (shm_open(3)), to which
+   * publish_shm() copies the counters periodically.  The readers map
+   * the segment, and sample the counters without asking map646.
+   *
+   * The segment is a stat_shm_header followed by the num_entries[STAT_V4]
+   * entries of the map-static addresses and the num_entries[STAT_V6]
+   * entries of the map66-static addresses, in the native byte order.
+   * The entries of all the registered addresses are included, even if
+   * no packet is counted.  An entry is entry_len bytes long, and its
+   * counters have len_buckets buckets of the histogram bits
+   * hist_bits.  The counters are followed by the top_ports
+   * stat_top_ports of each of TCP_IN to UDP_OUT, in the descending
+   * order of the counts, and the hll_registers registers of the peers.
+   *
+   * The header also carries the counts of the dropped packets since
+   * the startup by reason (see drop.h), drop_reasons of them.  They are
+   * not cleared by flush().
+   *
+   * The segment is protected by a sequence lock.  seq is odd while
+   * the segment is written, so a reader copies what it needs between
+   * two loads of an even seq, and retries if seq has changed.  The
+   * segment only grows; a reader must map it again if size is larger
+   * than its mapping.
+   */
+#define STAT_SHM_MAGIC "M6SM"
+#define STAT_SHM_VERSION 5
+  struct stat_shm_header{
+    char magic[4];
+    uint32_t version;
+    uint32_t seq;
+    uint32_t pid;		/* The process ID of map646. */
+    uint32_t header_len;	/* sizeof(stat_shm_header) */
+    uint32_t entry_len;
+    uint32_t len_buckets;
+    uint32_t hist_bits;
+    uint64_t size;		/* The size of the segment. */
+    uint64_t publish_time;	/* In milliseconds since the epoch. */
+    uint64_t last_flush;	/* In seconds since the epoch. */
+    uint64_t num_entries[2];
+    uint32_t top_ports;
+    uint32_t hll_registers;
+    uint64_t total[2][6];	/* The sums of num of all the entries. */
+    uint32_t drop_reasons;	/* DROP_REASON_MAX */
+    uint32_t reserved;
+    uint64_t drop[DROP_REASON_MAX]; /* drop_get_count() of each reason. */
+  };
+
+  struct stat_shm_entry{
+    in6_addr addr;		/* An IPv4 address uses 4 bytes. */
+    uint32_t counter[];		/* The 6 stat_counters in a row. */
+  };
+
   class stat{
   public:
-    int update(const uint8_t *bufp, ssize_t len, uint8_t d);
+    stat();
+    ~stat();
+    int initialize(int num_shards, int hist_bits, int top_ports);
+    int update(int shard, const uint8_t *bufp, ssize_t len, uint8_t d,
+	       const struct mapping_match *matchp);
+    void register_id(int af, uint32_t id, const void *addrp);
+    int enable();
+    void disable();
     void flush();
-    int write_stat(int fd);
-    int write_info(int fd);
-    int write_last_flush_time(int fd);
-    /*
-     *  int safe_write(int fd, std::string msg)
-     *  communicate with stat_client and send the msg size before send the msg itself 
-     */
-    int safe_write(int fd, std::string msg);
+    /* The replies of the stat commands (see statctl.h). */
+    void show(std::string &buf);
+    void snapshot(std::string &buf);
+    void info(std::string &buf);
+    void last_flush_time(std::string &buf);
+    int open_shm(const char *name);
+    void publish_shm();
+    void unlink_shm();
   private:
-    std::string get_json();
-    int get_hist(int len);
-    std::map<map646_in6_addr, stat_chunk> stat66;
-    std::map<map646_in_addr, stat_chunk> stat46;
+    void get_json(std::string &buf);
+    void add_json(json_writer &jw, int family);
+    void get_snapshot(std::string &buf);
+    void add_snapshot(std::string &buf, int family);
+    stat_counter *get_counter(stat_slot *slotp, int index);
+    stat_top_port *get_top_ports(stat_slot *slotp, int index);
+    uint8_t *get_peer_hll(stat_slot *slotp);
+    void merge_top_ports(int family, uint32_t id, int index,
+			 std::vector<stat_top_port> &ports);
+    stat_slot *get_slot(stat_shard *shardp, int cur_bank, int family,
+			uint32_t id);
+    int grow_directories(int family, uint32_t num_blocks);
+    int alloc_blocks(int family, uint32_t b);
+    void free_blocks();
+    bool sum_slot(int family, uint32_t id, stat_slot *sump);
+    std::string get_addr(int family, uint32_t id);
+    void count(stat_shard *shardp, int cur_bank, int family, uint32_t id,
+	       int index, int len, int port, uint64_t peer);
+    std::vector<stat_addr_block *> addr_blocks[2];
+    uint32_t id_count[2];
+    stat_shard **shards;
+    int num_shards;
+    bool enabled;		/* The blocks are allocated. */
+    int bank;			/* The current bank. */
+    int hist_bits;
+    int hist_buckets;
+    size_t counter_size;
+    int top_ports;		/* The entries of a stat_top_port array. */
+    size_t slot_size;		/* A multiple of STAT_CACHE_LINE. */
     map646_time last_flush;
+    stat_shm_header *shmp;	/* The mapped segment, or NULL. */
+    size_t shm_size;
+    int shm_fd;
+    const char *shm_name;
+    /*
+     * Serializes the readers, flush(), register_id(), enable() and
+     * disable().  The forwarding threads never take this lock.
+     */
+    pthread_mutex_t lock;
   };
 
   std::string get_proto(int proto);
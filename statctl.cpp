@@ -0,0 +1,305 @@
+/*
+ * Copyright 2010, 2011, 2012
+ *   IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include <map>
+#include <string>
+
+#include "statctl.h"
+
+#define STATCTL_COMMAND_SIZE 10
+#define STATCTL_MAX_CLIENTS 256
+#define STATCTL_MAX_EVENTS 16
+/* A client is closed if it does nothing for this seconds. */
+#define STATCTL_TIMEOUT 10
+
+enum statctl_state {
+  STATCTL_READ_COMMAND,
+  STATCTL_WRITE_SIZE,
+  STATCTL_READ_ACK,
+  STATCTL_WRITE_REPLY
+};
+
+struct statctl_client {
+  int fd;
+  enum statctl_state state;
+  std::string ack;
+  std::string size;
+  std::string reply;
+  size_t written;
+  time_t last_active;
+};
+
+static int statctl_listen_fd = -1;
+static int statctl_epfd = -1;
+static statctl_handler_t statctl_handler;
+static pthread_t statctl_thread;
+static std::map<int, struct statctl_client *> statctl_clients;
+
+static void *statctl_main(void *);
+static void statctl_accept(void);
+static int statctl_client_io(struct statctl_client *);
+static int statctl_wait(struct statctl_client *, uint32_t);
+static void statctl_close(struct statctl_client *);
+
+/*
+ * Start the control thread serving the stat clients connecting to
+ * the listening socket.
+ */
+int
+statctl_start(int listen_fd, statctl_handler_t handler)
+{
+  assert(handler != NULL);
+
+  int flags = fcntl(listen_fd, F_GETFL);
+  if (flags == -1 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    warn("failed to make the stat socket non-blocking");
+    return (-1);
+  }
+  if ((statctl_epfd = epoll_create(STATCTL_MAX_EVENTS)) == -1) {
+    warn("epoll_create() failed for the stat socket");
+    return (-1);
+  }
+  struct epoll_event epev;
+  memset(&epev, 0, sizeof(epev));
+  epev.data.fd = listen_fd;
+  epev.events = EPOLLIN;
+  if (epoll_ctl(statctl_epfd, EPOLL_CTL_ADD, listen_fd, &epev) == -1) {
+    warn("epoll_ctl() failed for the stat socket");
+    close(statctl_epfd);
+    return (-1);
+  }
+  statctl_listen_fd = listen_fd;
+  statctl_handler = handler;
+
+  if (pthread_create(&statctl_thread, NULL, statctl_main, NULL) != 0) {
+    warnx("failed to create the stat control thread.");
+    return (-1);
+  }
+
+  return (0);
+}
+
+static void *
+statctl_main(void *arg)
+{
+  while (1) {
+    struct epoll_event events[STATCTL_MAX_EVENTS];
+    int res = epoll_wait(statctl_epfd, events, STATCTL_MAX_EVENTS, 1000);
+    if (res == -1) {
+      if (errno == EINTR) {
+	continue;
+      }
+      err(EXIT_FAILURE, "epoll_wait() failed for the stat socket");
+    }
+
+    for (int i = 0; i < res; i++) {
+      int fd = events[i].data.fd;
+      if (fd == statctl_listen_fd) {
+	statctl_accept();
+	continue;
+      }
+      std::map<int, struct statctl_client *>::iterator it
+	= statctl_clients.find(fd);
+      if (it == statctl_clients.end()) {
+	continue;
+      }
+      struct statctl_client *clientp = it->second;
+      clientp->last_active = time(NULL);
+      if (statctl_client_io(clientp) == -1) {
+	statctl_close(clientp);
+      }
+    }
+
+    /* Close the idle clients. */
+    time_t now = time(NULL);
+    std::map<int, struct statctl_client *>::iterator it
+      = statctl_clients.begin();
+    while (it != statctl_clients.end()) {
+      struct statctl_client *clientp = (it++)->second;
+      if (now - clientp->last_active > STATCTL_TIMEOUT) {
+	statctl_close(clientp);
+      }
+    }
+  }
+
+  return (NULL);
+}
+
+static void
+statctl_accept(void)
+{
+  while (1) {
+    int fd = accept(statctl_listen_fd, NULL, NULL);
+    if (fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+	warn("failed to accept stat client");
+      }
+      return;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (statctl_clients.size() >= STATCTL_MAX_CLIENTS
+	|| flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+      close(fd);
+      continue;
+    }
+
+    struct statctl_client *clientp = new statctl_client;
+    clientp->fd = fd;
+    clientp->state = STATCTL_READ_COMMAND;
+    clientp->written = 0;
+    clientp->last_active = time(NULL);
+    struct epoll_event epev;
+    memset(&epev, 0, sizeof(epev));
+    epev.data.fd = fd;
+    epev.events = EPOLLIN;
+    if (epoll_ctl(statctl_epfd, EPOLL_CTL_ADD, fd, &epev) == -1) {
+      warn("epoll_ctl() failed for a stat client");
+      close(fd);
+      delete clientp;
+      continue;
+    }
+    statctl_clients[fd] = clientp;
+  }
+}
+
+/*
+ * Advance the exchange with a client as far as the socket allows.
+ * Returns -1 when the client should be closed.
+ */
+static int
+statctl_client_io(struct statctl_client *clientp)
+{
+  while (1) {
+    switch (clientp->state) {
+    case STATCTL_READ_COMMAND: {
+      /* A command is sent in one write, with or without a NUL. */
+      char command[STATCTL_COMMAND_SIZE + 1];
+      ssize_t n = read(clientp->fd, command, STATCTL_COMMAND_SIZE);
+      if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	return (0);
+      }
+      if (n <= 0) {
+	return (-1);
+      }
+      command[n] = '\0';
+      command[strcspn(command, "\r\n")] = '\0';
+      statctl_handler(command, clientp->reply);
+
+      char size[32];
+      snprintf(size, sizeof(size), "%zu", clientp->reply.size());
+      clientp->size = size;
+      clientp->written = 0;
+      clientp->state = STATCTL_WRITE_SIZE;
+      break;
+    }
+
+    case STATCTL_WRITE_SIZE:
+    case STATCTL_WRITE_REPLY: {
+      const std::string &out = (clientp->state == STATCTL_WRITE_SIZE)
+	? clientp->size : clientp->reply;
+      while (clientp->written < out.size()) {
+	ssize_t n = send(clientp->fd, out.data() + clientp->written,
+			 out.size() - clientp->written, MSG_NOSIGNAL);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	  return (statctl_wait(clientp, EPOLLOUT));
+	}
+	if (n == -1) {
+	  return (-1);
+	}
+	clientp->written += n;
+      }
+      if (clientp->state == STATCTL_WRITE_REPLY) {
+	return (-1);
+      }
+      clientp->state = STATCTL_READ_ACK;
+      if (statctl_wait(clientp, EPOLLIN) == -1) {
+	return (-1);
+      }
+      break;
+    }
+
+    case STATCTL_READ_ACK: {
+      char ack[STATCTL_COMMAND_SIZE];
+      ssize_t n = read(clientp->fd, ack, sizeof(ack));
+      if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	return (0);
+      }
+      if (n <= 0) {
+	return (-1);
+      }
+      clientp->ack.append(ack, n);
+      if (clientp->ack.size() < 2) {
+	break;
+      }
+      if (clientp->ack.compare(0, 2, "ok") != 0) {
+	return (-1);
+      }
+      clientp->written = 0;
+      clientp->state = STATCTL_WRITE_REPLY;
+      break;
+    }
+    }
+  }
+}
+
+/* Wait for the events of a client. */
+static int
+statctl_wait(struct statctl_client *clientp, uint32_t events)
+{
+  struct epoll_event epev;
+  memset(&epev, 0, sizeof(epev));
+  epev.data.fd = clientp->fd;
+  epev.events = events;
+  if (epoll_ctl(statctl_epfd, EPOLL_CTL_MOD, clientp->fd, &epev) == -1) {
+    warn("epoll_ctl() failed for a stat client");
+    return (-1);
+  }
+  return (0);
+}
+
+static void
+statctl_close(struct statctl_client *clientp)
+{
+  /* Closing the socket removes it from the epoll instance. */
+  close(clientp->fd);
+  statctl_clients.erase(clientp->fd);
+  delete clientp;
+}
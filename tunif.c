@@ -30,6 +30,7 @@
 #include <stdint.h>
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
 #include <unistd.h>
 
 #if !defined(__linux__)
@@ -46,6 +47,7 @@
 #include <linux/fib_rules.h>
 #include <linux/if_tun.h>
 #include <linux/if_ether.h>
+#include <linux/virtio_net.h>
 #include <arpa/inet.h>
 #else
 #include <ifaddrs.h>
@@ -54,13 +56,31 @@
 #include <net/if_tun.h>
 #endif
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <sys/uio.h>
+
+#include "tunif.h"
+#include "checksum.h"
+#include "logring.h"
 
 #define POLICY_TABLE_ID 1
 
 char tun_if_name[IFNAMSIZ];
+/* Set when the virtio-net header follows the tun_pi{} structure. */
+int tun_offload = 0;
+/* The length of the headers preceding the IP header of a packet. */
+size_t tun_hdr_len = sizeof(uint32_t);
 
 static int tun_op_route(int, int, const void *, int, int);
 static int tun_op_rule(int op, int af, const void *addr, int prefix_len, int rt_class);
+#if defined(__linux__)
+static int tun_nl_open(void);
+static int tun_nl_request(struct nlmsghdr *, int, int, const void *, int);
+static int tun_nl_flush(void);
+#endif
 
 /*
  * Create a new tun interface with the given name.  If the name
@@ -69,11 +89,27 @@ static int tun_op_rule(int op, int af, const void *addr, int prefix_len, int rt_
  * The created tun interface doesn't have the NO_PI flag (in Linux),
  * and has the TUNSIFHEAD flag (in BSD) to provide address family
  * information at the beginning of all incoming/outgoing packets.
+ *
+ * In Linux, num_queues file descriptors are attached to the same
+ * interface using the IFF_MULTI_QUEUE flag, and stored in the
+ * tun_fds array.  The kernel spreads incoming flows over the queues,
+ * so that each queue can be served by its own thread.  Other
+ * operating systems support only one queue.  The number of opened
+ * queues is returned.
+ *
+ * If the offload parameter is non-zero (Linux only), the interface is
+ * created with the IFF_VNET_HDR flag, and the checksum and
+ * segmentation offload features are enabled.  Each packet is then
+ * preceded by a virtio_net_hdr{} structure after the tun_pi{}
+ * structure, and may be a GSO packet up to 64KB long.  The header
+ * length is stored in tun_hdr_len.
  */
 int
-tun_alloc(char *tun_if_name)
+tun_alloc(char *tun_if_name, int *tun_fds, int num_queues, int offload)
 {
   assert(tun_if_name != NULL);
+  assert(tun_fds != NULL);
+  assert(num_queues > 0 && num_queues <= TUN_MAX_QUEUES);
 
   int udp_fd;
   udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -82,23 +118,66 @@ tun_alloc(char *tun_if_name)
   }
 
 #if defined(__linux__)
-  /* Create a new tun device. */
-  int tun_fd;
-  tun_fd = open("/dev/net/tun", O_RDWR);
-  if (tun_fd == -1) {
-    err(EXIT_FAILURE, "cannot create a control channel of the tun interface.");
+  /* Create a new tun device, and attach the queues to it. */
+  struct ifreq ifr;
+  int queue;
+  for (queue = 0; queue < num_queues; queue++) {
+    int tun_fd;
+    tun_fd = open("/dev/net/tun", O_RDWR);
+    if (tun_fd == -1) {
+      err(EXIT_FAILURE,
+	  "cannot create a control channel of the tun interface.");
+    }
+
+    memset(&ifr, 0, sizeof(struct ifreq));
+    ifr.ifr_flags = IFF_TUN;
+    if (num_queues > 1) {
+      ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
+    if (offload) {
+      ifr.ifr_flags |= IFF_VNET_HDR;
+    }
+    strncpy(ifr.ifr_name, tun_if_name, IFNAMSIZ);
+    if (ioctl(tun_fd, TUNSETIFF, (void *)&ifr) == -1) {
+      close(tun_fd);
+      err(EXIT_FAILURE, "cannot create %s interface (queue %d).",
+	  tun_if_name, queue);
+    }
+    strncpy(tun_if_name, ifr.ifr_name, IFNAMSIZ);
+    tun_fds[queue] = tun_fd;
   }
 
-  struct ifreq ifr;
-  memset(&ifr, 0, sizeof(struct ifreq));
-  ifr.ifr_flags = IFF_TUN;
-  strncpy(ifr.ifr_name, tun_if_name, IFNAMSIZ);
-  if (ioctl(tun_fd, TUNSETIFF, (void *)&ifr) == -1) {
-    close(tun_fd);
-    err(EXIT_FAILURE, "cannot create %s interface.", tun_if_name);
+  if (offload) {
+    /*
+     * Use the 12 bytes long header (virtio_net_hdr_mrg_rxbuf{}), so
+     * that the IP header following the 4 bytes tun_pi{} structure is
+     * aligned to 4 bytes.
+     */
+    int vnet_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    if (ioctl(tun_fds[0], TUNSETVNETHDRSZ, &vnet_hdr_len) == -1) {
+      err(EXIT_FAILURE, "failed to set the vnet header size of %s.",
+	  tun_if_name);
+    }
+    tun_offload = 1;
+    tun_hdr_len = sizeof(struct tun_pi) + vnet_hdr_len;
+
+    /* Recent kernels don't accept UFO.  Retry without it. */
+    unsigned int features = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6
+      | TUN_F_TSO_ECN;
+    if (ioctl(tun_fds[0], TUNSETOFFLOAD, features | TUN_F_UFO) == -1
+	&& ioctl(tun_fds[0], TUNSETOFFLOAD, features) == -1) {
+      warn("failed to enable offload features of %s.", tun_if_name);
+    }
   }
-  strncpy(tun_if_name, ifr.ifr_name, IFNAMSIZ);
 #else
+  if (offload) {
+    warnx("offload is not supported.");
+  }
+  if (num_queues > 1) {
+    warnx("multiple tun queues are not supported.  use 1 queue.");
+    num_queues = 1;
+  }
+
   /* Create a new tun device. */
   struct ifreq ifr;
   memset(&ifr, 0, sizeof(struct ifreq));
@@ -139,6 +218,7 @@ tun_alloc(char *tun_if_name)
   if (ioctl(tun_fd, TUNSIFHEAD, &on) == -1) {
     err(EXIT_FAILURE, "failed to set TUNSIFHEAD to %d.\n", on);
   }
+  tun_fds[0] = tun_fd;
 #endif
 
   /* Make the tun device up. */
@@ -151,7 +231,7 @@ tun_alloc(char *tun_if_name)
 
   close(udp_fd);
 
-  return (tun_fd);
+  return (num_queues);
 }
 
 #if !defined(__linux__)
@@ -216,7 +296,7 @@ tun_get_af(const void *buf)
     af = AF_INET6;
     break;
   default:
-    warnx("unknown ether frame type %x received.", ether_type);
+    logring_log(LOGRING_UNKNOWN_ETHER_TYPE, ether_type);
     break;
   }
 #else
@@ -247,7 +327,7 @@ tun_set_af(void *buf, uint32_t af)
     ether_type = ETH_P_IPV6;
     break;
   default:
-    warnx("unsupported address family %d", af);
+    logring_log(LOGRING_UNSUPPORTED_AF, af);
     return (-1);
   }
 
@@ -265,6 +345,166 @@ tun_set_af(void *buf, uint32_t af)
 #endif
 }
 
+/*
+ * Fill the headers preceding an outgoing packet.  The address family
+ * information is set as tun_set_af() does, and the virtio-net header
+ * (if the offload mode is enabled) is cleared, which means no offload
+ * is requested.  The buf pointer must be TUN_HDR_MAX_LEN bytes long.
+ * The length of the headers is returned.
+ */
+size_t
+tun_set_hdr(void *buf, uint32_t af)
+{
+  assert(buf != NULL);
+
+  memset(buf, 0, tun_hdr_len);
+  (void)tun_set_af(buf, af);
+
+  return (tun_hdr_len);
+}
+
+/*
+ * Get the virtio-net header of the packet pointed by the buf pointer.
+ * NULL is returned if the offload mode is disabled.
+ */
+void *
+tun_vnet_hdr(void *buf)
+{
+  assert(buf != NULL);
+
+  if (!tun_offload) {
+    return (NULL);
+  }
+
+  return ((uint8_t *)buf + sizeof(uint32_t));
+}
+
+/*
+ * Get the offload information of the packet from its virtio-net
+ * header.  TUN_OFFLOAD_CSUM is set if the checksum of the packet is
+ * partial, and TUN_OFFLOAD_GSO is set if the packet is a GSO packet
+ * which will be segmented by the kernel.  0 is returned if the
+ * vnet_hdrp parameter is NULL.
+ */
+int
+tun_vnet_offload(const void *vnet_hdrp)
+{
+  int offload = 0;
+
+#if defined(__linux__)
+  const struct virtio_net_hdr *hdrp = vnet_hdrp;
+  if (hdrp == NULL) {
+    return (0);
+  }
+  if (hdrp->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+    offload |= TUN_OFFLOAD_CSUM;
+  }
+  if ((hdrp->gso_type & ~VIRTIO_NET_HDR_GSO_ECN)
+      != VIRTIO_NET_HDR_GSO_NONE) {
+    offload |= TUN_OFFLOAD_GSO;
+  }
+#endif
+
+  return (offload);
+}
+
+/*
+ * Complete the partial checksum of the IP packet pointed by the
+ * ip_hdrp parameter, and clear the VIRTIO_NET_HDR_F_NEEDS_CSUM flag.
+ * This is required before modifying the upper layer data (ICMP
+ * conversion), or before fragmenting the packet.
+ */
+int
+tun_vnet_complete_csum(void *vnet_hdrp, void *ip_hdrp, size_t ip_len)
+{
+  assert(vnet_hdrp != NULL);
+  assert(ip_hdrp != NULL);
+
+#if defined(__linux__)
+  struct virtio_net_hdr *hdrp = vnet_hdrp;
+  if (!(hdrp->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+    return (0);
+  }
+  if (hdrp->csum_start + hdrp->csum_offset + sizeof(uint16_t) > ip_len) {
+    logring_log(LOGRING_VNET_CSUM_OFFSET,
+		hdrp->csum_start + hdrp->csum_offset + sizeof(uint16_t));
+    return (-1);
+  }
+  cksum_complete_partial((uint8_t *)ip_hdrp + hdrp->csum_start,
+			 ip_len - hdrp->csum_start, hdrp->csum_offset);
+  hdrp->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
+  hdrp->csum_start = 0;
+  hdrp->csum_offset = 0;
+#endif
+
+  return (0);
+}
+
+/*
+ * Create the virtio-net header of a translated packet from that of
+ * the original packet.  The af parameter is the address family of the
+ * translated packet, and the hlen_delta parameter is the difference
+ * of the IP header length (translated - original).  The ulp_hdrp
+ * parameter points the upper layer header.
+ *
+ * The GSO type is converted to the one of the new address family.  If
+ * the mtu parameter is not 0, the segment size is reduced so that
+ * each TCP segment fits in the MTU after translation.
+ */
+int
+tun_vnet_translate(void *vnet_hdrp, const void *orig_vnet_hdrp, int af,
+		   int hlen_delta, const void *ulp_hdrp, int mtu)
+{
+  assert(vnet_hdrp != NULL);
+  assert(orig_vnet_hdrp != NULL);
+  assert(ulp_hdrp != NULL);
+
+#if defined(__linux__)
+  struct virtio_net_hdr *hdrp = vnet_hdrp;
+  const struct virtio_net_hdr *orig_hdrp = orig_vnet_hdrp;
+
+  memcpy(hdrp, orig_hdrp, sizeof(struct virtio_net_hdr));
+  if (hdrp->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+    hdrp->csum_start += hlen_delta;
+  }
+
+  int gso_type = orig_hdrp->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+  int ulp_hlen;
+  switch (gso_type) {
+  case VIRTIO_NET_HDR_GSO_NONE:
+    return (0);
+  case VIRTIO_NET_HDR_GSO_TCPV4:
+  case VIRTIO_NET_HDR_GSO_TCPV6:
+    gso_type = (af == AF_INET) ? VIRTIO_NET_HDR_GSO_TCPV4
+      : VIRTIO_NET_HDR_GSO_TCPV6;
+    ulp_hlen = ((const struct tcphdr *)ulp_hdrp)->doff << 2;
+    break;
+  case VIRTIO_NET_HDR_GSO_UDP:
+    /* UFO packets are fragmented by the kernel. */
+    ulp_hlen = sizeof(struct udphdr);
+    mtu = 0;
+    break;
+  default:
+    logring_log(LOGRING_VNET_GSO_TYPE, gso_type);
+    return (-1);
+  }
+  hdrp->gso_type = gso_type | (orig_hdrp->gso_type & VIRTIO_NET_HDR_GSO_ECN);
+
+  int hdr_len = ((af == AF_INET) ? sizeof(struct ip) : sizeof(struct ip6_hdr))
+    + ulp_hlen;
+  hdrp->hdr_len = hdr_len;
+  if (mtu > 0 && hdr_len + hdrp->gso_size > mtu) {
+    if (mtu <= hdr_len) {
+      logring_log(LOGRING_VNET_GSO_MTU, mtu);
+      return (-1);
+    }
+    hdrp->gso_size = mtu - hdr_len;
+  }
+#endif
+
+  return (0);
+}
+
 #if defined(__linux__)
 /* The addition procedure of a route entry for Linux. */
 int
@@ -298,15 +538,280 @@ tun_add_policy(int af, const void *addr, int prefix_len)
 		     POLICY_TABLE_ID);
 }
 
-/* The deletion procedure of a policy for Linux */
+/*
+ * The deletion procedure of a policy for Linux.  If addr is NULL, the
+ * first policy pointing the policy-based table is deleted.
+ */
 int
-tun_delete_policy()
+tun_delete_policy(int af, const void *addr, int prefix_len)
 {
-  int prefix_len = 0;
-  return tun_op_rule(RTM_DELRULE, AF_INET6, NULL, prefix_len,
+  return tun_op_rule(RTM_DELRULE, AF_INET6, addr, prefix_len,
 		     POLICY_TABLE_ID);
 }
 
+/*
+ * The netlink session used to program the routes and the policies.
+ * The requests are sent with NLM_F_ACK over one persistent socket.
+ * Between tun_route_begin() and tun_route_commit(), the requests are
+ * packed into a buffer and sent with one sendmsg(2) call per
+ * TUN_NL_BATCH_MAX requests.  Otherwise, each request is sent
+ * immediately.  In both cases, the NLMSG_ERROR replies are matched
+ * with the requests by the sequence number, and each failed request
+ * is reported.
+ *
+ * The session is not locked.  The callers must serialize the route
+ * and policy operations (mapping.c does it with its update lock).
+ */
+#define TUN_NL_BUF_LEN (64 * 1024)
+#define TUN_NL_BATCH_MAX 512
+#define TUN_NL_RCVBUF_LEN (1024 * 1024)
+
+struct tun_nl_req {
+  int op;
+  int af;
+  int prefix_len;
+  uint8_t addr[16];
+};
+
+static struct {
+  int fd;
+  int batching;
+  uint32_t seq;		/* The sequence number of the last request. */
+  int failures;		/* The number of failed requests in the batch. */
+  size_t len;
+  int num_reqs;
+  struct tun_nl_req reqs[TUN_NL_BATCH_MAX];
+  uint8_t buf[TUN_NL_BUF_LEN] __attribute__((aligned(NLMSG_ALIGNTO)));
+} tun_nl = { .fd = -1 };
+
+/*
+ * Start a batch of the route and policy requests.  The requests are
+ * not guaranteed to be applied until tun_route_commit() is called.
+ */
+int
+tun_route_begin(void)
+{
+  if (tun_nl_open() == -1) {
+    return (-1);
+  }
+  tun_nl.batching = 1;
+  tun_nl.failures = 0;
+
+  return (0);
+}
+
+/*
+ * Send all the requests queued since tun_route_begin(), and wait for
+ * the replies.  Returns the number of the failed requests in the
+ * batch, or -1 if the netlink communication failed.
+ */
+int
+tun_route_commit(void)
+{
+  assert(tun_nl.batching);
+
+  int ret = tun_nl_flush();
+  tun_nl.batching = 0;
+  if (ret == -1) {
+    return (-1);
+  }
+
+  return (tun_nl.failures);
+}
+
+/* Open the netlink socket if not opened yet. */
+static int
+tun_nl_open(void)
+{
+  if (tun_nl.fd != -1) {
+    return (0);
+  }
+
+  tun_nl.fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (tun_nl.fd == -1) {
+    warn("cannot open a netlink socket.");
+    return (-1);
+  }
+
+  /*
+   * The replies of a whole batch are queued to the socket before we
+   * read them.
+   */
+  int rcvbuf = TUN_NL_RCVBUF_LEN;
+  if (setsockopt(tun_nl.fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf,
+		 sizeof(rcvbuf)) == -1) {
+    (void)setsockopt(tun_nl.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+		     sizeof(rcvbuf));
+  }
+#if defined(NETLINK_CAP_ACK)
+  /* We don't need the copy of the request in the error replies. */
+  int on = 1;
+  (void)setsockopt(tun_nl.fd, SOL_NETLINK, NETLINK_CAP_ACK, &on, sizeof(on));
+#endif
+
+  struct sockaddr_nl so_nl;
+  memset(&so_nl, 0, sizeof(struct sockaddr_nl));
+  so_nl.nl_family = AF_NETLINK;
+  if (bind(tun_nl.fd, (struct sockaddr *)&so_nl, sizeof(so_nl)) == -1) {
+    warn("cannot bind a netlink socket.");
+    close(tun_nl.fd);
+    tun_nl.fd = -1;
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * Queue a request message built by tun_op_route() or tun_op_rule().
+ * The request information is kept to report the failure.  Returns -1
+ * if the request cannot be sent, or if the request is sent
+ * immediately and failed.
+ */
+static int
+tun_nl_request(struct nlmsghdr *nlmsghdrp, int op, int af, const void *addr,
+	       int prefix_len)
+{
+  assert(nlmsghdrp != NULL);
+
+  if (tun_nl_open() == -1) {
+    return (-1);
+  }
+
+  if (tun_nl.num_reqs == TUN_NL_BATCH_MAX
+      || tun_nl.len + NLMSG_ALIGN(nlmsghdrp->nlmsg_len) > TUN_NL_BUF_LEN) {
+    if (tun_nl_flush() == -1) {
+      return (-1);
+    }
+  }
+
+  nlmsghdrp->nlmsg_flags |= NLM_F_ACK;
+  nlmsghdrp->nlmsg_seq = ++tun_nl.seq;
+  memcpy(tun_nl.buf + tun_nl.len, nlmsghdrp, nlmsghdrp->nlmsg_len);
+  tun_nl.len += NLMSG_ALIGN(nlmsghdrp->nlmsg_len);
+
+  struct tun_nl_req *reqp = &tun_nl.reqs[tun_nl.num_reqs++];
+  reqp->op = op;
+  reqp->af = af;
+  reqp->prefix_len = prefix_len;
+  memset(reqp->addr, 0, sizeof(reqp->addr));
+  if (addr != NULL) {
+    memcpy(reqp->addr, addr,
+	   af == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr));
+  }
+
+  if (tun_nl.batching) {
+    return (0);
+  }
+
+  int failures = tun_nl.failures;
+  if (tun_nl_flush() == -1) {
+    return (-1);
+  }
+  return (tun_nl.failures == failures ? 0 : -1);
+}
+
+/* Report a failed request. */
+static void
+tun_nl_report(const struct tun_nl_req *reqp, int error)
+{
+  const char *what;
+  char addr_name[64];
+
+  switch (reqp->op) {
+  case RTM_NEWROUTE:
+    what = "route entry addition";
+    break;
+  case RTM_DELROUTE:
+    what = "route entry deletion";
+    break;
+  case RTM_NEWRULE:
+    what = "policy addition";
+    break;
+  case RTM_DELRULE:
+    what = "policy deletion";
+    break;
+  default:
+    what = "request";
+    break;
+  }
+  warnx("%s %s/%d %s failed: %s.",
+	reqp->af == AF_INET ? "IPv4" : "IPv6",
+	inet_ntop(reqp->af, reqp->addr, addr_name, sizeof(addr_name)),
+	reqp->prefix_len, what, strerror(error));
+}
+
+/*
+ * Send the queued requests, and read the replies until all the
+ * requests are acknowledged.
+ */
+static int
+tun_nl_flush(void)
+{
+  if (tun_nl.num_reqs == 0) {
+    return (0);
+  }
+
+  struct sockaddr_nl so_nl;
+  memset(&so_nl, 0, sizeof(struct sockaddr_nl));
+  so_nl.nl_family = AF_NETLINK;
+  struct iovec iov = {
+    .iov_base = (void *)tun_nl.buf,
+    .iov_len = tun_nl.len
+  };
+  struct msghdr msg = {
+    .msg_name = &so_nl,
+    .msg_namelen = sizeof(struct sockaddr_nl),
+    .msg_iov = &iov,
+    .msg_iovlen = 1
+  };
+
+  uint32_t first_seq = tun_nl.seq - tun_nl.num_reqs + 1;
+  int num_reqs = tun_nl.num_reqs;
+  tun_nl.len = 0;
+  tun_nl.num_reqs = 0;
+
+  if (sendmsg(tun_nl.fd, &msg, 0) == -1) {
+    warn("failed to write to a netlink socket.");
+    return (-1);
+  }
+
+  uint8_t rbuf[16 * 1024] __attribute__((aligned(NLMSG_ALIGNTO)));
+  int acked = 0;
+  while (acked < num_reqs) {
+    ssize_t read_len = recv(tun_nl.fd, rbuf, sizeof(rbuf), 0);
+    if (read_len == -1) {
+      if (errno == EINTR) {
+	continue;
+      }
+      warn("failed to read from a netlink socket.");
+      return (-1);
+    }
+
+    struct nlmsghdr *nlmsghdrp = (struct nlmsghdr *)rbuf;
+    int len = (int)read_len;
+    for (; NLMSG_OK(nlmsghdrp, len); nlmsghdrp = NLMSG_NEXT(nlmsghdrp, len)) {
+      if (nlmsghdrp->nlmsg_type != NLMSG_ERROR) {
+	continue;
+      }
+      uint32_t index = nlmsghdrp->nlmsg_seq - first_seq;
+      if (index >= (uint32_t)num_reqs) {
+	/* A stale reply. */
+	continue;
+      }
+      acked++;
+      const struct nlmsgerr *errp
+	= (const struct nlmsgerr *)NLMSG_DATA(nlmsghdrp);
+      if (errp->error != 0) {
+	tun_nl.failures++;
+	tun_nl_report(&tun_nl.reqs[index], -errp->error);
+      }
+    }
+  }
+
+  return (0);
+}
+
 /* Stub routine for route addition/deletion. */
 struct inet_prefix {
   uint8_t family;
@@ -413,36 +918,7 @@ tun_op_route(int op, int af, const void *addr, int prefix_len, int rt_class)
   m_nlmsg.m_nlmsghdr.nlmsg_len = NLMSG_ALIGN(m_nlmsg.m_nlmsghdr.nlmsg_len)
     + RTA_ALIGN(rta_value_len);
 
-  int netlink_fd;
-  netlink_fd = socket(AF_NETLINK, SOCK_RAW, 0);
-  if (netlink_fd == -1) {
-    err(EXIT_FAILURE, "cannot open a netlink socket.");
-  }
-
-  struct iovec iov = {
-    .iov_base = (void *)&m_nlmsg.m_nlmsghdr,
-    .iov_len = m_nlmsg.m_nlmsghdr.nlmsg_len
-  };
-  struct sockaddr_nl so_nl;
-  struct msghdr msg = {
-    .msg_name = &so_nl,
-    .msg_namelen = sizeof(struct sockaddr_nl),
-    .msg_iov = &iov,
-    .msg_iovlen = 1
-  };
-  memset(&so_nl, 0, sizeof(struct sockaddr_nl));
-  so_nl.nl_family = AF_NETLINK;
-  static int seq = 0;
-  m_nlmsg.m_nlmsghdr.nlmsg_seq = ++seq;
-  ssize_t write_len;
-  write_len = sendmsg(netlink_fd, &msg, 0);
-  if (write_len == -1) {
-    err(EXIT_FAILURE, "failed to write to a netlink socket.");
-  }
-
-  close (netlink_fd);
-
-  return (0);
+  return (tun_nl_request(&m_nlmsg.m_nlmsghdr, op, af, addr, prefix_len));
 }
 
 static int
@@ -535,36 +1011,7 @@ tun_op_rule(int op, int af, const void *addr, int prefix_len, int rt_class)
 
   }
 
-  int netlink_fd;
-  netlink_fd = socket(AF_NETLINK, SOCK_RAW, 0);
-  if (netlink_fd == -1) {
-    err(EXIT_FAILURE, "cannot open a netlink socket.");
-  }
-
-  struct iovec iov = {
-    .iov_base = (void *)&m_nlmsg.m_nlmsghdr,
-    .iov_len = m_nlmsg.m_nlmsghdr.nlmsg_len
-  };
-  struct sockaddr_nl so_nl;
-  struct msghdr msg = {
-    .msg_name = &so_nl,
-    .msg_namelen = sizeof(struct sockaddr_nl),
-    .msg_iov = &iov,
-    .msg_iovlen = 1
-  };
-  memset(&so_nl, 0, sizeof(struct sockaddr_nl));
-  so_nl.nl_family = AF_NETLINK;
-  static int seq = 0;
-  m_nlmsg.m_nlmsghdr.nlmsg_seq = ++seq;
-  ssize_t write_len;
-  write_len = sendmsg(netlink_fd, &msg, 0);
-  if (write_len == -1) {
-    err(EXIT_FAILURE, "failed to write to a netlink socket.");
-  }
-
-  close (netlink_fd);
-
-  return (0);
+  return (tun_nl_request(&m_nlmsg.m_nlmsghdr, op, af, addr, prefix_len));
 }
 #else
 /* The addition procedure of a route entry for BSD. */
@@ -639,6 +1086,22 @@ tun_make_netmask(union sockunion *mask, int af, int prefix_len)
   return (0);
 }
 
+/*
+ * The route requests are always applied immediately on BSD.  The
+ * batch functions are provided for the compatibility.
+ */
+int
+tun_route_begin(void)
+{
+  return (0);
+}
+
+int
+tun_route_commit(void)
+{
+  return (0);
+}
+
 /* Stub routine for route addition/deletion. */
 #define NEXTADDR(w, u) \
   if (rtm_addrs & (w)) { \
@@ -31,20 +31,35 @@ extern "C" {
 #endif
 
 #define TUN_DEFAULT_IF_NAME "tun646"
+#define TUN_MAX_QUEUES 64
+#define TUN_HDR_MAX_LEN 16 /* tun_pi{} and virtio_net_hdr_mrg_rxbuf{} */
+
+/* Offload information returned by tun_vnet_offload(). */
+#define TUN_OFFLOAD_CSUM 0x01 /* The checksum is partial. */
+#define TUN_OFFLOAD_GSO 0x02  /* The packet is a GSO packet. */
 
 extern char tun_if_name[];
+extern int tun_offload;
+extern size_t tun_hdr_len;
 
-int tun_alloc(char *);
+int tun_alloc(char *, int *, int, int);
 #if !defined(__linux__)
 int tun_dealloc(const char *);
 #endif
 uint32_t tun_get_af(const void *);
 int tun_set_af(void *, uint32_t);
+size_t tun_set_hdr(void *, uint32_t);
+void *tun_vnet_hdr(void *);
+int tun_vnet_offload(const void *);
+int tun_vnet_complete_csum(void *, void *, size_t);
+int tun_vnet_translate(void *, const void *, int, int, const void *, int);
 int tun_add_route(int, const void *, int);
 int tun_add_policy(int, const void *, int);
 int tun_create_policy_table();
 int tun_delete_route(int, const void *, int);
-int tun_delete_policy();
+int tun_delete_policy(int, const void *, int);
+int tun_route_begin(void);
+int tun_route_commit(void);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,781 @@
+/*
+ * Copyright 2010, 2011, 2012
+ *   IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#if defined(WITH_IO_URING)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "tunio.h"
+#include "qsbr.h"
+#include "drop.h"
+
+#if defined(WITH_IO_URING)
+#define TUNIO_URING_RX_DEPTH 64	/* The number of reads kept in flight. */
+#define TUNIO_URING_TX_DEPTH 64	/* The number of writes in flight. */
+#define TUNIO_URING_TX_BATCH 16	/* Writes queued before submission. */
+#define TUNIO_URING_TX_SLACK 64 /* Translation may enlarge a packet. */
+#define TUNIO_URING_BUF(ringp, id) \
+  ((ringp)->bufs + (size_t)(id) * (ringp)->buf_size)
+/*
+ * Set to user_data of a write request sent directly from a receive
+ * buffer.  The buffer is posted for reading again when the write
+ * completes.
+ */
+#define TUNIO_URING_RX_WRITE 0x10000
+
+/*
+ * The io_uring instance of a tun queue.  The buffers from 0 to
+ * TUNIO_URING_RX_DEPTH - 1 are used to receive packets, and the rest
+ * are used to send packets.  All of them are registered to the kernel
+ * as one fixed buffer, and the buffer index is used as user_data of
+ * each request.
+ */
+struct tunio_uring {
+  int ring_fd;
+  unsigned to_submit;
+
+  /* The submission queue. */
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+
+  /* The completion queue. */
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_len;
+  void *cq_ring;
+  size_t cq_ring_len;
+  size_t sqes_len;
+
+  uint8_t *bufs;
+  size_t buf_size;
+  int tx_free[TUNIO_URING_TX_DEPTH];
+  int tx_free_count;
+
+  /*
+   * The receive buffer being processed by the input function, and
+   * whether it has been sent in place.
+   */
+  int rx_current;
+  int rx_current_sent;
+
+  /*
+   * The FIFO of the read completions taken off the completion queue
+   * and not processed yet.  Each receive buffer is queued at most
+   * once.
+   */
+  struct {
+    int buf_id;
+    int res;
+  } rx_ready[TUNIO_URING_RX_DEPTH];
+  int rx_ready_head;
+  int rx_ready_count;
+};
+
+static int tunio_uring_setup(struct tunio *);
+static void tunio_uring_teardown(struct tunio *);
+static int tunio_uring_enter(struct tunio_uring *, unsigned);
+static int tunio_uring_queue(struct tunio_uring *, int, const void *, size_t,
+			     uint64_t);
+static int tunio_uring_post_read(struct tunio *, int);
+static void tunio_uring_push_ready(struct tunio_uring *, int, int);
+static void tunio_uring_reap(struct tunio *);
+static int tunio_uring_run(struct tunio *, tunio_input_t, void *);
+static ssize_t tunio_uring_write(struct tunio *, const void *, size_t);
+static ssize_t tunio_uring_writev(struct tunio *, const struct iovec *, int);
+#endif
+
+struct tunio {
+  int fd;
+  int backend;
+  size_t buf_len;
+  uint8_t *buf;			/* TUNIO_HEADROOM bytes + buf_len bytes */
+  tunio_output_t output;	/* TUNIO_BACKEND_OUTPUT only */
+  void *output_arg;
+#if defined(WITH_IO_URING)
+  struct tunio_uring uring;
+#endif
+};
+
+/*
+ * Create an I/O context for the tun queue specified by the fd
+ * parameter.  Packets up to buf_len bytes (including the tun headers)
+ * can be received.  If the requested backend is not available, the
+ * read(2)/writev(2) backend is used instead.
+ */
+struct tunio *
+tunio_create(int fd, int backend, size_t buf_len)
+{
+  struct tunio *tiop;
+
+  tiop = (struct tunio *)calloc(1, sizeof(struct tunio));
+  if (tiop == NULL) {
+    warn("failed to allocate memory for a tunio instance.");
+    return (NULL);
+  }
+  tiop->fd = fd;
+  tiop->backend = TUNIO_BACKEND_RW;
+  tiop->buf_len = buf_len;
+  tiop->buf = (uint8_t *)malloc(TUNIO_HEADROOM + buf_len);
+  if (tiop->buf == NULL) {
+    warn("failed to allocate memory for a tunio buffer.");
+    free(tiop);
+    return (NULL);
+  }
+
+  if (backend == TUNIO_BACKEND_URING) {
+#if defined(WITH_IO_URING)
+    if (tunio_uring_setup(tiop) == 0) {
+      tiop->backend = TUNIO_BACKEND_URING;
+    } else {
+      warnx("io_uring is not available.  falling back to read/writev.");
+    }
+#else
+    warnx("io_uring support is not compiled in.  falling back to read/writev.");
+#endif
+  }
+
+  return (tiop);
+}
+
+/*
+ * Create an I/O context which passes the sent packets to the output
+ * function instead of a tun queue.  This is used to run the
+ * translation without a tun interface, for example for benchmarking.
+ * tunio_run() cannot be used with this context.
+ */
+struct tunio *
+tunio_create_output(tunio_output_t output, void *arg)
+{
+  assert(output != NULL);
+
+  struct tunio *tiop = tunio_create(-1, TUNIO_BACKEND_RW, TUNIO_GSO_BUF_LEN);
+  if (tiop == NULL) {
+    return (NULL);
+  }
+  tiop->backend = TUNIO_BACKEND_OUTPUT;
+  tiop->output = output;
+  tiop->output_arg = arg;
+
+  return (tiop);
+}
+
+/*
+ * Release the I/O context.  The tun file descriptor itself is not
+ * closed.
+ */
+void
+tunio_destroy(struct tunio *tiop)
+{
+  if (tiop == NULL) {
+    return;
+  }
+#if defined(WITH_IO_URING)
+  if (tiop->backend == TUNIO_BACKEND_URING) {
+    tunio_uring_teardown(tiop);
+  }
+#endif
+  free(tiop->buf);
+  free(tiop);
+}
+
+int
+tunio_backend(const struct tunio *tiop)
+{
+  assert(tiop != NULL);
+
+  return (tiop->backend);
+}
+
+/*
+ * Read packets from the tun queue and pass each of them to the input
+ * function.  This function returns only when reading from the tun
+ * queue fails, with errno set.
+ */
+int
+tunio_run(struct tunio *tiop, tunio_input_t input, void *arg)
+{
+  assert(tiop != NULL);
+  assert(input != NULL);
+
+#if defined(WITH_IO_URING)
+  if (tiop->backend == TUNIO_BACKEND_URING) {
+    return (tunio_uring_run(tiop, input, arg));
+  }
+#endif
+  if (tiop->backend == TUNIO_BACKEND_OUTPUT) {
+    errno = EINVAL;
+    return (-1);
+  }
+
+  ssize_t read_len;
+  while (1) {
+    /*
+     * The thread is offline for QSBR while waiting for a packet, so
+     * that an idle queue does not delay the reclamation of the mapping
+     * tables.
+     */
+    qsbr_offline();
+    read_len = read(tiop->fd, (void *)(tiop->buf + TUNIO_HEADROOM),
+		    tiop->buf_len);
+    qsbr_online();
+    if (read_len == -1) {
+      if (errno == EINTR || errno == EAGAIN) {
+	continue;
+      }
+      return (-1);
+    }
+    input(tiop, tiop->buf + TUNIO_HEADROOM, read_len, arg);
+  }
+
+  return (0);
+}
+
+/*
+ * Send a contiguous packet to the tun queue.  When the packet is
+ * built in the buffer passed to the input function, the io_uring
+ * backend sends it without copying, so the packet must not be
+ * modified after this call.
+ */
+ssize_t
+tunio_write(struct tunio *tiop, const void *datap, size_t data_len)
+{
+  assert(tiop != NULL);
+  assert(datap != NULL);
+
+#if defined(WITH_IO_URING)
+  if (tiop->backend == TUNIO_BACKEND_URING) {
+    return (tunio_uring_write(tiop, datap, data_len));
+  }
+#endif
+  if (tiop->backend == TUNIO_BACKEND_OUTPUT) {
+    tiop->output((const uint8_t *)datap, data_len, tiop->output_arg);
+    return (data_len);
+  }
+
+  return (write(tiop->fd, datap, data_len));
+}
+
+/*
+ * Send a packet to the tun queue.  With the io_uring backend, the
+ * packet is copied to a send buffer and the write request is
+ * submitted together with other requests later, so a write error is
+ * reported asynchronously.
+ */
+ssize_t
+tunio_writev(struct tunio *tiop, const struct iovec *iov, int iovcnt)
+{
+  assert(tiop != NULL);
+  assert(iov != NULL);
+
+#if defined(WITH_IO_URING)
+  if (tiop->backend == TUNIO_BACKEND_URING) {
+    return (tunio_uring_writev(tiop, iov, iovcnt));
+  }
+#endif
+  if (tiop->backend == TUNIO_BACKEND_OUTPUT) {
+    /* Gather the packet to the buffer, which is not used for reading. */
+    size_t total_len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+      if (total_len + iov[i].iov_len > TUNIO_HEADROOM + tiop->buf_len) {
+	errno = EMSGSIZE;
+	return (-1);
+      }
+      if (iov[i].iov_len != 0) {
+	memcpy(tiop->buf + total_len, iov[i].iov_base, iov[i].iov_len);
+	total_len += iov[i].iov_len;
+      }
+    }
+    tiop->output(tiop->buf, total_len, tiop->output_arg);
+    return (total_len);
+  }
+
+  return (writev(tiop->fd, iov, iovcnt));
+}
+
+#if defined(WITH_IO_URING)
+/*
+ * Create an io_uring instance, map its rings, and register the tun
+ * file descriptor and the packet buffers.
+ */
+static int
+tunio_uring_setup(struct tunio *tiop)
+{
+  struct tunio_uring *ringp = &tiop->uring;
+  struct io_uring_params params;
+  uint8_t *sq_ring, *cq_ring;
+
+  memset(ringp, 0, sizeof(struct tunio_uring));
+  ringp->sq_ring = MAP_FAILED;
+  ringp->cq_ring = MAP_FAILED;
+  ringp->sqes = (struct io_uring_sqe *)MAP_FAILED;
+
+  memset(&params, 0, sizeof(struct io_uring_params));
+  ringp->ring_fd = syscall(__NR_io_uring_setup,
+			   TUNIO_URING_RX_DEPTH + TUNIO_URING_TX_DEPTH,
+			   &params);
+  if (ringp->ring_fd == -1) {
+    warn("io_uring_setup() failed.");
+    return (-1);
+  }
+  if (!(params.features & IORING_FEAT_FAST_POLL)) {
+    /*
+     * Without the fast poll feature, every pending read would occupy
+     * a kernel worker thread.
+     */
+    warnx("io_uring of this kernel does not support fast poll.");
+    goto fail;
+  }
+
+  ringp->sq_ring_len = params.sq_off.array
+    + params.sq_entries * sizeof(unsigned);
+  ringp->cq_ring_len = params.cq_off.cqes
+    + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ringp->cq_ring_len > ringp->sq_ring_len) {
+      ringp->sq_ring_len = ringp->cq_ring_len;
+    }
+    ringp->cq_ring_len = ringp->sq_ring_len;
+  }
+  ringp->sq_ring = mmap(NULL, ringp->sq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ringp->ring_fd,
+			IORING_OFF_SQ_RING);
+  if (ringp->sq_ring == MAP_FAILED) {
+    warn("failed to map the io_uring submission queue.");
+    goto fail;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ringp->cq_ring = ringp->sq_ring;
+  } else {
+    ringp->cq_ring = mmap(NULL, ringp->cq_ring_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ringp->ring_fd,
+			  IORING_OFF_CQ_RING);
+    if (ringp->cq_ring == MAP_FAILED) {
+      warn("failed to map the io_uring completion queue.");
+      goto fail;
+    }
+  }
+  ringp->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ringp->sqes = (struct io_uring_sqe *)mmap(NULL, ringp->sqes_len,
+					    PROT_READ | PROT_WRITE,
+					    MAP_SHARED | MAP_POPULATE,
+					    ringp->ring_fd, IORING_OFF_SQES);
+  if (ringp->sqes == MAP_FAILED) {
+    warn("failed to map the io_uring submission queue entries.");
+    goto fail;
+  }
+
+  sq_ring = (uint8_t *)ringp->sq_ring;
+  ringp->sq_head = (unsigned *)(sq_ring + params.sq_off.head);
+  ringp->sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+  ringp->sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+  ringp->sq_mask = *(unsigned *)(sq_ring + params.sq_off.ring_mask);
+  ringp->sq_entries = params.sq_entries;
+  cq_ring = (uint8_t *)ringp->cq_ring;
+  ringp->cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+  ringp->cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+  ringp->cq_mask = *(unsigned *)(cq_ring + params.cq_off.ring_mask);
+  ringp->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+
+  /* Register the tun queue as the fixed file 0. */
+  if (syscall(__NR_io_uring_register, ringp->ring_fd,
+	      IORING_REGISTER_FILES, &tiop->fd, 1) == -1) {
+    warn("failed to register the tun queue to io_uring.");
+    goto fail;
+  }
+
+  /* Register all the packet buffers as the fixed buffer 0. */
+  struct iovec buf_iov;
+  ringp->buf_size = (TUNIO_HEADROOM + tiop->buf_len + TUNIO_URING_TX_SLACK
+		     + 63) & ~63;
+  buf_iov.iov_len = (TUNIO_URING_RX_DEPTH + TUNIO_URING_TX_DEPTH)
+    * ringp->buf_size;
+  if (posix_memalign(&buf_iov.iov_base, sysconf(_SC_PAGESIZE),
+		     buf_iov.iov_len) != 0) {
+    warnx("failed to allocate memory for io_uring buffers.");
+    goto fail;
+  }
+  ringp->bufs = (uint8_t *)buf_iov.iov_base;
+  if (syscall(__NR_io_uring_register, ringp->ring_fd,
+	      IORING_REGISTER_BUFFERS, &buf_iov, 1) == -1) {
+    warn("failed to register buffers to io_uring.");
+    goto fail;
+  }
+  for (int i = 0; i < TUNIO_URING_TX_DEPTH; i++) {
+    ringp->tx_free[i] = TUNIO_URING_RX_DEPTH + i;
+  }
+  ringp->tx_free_count = TUNIO_URING_TX_DEPTH;
+  ringp->rx_current = -1;
+  ringp->rx_ready_head = 0;
+  ringp->rx_ready_count = 0;
+
+  /*
+   * The queue is left blocking.  A read request on an idle queue is
+   * not completed with EAGAIN but waits in the poll handler of
+   * io_uring until a packet arrives.
+   */
+
+  return (0);
+
+ fail:
+  tunio_uring_teardown(tiop);
+  return (-1);
+}
+
+static void
+tunio_uring_teardown(struct tunio *tiop)
+{
+  struct tunio_uring *ringp = &tiop->uring;
+
+  if (ringp->sqes != MAP_FAILED) {
+    munmap(ringp->sqes, ringp->sqes_len);
+  }
+  if (ringp->cq_ring != MAP_FAILED && ringp->cq_ring != ringp->sq_ring) {
+    munmap(ringp->cq_ring, ringp->cq_ring_len);
+  }
+  if (ringp->sq_ring != MAP_FAILED) {
+    munmap(ringp->sq_ring, ringp->sq_ring_len);
+  }
+  if (ringp->ring_fd != -1) {
+    close(ringp->ring_fd);
+  }
+  free(ringp->bufs);
+  memset(ringp, 0, sizeof(struct tunio_uring));
+  ringp->ring_fd = -1;
+}
+
+/*
+ * Submit all the queued requests, and wait for at least min_complete
+ * completions.
+ */
+static int
+tunio_uring_enter(struct tunio_uring *ringp, unsigned min_complete)
+{
+  unsigned flags = 0;
+  int ret;
+
+  if (min_complete > 0) {
+    flags |= IORING_ENTER_GETEVENTS;
+  }
+  while (1) {
+    ret = syscall(__NR_io_uring_enter, ringp->ring_fd, ringp->to_submit,
+		  min_complete, flags, NULL, 0);
+    if (ret == -1) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return (-1);
+    }
+    ringp->to_submit -= ret;
+    return (0);
+  }
+}
+
+/*
+ * Queue a read or write request using the registered buffers.  The
+ * request is submitted with the next tunio_uring_enter() call.
+ */
+static int
+tunio_uring_queue(struct tunio_uring *ringp, int opcode, const void *addr,
+		  size_t len, uint64_t user_data)
+{
+  unsigned tail = *ringp->sq_tail;
+  if (tail - __atomic_load_n(ringp->sq_head, __ATOMIC_ACQUIRE)
+      >= ringp->sq_entries) {
+    /* The submission queue is full.  Flush it. */
+    if (tunio_uring_enter(ringp, 0) == -1) {
+      return (-1);
+    }
+    if (tail - __atomic_load_n(ringp->sq_head, __ATOMIC_ACQUIRE)
+	>= ringp->sq_entries) {
+      errno = EBUSY;
+      return (-1);
+    }
+  }
+
+  unsigned index = tail & ringp->sq_mask;
+  struct io_uring_sqe *sqep = &ringp->sqes[index];
+  memset(sqep, 0, sizeof(struct io_uring_sqe));
+  sqep->opcode = opcode;
+  sqep->flags = IOSQE_FIXED_FILE;
+  sqep->fd = 0;
+  sqep->addr = (uintptr_t)addr;
+  sqep->len = len;
+  sqep->buf_index = 0;
+  sqep->user_data = user_data;
+  ringp->sq_array[index] = index;
+  __atomic_store_n(ringp->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ringp->to_submit++;
+
+  return (0);
+}
+
+/* Post the receive buffer for reading, leaving the headroom. */
+static int
+tunio_uring_post_read(struct tunio *tiop, int buf_id)
+{
+  struct tunio_uring *ringp = &tiop->uring;
+
+  return (tunio_uring_queue(ringp, IORING_OP_READ_FIXED,
+			    TUNIO_URING_BUF(ringp, buf_id) + TUNIO_HEADROOM,
+			    tiop->buf_len, buf_id));
+}
+
+/*
+ * Take all the completions off the completion queue.  The send
+ * buffers and the receive buffers sent in place are recycled here.
+ * The received packets are only stored to rx_ready[], and processed
+ * by tunio_uring_run(), since this is also called by
+ * tunio_uring_writev() while a packet is being processed.
+ */
+static void
+tunio_uring_reap(struct tunio *tiop)
+{
+  struct tunio_uring *ringp = &tiop->uring;
+
+  unsigned head = *ringp->cq_head;
+  unsigned tail = __atomic_load_n(ringp->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe *cqep = &ringp->cqes[head & ringp->cq_mask];
+    uint64_t user_data = cqep->user_data;
+    int buf_id = (int)(user_data & ~TUNIO_URING_RX_WRITE);
+    int res = cqep->res;
+    head++;
+    __atomic_store_n(ringp->cq_head, head, __ATOMIC_RELEASE);
+
+    if (user_data & TUNIO_URING_RX_WRITE) {
+      /* A packet sent in place.  Read to the buffer again. */
+      if (res < 0) {
+	drop_count(DROP_SEND_FAILED, -res, 0);
+      }
+      if (buf_id == ringp->rx_current) {
+	/*
+	 * Reaped by tunio_uring_writev() while the packet is still
+	 * processed.  tunio_uring_run() posts it when finished.
+	 */
+	ringp->rx_current_sent = 0;
+	continue;
+      }
+      if (tunio_uring_post_read(tiop, buf_id) == -1) {
+	/* Report the failure as a read error of the buffer. */
+	tunio_uring_push_ready(ringp, buf_id, -errno);
+      }
+      continue;
+    }
+    if (buf_id >= TUNIO_URING_RX_DEPTH) {
+      /* A write request completed. */
+      if (res < 0) {
+	drop_count(DROP_SEND_FAILED, -res, 0);
+      }
+      ringp->tx_free[ringp->tx_free_count++] = buf_id;
+      continue;
+    }
+
+    tunio_uring_push_ready(ringp, buf_id, res);
+  }
+}
+
+/* Queue a read completion to rx_ready[]. */
+static void
+tunio_uring_push_ready(struct tunio_uring *ringp, int buf_id, int res)
+{
+  assert(ringp->rx_ready_count < TUNIO_URING_RX_DEPTH);
+
+  int index = (ringp->rx_ready_head + ringp->rx_ready_count)
+    % TUNIO_URING_RX_DEPTH;
+  ringp->rx_ready[index].buf_id = buf_id;
+  ringp->rx_ready[index].res = res;
+  ringp->rx_ready_count++;
+}
+
+/*
+ * The io_uring version of the receive loop.  All the receive buffers
+ * are posted at once.  Each time completions arrive, the received
+ * packets are processed, their buffers are posted again, and the
+ * write requests generated meanwhile are submitted together with
+ * them by one system call.
+ */
+static int
+tunio_uring_run(struct tunio *tiop, tunio_input_t input, void *arg)
+{
+  struct tunio_uring *ringp = &tiop->uring;
+
+  for (int i = 0; i < TUNIO_URING_RX_DEPTH; i++) {
+    if (tunio_uring_post_read(tiop, i) == -1) {
+      return (-1);
+    }
+  }
+
+  while (1) {
+    qsbr_offline();
+    if (tunio_uring_enter(ringp, 1) == -1) {
+      return (-1);
+    }
+    qsbr_online();
+
+    tunio_uring_reap(tiop);
+    /*
+     * The input function may reap more completions while waiting for
+     * a send buffer.  They are queued after the current one.
+     */
+    while (ringp->rx_ready_count > 0) {
+      int buf_id = ringp->rx_ready[ringp->rx_ready_head].buf_id;
+      int res = ringp->rx_ready[ringp->rx_ready_head].res;
+      ringp->rx_ready_head = (ringp->rx_ready_head + 1)
+	% TUNIO_URING_RX_DEPTH;
+      ringp->rx_ready_count--;
+
+      if (res < 0) {
+	if (res != -EINTR && res != -EAGAIN) {
+	  errno = -res;
+	  return (-1);
+	}
+      } else {
+	ringp->rx_current = buf_id;
+	ringp->rx_current_sent = 0;
+	input(tiop, TUNIO_URING_BUF(ringp, buf_id) + TUNIO_HEADROOM, res,
+	      arg);
+	ringp->rx_current = -1;
+	if (ringp->rx_current_sent) {
+	  /* The buffer is posted again when the write completes. */
+	  continue;
+	}
+      }
+      if (tunio_uring_post_read(tiop, buf_id) == -1) {
+	return (-1);
+      }
+    }
+  }
+
+  return (0);
+}
+
+/*
+ * Send a contiguous packet.  A packet in the receive buffer being
+ * processed is sent directly from the buffer.  Others are copied to a
+ * send buffer by tunio_uring_writev().
+ */
+static ssize_t
+tunio_uring_write(struct tunio *tiop, const void *datap, size_t data_len)
+{
+  struct tunio_uring *ringp = &tiop->uring;
+
+  if (ringp->rx_current != -1 && !ringp->rx_current_sent) {
+    const uint8_t *bufp = TUNIO_URING_BUF(ringp, ringp->rx_current);
+    const uint8_t *p = (const uint8_t *)datap;
+    if (p >= bufp && p + data_len <= bufp + ringp->buf_size) {
+      if (tunio_uring_queue(ringp, IORING_OP_WRITE_FIXED, datap, data_len,
+			    ringp->rx_current | TUNIO_URING_RX_WRITE)
+	  == -1) {
+	return (-1);
+      }
+      ringp->rx_current_sent = 1;
+      if (ringp->to_submit >= TUNIO_URING_TX_BATCH) {
+	if (tunio_uring_enter(ringp, 0) == -1) {
+	  return (-1);
+	}
+      }
+      return (data_len);
+    }
+  }
+
+  struct iovec iov;
+  iov.iov_base = (void *)datap;
+  iov.iov_len = data_len;
+
+  return (tunio_uring_writev(tiop, &iov, 1));
+}
+
+static ssize_t
+tunio_uring_writev(struct tunio *tiop, const struct iovec *iov, int iovcnt)
+{
+  struct tunio_uring *ringp = &tiop->uring;
+  size_t total_len = 0;
+
+  for (int i = 0; i < iovcnt; i++) {
+    total_len += iov[i].iov_len;
+  }
+
+  if (total_len > ringp->buf_size) {
+    errno = EMSGSIZE;
+    return (-1);
+  }
+  while (ringp->tx_free_count == 0) {
+    /*
+     * All the send buffers are in flight.  Wait for some of them to
+     * complete instead of writing this packet directly, which would
+     * send it before the queued ones.  A write to the tun queue
+     * completes without waiting for the reader.
+     */
+    if (tunio_uring_enter(ringp, 1) == -1) {
+      return (-1);
+    }
+    tunio_uring_reap(tiop);
+  }
+
+  int buf_id = ringp->tx_free[--ringp->tx_free_count];
+  uint8_t *bufp = TUNIO_URING_BUF(ringp, buf_id);
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len == 0) {
+      continue;
+    }
+    memcpy(bufp, iov[i].iov_base, iov[i].iov_len);
+    bufp += iov[i].iov_len;
+  }
+  if (tunio_uring_queue(ringp, IORING_OP_WRITE_FIXED,
+			TUNIO_URING_BUF(ringp, buf_id), total_len, buf_id)
+      == -1) {
+    ringp->tx_free[ringp->tx_free_count++] = buf_id;
+    return (-1);
+  }
+  if (ringp->to_submit >= TUNIO_URING_TX_BATCH) {
+    if (tunio_uring_enter(ringp, 0) == -1) {
+      return (-1);
+    }
+  }
+
+  return (total_len);
+}
+#endif
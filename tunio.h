@@ -0,0 +1,81 @@
+/*
+ * Copyright 2010, 2011, 2012
+ *   IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TUNIO_H__
+#define __TUNIO_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define TUNIO_BUF_LEN 1600 /* XXX: should be bigger than the MTU size of
+			      the local interfaces used to transmit
+			      actual packets. */
+#define TUNIO_GSO_BUF_LEN (65536 + 128) /* A 64KB GSO packet with the
+					   tun headers. */
+
+/*
+ * The space reserved in front of each received packet.  The input
+ * function may write the translated headers there, in front of the
+ * payload, and send the packet in place with tunio_write().
+ */
+#define TUNIO_HEADROOM 64
+
+#define TUNIO_BACKEND_RW	0 /* read(2)/writev(2) */
+#define TUNIO_BACKEND_URING	1 /* io_uring with registered buffers */
+#define TUNIO_BACKEND_OUTPUT	2 /* an output function without a tun queue */
+
+struct tunio;
+
+/*
+ * Called for each packet read from the tun queue.  The buffer is
+ * owned by the tunio instance and is valid only during the call.
+ * TUNIO_HEADROOM bytes before the buffer are also writable.
+ */
+typedef void (*tunio_input_t)(struct tunio *, uint8_t *, ssize_t, void *);
+
+/*
+ * Called for each packet sent to the tunio instance created by
+ * tunio_create_output().  The packet is valid only during the call.
+ */
+typedef void (*tunio_output_t)(const uint8_t *, size_t, void *);
+
+struct tunio *tunio_create(int, int, size_t);
+struct tunio *tunio_create_output(tunio_output_t, void *);
+void tunio_destroy(struct tunio *);
+int tunio_backend(const struct tunio *);
+int tunio_run(struct tunio *, tunio_input_t, void *);
+ssize_t tunio_write(struct tunio *, const void *, size_t);
+ssize_t tunio_writev(struct tunio *, const struct iovec *, int);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1169 @@
+/*
+ * Copyright 2010, 2011, 2012
+ *   IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+
+#include "mapping.h"
+#include "tunif.h"
+#include "tunio.h"
+#include "checksum.h"
+#include "pmtudisc.h"
+#include "icmpsub.h"
+#include "drop.h"
+#include "logring.h"
+#include "xlate.h"
+
+#if defined(__linux__)
+#define IPV6_VERSION 0x60
+#endif
+
+static int send_4to6(struct tunio *, const struct mapping_match *, void *,
+		     void *, size_t);
+static int send_6to4(struct tunio *, const struct mapping_match *, void *,
+		     void *, size_t);
+static int send66_GtoI(struct tunio *, const struct mapping_match *, void *,
+		       void *, size_t);
+static int send66_ItoG(struct tunio *, const struct mapping_match *, void *,
+		       void *, size_t);
+static ssize_t send_in_place(struct tunio *, const struct iovec *);
+
+/*
+ * Translate a packet read from the tun interface, and send the result
+ * to the tunio instance.  The bufp parameter points the tun headers
+ * followed by the IP packet, and TUNIO_HEADROOM bytes before it must
+ * be writable.  The direction and the mapping entries are the ones
+ * returned by the dispatch() function for the packet.  The packet is
+ * modified during the translation.
+ */
+int
+xlate_packet(struct tunio *tiop, int direction,
+	     const struct mapping_match *matchp, uint8_t *bufp, size_t len)
+{
+  assert(tiop != NULL);
+  assert(matchp != NULL);
+  assert(bufp != NULL);
+
+  if (len < tun_hdr_len) {
+    drop_count(DROP_SHORT_PACKET, len, 0);
+    return (-1);
+  }
+
+  void *vnet_hdrp = tun_vnet_hdr(bufp);
+  void *datap = bufp + tun_hdr_len;
+  size_t data_len = len - tun_hdr_len;
+
+  switch (direction) {
+  case FOURTOSIX:
+    return (send_4to6(tiop, matchp, vnet_hdrp, datap, data_len));
+  case SIXTOFOUR:
+    return (send_6to4(tiop, matchp, vnet_hdrp, datap, data_len));
+  case SIXTOSIX_GtoI:
+    return (send66_GtoI(tiop, matchp, vnet_hdrp, datap, data_len));
+  case SIXTOSIX_ItoG:
+    return (send66_ItoG(tiop, matchp, vnet_hdrp, datap, data_len));
+  default:
+    drop_count(DROP_UNSUPPORTED, 0, 0);
+    return (-1);
+  }
+}
+
+/*
+ * Send a translated packet in place.  The headers given as iov[0] to
+ * iov[2] are copied in front of the payload given as iov[3], which is
+ * in the buffer read from the tun queue, and the packet is sent with
+ * one write.  The translated headers are at most 28 bytes longer than
+ * the original ones, which fits in TUNIO_HEADROOM.
+ */
+static ssize_t
+send_in_place(struct tunio *tiop, const struct iovec *iov)
+{
+  assert(iov != NULL);
+  assert(iov[3].iov_base != NULL);
+
+  size_t hdr_len = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+  uint8_t *packetp = (uint8_t *)iov[3].iov_base - hdr_len;
+  uint8_t *p = packetp;
+  for (int i = 0; i < 3; i++) {
+    if (iov[i].iov_len == 0) {
+      continue;
+    }
+    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
+
+  return (tunio_write(tiop, packetp, hdr_len + iov[3].iov_len));
+}
+
+/*
+ * Convert an IPv4 packet given as the argument to an IPv6 packet, and
+ * send it.
+ */
+static int
+send_4to6(struct tunio *tiop, const struct mapping_match *matchp,
+	void *vnet_hdrp, void *datap, size_t data_len)
+{
+  assert (datap != NULL);
+
+  uint8_t *packetp = (uint8_t *)datap;
+
+  /* Analyze IPv4 header contents. */
+  struct ip *ip4_hdrp;
+  struct in_addr ip4_src, ip4_dst;
+  uint16_t ip4_tlen, ip4_hlen, ip4_plen;
+  uint8_t ip4_ttl, ip4_proto;
+  ip4_hdrp = (struct ip *)packetp;
+  if (ip4_hdrp->ip_hl << 2 != sizeof(struct ip)) {
+    /* IPv4 options are not supported. Just drop it. */
+    drop_count(DROP_IP4_OPTIONS, 0, 0);
+    return (0);
+  }
+  memcpy((void *)&ip4_src, (const void *)&ip4_hdrp->ip_src,
+	 sizeof(struct in_addr));
+  memcpy((void *)&ip4_dst, (const void *)&ip4_hdrp->ip_dst,
+	 sizeof(struct in_addr));
+  ip4_tlen = ntohs(ip4_hdrp->ip_len);
+  ip4_hlen = ip4_hdrp->ip_hl << 2;
+  ip4_plen = ip4_tlen - ip4_hlen;
+  ip4_ttl = ip4_hdrp->ip_ttl;
+  ip4_proto = ip4_hdrp->ip_p;
+
+  /* Check the packet size. */
+  if (ip4_tlen > data_len) {
+    /* Data is too short.  Drop it. */
+    drop_count(DROP_TRUNCATED, data_len, ip4_tlen);
+    return (-1);
+  }
+
+  /* Fragment information check. */
+  int ip4_id = ntohs(ip4_hdrp->ip_id);
+  int ip4_off_flags = ntohs(ip4_hdrp->ip_off);
+  int ip4_offset = ip4_off_flags & IP_OFFMASK;
+  int ip4_more_frag = ip4_off_flags & IP_MF;
+  int ip4_is_frag = 0;
+  if (ip4_more_frag || ip4_offset != 0) {
+    /* This is one of the fragmented packets. */
+    ip4_is_frag = 1;
+  }
+
+  packetp += ip4_hlen;
+
+#ifdef DEBUG
+  logring_log_addr(LOGRING_DEBUG_INPUT, AF_INET, &ip4_src, &ip4_dst,
+		   ip4_plen);
+#endif
+
+  /* ICMP error handling. */
+  if (ip4_proto == IPPROTO_ICMP) {
+    int discard_ok = 0;
+    if (icmpsub_process_icmp4(tiop, (const struct icmp *)packetp,
+			      data_len - sizeof(ip4_hlen),
+			      &discard_ok)
+	== -1) {
+      return (0);
+    }
+    if (discard_ok) {
+      return (0);
+    }
+  }
+
+  /* Convert IP addresses. */
+  struct in6_addr ip6_src, ip6_dst;
+  if (mapping_translate_4to6(matchp, &ip4_src, &ip4_dst,
+			     &ip6_src, &ip6_dst) == -1) {
+    /* Counted by the mapping class. */
+    return (0);
+  }
+  int32_t cksum_delta = mapping_cksum_delta(matchp, FOURTOSIX, &ip6_src);
+
+  /* Prepare an IPv6 header template. */
+  struct ip6_hdr ip6_hdr;
+  memset(&ip6_hdr, 0, sizeof(struct ip6_hdr));
+  ip6_hdr.ip6_vfc = IPV6_VERSION;
+  ip6_hdr.ip6_plen = htons(ip4_plen);
+  ip6_hdr.ip6_nxt = ip4_proto;
+  ip6_hdr.ip6_hlim = ip4_ttl;
+  memcpy((void *)&ip6_hdr.ip6_src, (const void *)&ip6_src,
+	 sizeof(struct in6_addr));
+  memcpy((void *)&ip6_hdr.ip6_dst, (const void *)&ip6_dst,
+	 sizeof(struct in6_addr));
+
+#ifdef DEBUG
+  logring_log_addr(LOGRING_DEBUG_OUTPUT, AF_INET6, &ip6_src, &ip6_dst,
+		   ntohs(ip6_hdr.ip6_plen));
+#endif
+
+  /* Fragment processing. */
+  int mtu = pmtudisc_get_path_mtu_size(AF_INET6, &ip6_dst);
+#define IP6_FRAG6_HDR_LEN (sizeof(struct ip6_hdr) + sizeof(struct ip6_frag))
+  int offload = tun_vnet_offload(vnet_hdrp);
+  int need_frag = !(offload & TUN_OFFLOAD_GSO)
+    && ip4_plen > mtu - IP6_FRAG6_HDR_LEN;
+  if ((offload & TUN_OFFLOAD_CSUM)
+      && (need_frag || ip4_proto == IPPROTO_ICMP)) {
+    /*
+     * A partial checksum cannot be split into fragments, and the
+     * ICMP conversion needs a complete checksum.
+     */
+    if (tun_vnet_complete_csum(vnet_hdrp, datap, ip4_tlen) == -1) {
+      return (0);
+    }
+    offload &= ~TUN_OFFLOAD_CSUM;
+  }
+  if (need_frag) {
+    /* Fragment is needed for this packet. */
+
+    /*
+     * Send an ICMP error message with the unreach type and the
+     * need_fragment code.  ICMP error message generation will be rate
+     * limited.  A failure is counted as a drop, and the processing
+     * continues anyway.
+     */
+    (void)icmpsub_send_icmp4_unreach_needfrag(tiop, datap, &ip4_dst,
+					      &ip4_src,
+					      mtu - IP6_FRAG6_HDR_LEN);
+
+    int frag_payload_unit = ((mtu - IP6_FRAG6_HDR_LEN) >> 3) << 3;
+    struct ip6_frag ip6_frag_hdr;
+    memset(&ip6_frag_hdr, 0, sizeof(struct ip6_frag));
+    if (ip4_id == 0) {
+      /*
+       * ip4_id may be 0 if the incoming packet is not a fragmented
+       * packet.
+       */
+      ip4_id = random();
+    }
+    ip6_frag_hdr.ip6f_ident = htonl(ip4_id);
+
+    int frag_count = (ip4_plen / frag_payload_unit) + 1;
+    int plen_left = ip4_plen;
+    int relative_offset = 0;
+    while (frag_count--) {
+      /*
+       * Set the original payload length value here to calculate the
+       * relative offset value and upper layer checksum value for
+       * ICMPv6 case.  The next header field is also reset here for
+       * checksum calculation.
+       *
+       * The ICMPv6 fragmentation works in this case only (that means,
+       * the incoming ICMP is not fragmented, but outgoing ICMPv6 is
+       * fragmented), because the ICMPv6 checksum calculation needs
+       * the payload length information in the IPv6 pseudo header
+       * which is not included in the ICMP checksum value.  Note that
+       * TCP and UDP doesn't require the original payload length
+       * information because that information is already counted in
+       * their checksum values.
+       */
+      ip6_hdr.ip6_plen = htons(ip4_plen);
+      ip6_hdr.ip6_nxt = ip4_proto;
+
+      /*
+       * Decide the length of each fragment, and configure the more
+       * fragment flag.
+       */
+      ip6_frag_hdr.ip6f_offlg |= IP6F_MORE_FRAG;
+      int frag_plen = 0;
+      if (plen_left > frag_payload_unit) {
+	frag_plen = frag_payload_unit;
+      } else {
+	frag_plen = plen_left;
+	if (!ip4_more_frag) {
+	  /*
+	   * Clear the IP6F_MORE_FRAG flag since this is the final
+	   * packet generated from a non-fragmented packet or from the
+	   * final fragmented packet.
+	   */
+	  ip6_frag_hdr.ip6f_offlg &= ~IP6F_MORE_FRAG;
+	}
+      }
+
+      /* The fragment offset re-calculation. */
+      relative_offset = ntohs(ip6_hdr.ip6_plen) - plen_left;
+      ip6_frag_hdr.ip6f_offlg |= htons((ip4_offset << 3) + relative_offset);
+
+      plen_left -= frag_plen;
+
+      /* Arrange the pieces of the information. */
+      struct iovec iov[4];
+      uint8_t tun_hdr[TUN_HDR_MAX_LEN];
+      iov[0].iov_base = tun_hdr;
+      iov[0].iov_len = tun_set_hdr(tun_hdr, AF_INET6);
+      iov[1].iov_base = &ip6_hdr;
+      iov[1].iov_len = sizeof(struct ip6_hdr);
+      iov[2].iov_base = &ip6_frag_hdr;
+      iov[2].iov_len = sizeof(struct ip6_frag);
+      iov[3].iov_base = packetp + relative_offset;
+      iov[3].iov_len = frag_plen;
+
+      /*
+       * Re-calculate the checksum in the ICMP (which is converted to
+       * ICMPv6 eventually), TCP, or UDP header, if a packet contains
+       * the upper layer protocol header.
+       */
+      if (ntohs(ip6_frag_hdr.ip6f_offlg & IP6F_OFF_MASK) == 0) {
+	/* The first fragmented packet case. */
+	if (ip4_proto == IPPROTO_ICMP) {
+	  /* Convert the ICMP type/code to those of ICMPv6. */
+	  if (icmpsub_convert_icmp(IPPROTO_ICMP, iov) == -1) {
+	    /* ICMP to ICMPv6 conversion failed. */
+	    return (0);
+	  }
+	}
+	if (cksum_adjust_ulp(ip6_hdr.ip6_nxt, iov[3].iov_base, cksum_delta)
+	    == -1) {
+	  cksum_update_ulp(ip6_hdr.ip6_nxt, ip4_hdrp, iov);
+	}
+      } else if (ip4_proto == IPPROTO_ICMP) {
+	/*
+	 * ICMP to ICMPv6 special case handling.  The next header
+	 * value of the first fragment of ICMPv6 is set to
+	 * IPPROTO_ICMPV6 in the convert_icmp() function, but the rest
+	 * of the fragment packets need to be set it properly here to
+	 * make the IPv6 header chain appropriate.
+	 */
+	ip6_hdr.ip6_nxt = IPPROTO_ICMPV6;
+      }
+
+      /*
+       * Insert the IPv6 fragment header to the IPv6 header chain, and
+       * adjust the payload length.
+       */
+      ip6_frag_hdr.ip6f_nxt = ip6_hdr.ip6_nxt;
+      ip6_hdr.ip6_nxt = IPPROTO_FRAGMENT;
+      ip6_hdr.ip6_plen = htons(frag_plen + sizeof(struct ip6_frag));
+
+      /* Send this fragment. */
+      ssize_t write_len;
+      write_len = tunio_writev(tiop, iov, 4);
+      if (write_len == -1) {
+	drop_count(DROP_SEND_FAILED, errno, 0);
+      }
+    }
+  } else {
+    /* The packet size is smaller than the MTU size. */
+    struct ip6_frag ip6_frag_hdr;
+    struct iovec iov[4];
+    uint8_t tun_hdr[TUN_HDR_MAX_LEN];
+    if (ip4_is_frag) {
+      /*
+       * Size is OK, but the incoming IPv4 packet has fragment
+       * information.  Replace the IPv4 fragment information with the
+       * IPv6 Fragment header.
+       */
+
+      /*
+       * Fragmented ICMP is not supported, because the checksum
+       * calculation procedure for the ICMPv6 packet needs the payload
+       * length of the original IP packet which is only available
+       * after receiving all the fragmented ICMP packets.
+       */
+      if (ip4_proto == IPPROTO_ICMP) {
+	/* Just drop it. */
+	drop_count(DROP_ICMP_FRAGMENT, IPPROTO_ICMP, 0);
+	return (0);
+      }
+
+      /*
+       * Copy the fragment related information from the IPv4 header to
+       * the IPv6 fragment header.
+       */
+      memset(&ip6_frag_hdr, 0, sizeof(struct ip6_frag));
+      if (ip4_more_frag) {
+	ip6_frag_hdr.ip6f_offlg |= IP6F_MORE_FRAG;
+      }
+      ip6_frag_hdr.ip6f_offlg |= htons(ip4_offset << 3);
+      ip6_frag_hdr.ip6f_ident = htonl(ip4_id);
+
+      /* Arrange the pieces of the information. */
+      iov[0].iov_base = tun_hdr;
+      iov[0].iov_len = tun_set_hdr(tun_hdr, AF_INET6);
+      iov[1].iov_base = &ip6_hdr;
+      iov[1].iov_len = sizeof(struct ip6_hdr);
+      iov[2].iov_base = &ip6_frag_hdr;
+      iov[2].iov_len = sizeof(struct ip6_frag);
+      iov[3].iov_base = packetp;
+      iov[3].iov_len = ip4_plen;
+    } else {
+      /*
+       * No fragment processing is needed.  Just create a simple IPv6
+       * packet.
+       */
+      iov[0].iov_base = tun_hdr;
+      iov[0].iov_len = tun_set_hdr(tun_hdr, AF_INET6);
+      iov[1].iov_base = &ip6_hdr;
+      iov[1].iov_len = sizeof(struct ip6_hdr);
+      iov[2].iov_base = NULL;
+      iov[2].iov_len = 0;
+      iov[3].iov_base = packetp;
+      iov[3].iov_len = ip4_plen;
+
+      /*
+       * A GSO packet is translated as a whole, and segmented by the
+       * kernel after being sent.
+       */
+      if (offload
+	  && tun_vnet_translate(tun_vnet_hdr(tun_hdr), vnet_hdrp, AF_INET6,
+				sizeof(struct ip6_hdr) - ip4_hlen, packetp,
+				mtu) == -1) {
+	return (0);
+      }
+    }
+
+    /*
+     * Re-calculate the checksum in ICMP (which is converted to ICMPv6
+     * eventually), TCP, or UDP header, if a packet contains the upper
+     * layer protocol header.
+     */
+    if (ip4_offset == 0) {
+      /*
+       * This is a single packet or the first fragment packet, which
+       * includes an upper layer protocol header.
+       */
+      if (ip4_proto == IPPROTO_ICMP) {
+	/* Convert the ICMP type/code to those of ICMPv6. */
+	if (icmpsub_convert_icmp(IPPROTO_ICMP, iov) == -1) {
+	  /* ICMP to ICMPv6 conversion failed. */
+	  return (0);
+	}
+      }
+      if (offload & TUN_OFFLOAD_CSUM) {
+	/* See cksum_complement_ulp(). */
+	cksum_complement_ulp(ip6_hdr.ip6_nxt, packetp);
+	if (cksum_adjust_ulp(ip6_hdr.ip6_nxt, iov[3].iov_base, cksum_delta)
+	    == -1) {
+	  cksum_update_ulp(ip6_hdr.ip6_nxt, ip4_hdrp, iov);
+	}
+	cksum_complement_ulp(ip6_hdr.ip6_nxt, packetp);
+      } else {
+	if (cksum_adjust_ulp(ip6_hdr.ip6_nxt, iov[3].iov_base, cksum_delta)
+	    == -1) {
+	  cksum_update_ulp(ip6_hdr.ip6_nxt, ip4_hdrp, iov);
+	}
+      }
+    }
+
+    /*
+     * Insert the IPv6 fragment header to the IPv6 header chain if it
+     * is necessary, and adjust the payload length.
+     */
+    if (ip4_is_frag) {
+      ip6_frag_hdr.ip6f_nxt = ip6_hdr.ip6_nxt;
+      ip6_hdr.ip6_nxt = IPPROTO_FRAGMENT;
+      ip6_hdr.ip6_plen = htons(ip4_plen + sizeof(struct ip6_frag));
+    }
+
+    /* Send this (fragmented) packet. */
+    ssize_t write_len;
+    write_len = send_in_place(tiop, iov);
+    if (write_len == -1) {
+      drop_count(DROP_SEND_FAILED, errno, 0);
+    }
+  }
+
+  return (0);
+}
+
+/*
+ * Convert an IPv6 packet given as the argument to an IPv4 packet, and
+ * send it.
+ */
+static int
+send_6to4(struct tunio *tiop, const struct mapping_match *matchp,
+	void *vnet_hdrp, void *datap, size_t data_len)
+{
+  assert(datap != NULL);
+
+  char *packetp = (char *)datap;
+
+  /* Analyze IPv6 header contents. */
+  struct ip6_hdr *ip6_hdrp;
+  uint8_t ip6_next_header;
+  ip6_hdrp = (struct ip6_hdr *)packetp;
+  ip6_next_header = ip6_hdrp->ip6_nxt;
+  packetp += sizeof(struct ip6_hdr);
+
+  /* ICMPv6 error handling. */
+  /* XXX: we don't handle fragmented ICMPv6 messages. */
+  if (ip6_next_header == IPPROTO_ICMPV6) {
+    int discard_ok = 0;
+    if (icmpsub_process_icmp6(tiop, (const struct icmp6_hdr *)packetp,
+			      data_len - sizeof(struct ip6_hdr),
+			      &discard_ok)
+	== -1) {
+      return (0);
+    }
+    if (discard_ok) {
+      return (0);
+    }
+  }
+
+  /* Fragment header check. */
+  struct ip6_frag *ip6_frag_hdrp = NULL;
+  int ip6_more_frag = 0;
+  int ip6_offset = 0;
+  int ip6_id = 0;
+  if (ip6_next_header == IPPROTO_FRAGMENT) {
+    ip6_frag_hdrp = (struct ip6_frag *)packetp;
+    ip6_next_header = ip6_frag_hdrp->ip6f_nxt;
+    ip6_more_frag = ip6_frag_hdrp->ip6f_offlg & IP6F_MORE_FRAG;
+    ip6_offset = ntohs(ip6_frag_hdrp->ip6f_offlg & IP6F_OFF_MASK);
+    ip6_id = ntohl(ip6_frag_hdrp->ip6f_ident);
+    packetp += sizeof(struct ip6_frag);
+  }
+
+  /*
+   * Next header check: Currently, any kinds of extension headers other
+   * than the Fragment header are not supported and just dropped.
+   */
+  if (ip6_next_header != IPPROTO_ICMPV6
+      && ip6_next_header != IPPROTO_TCP
+      && ip6_next_header != IPPROTO_UDP) {
+    drop_count(DROP_IP6_EXTHDR, ip6_next_header, 0);
+    return (0);
+  }
+
+  /* Get some basic IPv6 header values. */
+  struct in6_addr ip6_src, ip6_dst;
+  uint16_t ip6_payload_len;
+  uint8_t ip6_hop_limit;
+  memcpy((void *)&ip6_src, (const void *)&ip6_hdrp->ip6_src,
+	 sizeof(struct in6_addr));
+  memcpy((void *)&ip6_dst, (const void *)&ip6_hdrp->ip6_dst,
+	 sizeof(struct in6_addr));
+  ip6_payload_len = ntohs(ip6_hdrp->ip6_plen);
+  if (ip6_frag_hdrp != NULL) {
+    ip6_payload_len -= sizeof(struct ip6_frag);
+  }
+  ip6_hop_limit = ip6_hdrp->ip6_hlim;
+
+  /* Check the packet size. */
+  if (ip6_payload_len + sizeof(struct ip6_hdr) > data_len) {
+    /* Data is too short.  Drop it. */
+    drop_count(DROP_TRUNCATED, data_len,
+	       ip6_payload_len + sizeof(struct ip6_hdr));
+    return (-1);
+  }
+
+#ifdef DEBUG
+  logring_log_addr(LOGRING_DEBUG_INPUT, AF_INET6, &ip6_src, &ip6_dst,
+		   ip6_payload_len);
+#endif
+
+  /* Convert IP addresses. */
+  struct in_addr ip4_src, ip4_dst;
+  if (mapping_translate_6to4(matchp, &ip6_src, &ip6_dst,
+			     &ip4_src, &ip4_dst) == -1) {
+    /* Counted by the mapping class. */
+    return (-1);
+  }
+  int32_t cksum_delta = mapping_cksum_delta(matchp, SIXTOFOUR, &ip6_dst);
+
+  /* Prepare an IPv4 header. */
+  struct ip ip4_hdr;
+  memset(&ip4_hdr, 0, sizeof(struct ip));
+  ip4_hdr.ip_v = IPVERSION;
+  ip4_hdr.ip_hl = sizeof(struct ip) >> 2;
+  ip4_hdr.ip_len = htons(sizeof(struct ip) + ip6_payload_len);
+  ip4_hdr.ip_id = htons(ip6_id & 0xffff);
+  ip4_hdr.ip_off = htons(IP_DF);
+  ip4_hdr.ip_ttl = ip6_hop_limit;
+  ip4_hdr.ip_p = ip6_next_header;
+  /* The header checksum is calculated before being sent. */
+  ip4_hdr.ip_sum = 0;
+  memcpy((void *)&ip4_hdr.ip_src, (const void *)&ip4_src,
+	 sizeof(struct in_addr));
+  memcpy((void *)&ip4_hdr.ip_dst, (const void *)&ip4_dst,
+	 sizeof(struct in_addr));
+
+#ifdef DEBUG
+  logring_log_addr(LOGRING_DEBUG_OUTPUT, AF_INET, &ip4_src, &ip4_dst,
+		   ip6_payload_len);
+#endif
+
+  /* Fragment processing. */
+  int mtu = pmtudisc_get_path_mtu_size(AF_INET, &ip4_dst);
+  int offload = tun_vnet_offload(vnet_hdrp);
+  int need_frag = !(offload & TUN_OFFLOAD_GSO)
+    && ip6_payload_len > mtu - sizeof(struct ip);
+  if ((offload & TUN_OFFLOAD_GSO)
+      && sizeof(struct ip) + ip6_payload_len > IP_MAXPACKET) {
+    drop_count(DROP_GSO_TOO_LONG, ip6_payload_len, 0);
+    return (0);
+  }
+  if ((offload & TUN_OFFLOAD_CSUM)
+      && (need_frag || ip6_next_header == IPPROTO_ICMPV6)) {
+    /* See the comment in send_4to6(). */
+    if (tun_vnet_complete_csum(vnet_hdrp, datap,
+			       sizeof(struct ip6_hdr)
+			       + ntohs(ip6_hdrp->ip6_plen)) == -1) {
+      return (0);
+    }
+    offload &= ~TUN_OFFLOAD_CSUM;
+  }
+  if (need_frag) {
+    /* Fragment is needed for this packet. */
+
+    /*
+     * Send an ICMPv6 Packet Too Big message.  ICMP error message
+     * generation will be rate limited.  A failure is counted as a
+     * drop, and the processing continues anyway.
+     */
+    (void)icmpsub_send_icmp6_packet_too_big(tiop, datap, &ip6_dst, &ip6_src,
+					    mtu);
+
+    int frag_payload_unit = ((mtu - sizeof(struct ip)) >> 3) << 3;
+    if (ip6_id == 0) {
+      /*
+       * ip6_id may be 0 if the incoming packet is not a fragmented
+       * packet.
+       */
+      ip4_hdr.ip_id = random();
+    }
+
+    int frag_count = (ip6_payload_len / frag_payload_unit) + 1;
+    int plen_left = ip6_payload_len;
+    int relative_offset = 0;
+    while (frag_count--) {
+      /*
+       * Decide the length of each fragment, and configure the more
+       * fragment flag.
+       */
+      ip4_hdr.ip_off |= htons(IP_MF);
+      int frag_plen = 0;
+      if (plen_left > frag_payload_unit) {
+	frag_plen = frag_payload_unit;
+      } else {
+	frag_plen = plen_left;
+	if (!ip6_more_frag) {
+	  /*
+	   * Clear the IP_MF flag since this is the final packet
+	   * generated from a non-fragmented packet or from the final
+	   * fragmented packet.
+	   */
+	  ip4_hdr.ip_off &= htons(~IP_MF);
+	}
+      }
+
+      /* The fragment offset re-calculation. */
+      relative_offset = ip6_payload_len - plen_left;
+      ip4_hdr.ip_off |= htons((ip6_offset + relative_offset) >> 3);
+
+      plen_left -= frag_plen;
+
+      /* Arrange the pieces of the information. */
+      struct iovec iov[4];
+      uint8_t tun_hdr[TUN_HDR_MAX_LEN];
+      iov[0].iov_base = tun_hdr;
+      iov[0].iov_len = tun_set_hdr(tun_hdr, AF_INET);
+      iov[1].iov_base = &ip4_hdr;
+      iov[1].iov_len = sizeof(struct ip);
+      iov[2].iov_base = NULL;
+      iov[2].iov_len = 0;
+      iov[3].iov_base = packetp + relative_offset;
+      iov[3].iov_len = frag_plen;
+
+      /*
+       * Re-calculate the checksum in the ICMPv6 (which is converted
+       * to ICMP eventually), TCP, or UDP header, if a packet contains
+       * the upper layer protocol header.
+       */
+      if ((ntohs(ip4_hdr.ip_off) & IP_OFFMASK) == 0) {
+	/* This is the first fragmented packet. */
+	if (ip6_next_header == IPPROTO_ICMPV6) {
+	  /* Convert the ICMPv6 type/code to those of ICMP. */
+	  if (icmpsub_convert_icmp(IPPROTO_ICMPV6, iov) == -1) {
+	    /* ICMPv6 to ICMP conversion failed. */
+	    return (0);
+	  }
+	}
+	/*
+	 * If the input IPv6 packet is a fragmented packet which
+	 * is still too big to forward, then ip6_nxt has been set
+	 * to ipv6-frag.  Update the field with the final protocol
+	 * number before re-calculating upper layer checksum which
+	 * uses protocol number as a part of the IP pseudo header.
+	 * (This line can be placed out of this while loop.)
+	 */
+	ip6_hdrp->ip6_nxt = ip6_next_header;
+	if (cksum_adjust_ulp(ip4_hdr.ip_p, iov[3].iov_base, cksum_delta)
+	    == -1) {
+	  cksum_update_ulp(ip4_hdr.ip_p, ip6_hdrp, iov);
+	}
+      }
+
+      /* Adjust IPv4 total length. */
+      ip4_hdr.ip_len = htons(frag_plen + sizeof(struct ip));
+
+      /* Calculate the IPv4 header checksum. */
+      ip4_hdr.ip_sum = 0; /* need to clear, since we reuse ip4_hdr. */
+      ip4_hdr.ip_sum = cksum_calc_ip4_header(&ip4_hdr);
+
+      /* Send this fragment. */
+      ssize_t write_len;
+      write_len = tunio_writev(tiop, iov, 4);
+      if (write_len == -1) {
+	drop_count(DROP_SEND_FAILED, errno, 0);
+      }
+    }
+  } else {
+    /* The packet size is smaller than the MTU size. */
+    struct iovec iov[4];
+    uint8_t tun_hdr[TUN_HDR_MAX_LEN];
+    if (ip6_frag_hdrp != NULL) {
+      /*
+       * Size is OK, but the incoming IPv6 packet has fragment
+       * information.  Replace the IPv6 Fragment header with the IPv4
+       * fragment information.
+       */
+
+      /* See the comment in send_4to6(). */
+      if (ip6_next_header == IPPROTO_ICMPV6) {
+	/* Just drop it. */
+	drop_count(DROP_ICMP_FRAGMENT, IPPROTO_ICMPV6, 0);
+	return (0);
+      }
+
+      /*
+       * Copy the fragment related information from the Fragment
+       * header to the IPv4 header.
+       */
+      if (ip6_more_frag) {
+	ip4_hdr.ip_off |= htons(IP_MF);
+      }
+      ip4_hdr.ip_off |= htons(ip6_offset >> 3);
+      /*
+       * XXX: we don't have a big enough field for the fragment
+       * identifier in IPv4 (16 bits in IPv4, 32 bits in IPv6).  Cut
+       * top 16 bits.
+       */
+      ip4_hdr.ip_id = htons(ip6_id & 0xffff);
+
+      /* Arrange the pieces of the information. */
+      iov[0].iov_base = tun_hdr;
+      iov[0].iov_len = tun_set_hdr(tun_hdr, AF_INET);
+      iov[1].iov_base = &ip4_hdr;
+      iov[1].iov_len = sizeof(struct ip);
+      iov[2].iov_base = NULL;
+      iov[2].iov_len = 0;
+      iov[3].iov_base = packetp;
+      iov[3].iov_len = ip6_payload_len;
+    } else {
+      /*
+       * No fragment processing is needed.  Just create a simple IPv4
+       * packet.
+       */
+      iov[0].iov_base = tun_hdr;
+      iov[0].iov_len = tun_set_hdr(tun_hdr, AF_INET);
+      iov[1].iov_base = &ip4_hdr;
+      iov[1].iov_len = sizeof(struct ip);
+      iov[2].iov_base = NULL;
+      iov[2].iov_len = 0;
+      iov[3].iov_base = packetp;
+      iov[3].iov_len = ip6_payload_len;
+
+      /* See the comment in send_4to6(). */
+      if (offload
+	  && tun_vnet_translate(tun_vnet_hdr(tun_hdr), vnet_hdrp, AF_INET,
+				(int)sizeof(struct ip)
+				- (int)sizeof(struct ip6_hdr),
+				packetp, mtu) == -1) {
+	return (0);
+      }
+    }
+
+    /*
+     * Re-calculate the checksum in the ICMPv6 (which is converted
+     * to ICMP eventually), TCP, or UDP header, if a packet contains
+     * the upper layer protocol header.
+     */
+    if ((ntohs(ip4_hdr.ip_off) & IP_OFFMASK) == 0) {
+      /*
+       * This is a single packet or the first fragment packet, which
+       * includes an upper layer protocol header.
+       */
+      if (ip6_next_header == IPPROTO_ICMPV6) {
+	/* Convert the ICMPv6 type/code to those of ICMP. */
+	if (icmpsub_convert_icmp(IPPROTO_ICMPV6, iov) == -1) {
+	  /* ICMPv6 to ICMP conversion failed. */
+	  return (0);
+	}
+      }
+
+      /*
+       * Since the input IPv6 packet is a fragmented packet,
+       * ip6_nxt is set to ipv6-frag.  Update the field with the
+       * final protocol number before re-calculating upper layer
+       * checksum which uses protocol number as a part of the IP
+       * pseudo header.
+       */
+      ip6_hdrp->ip6_nxt = ip6_next_header;
+      if (offload & TUN_OFFLOAD_CSUM) {
+	/* See cksum_complement_ulp(). */
+	cksum_complement_ulp(ip4_hdr.ip_p, packetp);
+	if (cksum_adjust_ulp(ip4_hdr.ip_p, iov[3].iov_base, cksum_delta)
+	    == -1) {
+	  cksum_update_ulp(ip4_hdr.ip_p, ip6_hdrp, iov);
+	}
+	cksum_complement_ulp(ip4_hdr.ip_p, packetp);
+      } else {
+	if (cksum_adjust_ulp(ip4_hdr.ip_p, iov[3].iov_base, cksum_delta)
+	    == -1) {
+	  cksum_update_ulp(ip4_hdr.ip_p, ip6_hdrp, iov);
+	}
+      }
+    }
+
+    /* Calculate the IPv4 header checksum. */
+    ip4_hdr.ip_sum = cksum_calc_ip4_header(&ip4_hdr);
+
+    /* Send this (fragmented) packet. */
+    ssize_t write_len;
+    write_len = send_in_place(tiop, iov);
+    if (write_len == -1) {
+      drop_count(DROP_SEND_FAILED, errno, 0);
+    }
+  }
+
+  return (0);
+}
+
+
+/*
+ * Convert an IPv6 packet given as the argument to an IPv6 packet, and
+ * send it.
+ */
+static int
+send66_ItoG(struct tunio *tiop, const struct mapping_match *matchp,
+	  void *vnet_hdrp, void *datap, size_t data_len)
+{
+  assert(datap != NULL);
+
+  char *packetp = (char *)datap;
+
+  /* Analyze IPv6 header contents. */
+  struct ip6_hdr *ip6_hdrp;
+  uint8_t ip6_next_header;
+  ip6_hdrp = (struct ip6_hdr *)packetp;
+  ip6_next_header = ip6_hdrp->ip6_nxt;
+  packetp += sizeof(struct ip6_hdr);
+
+  /* ICMPv6 error handling. */
+  /* XXX: we don't handle fragmented ICMPv6 messages. */
+  if (ip6_next_header == IPPROTO_ICMPV6) {
+    int discard_ok = 0;
+    if (icmpsub_process_icmp6(tiop, (const struct icmp6_hdr *)packetp,
+			      data_len - sizeof(struct ip6_hdr),
+			      &discard_ok)
+	== -1) {
+      return (0);
+    }
+    if (discard_ok)
+      return (0);
+  }
+
+  /* Fragment header check. */
+  struct ip6_frag *ip6_frag_hdrp = NULL;
+  if (ip6_next_header == IPPROTO_FRAGMENT) {
+    ip6_frag_hdrp = (struct ip6_frag *)packetp;
+    ip6_next_header = ip6_frag_hdrp->ip6f_nxt;
+    packetp += sizeof(struct ip6_frag);
+  }
+
+  /*
+   * Next header check: Currently, any kinds of extension headers other
+   * than the Fragment header are not supported and just dropped.
+   */
+  if (ip6_next_header != IPPROTO_ICMPV6
+      && ip6_next_header != IPPROTO_TCP
+      && ip6_next_header != IPPROTO_UDP) {
+    drop_count(DROP_IP6_EXTHDR, ip6_next_header, 0);
+    return (0);
+  }
+
+  /* Get some basic IPv6 header values. */
+  struct in6_addr ip6_before_src, ip6_before_dst;
+  uint16_t ip6_payload_len;
+  uint8_t ip6_hop_limit;
+  memcpy((void *)&ip6_before_src, (const void *)&ip6_hdrp->ip6_src,
+	 sizeof(struct in6_addr));
+  memcpy((void *)&ip6_before_dst, (const void *)&ip6_hdrp->ip6_dst,
+	 sizeof(struct in6_addr));
+  ip6_payload_len = ntohs(ip6_hdrp->ip6_plen);
+  if (ip6_frag_hdrp != NULL) {
+    ip6_payload_len -= sizeof(struct ip6_frag);
+  }
+  ip6_hop_limit = ip6_hdrp->ip6_hlim;
+
+  /* Check the packet size. */
+  if (ip6_payload_len + sizeof(struct ip6_hdr) > data_len) {
+    /* Data is too short.  Drop it. */
+    drop_count(DROP_TRUNCATED, data_len,
+	       ip6_payload_len + sizeof(struct ip6_hdr));
+    return (-1);
+  }
+
+#ifdef DEBUG
+  logring_log_addr(LOGRING_DEBUG_INPUT, AF_INET6, &ip6_before_src,
+		   &ip6_before_dst, ip6_payload_len);
+#endif
+
+  /* Convert IP addresses. */
+  struct in6_addr ip6_after_src, ip6_after_dst;
+  if (mapping66_translate_ItoG(matchp, &ip6_before_src, &ip6_before_dst,
+			       &ip6_after_src, &ip6_after_dst) == -1) {
+    /* Counted by the mapping class. */
+    return (-1);
+  }
+  int32_t cksum_delta = mapping_cksum_delta(matchp, SIXTOSIX_ItoG, NULL);
+
+  /* Prepare an IPv6 header template. */
+  struct ip6_hdr ip6_hdr;
+  memset(&ip6_hdr, 0, sizeof(struct ip6_hdr));
+  ip6_hdr.ip6_vfc = IPV6_VERSION;
+  ip6_hdr.ip6_plen = ip6_hdrp->ip6_plen;
+  ip6_hdr.ip6_nxt = ip6_next_header;
+  ip6_hdr.ip6_hlim = ip6_hop_limit;
+  memcpy((void *)&ip6_hdr.ip6_src, (const void *)&ip6_after_src,
+	 sizeof(struct in6_addr));
+  memcpy((void *)&ip6_hdr.ip6_dst, (const void *)&ip6_after_dst,
+	 sizeof(struct in6_addr));
+
+#ifdef DEBUG
+  logring_log_addr(LOGRING_DEBUG_OUTPUT, AF_INET6, &ip6_after_src,
+		   &ip6_after_dst, ntohs(ip6_hdr.ip6_plen));
+#endif
+
+  struct iovec iov[4];
+  uint8_t tun_hdr[TUN_HDR_MAX_LEN];
+
+  iov[0].iov_base = tun_hdr;
+  iov[0].iov_len = tun_set_hdr(tun_hdr, AF_INET6);
+  iov[1].iov_base = &ip6_hdr;
+  iov[1].iov_len = sizeof(struct ip6_hdr);
+  iov[2].iov_base = NULL;
+  iov[2].iov_len = 0;
+  iov[3].iov_base = packetp;
+  iov[3].iov_len = ip6_payload_len;
+
+  /*
+   * The offload information is kept as is, since the header length
+   * doesn't change.
+   */
+  int offload = tun_vnet_offload(vnet_hdrp);
+  if (offload
+      && tun_vnet_translate(tun_vnet_hdr(tun_hdr), vnet_hdrp, AF_INET6, 0,
+			    packetp, 0) == -1) {
+    return (0);
+  }
+
+  if (offload & TUN_OFFLOAD_CSUM) {
+    /* See cksum_complement_ulp(). */
+    cksum_complement_ulp(ip6_hdr.ip6_nxt, packetp);
+    if (cksum_adjust_ulp(ip6_hdr.ip6_nxt, iov[3].iov_base, cksum_delta)
+	== -1) {
+      cksum66_update_ulp(ip6_hdr.ip6_nxt, ip6_hdrp, iov);
+    }
+    cksum_complement_ulp(ip6_hdr.ip6_nxt, packetp);
+  } else {
+    if (cksum_adjust_ulp(ip6_hdr.ip6_nxt, iov[3].iov_base, cksum_delta)
+	== -1) {
+      cksum66_update_ulp(ip6_hdr.ip6_nxt, ip6_hdrp, iov);
+    }
+  }
+
+  ssize_t write_len;
+  write_len = send_in_place(tiop, iov);
+  if (write_len == -1) {
+    drop_count(DROP_SEND_FAILED, errno, 0);
+  }
+
+  return (0);
+}
+
+/*
+ * Convert an IPv6 packet given as the argument to an IPv6 packet, and
+ * send it.
+ */
+static int
+send66_GtoI(struct tunio *tiop, const struct mapping_match *matchp,
+	  void *vnet_hdrp, void *datap, size_t data_len)
+{
+  assert(datap != NULL);
+
+  char *packetp = (char *)datap;
+
+  /* Analyze IPv6 header contents. */
+  struct ip6_hdr *ip6_hdrp;
+  uint8_t ip6_next_header;
+  ip6_hdrp = (struct ip6_hdr *)packetp;
+  ip6_next_header = ip6_hdrp->ip6_nxt;
+  packetp += sizeof(struct ip6_hdr);
+
+  /* ICMPv6 error handling. */
+  /* XXX: we don't handle fragmented ICMPv6 messages. */
+  if (ip6_next_header == IPPROTO_ICMPV6) {
+    int discard_ok = 0;
+    if (icmpsub_process_icmp6(tiop, (const struct icmp6_hdr *)packetp,
+			      data_len - sizeof(struct ip6_hdr),
+			      &discard_ok)
+	== -1) {
+      return (0);
+    }
+    if (discard_ok)
+      return (0);
+  }
+
+  /* Fragment header check. */
+  struct ip6_frag *ip6_frag_hdrp = NULL;
+  if (ip6_next_header == IPPROTO_FRAGMENT) {
+    ip6_frag_hdrp = (struct ip6_frag *)packetp;
+    ip6_next_header = ip6_frag_hdrp->ip6f_nxt;
+    packetp += sizeof(struct ip6_frag);
+  }
+
+  /*
+   * Next header check: Currently, any kinds of extension headers other
+   * than the Fragment header are not supported and just dropped.
+   */
+  if (ip6_next_header != IPPROTO_ICMPV6
+      && ip6_next_header != IPPROTO_TCP
+      && ip6_next_header != IPPROTO_UDP) {
+    drop_count(DROP_IP6_EXTHDR, ip6_next_header, 0);
+    return (0);
+  }
+
+  /* Get some basic IPv6 header values. */
+  struct in6_addr ip6_before_src, ip6_before_dst;
+  uint16_t ip6_payload_len;
+  uint8_t ip6_hop_limit;
+  memcpy((void *)&ip6_before_src, (const void *)&ip6_hdrp->ip6_src,
+	 sizeof(struct in6_addr));
+  memcpy((void *)&ip6_before_dst, (const void *)&ip6_hdrp->ip6_dst,
+	 sizeof(struct in6_addr));
+  ip6_payload_len = ntohs(ip6_hdrp->ip6_plen);
+  if (ip6_frag_hdrp != NULL) {
+    ip6_payload_len -= sizeof(struct ip6_frag);
+  }
+  ip6_hop_limit = ip6_hdrp->ip6_hlim;
+
+  /* Check the packet size. */
+  if (ip6_payload_len + sizeof(struct ip6_hdr) > data_len) {
+    /* Data is too short.  Drop it. */
+    drop_count(DROP_TRUNCATED, data_len,
+	       ip6_payload_len + sizeof(struct ip6_hdr));
+    return (-1);
+  }
+
+#ifdef DEBUG
+  logring_log_addr(LOGRING_DEBUG_INPUT, AF_INET6, &ip6_before_src,
+		   &ip6_before_dst, ip6_payload_len);
+#endif
+
+  /* Convert IP addresses. */
+  struct in6_addr ip6_after_src, ip6_after_dst;
+  if (mapping66_translate_GtoI(matchp, &ip6_before_src, &ip6_before_dst,
+			       &ip6_after_src, &ip6_after_dst) == -1) {
+    /* Counted by the mapping class. */
+    return (-1);
+  }
+  int32_t cksum_delta = mapping_cksum_delta(matchp, SIXTOSIX_GtoI, NULL);
+
+  /* Prepare an IPv6 header template. */
+  struct ip6_hdr ip6_hdr;
+  memset(&ip6_hdr, 0, sizeof(struct ip6_hdr));
+  ip6_hdr.ip6_vfc = IPV6_VERSION;
+  ip6_hdr.ip6_plen = ip6_hdrp->ip6_plen;
+  ip6_hdr.ip6_nxt = ip6_next_header;
+  ip6_hdr.ip6_hlim = ip6_hop_limit;
+  memcpy((void *)&ip6_hdr.ip6_src, (const void *)&ip6_after_src,
+	 sizeof(struct in6_addr));
+  memcpy((void *)&ip6_hdr.ip6_dst, (const void *)&ip6_after_dst,
+	 sizeof(struct in6_addr));
+
+#ifdef DEBUG
+  logring_log_addr(LOGRING_DEBUG_OUTPUT, AF_INET6, &ip6_after_src,
+		   &ip6_after_dst, ntohs(ip6_hdr.ip6_plen));
+#endif
+
+  struct iovec iov[4];
+  uint8_t tun_hdr[TUN_HDR_MAX_LEN];
+
+  iov[0].iov_base = tun_hdr;
+  iov[0].iov_len = tun_set_hdr(tun_hdr, AF_INET6);
+  iov[1].iov_base = &ip6_hdr;
+  iov[1].iov_len = sizeof(struct ip6_hdr);
+  iov[2].iov_base = NULL;
+  iov[2].iov_len = 0;
+  iov[3].iov_base = packetp;
+  iov[3].iov_len = ip6_payload_len;
+
+  /*
+   * The offload information is kept as is, since the header length
+   * doesn't change.
+   */
+  int offload = tun_vnet_offload(vnet_hdrp);
+  if (offload
+      && tun_vnet_translate(tun_vnet_hdr(tun_hdr), vnet_hdrp, AF_INET6, 0,
+			    packetp, 0) == -1) {
+    return (0);
+  }
+
+  if (offload & TUN_OFFLOAD_CSUM) {
+    /* See cksum_complement_ulp(). */
+    cksum_complement_ulp(ip6_hdr.ip6_nxt, packetp);
+    if (cksum_adjust_ulp(ip6_hdr.ip6_nxt, iov[3].iov_base, cksum_delta)
+	== -1) {
+      cksum66_update_ulp(ip6_hdr.ip6_nxt, ip6_hdrp, iov);
+    }
+    cksum_complement_ulp(ip6_hdr.ip6_nxt, packetp);
+  } else {
+    if (cksum_adjust_ulp(ip6_hdr.ip6_nxt, iov[3].iov_base, cksum_delta)
+	== -1) {
+      cksum66_update_ulp(ip6_hdr.ip6_nxt, ip6_hdrp, iov);
+    }
+  }
+
+  ssize_t write_len;
+  write_len = send_in_place(tiop, iov);
+  if (write_len == -1) {
+    drop_count(DROP_SEND_FAILED, errno, 0);
+  }
+
+  return (0);
+}